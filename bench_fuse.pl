@@ -0,0 +1,199 @@
+#!/usr/bin/perl
+# End to end throughput of kernel -> FUSE -> nufs against a mounted image.
+#
+# usage: perl bench_fuse.pl [-n ops_per_worker] [-t thread_counts] [-w workloads]
+#
+# For every mount mode (single threaded "-s" and multithreaded) and every
+# worker count, a fresh image gets mounted in a temp dir, each workload is
+# driven by that many forked workers at once, and the mount is torn down
+# again. A comparison table goes to stdout, the nufs logs to bench_fuse.log.
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(SEEK_SET);
+use File::Temp qw(tempdir);
+use Getopt::Std;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+
+my %opts;
+getopts("n:t:w:", \%opts) or die "usage: $0 [-n ops] [-t 1,2,4] [-w seq_write,...]\n";
+
+my $ops = $opts{n} // 256;
+my @threads = split /,/, ($opts{t} // "1,2,4");
+my $io_size = 4096;
+# the image is only 1MB, so keep the combined file sizes of all workers well under that
+my $file_size = 64 * 1024;
+my $big_dir_files = 48;
+
+my @mount_modes = (["single", "-s"], ["multi", ""]);
+my @workloads = qw(seq_write seq_read rand_write rand_read meta readdir);
+@workloads = split /,/, $opts{w} if $opts{w};
+
+sub worker_file {
+    my ($mnt, $worker) = @_;
+    return "$mnt/data_$worker";
+}
+
+# Every workload returns (ops, bytes) for a single worker.
+my %run = (
+    seq_write => sub {
+        my ($mnt, $worker) = @_;
+        my $buf = "w" x $io_size;
+        open my $fh, ">", worker_file($mnt, $worker) or die "open: $!";
+        for my $i (0 .. $ops - 1) {
+            sysseek $fh, ($i * $io_size) % $file_size, SEEK_SET;
+            syswrite $fh, $buf;
+        }
+        close $fh;
+        return ($ops, $ops * $io_size);
+    },
+    seq_read => sub {
+        my ($mnt, $worker) = @_;
+        my $buf;
+        open my $fh, "<", worker_file($mnt, $worker) or die "open: $!";
+        for my $i (0 .. $ops - 1) {
+            sysseek $fh, ($i * $io_size) % $file_size, SEEK_SET;
+            sysread $fh, $buf, $io_size;
+        }
+        close $fh;
+        return ($ops, $ops * $io_size);
+    },
+    rand_write => sub {
+        my ($mnt, $worker) = @_;
+        my $buf = "r" x $io_size;
+        open my $fh, "+<", worker_file($mnt, $worker) or die "open: $!";
+        for my $i (0 .. $ops - 1) {
+            sysseek $fh, int(rand($file_size - $io_size)), SEEK_SET;
+            syswrite $fh, $buf;
+        }
+        close $fh;
+        return ($ops, $ops * $io_size);
+    },
+    rand_read => sub {
+        my ($mnt, $worker) = @_;
+        my $buf;
+        open my $fh, "<", worker_file($mnt, $worker) or die "open: $!";
+        for my $i (0 .. $ops - 1) {
+            sysseek $fh, int(rand($file_size - $io_size)), SEEK_SET;
+            sysread $fh, $buf, $io_size;
+        }
+        close $fh;
+        return ($ops, $ops * $io_size);
+    },
+    # one op is a create + stat + unlink of the same name
+    meta => sub {
+        my ($mnt, $worker) = @_;
+        for my $i (0 .. $ops - 1) {
+            my $name = "$mnt/meta_${worker}_$i";
+            open my $fh, ">", $name or die "create $name: $!";
+            close $fh;
+            my @st = stat $name;
+            unlink $name;
+        }
+        return ($ops, 0);
+    },
+    readdir => sub {
+        my ($mnt, $worker) = @_;
+        for my $i (0 .. $ops - 1) {
+            opendir my $dh, "$mnt/big" or die "opendir: $!";
+            my @entries = readdir $dh;
+            closedir $dh;
+        }
+        return ($ops, 0);
+    },
+);
+
+# Untimed setup a workload needs before its workers start.
+my %setup = (
+    readdir => sub {
+        my ($mnt) = @_;
+        mkdir "$mnt/big";
+        for my $i (0 .. $big_dir_files - 1) {
+            open my $fh, ">", "$mnt/big/entry_$i" or last;
+            close $fh;
+        }
+    },
+);
+
+sub mount_image {
+    my ($flag, $mnt, $image) = @_;
+    my $pid = fork // die "fork: $!";
+    if ($pid == 0) {
+        open STDOUT, ">>", "bench_fuse.log";
+        open STDERR, ">&", \*STDOUT;
+        my @args = ("./nufs", ($flag ? ($flag) : ()), "-f", $mnt, $image);
+        exec @args or die "exec: $!";
+    }
+
+    for (1 .. 50) {
+        return $pid if `grep -F " $mnt " /proc/mounts`;
+        sleep 0.1;
+    }
+    die "nufs never mounted $mnt, see bench_fuse.log\n";
+}
+
+sub unmount_image {
+    my ($pid, $mnt) = @_;
+    system("fusermount -u $mnt");
+    waitpid $pid, 0;
+}
+
+# Runs [workload] with [workers] forked workers at once.
+# Returns (seconds, total ops, total bytes).
+sub drive {
+    my ($workload, $mnt, $workers) = @_;
+    pipe my $reader, my $writer or die "pipe: $!";
+
+    my $start = time;
+    for my $worker (0 .. $workers - 1) {
+        my $pid = fork // die "fork: $!";
+        if ($pid == 0) {
+            close $reader;
+            srand($worker + 1);
+            my ($done, $bytes) = $run{$workload}->($mnt, $worker);
+            syswrite $writer, "$done $bytes\n";
+            POSIX::_exit(0);
+        }
+    }
+    close $writer;
+    1 while wait() != -1;
+    my $secs = time - $start;
+
+    my ($total_ops, $total_bytes) = (0, 0);
+    while (my $line = <$reader>) {
+        my ($done, $bytes) = split ' ', $line;
+        $total_ops += $done;
+        $total_bytes += $bytes;
+    }
+    close $reader;
+    return ($secs, $total_ops, $total_bytes);
+}
+
+system("make nufs >/dev/null") == 0 or die "failed to build nufs\n";
+unlink "bench_fuse.log";
+
+my @rows;
+for my $mode (@mount_modes) {
+    my ($mode_name, $flag) = @$mode;
+    for my $workers (@threads) {
+        my $dir = tempdir("nufs-bench-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+        my $mnt = "$dir/mnt";
+        mkdir $mnt;
+
+        # nufs formats a missing image on its first mount
+        my $pid = mount_image($flag, $mnt, "$dir/data.nufs");
+        for my $workload (@workloads) {
+            $setup{$workload}->($mnt) if $setup{$workload};
+            my ($secs, $total_ops, $total_bytes) = drive($workload, $mnt, $workers);
+            push @rows, [$mode_name, $workers, $workload, $total_ops / $secs,
+                         $total_bytes / $secs / (1024 * 1024), $secs];
+        }
+        unmount_image($pid, $mnt);
+    }
+}
+
+printf "%-7s %7s %-11s %12s %9s %9s\n", "mount", "workers", "workload", "ops/s", "MB/s", "secs";
+for my $row (@rows) {
+    printf "%-7s %7d %-11s %12.1f %9.2f %9.3f\n", @$row;
+}
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -15,9 +16,30 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "neat_stats.h"
 
+// the memfd behind a memory-only image
 static int blocks_fd = -1;
+// the backing files of an image on disk, none for a memory-only one
+static int stripe_fds[BLOCKS_MAX_STRIPES];
+static int stripe_open = 0;
+// how the image is spread over its backing files, one file is a single stripe unit of all the blocks
+static int stripe_count = 1;
+static int stripe_blocks = BLOCK_COUNT;
+// stripe unit an image made of several files gets when it is created
+static int new_stripe_blocks = BLOCKS_DEFAULT_STRIPE_BLOCKS;
 static void *blocks_base = 0;
+// bytes actually mapped, more than NUFS_SIZE when a huge page backs the image
+static size_t blocks_mapped_size = NUFS_SIZE;
+// free blocks in each region, -1 until it is needed for a region the summary didn't know
+static int region_free[BLOCKS_REGION_COUNT];
+// set when blocks are handed out at the log head instead of first free
+static int log_mode = 0;
+// segment (region) the log is appending to and the next block in it to try, -1 until the first allocation
+static int log_segment = -1;
+static int log_head = -1;
+// set for a mount that must leave the image on disk as it is, another mount may be using it meanwhile
+static int read_only = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
@@ -30,29 +52,455 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+static blocks_summary_t *get_blocks_summary() {
+  return (blocks_summary_t *) ((uint8_t *) blocks_get_block(0) + BLOCK_SUMMARY_OFFSET);
+}
+
+// Take over the free block counts the image was unmounted with, if it was unmounted cleanly.
+static void blocks_load_summary() {
+  blocks_summary_t *summary = get_blocks_summary();
+  int known = 0;
+  for (int region = 0; region < BLOCKS_REGION_COUNT; ++region) {
+    int count = summary->region_free[region];
+    region_free[region] = summary->magic == BLOCKS_SUMMARY_CLEAN && count != BLOCKS_REGION_UNKNOWN ? count : -1;
+    known += region_free[region] >= 0;
+  }
+  printf("+ blocks_load_summary() -> %d of %d regions known\n", known, BLOCKS_REGION_COUNT);
+
+  // a crash from here on has to leave the counts untrusted (a read only mount never writes them back)
+  if (!read_only) {
+    summary->magic = 0;
+  }
+}
+
+// Write the free block counts to the image and mark them trusted.
+static void blocks_store_summary() {
+  blocks_summary_t *summary = get_blocks_summary();
+  for (int region = 0; region < BLOCKS_REGION_COUNT; ++region) {
+    summary->region_free[region] = region_free[region] >= 0 ? region_free[region] : BLOCKS_REGION_UNKNOWN;
+  }
+  summary->magic = BLOCKS_SUMMARY_CLEAN;
+}
+
+// Count the free blocks in the given region of the bitmap.
+static int blocks_count_region(void *bbm, int region) {
+  int count = 0;
+  for (int ii = region * BLOCKS_REGION_SIZE; ii < (region + 1) * BLOCKS_REGION_SIZE; ++ii) {
+    count += !bitmap_get(bbm, ii);
+  }
+  return count;
+}
+
+// Get the free blocks in the given region, counting them the first time they are needed.
+static int blocks_region_free(void *bbm, int region) {
+  if (region_free[region] < 0) {
+    region_free[region] = blocks_count_region(bbm, region);
+  }
+  return region_free[region];
+}
+
+// Set the bitmap bit of the given block, and the count of its region if that is known.
+static void blocks_set_used(void *bbm, int bnum, int used) {
+  if (bitmap_get(bbm, bnum) == used) {
+    return;
+  }
+  bitmap_put(bbm, bnum, used);
+  int region = bnum / BLOCKS_REGION_SIZE;
+  if (region_free[region] >= 0) {
+    region_free[region] += used ? -1 : 1;
+  }
+}
+
+// Split the comma separated backing files in [image_path] into [paths], pointing into [buf].
+// Returns the number of files, -1 if there are more than BLOCKS_MAX_STRIPES.
+static int blocks_split_paths(const char *image_path, char *buf, char **paths) {
+  strcpy(buf, image_path);
+  int count = 0;
+  char *save = NULL;
+  for (char *path = strtok_r(buf, ",", &save); path != NULL; path = strtok_r(NULL, ",", &save)) {
+    if (count == BLOCKS_MAX_STRIPES) {
+      return -1;
+    }
+    paths[count++] = path;
+  }
+  return count;
+}
+
+// Take over the layout the image was made with from [fd], its first backing file (-1 if there is none),
+// or pick one for [count] files if the image is new.
+// Returns 0 on success, -1 if the image is made of a different number of files.
+static int blocks_read_layout(int fd, int count) {
+  blocks_summary_t summary;
+  // block 0 is always at the very start of the first file, whatever the stripe unit
+  if (fd == -1 || pread(fd, &summary, sizeof(summary), BLOCK_SUMMARY_OFFSET) != sizeof(summary)) {
+    stripe_count = count;
+    stripe_blocks = count > 1 ? new_stripe_blocks : BLOCK_COUNT;
+  }
+  else if (summary.stripe_count > 1) {
+    stripe_count = summary.stripe_count;
+    stripe_blocks = summary.stripe_blocks;
+  }
+  else {
+    stripe_count = 1;
+    stripe_blocks = BLOCK_COUNT;
+  }
+  return stripe_count == count ? 0 : -1;
+}
+
+// Record the layout in block 0, so the image is read back the same way next time. A single file keeps the
+// zeros an image from before striping has there.
+static void blocks_store_layout() {
+  blocks_summary_t *summary = get_blocks_summary();
+  summary->stripe_count = stripe_count > 1 ? stripe_count : 0;
+  summary->stripe_blocks = stripe_count > 1 ? stripe_blocks : 0;
+}
+
+// Find where the given stripe unit lives: the backing file it is in and its byte offset in there.
+// Returns the index of the file.
+static int blocks_unit_file(int unit, off_t *offset) {
+  *offset = (off_t) (unit / stripe_count) * stripe_blocks * BLOCK_SIZE;
+  return unit % stripe_count;
+}
+
+// Get the size every backing file has, its share of the stripe units (the last ones may be a unit short,
+// they are made as long as the rest).
+static size_t blocks_stripe_file_size() {
+  int units = BLOCK_COUNT / stripe_blocks;
+  return (size_t) ((units + stripe_count - 1) / stripe_count) * stripe_blocks * BLOCK_SIZE;
+}
+
+// Map every stripe unit of the image from its backing file, side by side in one range of addresses, so
+// the rest of the code still sees one flat image.
+// Returns the start of the range on success, MAP_FAILED on failure.
+static void *blocks_map_stripes() {
+  // a read only mount sees what the files hold, but nothing it changes in memory gets back to them
+  int share = read_only ? MAP_PRIVATE : MAP_SHARED;
+  if (stripe_count == 1) {
+    return mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, share, stripe_fds[0], 0);
+  }
+
+  // reserve the range first, the units then go over it in place
+  uint8_t *base = mmap(0, NUFS_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  size_t unit_size = (size_t) stripe_blocks * BLOCK_SIZE;
+  for (int unit = 0; unit < BLOCK_COUNT / stripe_blocks; ++unit) {
+    off_t offset;
+    int file = blocks_unit_file(unit, &offset);
+    if (mmap(base + unit * unit_size, unit_size, PROT_READ | PROT_WRITE, share | MAP_FIXED,
+             stripe_fds[file], offset) == MAP_FAILED) {
+      munmap(base, NUFS_SIZE);
+      return MAP_FAILED;
+    }
+  }
+  return base;
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+  char buf[strlen(image_path) + 1];
+  char *paths[BLOCKS_MAX_STRIPES];
+  int count = blocks_split_paths(image_path, buf, paths);
+  assert(count > 0);
+  for (int ii = 0; ii < count; ++ii) {
+    stripe_fds[ii] = read_only ? open(paths[ii], O_RDONLY) : open(paths[ii], O_CREAT | O_RDWR, 0644);
+    assert(stripe_fds[ii] != -1);
+  }
+  stripe_open = count;
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  int rv = blocks_read_layout(stripe_fds[0], count);
+  if (rv != 0) {
+    fprintf(stderr, "+ blocks_init(%s) -> the image is made of %d files, not %d\n", image_path, stripe_count, count);
+  }
   assert(rv == 0);
 
+  // make sure the disk image is exactly 1MB, spread evenly over its files
+  for (int ii = 0; ii < count && !read_only; ++ii) {
+    rv = ftruncate(stripe_fds[ii], blocks_stripe_file_size());
+    assert(rv == 0);
+  }
+
   // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  blocks_base = blocks_map_stripes();
   assert(blocks_base != MAP_FAILED);
+  if (stripe_count > 1) {
+    printf("+ blocks_init(%s) -> %d files, %d blocks per stripe unit\n", image_path, stripe_count, stripe_blocks);
+  }
+  blocks_load_summary();
+  log_segment = -1;
+  log_head = -1;
+  // an image that is only read already has all of this in block 0
+  if (read_only) {
+    return;
+  }
+  blocks_store_layout();
 
   // block 0 stores the block bitmap and the inode bitmap
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  blocks_set_used(bbm, 0, 1);
+}
+
+void blocks_set_read_only(int enabled) {
+  read_only = enabled;
+}
+
+int blocks_check_image(const char *image_path) {
+  char buf[strlen(image_path) + 1];
+  char *paths[BLOCKS_MAX_STRIPES];
+  int count = blocks_split_paths(image_path, buf, paths);
+  int fds[BLOCKS_MAX_STRIPES];
+  int opened = 0;
+  int rv = count > 0 ? 0 : -1;
+
+  for (; rv == 0 && opened < count; ++opened) {
+    fds[opened] = open(paths[opened], O_RDONLY);
+    if (fds[opened] == -1) {
+      rv = -1;
+      break;
+    }
+  }
+  // there has to be an image already, not just something blocks_init could make one out of
+  struct stat st;
+  if (rv == 0 && (fstat(fds[0], &st) != 0 || st.st_size < BLOCK_SIZE || blocks_read_layout(fds[0], count) != 0)) {
+    rv = -1;
+  }
+  for (int ii = 0; ii < opened; ++ii) {
+    if (rv == 0 && (fstat(fds[ii], &st) != 0 || (size_t) st.st_size != blocks_stripe_file_size())) {
+      rv = -1;
+    }
+    close(fds[ii]);
+  }
+  return rv;
+}
+
+// One backing file worth of work for blocks_run_stripe_jobs.
+typedef struct blocks_stripe_job {
+  int stripe;
+  const char *path;
+  int rv;
+  pthread_t thread;
+} blocks_stripe_job_t;
+
+// Run [fn] for every one of the stripe_count [jobs], each on a thread of its own (the first one on the
+// calling thread), so the backing files, maybe on different disks, all get their I/O at the same time.
+// Returns 0 if every job set its rv to 0, -1 if not.
+static int blocks_run_stripe_jobs(void *(*fn)(void *), blocks_stripe_job_t *jobs) {
+  int started[BLOCKS_MAX_STRIPES] = {0};
+  for (int ii = 1; ii < stripe_count; ++ii) {
+    started[ii] = pthread_create(&jobs[ii].thread, NULL, fn, &jobs[ii]) == 0;
+  }
+  fn(&jobs[0]);
+
+  int rv = jobs[0].rv;
+  for (int ii = 1; ii < stripe_count; ++ii) {
+    if (started[ii]) {
+      pthread_join(jobs[ii].thread, NULL);
+    }
+    else {
+      fn(&jobs[ii]);
+    }
+    rv |= jobs[ii].rv;
+  }
+  return rv != 0 ? -1 : 0;
+}
+
+// Write every dirty page of one backing file out and wait for the disk to have it. The units are shared
+// mappings of the file, so their pages are its page cache and fsync takes them along without an msync.
+static void *blocks_flush_stripe(void *arg) {
+  blocks_stripe_job_t *job = arg;
+  job->rv = fsync(stripe_fds[job->stripe]);
+  return NULL;
+}
+
+int blocks_flush() {
+  // a memory-only image has nowhere to go until it is saved
+  if (stripe_open == 0) {
+    return 0;
+  }
+  blocks_stripe_job_t jobs[BLOCKS_MAX_STRIPES];
+  for (int ii = 0; ii < stripe_count; ++ii) {
+    jobs[ii].stripe = ii;
+  }
+  int rv = blocks_run_stripe_jobs(blocks_flush_stripe, jobs);
+  printf("+ blocks_flush() -> %d files, %d\n", stripe_count, rv);
+  return rv;
+}
+
+int blocks_set_stripe_blocks(int count) {
+  // a power of two up to BLOCK_COUNT is what divides the image into whole units
+  if (count < 1 || count > BLOCK_COUNT || (count & (count - 1)) != 0) {
+    return -1;
+  }
+  new_stripe_blocks = count;
+  return 0;
+}
+
+// Map [size] bytes of the memfd behind a memory-only image.
+// Returns the mapping on success, MAP_FAILED on failure.
+static void *blocks_map_memfd(int fd, size_t size) {
+  if (ftruncate(fd, size) != 0) {
+    return MAP_FAILED;
+  }
+  return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+// Copy the image in the given backing files (if there is one) into the memory-only image, and take over
+// its layout so it gets saved back the same way.
+static void blocks_load_stripes(const char *image_path) {
+  if (image_path == NULL) {
+    blocks_read_layout(-1, 1);
+    return;
+  }
+  char buf[strlen(image_path) + 1];
+  char *paths[BLOCKS_MAX_STRIPES];
+  int count = blocks_split_paths(image_path, buf, paths);
+  assert(count > 0);
+  int fds[BLOCKS_MAX_STRIPES];
+  for (int ii = 0; ii < count; ++ii) {
+    fds[ii] = open(paths[ii], O_RDONLY);
+  }
+
+  int rv = blocks_read_layout(fds[0], count);
+  if (rv != 0) {
+    fprintf(stderr, "+ blocks_init_memory(%s) -> the image is made of %d files, not %d\n", image_path, stripe_count, count);
+  }
+  assert(rv == 0);
+
+  ssize_t got = 0;
+  size_t unit_size = (size_t) stripe_blocks * BLOCK_SIZE;
+  for (int unit = 0; unit < BLOCK_COUNT / stripe_blocks; ++unit) {
+    off_t offset;
+    int file = blocks_unit_file(unit, &offset);
+    if (fds[file] != -1) {
+      ssize_t unit_got = pread(fds[file], blocks_base + unit * unit_size, unit_size, offset);
+      got += unit_got > 0 ? unit_got : 0;
+    }
+  }
+  for (int ii = 0; ii < count; ++ii) {
+    if (fds[ii] != -1) {
+      close(fds[ii]);
+    }
+  }
+  if (got > 0) {
+    printf("+ loaded %zd bytes from %s\n", got, image_path);
+  }
+}
+
+// Create the image in anonymous memory, loaded from the given image if there is one.
+void blocks_init_memory(const char *image_path) {
+  // a hugetlbfs page only exists if some were reserved (vm.nr_hugepages), so fall back to normal pages
+  const char *backing = "huge page";
+  blocks_mapped_size = BLOCKS_HUGE_PAGE_SIZE;
+  blocks_fd = memfd_create("nufs", MFD_CLOEXEC | MFD_HUGETLB);
+  blocks_base = blocks_fd != -1 ? blocks_map_memfd(blocks_fd, blocks_mapped_size) : MAP_FAILED;
+  if (blocks_base == MAP_FAILED) {
+    if (blocks_fd != -1) {
+      close(blocks_fd);
+    }
+    backing = "normal pages";
+    blocks_mapped_size = NUFS_SIZE;
+    blocks_fd = memfd_create("nufs", MFD_CLOEXEC);
+    assert(blocks_fd != -1);
+    blocks_base = blocks_map_memfd(blocks_fd, blocks_mapped_size);
+    assert(blocks_base != MAP_FAILED);
+    // transparent huge pages still apply if shmem has them enabled
+    madvise(blocks_base, blocks_mapped_size, MADV_HUGEPAGE);
+  }
+  printf("+ blocks_init_memory(%s) -> %zu bytes on %s\n", image_path, blocks_mapped_size, backing);
+
+  blocks_load_stripes(image_path);
+  blocks_store_layout();
+  blocks_load_summary();
+  log_segment = -1;
+  log_head = -1;
+
+  void *bbm = get_blocks_bitmap();
+  blocks_set_used(bbm, 0, 1);
+}
+
+// Write the stripe units of one backing file into a temporary file next to it.
+static void *blocks_save_stripe(void *arg) {
+  blocks_stripe_job_t *job = arg;
+  char tmp_path[strlen(job->path) + 8];
+  sprintf(tmp_path, "%s.saving", job->path);
+
+  int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1) {
+    printf("+ blocks_save(%s) -> can't create %s: %s\n", job->path, tmp_path, strerror(errno));
+    job->rv = -1;
+    return NULL;
+  }
+  size_t unit_size = (size_t) stripe_blocks * BLOCK_SIZE;
+  size_t written = 0;
+  for (int unit = job->stripe; unit < BLOCK_COUNT / stripe_blocks; unit += stripe_count) {
+    off_t offset;
+    blocks_unit_file(unit, &offset);
+    ssize_t unit_written = pwrite(fd, blocks_base + unit * unit_size, unit_size, offset);
+    written += unit_written > 0 ? unit_written : 0;
+  }
+  // every file is as long as the others, even the ones a unit short
+  job->rv = ftruncate(fd, blocks_stripe_file_size()) == 0 && written > 0 && fsync(fd) == 0 ? 0 : -1;
+  close(fd);
+  return NULL;
+}
+
+// Write the whole image out to the given backing files, each through a temporary file.
+int blocks_save(const char *image_path) {
+  char buf[strlen(image_path) + 1];
+  char *paths[BLOCKS_MAX_STRIPES];
+  int count = blocks_split_paths(image_path, buf, paths);
+  if (count != stripe_count) {
+    printf("+ blocks_save(%s) -> the image is made of %d files, not %d\n", image_path, stripe_count, count);
+    return -1;
+  }
+  blocks_stripe_job_t jobs[BLOCKS_MAX_STRIPES];
+  for (int ii = 0; ii < count; ++ii) {
+    jobs[ii].stripe = ii;
+    jobs[ii].path = paths[ii];
+  }
+
+  // the copy is as good as a clean unmount, the image in use stays untrusted
+  blocks_store_summary();
+  int rv = blocks_run_stripe_jobs(blocks_save_stripe, jobs);
+  get_blocks_summary()->magic = 0;
+
+  // only complete copies replace the old files, a crash halfway leaves those as they were (a crash in
+  // between the renames can still leave some files saved and the rest not)
+  for (int ii = 0; ii < count; ++ii) {
+    char tmp_path[strlen(paths[ii]) + 8];
+    sprintf(tmp_path, "%s.saving", paths[ii]);
+    if (rv != 0 || rename(tmp_path, paths[ii]) != 0) {
+      printf("+ blocks_save(%s) -> failed: %s\n", paths[ii], strerror(errno));
+      unlink(tmp_path);
+      rv = -1;
+    }
+  }
+  if (rv != 0) {
+    return -1;
+  }
+  printf("+ blocks_save(%s) -> %d bytes\n", image_path, NUFS_SIZE);
+  return 0;
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  // the counts of a read only mount are stale next to those of a mount that kept writing
+  if (!read_only) {
+    blocks_store_summary();
+  }
+  int rv = munmap(blocks_base, blocks_mapped_size);
   assert(rv == 0);
+  if (blocks_fd != -1) {
+    close(blocks_fd);
+  }
+  for (int ii = 0; ii < stripe_open; ++ii) {
+    close(stripe_fds[ii]);
+  }
+  blocks_fd = -1;
+  stripe_open = 0;
+  blocks_mapped_size = NUFS_SIZE;
+  read_only = 0;
 }
 
 // Get the given block, returning a pointer to its start.
@@ -70,69 +518,281 @@ void *get_inode_bitmap() {
   return (void *) (block + BLOCK_BITMAP_SIZE);
 }
 
+// Find the first free block, skipping regions that are full.
+// Returns its index, -1 if there is none.
+static int blocks_first_free(void *bbm) {
+  for (int region = 0; region < BLOCKS_REGION_COUNT; ++region) {
+    // a full region isn't worth looking at bit by bit
+    if (blocks_region_free(bbm, region) == 0) {
+      continue;
+    }
+
+    for (int ii = region * BLOCKS_REGION_SIZE; ii < (region + 1) * BLOCKS_REGION_SIZE; ++ii) {
+      if (ii > 0 && !bitmap_get(bbm, ii)) {
+        return ii;
+      }
+    }
+  }
+  return -1;
+}
+
+// Point the log head at [bnum], starting writeback of the segment it leaves behind so that goes out to the
+// image file as one sequential batch instead of page by page whenever the kernel gets to it.
+static void blocks_log_move_head(int bnum) {
+  int segment = bnum / BLOCKS_REGION_SIZE;
+  if (segment != log_segment && log_segment >= 0 && stripe_open > 0) {
+    msync(blocks_get_block(log_segment * BLOCKS_REGION_SIZE), BLOCKS_REGION_SIZE * BLOCK_SIZE, MS_ASYNC);
+  }
+  if (segment != log_segment) {
+    printf("+ log moves to segment %d\n", segment);
+  }
+  log_segment = segment;
+  log_head = bnum;
+}
+
+// Move the log on to the next segment after its current one that is entirely free, or failing that the
+// next one with any free block (the log fills in holes until the cleaner frees a whole segment up).
+// Returns 0 on success, -1 if there is no free block anywhere.
+static int blocks_log_next_segment(void *bbm) {
+  int next = -1;
+  for (int step = 1; step <= BLOCKS_REGION_COUNT; ++step) {
+    int segment = (log_segment + step + BLOCKS_REGION_COUNT) % BLOCKS_REGION_COUNT;
+    int free = blocks_region_free(bbm, segment);
+    if (free == BLOCKS_REGION_SIZE) {
+      next = segment;
+      break;
+    }
+    if (free > 0 && next < 0) {
+      next = segment;
+    }
+  }
+  if (next < 0) {
+    return -1;
+  }
+  blocks_log_move_head(next * BLOCKS_REGION_SIZE);
+  return 0;
+}
+
+// Find the next free block at or after the log head, moving on to another segment once its own is used up.
+// Returns its index, -1 if there is none.
+static int blocks_log_find(void *bbm) {
+  for (int moves = 0; moves <= BLOCKS_REGION_COUNT; ++moves) {
+    if (log_segment >= 0 && blocks_region_free(bbm, log_segment) > 0) {
+      for (int end = (log_segment + 1) * BLOCKS_REGION_SIZE; log_head < end; ++log_head) {
+        if (log_head > 0 && !bitmap_get(bbm, log_head)) {
+          return log_head++;
+        }
+      }
+    }
+    if (blocks_log_next_segment(bbm) != 0) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
 // Allocate a new block and return its index.
 int alloc_block() {
   void *bbm = get_blocks_bitmap();
+  int ii = log_mode ? blocks_log_find(bbm) : blocks_first_free(bbm);
+  if (ii < 0) {
+    return -1;
+  }
+
+  blocks_set_used(bbm, ii, 1);
+  printf("+ alloc_block() -> %d\n", ii);
+  stats__count(STATS_EVENT_BLOCKS_ALLOCATED, 1);
+
+  //a reused block must not leak whatever the previous owner left in it
+  memset(blocks_get_block(ii), 0, BLOCK_SIZE);
+  get_block_refs()[ii] = 0;
+  get_block_fingerprints()[ii] = 0;
+  get_block_checksums()[ii] = 0;
+  return ii;
+}
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
+void mark_block_used(int bnum, int used) {
+  blocks_set_used(get_blocks_bitmap(), bnum, used);
+}
 
-      reset_next_block_i(ii);
-      return ii;
+int count_free_region_blocks(int region) {
+  return blocks_region_free(get_blocks_bitmap(), region);
+}
+
+int count_free_blocks() {
+  void *bbm = get_blocks_bitmap();
+  int count = 0;
+  for (int region = 0; region < BLOCKS_REGION_COUNT; ++region) {
+    count += blocks_region_free(bbm, region);
+  }
+  return count;
+}
+
+int recount_free_blocks() {
+  void *bbm = get_blocks_bitmap();
+  int off = 0;
+  for (int region = 0; region < BLOCKS_REGION_COUNT; ++region) {
+    int count = blocks_count_region(bbm, region);
+    if (region_free[region] >= 0 && region_free[region] != count) {
+      printf("+ recount_free_blocks() -> region %d has %d free blocks, not %d\n", region, count, region_free[region]);
+      off++;
     }
+    region_free[region] = count;
   }
+  return off;
+}
 
-  return -1;
+// Drop an owner of the given block, it is only deallocated once the last one lets go.
+// Returns 1 if the block was deallocated, 0 if it is still owned.
+static int drop_block_owner(void *bbm, int bnum) {
+  uint8_t *refs = get_block_refs();
+  if (refs[bnum] > 0) {
+    refs[bnum]--;
+    return 0;
+  }
+
+  blocks_set_used(bbm, bnum, 0);
+  get_block_fingerprints()[bnum] = 0;
+  get_block_checksums()[bnum] = 0;
+  return 1;
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
   printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  if (drop_block_owner(get_blocks_bitmap(), bnum)) {
+    stats__count(STATS_EVENT_BLOCKS_FREED, 1);
+  }
 }
 
+// Deallocate a batch of blocks in one pass over the bitmap.
+void free_blocks(int *bnums, int count) {
+  if (count <= 0) {
+    return;
+  }
 
-//The following code was added to support extension blocks, in which
-//the last sieof(int) space is reserved for pointing towards an extension
-//block if it is needed. By default, this int is always reset to -1
+  printf("+ free_blocks(%d blocks, first %d)\n", count, bnums[0]);
+  void *bbm = get_blocks_bitmap();
+  int freed = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    freed += drop_block_owner(bbm, bnums[ii]);
+  }
+  stats__count(STATS_EVENT_BLOCKS_FREED, freed);
+}
 
+uint8_t *get_block_refs() {
+  return (uint8_t *) blocks_get_block(0) + BLOCK_REFS_OFFSET;
+}
 
-int block_data_size(){
-  return BLOCK_SIZE - sizeof(int);
+uint32_t *get_block_fingerprints() {
+  return (uint32_t *) ((uint8_t *) blocks_get_block(0) + BLOCK_FINGERPRINTS_OFFSET);
 }
 
-int get_next_block_i(int block_i){
-  int *next_block_i_pntr = (int *) (blocks_get_block(block_i) + BLOCK_SIZE - sizeof(int));
+uint32_t *get_block_checksums() {
+  return (uint32_t *) ((uint8_t *) blocks_get_block(0) + BLOCK_CHECKSUMS_OFFSET);
+}
 
-  return next_block_i_pntr[0];
+void *get_snapshot_table() {
+  return (uint8_t *) blocks_get_block(0) + BLOCK_SNAPSHOTS_OFFSET;
 }
 
-int reset_next_block_i(int block_i){
-  int *next_block_i_pntr = (int *) (blocks_get_block(block_i) + BLOCK_SIZE - sizeof(int));
-  *next_block_i_pntr = -1;
+int share_block(int block_i) {
+  uint8_t *refs = get_block_refs();
+  if (refs[block_i] >= BLOCK_MAX_SHARES) {
+    return -1;
+  }
+  refs[block_i]++;
   return 0;
 }
 
-int allocate_extension_block(int block_i){
-  int new_block_i = alloc_block();
-  
-  int *next_block_i_pntr = (int *) (blocks_get_block(block_i) + BLOCK_SIZE - sizeof(int));
-  *next_block_i_pntr = new_block_i;
-  return new_block_i;
+int block_is_shared(int block_i) {
+  return get_block_refs()[block_i] > 0;
+}
+
+// Find the first run of [count] free blocks at or after [from].
+// Returns the index of its first block, -1 if there is none.
+static int blocks_find_run_from(void *bbm, int from, int count) {
+  int run_start = -1;
+  int run_length = 0;
+
+  for (int ii = from > 0 ? from : 1; ii < BLOCK_COUNT; ++ii) {
+    // a full region can't hold any part of a run
+    if (ii % BLOCKS_REGION_SIZE == 0 && blocks_region_free(bbm, ii / BLOCKS_REGION_SIZE) == 0) {
+      run_length = 0;
+      ii += BLOCKS_REGION_SIZE - 1;
+      continue;
+    }
+    if (bitmap_get(bbm, ii)) {
+      run_length = 0;
+      continue;
+    }
+
+    if (run_length == 0) {
+      run_start = ii;
+    }
+    run_length++;
+
+    if (run_length == count) {
+      return run_start;
+    }
+  }
+
+  return -1;
 }
 
-int get_last_ext_block_i(int block_i){
-  int curr_block_i = block_i;
-  int prev_block_i = block_i;
+int find_free_block_run(int count){
   void *bbm = get_blocks_bitmap();
+  // the log would rather keep appending where it is than go back to the front of the image
+  int run_start = log_mode && log_segment >= 0 ? blocks_find_run_from(bbm, log_head, count) : -1;
+  return run_start >= 0 ? run_start : blocks_find_run_from(bbm, 1, count);
+}
+
+// Allocate a run of [count] blocks, zeroing them only if [zero] is set.
+static int blocks_alloc_run(int count, int zero) {
+  int run_start = find_free_block_run(count);
+  if (run_start < 0) {
+    return -1;
+  }
 
-  while (curr_block_i > 0 && bitmap_get(bbm, curr_block_i) > 0){
-    prev_block_i = curr_block_i;
-    curr_block_i = get_next_block_i(curr_block_i);
+  printf("+ alloc_block_run(%d%s) -> %d\n", count, zero ? "" : ", unzeroed", run_start);
+  void *bbm = get_blocks_bitmap();
+  for (int ii = run_start; ii < run_start + count; ++ii) {
+    blocks_set_used(bbm, ii, 1);
+    if (zero) {
+      memset(blocks_get_block(ii), 0, BLOCK_SIZE);
+    }
+    get_block_refs()[ii] = 0;
+    get_block_fingerprints()[ii] = 0;
+    get_block_checksums()[ii] = 0;
   }
+  if (log_mode) {
+    blocks_log_move_head(run_start + count - 1);
+    log_head = run_start + count;
+  }
+  stats__count(STATS_EVENT_BLOCKS_ALLOCATED, count);
+  return run_start;
+}
+
+int alloc_block_run(int count){
+  return blocks_alloc_run(count, 1);
+}
+
+int alloc_block_run_unzeroed(int count){
+  return blocks_alloc_run(count, 0);
+}
+
+void blocks_set_log_mode(int on) {
+  log_mode = on;
+}
+
+int blocks_log_mode() {
+  return log_mode;
+}
+
+int get_log_segment() {
+  return log_mode ? log_segment : -1;
+}
 
-  return prev_block_i;
+int block_is_behind_log(int bnum) {
+  return log_mode && bnum / BLOCKS_REGION_SIZE != log_segment;
 }
@@ -3,6 +3,7 @@
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 //Hervella changes: made these define instead of const int to share amongst files
@@ -12,13 +13,86 @@
 
 #define BLOCK_BITMAP_SIZE BLOCK_COUNT / 8  // default = 256 / 8 = 32
 
+// Block 0 starts with the block bitmap and the inode bitmap, and ends with the free block summary, a CRC32C
+// checksum for every block (see neat_checksum.h), the snapshot table (see neat_snapshot.h), then a share count
+// (one byte) and a dedup fingerprint (four bytes) for every block.
+#define BLOCK_REFS_OFFSET (BLOCK_SIZE - BLOCK_COUNT * (1 + (int) sizeof(uint32_t)))
+#define BLOCK_FINGERPRINTS_OFFSET (BLOCK_SIZE - BLOCK_COUNT * (int) sizeof(uint32_t))
+#define BLOCK_SNAPSHOTS_SIZE 128
+#define BLOCK_SNAPSHOTS_OFFSET (BLOCK_REFS_OFFSET - BLOCK_SNAPSHOTS_SIZE)
+#define BLOCK_CHECKSUMS_OFFSET (BLOCK_SNAPSHOTS_OFFSET - BLOCK_COUNT * (int) sizeof(uint32_t))
+#define BLOCK_SUMMARY_SIZE 32
+#define BLOCK_SUMMARY_OFFSET (BLOCK_CHECKSUMS_OFFSET - BLOCK_SUMMARY_SIZE)
+#define BLOCK_MAX_SHARES 255
+
+// The free block summary keeps how many blocks are free in each region of BLOCKS_REGION_SIZE blocks, so
+// mounting doesn't have to count the bitmap and the allocator can skip full regions without reading them.
+// It is only trusted if it was written at a clean unmount (blocks_free), mounting marks it stale again until
+// then. A region it doesn't know is counted the first time it is needed.
+#define BLOCKS_REGION_SIZE 32
+#define BLOCKS_REGION_COUNT (BLOCK_COUNT / BLOCKS_REGION_SIZE)
+#define BLOCKS_SUMMARY_CLEAN 0x4d55534e  // "NSUM"
+#define BLOCKS_REGION_UNKNOWN 0xffff
+
+typedef struct blocks_summary {
+  uint32_t magic;  // BLOCKS_SUMMARY_CLEAN if the counts below can be trusted
+  uint16_t region_free[BLOCKS_REGION_COUNT];  // BLOCKS_REGION_UNKNOWN for a region that wasn't counted
+  uint16_t stripe_count;   // backing files the image is spread over, 0 for a single one
+  uint16_t stripe_blocks;  // blocks per stripe unit, 0 for a single file
+} blocks_summary_t;
+
+// An image can be spread over several backing files (on different disks, say), given as one path of comma
+// separated files ("a.img,b.img"). The blocks go to the files in turn, a stripe unit of stripe_blocks blocks
+// at a time, and the units are mapped side by side so the image still looks like one flat range of blocks.
+// Block 0 is always at the start of the first file, that is where the layout is kept for the next mount.
+#define BLOCKS_MAX_STRIPES 8
+// Stripe unit of a new image made of several files, unless blocks_set_stripe_blocks says otherwise
+#define BLOCKS_DEFAULT_STRIPE_BLOCKS 8
+
+// In log mode the regions double as the segments of a log: blocks are handed out one after the other from
+// the log head, which only moves on to another segment once its own is used up (preferring one that is
+// entirely free), and blocks that get rewritten are copied to the head instead of being changed in place.
+// The image file then sees appends instead of scattered writes. Block 0 and the inode table stay where they
+// are, the table doubles as the map of where the latest version of each inode is. See neat_cleaner.h for
+// what frees whole segments up again.
+
+// What a memory-only image asks for first, one huge page holds all of it
+#define BLOCKS_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes);
 
-// Load and initialize the given disk image.
+// Load and initialize the given disk image (one file, or several separated by commas).
 void blocks_init(const char *image_path);
 
-// Close the disk image.
+// Make the next blocks_init leave the image on disk untouched until blocks_free, not even writing block 0
+// (for a read only mount, another one may be writing to the image meanwhile). The image has to exist already.
+void blocks_set_read_only(int enabled);
+
+// Check that the given disk image exists and each of its files is the size its layout calls for, without
+// creating or changing anything.
+// Returns 0 if it does, -1 if not.
+int blocks_check_image(const char *image_path);
+
+// Set the stripe unit, in blocks, of images made of several files that get created from now on (images
+// that already exist keep the one they were made with).
+// Returns 0 on success, -1 if it isn't a power of two up to BLOCK_COUNT.
+int blocks_set_stripe_blocks(int count);
+
+// Write every changed block out to the backing files and wait for them to have it, with one thread per file.
+// Returns 0 on success, -1 on failure.
+int blocks_flush();
+
+// Create the disk image in anonymous memory (a memfd, on a huge page if there is one), starting out as a
+// copy of the given image if it exists (NULL for an empty one). Nothing is written back unless asked to.
+void blocks_init_memory(const char *image_path);
+
+// Write a copy of the whole image to the given path (as many files as it is made of), replacing whatever
+// is there only once it is complete.
+// Returns 0 on success, -1 on failure.
+int blocks_save(const char *image_path);
+
+// Close the disk image, writing the free block summary out first.
 void blocks_free();
 
 // Get the block with the given index, returning a pointer to its start.
@@ -33,26 +107,72 @@ void *get_inode_bitmap();
 // Allocate a new block and return its index.
 int alloc_block();
 
-// Deallocate the block with the given index.
+// Mark the block with the given index used (1) or free (0) without touching its contents, keeping the free
+// block summary right. Anything outside this file changes the block bitmap through here.
+void mark_block_used(int bnum, int used);
+
+// Get the number of free blocks, counting only the regions the summary doesn't know yet.
+int count_free_blocks();
+
+// Get the number of free blocks in the given region, counting it if the summary doesn't know it yet.
+int count_free_region_blocks(int region);
+
+// Count every region the free block summary already knows again, fixing the counts that are off.
+// Returns the number of regions that were off.
+int recount_free_blocks();
+
+// Drop an owner of the block with the given index, deallocating it once it has none left.
 void free_block(int bnum);
 
-//Retrurns the actual size if we account for the last sizeof(int) space
-//reserved at the end of the block for the block index referencing the next block
-int block_data_size();
+// Drop an owner of [count] blocks at once from the array of indexes [bnums].
+void free_blocks(int *bnums, int count);
+
+// Return a pointer to the per-block share counts (owners past the first, so 0 for most blocks).
+uint8_t *get_block_refs();
+
+// Return a pointer to the per-block dedup fingerprints (0 for a block without one).
+uint32_t *get_block_fingerprints();
+
+// Return a pointer to the per-block checksums (0 for a block without one).
+uint32_t *get_block_checksums();
+
+// Return a pointer to the snapshot table.
+void *get_snapshot_table();
+
+//Adds an owner to the allocated block at [block_i]
+//Returns 0 on success, -1 if it already has BLOCK_MAX_SHARES extra owners
+int share_block(int block_i);
+
+//Checks if the block at [block_i] has more than one owner
+//Returns 1 if it is shared, 0 if not
+int block_is_shared(int block_i);
+
+//Finds the first run of [count] contiguous free blocks without allocating them
+//Returns the index of the first block in the run on success, -1 if no such run exists
+int find_free_block_run(int count);
+
+//Allocates the first run of [count] contiguous free blocks, zeroed like alloc_block
+//Returns the index of the first block in the run on success, -1 if no such run exists
+int alloc_block_run(int count);
+
+//Allocates like alloc_block_run, but leaves whatever the blocks held before in them, for a caller that
+//overwrites every byte of the run before anything can read it
+//Returns the index of the first block in the run on success, -1 if no such run exists
+int alloc_block_run_unzeroed(int count);
 
-//Returns the next block index (stored at the end of each block) if successful, -1 if not available
-//or on failure
-int get_next_block_i(int block_i);
+// Turn log mode on (1) or off (0), blocks already in use stay where they are either way.
+void blocks_set_log_mode(int on);
 
-//Resets the end of the block where the next block index is stored to -1
-//Returns 0 on success, -1 on failure
-int reset_next_block_i(int block_i);
+// Check if blocks are handed out at the log head.
+// Returns 1 in log mode, 0 if not.
+int blocks_log_mode();
 
-//Alloactes an extension block based on the block index given
-//Returns the new extension block index on success, -1 on failure
-int allocate_extension_block(int block_i);
+// Get the segment (region) the log is appending to.
+// Returns the segment, -1 if log mode is off or nothing was allocated since the image was loaded.
+int get_log_segment();
 
-//Iterates through the given block index until the last extension block is reached
-//Returns the last block available (inclusive the initial block given) on success, -1 on failure
-int get_last_ext_block_i(int block_i);
+// Check if the block with the given index has to be copied to the log head before it changes, which is
+// any block outside the segment the log is appending to while in log mode.
+// Returns 1 if it does, 0 if it can be changed in place.
+int block_is_behind_log(int bnum);
 #endif
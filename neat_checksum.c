@@ -0,0 +1,307 @@
+#include "neat_checksum.h"
+#include "neat_storage.h"
+#include "neat_inode.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "neat_stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CHECKSUM_FILE_NAME "neat_checksum.c // "
+
+//CRC-32C (Castagnoli), bit reflected
+#define CHECKSUM_POLY 0x82f63b78u
+//A whole block is checksummed as three lanes of this many bytes side by side (plus what is left over)
+#define CHECKSUM_LANE (BLOCK_SIZE / 3 / 8 * 8)
+
+//slicing-by-8 tables, [0] is the plain byte at a time one
+static uint32_t crc_table[8][256];
+//what running CHECKSUM_LANE zero bytes through the CRC does to it, one table per byte of the CRC
+static uint32_t lane_shift[4][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_kernel)(uint32_t crc, const unsigned char *p, size_t len);
+
+static int enabled = 0;
+//the checksum each block last matched, a block is only read through again once its checksum changes
+static uint32_t verified[BLOCK_COUNT];
+
+static neat_scrub_progress_t progress = {.last_failed_block = -1};
+//allocated blocks without a checksum seen so far in the pass that is still running
+static int pass_unsealed = 0;
+
+static pthread_t scrub_thread;
+static atomic_int stop_requested;
+static atomic_llong last_io_ms;
+
+static long long checksum__now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//Forced inline (along with the shift) into the kernels, which are optimized even though the build isn't
+static inline __attribute__((always_inline)) uint64_t checksum__load64(const unsigned char *p){
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+//Runs [crc] through CHECKSUM_LANE zero bytes, which is what appending a lane to the data before it amounts to
+static inline __attribute__((always_inline)) uint32_t checksum__shift(uint32_t crc){
+    return lane_shift[0][crc & 0xff] ^ lane_shift[1][(crc >> 8) & 0xff]
+           ^ lane_shift[2][(crc >> 16) & 0xff] ^ lane_shift[3][crc >> 24];
+}
+
+//Works on the raw CRC register (no inversion before or after), 8 bytes at a time with one lookup per byte
+__attribute__((optimize("O2")))
+static uint32_t checksum__portable_kernel(uint32_t crc, const unsigned char *p, size_t len){
+    for (; len > 0 && ((uintptr_t) p & 7); len--){
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    //the image is little endian, so the low byte of the word is the first one
+    for (; len >= 8; len -= 8, p += 8){
+        uint64_t word = checksum__load64(p) ^ crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff]
+              ^ crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff]
+              ^ crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff]
+              ^ crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+    }
+    for (; len > 0; len--){
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+//crc32 takes three cycles but a new one can start every cycle, so three independent lanes keep it busy.
+//The lanes are stitched back together by shifting the CRC of each one over the length of the next.
+__attribute__((target("sse4.2"), optimize("O2")))
+static uint32_t checksum__sse42_kernel(uint32_t crc, const unsigned char *p, size_t len){
+    for (; len > 0 && ((uintptr_t) p & 7); len--){
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    for (; len >= 3 * CHECKSUM_LANE; len -= 3 * CHECKSUM_LANE){
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+        for (const unsigned char *end = p + CHECKSUM_LANE; p < end; p += 8){
+            crc0 = _mm_crc32_u64(crc0, checksum__load64(p));
+            crc1 = _mm_crc32_u64(crc1, checksum__load64(p + CHECKSUM_LANE));
+            crc2 = _mm_crc32_u64(crc2, checksum__load64(p + 2 * CHECKSUM_LANE));
+        }
+        crc = checksum__shift(checksum__shift(crc0) ^ crc1) ^ crc2;
+        p += 2 * CHECKSUM_LANE;
+    }
+    for (; len >= 8; len -= 8, p += 8){
+        crc = _mm_crc32_u64(crc, checksum__load64(p));
+    }
+    for (; len > 0; len--){
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void checksum__init_tables(){
+    for (int n = 0; n < 256; n++){
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++){
+            crc = crc & 1 ? (crc >> 1) ^ CHECKSUM_POLY : crc >> 1;
+        }
+        crc_table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++){
+        for (int k = 1; k < 8; k++){
+            uint32_t prev = crc_table[k - 1][n];
+            crc_table[k][n] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+        }
+    }
+
+    //shifting is linear, so it is enough to know where each single bit ends up
+    uint32_t bit_shift[32];
+    for (int bit = 0; bit < 32; bit++){
+        uint32_t crc = 1u << bit;
+        for (int i = 0; i < CHECKSUM_LANE; i++){
+            crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+        bit_shift[bit] = crc;
+    }
+    for (int k = 0; k < 4; k++){
+        for (int n = 0; n < 256; n++){
+            uint32_t crc = 0;
+            for (int bit = 0; bit < 8; bit++){
+                crc ^= n & (1 << bit) ? bit_shift[k * 8 + bit] : 0;
+            }
+            lane_shift[k][n] = crc;
+        }
+    }
+
+    crc_kernel = checksum__portable_kernel;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")){
+        crc_kernel = checksum__sse42_kernel;
+    }
+#endif
+    printf("%susing the %s CRC32C\n", CHECKSUM_FILE_NAME, crc_kernel == checksum__portable_kernel ? "portable" : "SSE4.2");
+}
+
+void checksum__init(){
+    memset(verified, 0, sizeof(verified));
+    progress = (neat_scrub_progress_t) {.last_failed_block = -1};
+    pass_unsealed = 0;
+}
+
+void checksum__set_enabled(int on){
+    enabled = on;
+}
+
+int checksum__enabled(){
+    return enabled;
+}
+
+uint32_t checksum__crc32c(uint32_t crc, const void *data, size_t len){
+    pthread_once(&tables_once, checksum__init_tables);
+    return ~crc_kernel(~crc, data, len);
+}
+
+uint32_t checksum__crc32c_portable(uint32_t crc, const void *data, size_t len){
+    pthread_once(&tables_once, checksum__init_tables);
+    return ~checksum__portable_kernel(~crc, data, len);
+}
+
+uint32_t checksum__block(int block_i){
+    uint32_t crc = checksum__crc32c(0, blocks_get_block(block_i), BLOCK_SIZE);
+    return crc != 0 ? crc : 1;
+}
+
+void checksum__seal(int block_i){
+    uint32_t checksum = enabled ? checksum__block(block_i) : 0;
+    get_block_checksums()[block_i] = checksum;
+    verified[block_i] = checksum;
+}
+
+void checksum__forget(int block_i){
+    get_block_checksums()[block_i] = 0;
+}
+
+//Reads the block at [block_i] through and compares it to its checksum
+//Returns 0 if it matches, -1 if it doesn't
+static int checksum__recheck(int block_i, uint32_t checksum){
+    if (checksum__block(block_i) == checksum){
+        verified[block_i] = checksum;
+        return 0;
+    }
+
+    printf("%sERROR: block %d doesn't match its checksum\n", CHECKSUM_FILE_NAME, block_i);
+    //whatever matched before doesn't vouch for it anymore, reads fail from now on too
+    verified[block_i] = 0;
+    stats__count(STATS_EVENT_CHECKSUM_FAILURES, 1);
+    return -1;
+}
+
+int checksum__verify(int block_i){
+    uint32_t checksum = get_block_checksums()[block_i];
+    if (!enabled || checksum == 0 || verified[block_i] == checksum){
+        return 0;
+    }
+    return checksum__recheck(block_i, checksum);
+}
+
+int checksum__scrub_step(){
+    void *bbm = get_blocks_bitmap();
+    uint32_t *checksums = get_block_checksums();
+    int failures = 0;
+
+    for (int step = 0; step < SCRUB_BLOCKS_PER_STEP; step++){
+        if (progress.cursor >= BLOCK_COUNT){
+            progress.cursor = 0;
+            progress.passes++;
+            progress.unsealed = pass_unsealed;
+            pass_unsealed = 0;
+            break;
+        }
+
+        int block_i = progress.cursor++;
+        if (!bitmap_get(bbm, block_i)){
+            continue;
+        }
+        if (checksums[block_i] == 0){
+            //the metadata blocks at the front change on every call, they are never checksummed
+            pass_unsealed += block_i >= INODE_FIRST_DATA_BLOCK;
+            continue;
+        }
+
+        //the in-memory "already matched" shortcut is exactly what the scrubber is there to second guess
+        progress.blocks_checked++;
+        if (checksum__recheck(block_i, checksums[block_i]) != 0){
+            progress.failures++;
+            progress.last_failed_block = block_i;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+void checksum__note_io(){
+    atomic_store(&last_io_ms, checksum__now_ms());
+}
+
+static void *checksum__scrub_main(void *arg){
+    struct timespec tick = {0, SCRUB_TICK_MS * 1000000L};
+
+    //on linux the nice value is per thread, so this leaves the FUSE threads alone
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), SCRUB_NICE);
+
+    while (!atomic_load(&stop_requested)){
+        nanosleep(&tick, NULL);
+
+        if (checksum__now_ms() - atomic_load(&last_io_ms) < SCRUB_IDLE_MS){
+            continue;
+        }
+
+        storage_lock();
+        checksum__scrub_step();
+        storage_unlock();
+    }
+    return NULL;
+}
+
+int checksum__scrub_start(){
+    atomic_store(&stop_requested, 0);
+    if (pthread_create(&scrub_thread, NULL, checksum__scrub_main, NULL) != 0){
+        printf("%sERROR: failed to start the scrubber thread\n", CHECKSUM_FILE_NAME);
+        return -1;
+    }
+
+    storage_lock();
+    progress.running = 1;
+    storage_unlock();
+    return 0;
+}
+
+void checksum__scrub_stop(){
+    storage_lock();
+    int running = progress.running;
+    progress.running = 0;
+    storage_unlock();
+
+    if (!running){
+        return;
+    }
+    atomic_store(&stop_requested, 1);
+    pthread_join(scrub_thread, NULL);
+}
+
+void checksum__get_scrub_progress(neat_scrub_progress_t *out){
+    storage_lock();
+    *out = progress;
+    storage_unlock();
+}
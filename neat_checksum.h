@@ -0,0 +1,86 @@
+#ifndef NEAT_CHECKSUM_H
+#define NEAT_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+//With checksums on, every block the storage layer writes gets a CRC32C of its contents in block 0, and a read
+//checks the block against it the first time the block is read after the mount (or after it last changed).
+//Blocks the data went bad in behind our back after that are left to the background scrubber, which keeps
+//re-reading the whole image while it is idle. A checksum of 0 means "none", a block written with checksums off
+//(or not written since they were turned on) just isn't checked. That goes for the indirect, directory and xattr
+//blocks a lookup goes through as much as for data blocks, a mismatch in any of them fails the call with -EIO.
+
+//How long the image has to be free of foreground I/O before the scrubber reads anything
+#define SCRUB_IDLE_MS 200
+//How often the scrubber wakes up, and how many blocks it checks each time
+#define SCRUB_TICK_MS 50
+#define SCRUB_BLOCKS_PER_STEP 16
+//Nice value of the scrubber thread, so it only gets the CPU nobody else wants
+#define SCRUB_NICE 19
+
+typedef struct neat_scrub_progress {
+    int running;
+    int passes;             //completed sweeps over the whole image
+    int cursor;             //next block index to be looked at
+    int blocks_checked;
+    int unsealed;           //allocated blocks without a checksum found during the last completed pass
+    int failures;           //blocks that didn't match their checksum, counted every time one is found
+    int last_failed_block;  //-1 until one is found
+} neat_scrub_progress_t;
+
+//Ioctl on any file of the mount to read the scrubber progress
+#define NUFS_IOC_SCRUB_PROGRESS _IOR('N', 8, neat_scrub_progress_t)
+
+//Forgets which blocks already matched their checksums, the image just got (re)loaded (after blocks_init)
+void checksum__init();
+
+//Turns checksumming on or off (checksums already in the image stay until their blocks change)
+void checksum__set_enabled(int enabled);
+
+//Checks if blocks get checksummed
+//Returns 1 if they do, 0 if not
+int checksum__enabled();
+
+//Continues the CRC32C [crc] (0 to start one) over [len] bytes of [data], with the SSE4.2 crc32 instruction
+//if the CPU has it
+//Returns the updated CRC
+uint32_t checksum__crc32c(uint32_t crc, const void *data, size_t len);
+
+//Same as checksum__crc32c, but always table driven, the fallback for CPUs without SSE4.2
+//Returns the updated CRC
+uint32_t checksum__crc32c_portable(uint32_t crc, const void *data, size_t len);
+
+//Computes the checksum of the block at [block_i] as it is stored in block 0
+//Returns the checksum (never 0, that means "none")
+uint32_t checksum__block(int block_i);
+
+//Records the checksum of the block at [block_i] after it was written, or forgets it with checksums off
+void checksum__seal(int block_i);
+
+//Forgets the checksum of the block at [block_i] before it gets written in place
+void checksum__forget(int block_i);
+
+//Checks the block at [block_i] against its checksum, unless it already matched since it last changed
+//Returns 0 if it matches (or there is nothing to check), -1 if it doesn't
+int checksum__verify(int block_i);
+
+//Checks the next few blocks of the image against their checksums (caller holds storage_lock), reads of a block
+//found not to match fail until it is written again
+//Returns the number of blocks that didn't match
+int checksum__scrub_step();
+
+//Marks that foreground I/O just happened so the scrubber throttles itself
+void checksum__note_io();
+
+//Starts the background scrubber thread
+//Returns 0 on success, -1 on failure
+int checksum__scrub_start();
+
+//Stops the background scrubber thread and waits for it to exit
+void checksum__scrub_stop();
+
+//Copies the current scrubber progress into [progress]
+void checksum__get_scrub_progress(neat_scrub_progress_t *progress);
+#endif
@@ -0,0 +1,236 @@
+#include "neat_cleaner.h"
+#include "neat_storage.h"
+#include "neat_inode.h"
+#include "neat_xattr.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "neat_stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define CLEANER_FILE_NAME "neat_cleaner.c // "
+
+static neat_cleaner_progress_t progress;
+
+static pthread_t cleaner_thread;
+static atomic_int stop_requested;
+static atomic_llong last_io_ms;
+
+static long long cleaner__now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int cleaner__free_segments(){
+    int free = 0;
+    for (int segment = 0; segment < BLOCKS_REGION_COUNT; segment++){
+        free += segment != get_log_segment() && count_free_region_blocks(segment) == BLOCKS_REGION_SIZE;
+    }
+    return free;
+}
+
+int cleaner__pick_segment(){
+    int best = -1;
+    int best_free = CLEANER_MIN_FREE_BLOCKS - 1;
+    //block 0 and the inode table never move, so the segment they are in never comes free
+    for (int segment = (INODE_FIRST_DATA_BLOCK - 1) / BLOCKS_REGION_SIZE + 1; segment < BLOCKS_REGION_COUNT; segment++){
+        int free = count_free_region_blocks(segment);
+        if (segment != get_log_segment() && free < BLOCKS_REGION_SIZE && free > best_free){
+            best = segment;
+            best_free = free;
+        }
+    }
+    return best;
+}
+
+//Checks if the block at [block_i] is in [segment] and the cleaner may move it
+//Returns 1 if it may, 0 if not
+static int cleaner__movable(int block_i, int segment){
+    return block_i >= INODE_FIRST_DATA_BLOCK && block_i < BLOCK_COUNT && block_i / BLOCKS_REGION_SIZE == segment
+           && !block_is_shared(block_i);
+}
+
+//Copies the block at [block_i] to the log head, the caller points its owner at the copy and frees the original
+//Returns the index of the copy on success, -1 if there is no room for it outside [segment]
+static int cleaner__copy_block(int block_i, int segment){
+    int copy_i = alloc_block();
+    if (copy_i < 0){
+        return -1;
+    }
+    //the log had nowhere else to go, moving the block within the segment gets nothing back
+    if (copy_i / BLOCKS_REGION_SIZE == segment){
+        free_block(copy_i);
+        return -1;
+    }
+
+    memcpy(blocks_get_block(copy_i), blocks_get_block(block_i), BLOCK_SIZE);
+    //the data is the same, so dedup can keep matching it at its new home and its checksum still holds
+    get_block_fingerprints()[copy_i] = get_block_fingerprints()[block_i];
+    get_block_checksums()[copy_i] = get_block_checksums()[block_i];
+    stats__count(STATS_EVENT_CLEANER_MOVES, 1);
+    return copy_i;
+}
+
+//Moves the block at [*block_i] out of [segment] if it is in there, pointing [block_i] at its new home
+//Returns 1 if it was moved, 0 if it stays, -1 if the log ran out of room
+static int cleaner__move_owned(int *block_i, int segment){
+    if (!cleaner__movable(*block_i, segment)){
+        return 0;
+    }
+    int copy_i = cleaner__copy_block(*block_i, segment);
+    if (copy_i < 0){
+        return -1;
+    }
+    free_block(*block_i);
+    *block_i = copy_i;
+    return 1;
+}
+
+//Moves the blocks of [inode] that are in [segment] out of it
+//Returns the number of blocks moved, -1 if the log ran out of room
+static int cleaner__clean_inode(neat_inode_t *inode, int segment){
+    int moved = 0;
+
+    int count = inode__blocks_for_size(inode__stored_size(inode));
+    for (int i = 0; i < count; i++){
+        int block_i = inode__get_block_i(inode, i);
+        if (!cleaner__movable(block_i, segment)){
+            continue;
+        }
+        int copy_i = cleaner__copy_block(block_i, segment);
+        if (copy_i < 0){
+            return -1;
+        }
+        if (inode__set_block_i(inode, i, copy_i) != 0){
+            free_block(copy_i);
+            return -1;
+        }
+        free_block(block_i);
+        moved++;
+    }
+
+    //the runs of xattr values go before the xattr block pointing at them, which changes when they move
+    int runs_moved = xattr__move_runs(inode, segment * BLOCKS_REGION_SIZE, BLOCKS_REGION_SIZE);
+    if (runs_moved < 0){
+        return -1;
+    }
+
+    //setting entries in the indirect block above may already have moved it to the log head
+    int indirect_moved = cleaner__move_owned(&inode->indirect_i, segment);
+    int xattr_moved = indirect_moved < 0 ? -1 : cleaner__move_owned(&inode->xattr_i, segment);
+    if (xattr_moved < 0){
+        return -1;
+    }
+    return moved + runs_moved + indirect_moved + xattr_moved;
+}
+
+int cleaner__clean_segment(int segment){
+    int inode_count = inode__get_inode_count();
+    void *inbm = get_inode_bitmap();
+    int moved = 0;
+
+    for (int inode_i = 0; inode_i < inode_count; inode_i++){
+        if (!bitmap_get(inbm, inode_i)){
+            continue;
+        }
+        int rv = cleaner__clean_inode(inode__get_inode(inode_i), segment);
+        if (rv < 0){
+            printf("%sERROR: the log ran out of room cleaning segment %d\n", CLEANER_FILE_NAME, segment);
+            return -1;
+        }
+        moved += rv;
+    }
+
+    printf("%scleaned segment %d: %d blocks moved, %d free now\n", CLEANER_FILE_NAME, segment, moved,
+           count_free_region_blocks(segment));
+    return moved;
+}
+
+int cleaner__step(){
+    if (!blocks_log_mode()){
+        return 0;
+    }
+
+    progress.free_segments = cleaner__free_segments();
+    if (progress.free_segments >= CLEANER_FREE_SEGMENTS){
+        return 0;
+    }
+
+    int segment = cleaner__pick_segment();
+    if (segment < 0){
+        return 0;
+    }
+
+    int moved = cleaner__clean_segment(segment);
+    if (moved < 0){
+        return -1;
+    }
+
+    progress.blocks_moved += moved;
+    if (count_free_region_blocks(segment) == BLOCKS_REGION_SIZE){
+        progress.segments_cleaned++;
+        progress.free_segments++;
+    }
+    else {
+        progress.segments_partial++;
+    }
+    return moved;
+}
+
+void cleaner__note_io(){
+    atomic_store(&last_io_ms, cleaner__now_ms());
+}
+
+static void *cleaner__thread_main(void *arg){
+    struct timespec tick = {0, CLEANER_TICK_MS * 1000000L};
+
+    while (!atomic_load(&stop_requested)){
+        nanosleep(&tick, NULL);
+
+        //foreground I/O always wins, only move blocks once the image has been idle for a bit
+        if (cleaner__now_ms() - atomic_load(&last_io_ms) < CLEANER_IDLE_MS){
+            continue;
+        }
+
+        storage_lock();
+        cleaner__step();
+        storage_unlock();
+    }
+    return NULL;
+}
+
+int cleaner__start(){
+    atomic_store(&stop_requested, 0);
+    if (pthread_create(&cleaner_thread, NULL, cleaner__thread_main, NULL) != 0){
+        printf("%sERROR: failed to start the cleaner thread\n", CLEANER_FILE_NAME);
+        return -1;
+    }
+
+    storage_lock();
+    progress.running = 1;
+    storage_unlock();
+    return 0;
+}
+
+void cleaner__stop(){
+    storage_lock();
+    int running = progress.running;
+    progress.running = 0;
+    storage_unlock();
+
+    if (!running){
+        return;
+    }
+    atomic_store(&stop_requested, 1);
+    pthread_join(cleaner_thread, NULL);
+}
+
+void cleaner__get_progress(neat_cleaner_progress_t *out){
+    storage_lock();
+    *out = progress;
+    storage_unlock();
+}
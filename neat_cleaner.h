@@ -0,0 +1,64 @@
+#ifndef NEAT_CLEANER_H
+#define NEAT_CLEANER_H
+
+#include <sys/ioctl.h>
+#include "neat_inode.h"
+
+//In log mode (see blocks.h) rewritten blocks leave holes behind in the segments the log has moved past. The
+//cleaner gets whole segments back for the log to append to: while too few of them are entirely free it picks
+//the segment with the most free blocks and moves the live blocks out of it to the log head. Only blocks the
+//live inode table points at (data, indirect and xattr blocks, and the runs of xattr values) are moved, and only
+//if nothing else shares them, so a segment holding snapshot or shared blocks may not come free entirely.
+
+//How long the image has to be free of foreground I/O before the cleaner moves anything
+#define CLEANER_IDLE_MS 200
+//How often the background thread wakes up to clean (at most) one segment
+#define CLEANER_TICK_MS 50
+//The cleaner keeps going until at least this many segments other than the one the log is in are entirely free
+#define CLEANER_FREE_SEGMENTS 2
+//A segment has to have at least this many free blocks to be worth cleaning, moving a nearly full one
+//costs as much as it gets back
+#define CLEANER_MIN_FREE_BLOCKS (BLOCKS_REGION_SIZE / 4)
+
+typedef struct neat_cleaner_progress {
+    int running;
+    int segments_cleaned;   //segments the cleaner freed up entirely
+    int segments_partial;   //segments it moved what it could out of, but something else still holds blocks in
+    int blocks_moved;
+    int free_segments;      //entirely free segments (other than the log's own) when it last looked
+} neat_cleaner_progress_t;
+
+//Ioctl on any file of the mount to read the cleaner progress
+#define NUFS_IOC_CLEANER_PROGRESS _IOR('N', 9, neat_cleaner_progress_t)
+
+//Counts the segments that are entirely free, not counting the one the log is appending to
+//Returns the segment count
+int cleaner__free_segments();
+
+//Picks the segment that is the best to clean: the one with the most free blocks (at least
+//CLEANER_MIN_FREE_BLOCKS) that isn't entirely free, isn't the one the log is appending to and doesn't
+//hold block 0 or the inode table
+//Returns the segment on success, -1 if none is worth it
+int cleaner__pick_segment();
+
+//Moves every live block the inode table points at out of [segment] to the log head
+//Returns the number of blocks moved, -1 if the log ran out of room before all of them were moved
+int cleaner__clean_segment(int segment);
+
+//Cleans one segment if too few are free (caller holds storage_lock)
+//Returns the number of blocks moved, -1 on failure
+int cleaner__step();
+
+//Marks that foreground I/O just happened so the background thread throttles itself
+void cleaner__note_io();
+
+//Starts the background cleaner thread
+//Returns 0 on success, -1 on failure
+int cleaner__start();
+
+//Stops the background cleaner thread and waits for it to exit
+void cleaner__stop();
+
+//Copies the current progress counters into [progress]
+void cleaner__get_progress(neat_cleaner_progress_t *progress);
+#endif
@@ -0,0 +1,425 @@
+#include "neat_compress.h"
+#include "neat_stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define COMPRESS_FILE_NAME "neat_compress.c // "
+
+#define LZ4_MIN_MATCH 4
+//the format wants the last match to start at least 12 bytes before the end, and 5 literals at the end
+#define LZ4_MFLIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+typedef struct compress_cache_slot {
+    int inode_i;
+    int frame_i;
+    unsigned int epoch;
+    char data[COMPRESS_FRAME_SIZE];
+} compress_cache_slot_t;
+
+typedef struct compress_cache {
+    compress_cache_slot_t slots[COMPRESS_CACHE_SLOTS];
+    int next_victim;
+    //compressed bytes of the frame being decompressed
+    char scratch[COMPRESS_FRAME_SIZE];
+} compress_cache_t;
+
+static __thread compress_cache_t *thread_cache = NULL;
+//the same cache again, only there so it is freed when its thread exits (FUSE starts and ends workers as it likes)
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+//bumped whenever a file gets (re)compressed, which invalidates every cached frame in every thread at once
+//(starts at 1 so the zeroed slots of a new cache never match)
+static atomic_uint compress_epoch = 1;
+
+static uint32_t compress__read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int compress__hash(uint32_t sequence){
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+//Writes the 255-run length extension of [length] at [op]
+//Returns the new output position
+static int compress__put_length(uint8_t *out, int op, int length){
+    while (length >= 255){
+        out[op++] = 255;
+        length -= 255;
+    }
+    out[op++] = length;
+    return op;
+}
+
+//Emits one sequence ([lit_len] literals, then a match of [match_len] bytes [offset] back, or no match if 0)
+//Returns the new output position, -1 if it doesn't fit
+static int compress__emit(uint8_t *out, int op, int cap, const uint8_t *literals, int lit_len, int offset, int match_len){
+    //token + worst case length bytes + literals + offset
+    if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > cap){
+        return -1;
+    }
+
+    int match_code = match_len > 0 ? match_len - LZ4_MIN_MATCH : 0;
+    uint8_t *token = out + op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+    if (lit_len >= 15){
+        op = compress__put_length(out, op, lit_len - 15);
+    }
+    memcpy(out + op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len > 0){
+        out[op++] = offset & 0xff;
+        out[op++] = offset >> 8;
+        if (match_code >= 15){
+            op = compress__put_length(out, op, match_code - 15);
+        }
+    }
+    return op;
+}
+
+int compress__lz4_compress(const char *src, int src_len, char *dst, int dst_cap){
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst;
+
+    int table[1 << LZ4_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    int misses = 0;
+
+    while (ip < src_len - LZ4_MFLIMIT){
+        uint32_t sequence = compress__read32(in + ip);
+        int h = compress__hash(sequence);
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ4_MAX_OFFSET || compress__read32(in + ref) != sequence){
+            //skip ahead faster the longer nothing matches, incompressible data isn't worth searching byte by byte
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        int match_len = LZ4_MIN_MATCH;
+        while (ip + match_len < src_len - LZ4_LAST_LITERALS && in[ref + match_len] == in[ip + match_len]){
+            match_len++;
+        }
+
+        op = compress__emit(out, op, dst_cap, in + anchor, ip - anchor, ip - ref, match_len);
+        if (op < 0){
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    //whatever is left goes out as literals
+    op = compress__emit(out, op, dst_cap, in + anchor, src_len - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+int compress__lz4_decompress(const char *src, int src_len, char *dst, int dst_cap){
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst;
+    int ip = 0;
+    int op = 0;
+
+    while (ip < src_len){
+        int token = in[ip++];
+
+        int lit_len = token >> 4;
+        if (lit_len == 15){
+            int b;
+            do {
+                if (ip >= src_len){
+                    return -1;
+                }
+                b = in[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > src_len || op + lit_len > dst_cap){
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        //the last sequence has no match
+        if (ip == src_len){
+            break;
+        }
+
+        if (ip + 2 > src_len){
+            return -1;
+        }
+        int offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op){
+            return -1;
+        }
+
+        int match_len = token & 15;
+        if (match_len == 15){
+            int b;
+            do {
+                if (ip >= src_len){
+                    return -1;
+                }
+                b = in[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (op + match_len > dst_cap){
+            return -1;
+        }
+
+        if (offset >= match_len){
+            memcpy(out + op, out + op - offset, match_len);
+        }
+        else {
+            //the match overlaps the bytes it is producing (a repeating run), so go byte by byte
+            for (int i = 0; i < match_len; i++){
+                out[op + i] = out[op - offset + i];
+            }
+        }
+        op += match_len;
+    }
+    return op;
+}
+
+static int compress__frame_count(int size){
+    return (size + COMPRESS_FRAME_SIZE - 1) / COMPRESS_FRAME_SIZE;
+}
+
+static void compress__make_cache_key(){
+    pthread_key_create(&cache_key, free);
+}
+
+static compress_cache_t *compress__thread_cache(){
+    if (thread_cache == NULL){
+        pthread_once(&cache_key_once, compress__make_cache_key);
+        thread_cache = calloc(1, sizeof(compress_cache_t));
+        pthread_setspecific(cache_key, thread_cache);
+    }
+    return thread_cache;
+}
+
+//Gets frame [frame_i] of the compressed [inode] decompressed, from this thread's cache if it is in there
+//Returns the frame data on success, NULL on failure
+static const char *compress__get_frame(neat_inode_t *inode, int frame_i){
+    compress_cache_t *cache = compress__thread_cache();
+    unsigned int epoch = atomic_load(&compress_epoch);
+
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++){
+        compress_cache_slot_t *slot = &cache->slots[i];
+        if (slot->epoch == epoch && slot->inode_i == inode->inode_i && slot->frame_i == frame_i){
+            stats__count(STATS_EVENT_CACHE_HITS, 1);
+            return slot->data;
+        }
+    }
+    stats__count(STATS_EVENT_CACHE_MISSES, 1);
+
+    int frame_count = compress__frame_count(inode->size);
+    int frame_ends[2];
+    int start;
+    if (frame_i == 0){
+        start = frame_count * sizeof(int);
+        if (inode__read_data(inode, (char *) &frame_ends[1], sizeof(int), 0) != sizeof(int)){
+            return NULL;
+        }
+    }
+    else {
+        if (inode__read_data(inode, (char *) frame_ends, sizeof(frame_ends), (frame_i - 1) * sizeof(int)) != sizeof(frame_ends)){
+            return NULL;
+        }
+        start = frame_ends[0];
+    }
+
+    int raw_len = inode->size - frame_i * COMPRESS_FRAME_SIZE;
+    raw_len = raw_len < COMPRESS_FRAME_SIZE ? raw_len : COMPRESS_FRAME_SIZE;
+    int packed_len = frame_ends[1] - start;
+    if (packed_len <= 0 || packed_len > raw_len || frame_ends[1] > inode->stored_size){
+        printf("%sERROR: inode %d has a bad frame %d (%d..%d)\n", COMPRESS_FILE_NAME, inode->inode_i, frame_i, start, frame_ends[1]);
+        return NULL;
+    }
+
+    compress_cache_slot_t *slot = &cache->slots[cache->next_victim];
+    cache->next_victim = (cache->next_victim + 1) % COMPRESS_CACHE_SLOTS;
+    slot->epoch = 0;
+
+    //frames that didn't compress were stored as is
+    if (packed_len == raw_len){
+        if (inode__read_data(inode, slot->data, raw_len, start) != raw_len){
+            return NULL;
+        }
+    }
+    else if (inode__read_data(inode, cache->scratch, packed_len, start) != packed_len
+             || compress__lz4_decompress(cache->scratch, packed_len, slot->data, raw_len) != raw_len){
+        printf("%sERROR: inode %d frame %d doesn't decompress\n", COMPRESS_FILE_NAME, inode->inode_i, frame_i);
+        return NULL;
+    }
+
+    slot->inode_i = inode->inode_i;
+    slot->frame_i = frame_i;
+    slot->epoch = epoch;
+    return slot->data;
+}
+
+int compress__read_inode(neat_inode_t *inode, char *buf, int size, int offset){
+    if (offset >= inode->size){
+        return 0;
+    }
+    if (offset + size > inode->size){
+        size = inode->size - offset;
+    }
+
+    int done = 0;
+    while (done < size){
+        int frame_i = (offset + done) / COMPRESS_FRAME_SIZE;
+        int frame_offset = (offset + done) % COMPRESS_FRAME_SIZE;
+
+        const char *frame = compress__get_frame(inode, frame_i);
+        if (frame == NULL){
+            return done > 0 ? done : -1;
+        }
+
+        int length = COMPRESS_FRAME_SIZE - frame_offset;
+        length = size - done < length ? size - done : length;
+        memcpy(buf + done, frame + frame_offset, length);
+        done += length;
+    }
+    return done;
+}
+
+//Gives [inode] private copies of its first [block_count] blocks (and blocks for the holes among them), so
+//rewriting them can't run out of space halfway
+//Returns 0 on success, -1 on failure (copies made so far just stay, they hold the same data)
+static int compress__unshare_blocks(neat_inode_t *inode, int block_count){
+    for (int i = 0; i < block_count; i++){
+        if (inode__get_writable_block_i(inode, i) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int compress__compress_inode(neat_inode_t *inode){
+    //single block files can't get any smaller
+    if ((inode->flags & (NEAT_INODE_COMPRESSED | NEAT_INODE_INCOMPRESSIBLE)) || !S_ISREG(inode->mode)
+        || inode->size <= BLOCK_SIZE){
+        return 0;
+    }
+
+    int size = inode->size;
+    int frame_count = compress__frame_count(size);
+    int header_size = frame_count * sizeof(int);
+
+    char *raw = malloc(size);
+    char *packed = malloc(header_size + size);
+    if (raw == NULL || packed == NULL || inode__read_data(inode, raw, size, 0) != size){
+        free(raw);
+        free(packed);
+        return -1;
+    }
+
+    int *frame_ends = (int *) packed;
+    int packed_size = header_size;
+    for (int frame_i = 0; frame_i < frame_count; frame_i++){
+        char *frame = raw + frame_i * COMPRESS_FRAME_SIZE;
+        int raw_len = size - frame_i * COMPRESS_FRAME_SIZE;
+        raw_len = raw_len < COMPRESS_FRAME_SIZE ? raw_len : COMPRESS_FRAME_SIZE;
+
+        //anything that doesn't come out strictly smaller is kept raw
+        int packed_len = compress__lz4_compress(frame, raw_len, packed + packed_size, raw_len - 1);
+        if (packed_len <= 0){
+            memcpy(packed + packed_size, frame, raw_len);
+            packed_len = raw_len;
+        }
+        packed_size += packed_len;
+        frame_ends[frame_i] = packed_size;
+    }
+    free(raw);
+
+    //holes already cost nothing, only the blocks behind the rest count
+    int saved = inode__allocated_blocks(inode) - inode__blocks_for_size(packed_size);
+    if (saved <= 0){
+        //don't try again until the file changes
+        inode->flags |= NEAT_INODE_INCOMPRESSIBLE;
+        free(packed);
+        return 0;
+    }
+
+    //the file still has enough blocks for the packed data, write it first and then cut off the rest
+    if (compress__unshare_blocks(inode, inode__blocks_for_size(packed_size)) != 0){
+        free(packed);
+        return -1;
+    }
+    inode__write_data(inode, packed, packed_size, 0);
+    free(packed);
+    inode__shrink_inode(inode, packed_size);
+
+    inode->size = size;
+    inode->stored_size = packed_size;
+    inode->flags |= NEAT_INODE_COMPRESSED;
+    compress__forget_frames();
+
+    printf("%scompressed inode %d: %d -> %d bytes (%d blocks saved)\n", COMPRESS_FILE_NAME,
+           inode->inode_i, size, packed_size, saved);
+    return saved;
+}
+
+void compress__forget_frames(){
+    atomic_fetch_add(&compress_epoch, 1);
+}
+
+int compress__inflate_inode(neat_inode_t *inode, int keep_size){
+    if (!(inode->flags & NEAT_INODE_COMPRESSED)){
+        return 0;
+    }
+
+    int size = inode->size;
+    keep_size = keep_size < size ? keep_size : size;
+
+    //only the blocks the raw data gets written back over have to be private
+    int rewrite_size = keep_size < inode->stored_size ? keep_size : inode->stored_size;
+    char *raw = malloc(keep_size > 0 ? keep_size : 1);
+    if (raw == NULL || compress__read_inode(inode, raw, keep_size, 0) != keep_size
+        || compress__unshare_blocks(inode, inode__blocks_for_size(rewrite_size)) != 0){
+        free(raw);
+        return -1;
+    }
+
+    //from here on the blocks are just [stored_size] plain bytes that get resized to the raw data
+    inode->size = inode->stored_size;
+    //the new part gets its blocks up front, so writing the raw data back can't run out of room halfway
+    if (inode__grow_inode(inode, keep_size) != 0
+        || inode__preallocate(inode, 0, inode__blocks_for_size(keep_size)) != 0){
+        inode->size = size;
+        free(raw);
+        return -1;
+    }
+    inode->flags &= ~NEAT_INODE_COMPRESSED;
+    inode->stored_size = 0;
+
+    inode__write_data(inode, raw, keep_size, 0);
+    free(raw);
+
+    printf("%sinflated inode %d back to %d bytes\n", COMPRESS_FILE_NAME, inode->inode_i, keep_size);
+    return 0;
+}
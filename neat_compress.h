@@ -0,0 +1,40 @@
+#ifndef NEAT_COMPRESS_H
+#define NEAT_COMPRESS_H
+
+#include "blocks.h"
+#include "neat_inode.h"
+
+//A compressed file is split into frames of this many blocks worth of data, each compressed on its own
+//so a read only has to decompress the frames it touches
+#define COMPRESS_FRAME_BLOCKS 4
+#define COMPRESS_FRAME_SIZE (COMPRESS_FRAME_BLOCKS * BLOCK_SIZE)
+//Decompressed frames each thread keeps around
+#define COMPRESS_CACHE_SLOTS 4
+
+//Layout of a compressed file's blocks: an int per frame holding where that frame ends (counted from the start
+//of the data), followed by the frames back to back. A frame as long as its raw data is stored as is.
+
+//Compresses [src_len] bytes of [src] into [dst] in the LZ4 block format
+//Returns the compressed length on success, 0 if it doesn't fit in [dst_cap] bytes
+int compress__lz4_compress(const char *src, int src_len, char *dst, int dst_cap);
+
+//Decompresses [src_len] bytes of LZ4 block data from [src] into [dst]
+//Returns the decompressed length on success, -1 if the data is corrupt or doesn't fit in [dst_cap] bytes
+int compress__lz4_decompress(const char *src, int src_len, char *dst, int dst_cap);
+
+//Compresses the regular file [inode] in place if that frees up at least one block
+//Returns the number of blocks saved (0 if it was left alone) on success, -1 on failure
+int compress__compress_inode(neat_inode_t *inode);
+
+//Turns the compressed [inode] back into plain blocks, keeping only its first [keep_size] bytes
+//Returns 0 on success, -1 on failure (the inode is left compressed)
+int compress__inflate_inode(neat_inode_t *inode, int keep_size);
+
+//Reads [size] bytes at [offset] out of the compressed [inode] (stops at the end of the file)
+//Returns the number of bytes read on success, -1 on failure
+int compress__read_inode(neat_inode_t *inode, char *buf, int size, int offset);
+
+//Drops the decompressed frames every thread has cached, for when an inode got other frames without
+//being compressed itself (a clone)
+void compress__forget_frames();
+#endif
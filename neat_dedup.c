@@ -0,0 +1,152 @@
+#include "neat_dedup.h"
+#include "neat_storage.h"
+#include "blocks.h"
+#include "bitmap.h"
+
+#include <string.h>
+
+#define DEDUP_FILE_NAME "neat_dedup.c // "
+
+#define DEDUP_LANES 8
+#define DEDUP_PRIME_1 2654435761u
+#define DEDUP_PRIME_2 2246822519u
+
+typedef struct dedup_cache_slot {
+    uint32_t fingerprint;
+    int16_t block_i;
+} dedup_cache_slot_t;
+
+//only ever a hint: a slot is checked against the fingerprint in block 0 and the block data before it is used,
+//so a block that was freed or rewritten since just stops matching
+static dedup_cache_slot_t cache[DEDUP_CACHE_SLOTS];
+//the cache is only built once a write looks something up, so mounting doesn't read every fingerprint
+static int cache_loaded = 0;
+static int enabled = 0;
+
+//Checks if the cached [slot] still describes its block
+static int dedup__slot_live(dedup_cache_slot_t *slot){
+    return slot->fingerprint != 0 && bitmap_get(get_blocks_bitmap(), slot->block_i)
+           && get_block_fingerprints()[slot->block_i] == slot->fingerprint;
+}
+
+static void dedup__cache_put(uint32_t fingerprint, int block_i){
+    int home = fingerprint & (DEDUP_CACHE_SLOTS - 1);
+
+    for (int probe = 0; probe < DEDUP_CACHE_PROBES; probe++){
+        dedup_cache_slot_t *slot = &cache[(home + probe) & (DEDUP_CACHE_SLOTS - 1)];
+        if (slot->fingerprint == fingerprint || !dedup__slot_live(slot)){
+            slot->fingerprint = fingerprint;
+            slot->block_i = block_i;
+            return;
+        }
+    }
+
+    //everything nearby is live, the home slot loses its entry (that block just can't be matched anymore)
+    cache[home].fingerprint = fingerprint;
+    cache[home].block_i = block_i;
+}
+
+void dedup__init(){
+    cache_loaded = 0;
+}
+
+//Builds the cache from the fingerprints in block 0, unless it already is
+static void dedup__load_cache(){
+    if (cache_loaded){
+        return;
+    }
+    cache_loaded = 1;
+    memset(cache, 0, sizeof(cache));
+
+    uint32_t *fingerprints = get_block_fingerprints();
+    void *bbm = get_blocks_bitmap();
+    int count = 0;
+    for (int block_i = 1; block_i < BLOCK_COUNT; block_i++){
+        if (fingerprints[block_i] != 0 && bitmap_get(bbm, block_i)){
+            dedup__cache_put(fingerprints[block_i], block_i);
+            count++;
+        }
+    }
+    printf("%sloaded %d fingerprints\n", DEDUP_FILE_NAME, count);
+}
+
+void dedup__set_enabled(int on){
+    enabled = on;
+}
+
+int dedup__enabled(){
+    return enabled;
+}
+
+uint32_t dedup__hash(const char *data){
+    uint32_t lanes[DEDUP_LANES];
+    for (int lane = 0; lane < DEDUP_LANES; lane++){
+        lanes[lane] = DEDUP_PRIME_1 * (lane + 1);
+    }
+
+    //every lane only ever sees its own words, so the inner loop has no dependencies between lanes
+    for (int offset = 0; offset < BLOCK_SIZE; offset += sizeof(lanes)){
+        uint32_t words[DEDUP_LANES];
+        memcpy(words, data + offset, sizeof(words));
+        for (int lane = 0; lane < DEDUP_LANES; lane++){
+            lanes[lane] = (lanes[lane] ^ words[lane]) * DEDUP_PRIME_1;
+            lanes[lane] ^= lanes[lane] >> 15;
+        }
+    }
+
+    uint32_t hash = 0;
+    for (int lane = 0; lane < DEDUP_LANES; lane++){
+        hash = (hash ^ lanes[lane]) * DEDUP_PRIME_2;
+        hash ^= hash >> 13;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+int dedup__find(uint32_t fingerprint, const char *data){
+    dedup__load_cache();
+    int home = fingerprint & (DEDUP_CACHE_SLOTS - 1);
+
+    for (int probe = 0; probe < DEDUP_CACHE_PROBES; probe++){
+        dedup_cache_slot_t *slot = &cache[(home + probe) & (DEDUP_CACHE_SLOTS - 1)];
+        if (slot->fingerprint == 0){
+            break;
+        }
+        //a matching fingerprint is only a candidate, the data has to match byte for byte
+        if (slot->fingerprint == fingerprint && dedup__slot_live(slot)
+            && memcmp(blocks_get_block(slot->block_i), data, BLOCK_SIZE) == 0){
+            return slot->block_i;
+        }
+    }
+    return -1;
+}
+
+void dedup__remember(int block_i, uint32_t fingerprint){
+    get_block_fingerprints()[block_i] = fingerprint;
+    //a cache that isn't built yet picks it up from block 0 anyway
+    if (cache_loaded){
+        dedup__cache_put(fingerprint, block_i);
+    }
+}
+
+void dedup__get_info(neat_dedup_info_t *info){
+    storage_lock();
+    memset(info, 0, sizeof(neat_dedup_info_t));
+    info->enabled = enabled;
+
+    uint8_t *refs = get_block_refs();
+    uint32_t *fingerprints = get_block_fingerprints();
+    void *bbm = get_blocks_bitmap();
+    for (int block_i = 1; block_i < BLOCK_COUNT; block_i++){
+        if (!bitmap_get(bbm, block_i)){
+            continue;
+        }
+        if (refs[block_i] > 0){
+            info->shared_blocks++;
+            info->extra_owners += refs[block_i];
+        }
+        if (fingerprints[block_i] != 0){
+            info->fingerprints++;
+        }
+    }
+    storage_unlock();
+}
@@ -0,0 +1,47 @@
+#ifndef NEAT_DEDUP_H
+#define NEAT_DEDUP_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+//Slots of the in-memory fingerprint -> block index, rebuilt from the fingerprints in block 0 on first lookup
+#define DEDUP_CACHE_SLOTS 512
+//How far a lookup probes past the home slot of a fingerprint
+#define DEDUP_CACHE_PROBES 8
+
+typedef struct neat_dedup_info {
+    int enabled;
+    int shared_blocks;      //blocks with more than one owner
+    int extra_owners;       //owners past the first summed over all blocks, what the data would take on top
+                            //without any sharing. the refcounts don't say where a share came from, so this
+                            //counts clones and snapshots as well as dedup hits
+    int fingerprints;       //blocks that can currently be deduplicated against
+} neat_dedup_info_t;
+
+//Ioctl on any file of the mount to read how much sharing blocks (dedup, clones and snapshots) is saving
+#define NUFS_IOC_DEDUP_INFO _IOR('N', 3, neat_dedup_info_t)
+
+//Forgets the fingerprint cache, it gets rebuilt from the image on first lookup (after blocks_init)
+void dedup__init();
+
+//Turns deduplicating full block writes on or off (shared blocks stay shared either way)
+void dedup__set_enabled(int enabled);
+
+//Checks if full block writes get deduplicated
+//Returns 1 if they do, 0 if not
+int dedup__enabled();
+
+//Hashes a whole block of [data], in 8 independent lanes so the compiler can vectorize it
+//Returns the fingerprint (never 0, that means "none")
+uint32_t dedup__hash(const char *data);
+
+//Looks for an allocated block holding exactly [data], which hashes to [fingerprint]
+//Returns the block index if there is one, -1 if not
+int dedup__find(uint32_t fingerprint, const char *data);
+
+//Records that the block at [block_i] now holds data hashing to [fingerprint]
+void dedup__remember(int block_i, uint32_t fingerprint);
+
+//Copies the current dedup numbers into [info]
+void dedup__get_info(neat_dedup_info_t *info);
+#endif
@@ -0,0 +1,215 @@
+#include "neat_defrag.h"
+#include "neat_storage.h"
+#include "neat_inode.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "neat_stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFRAG_FILE_NAME "neat_defrag.c // "
+
+static neat_defrag_progress_t progress;
+//fragmented inodes seen so far in the pass that is still running
+static int pass_fragmented = 0;
+
+static pthread_t defrag_thread;
+static atomic_int stop_requested;
+static atomic_llong last_io_ms;
+
+static long long defrag__now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int defrag__inode_fragments(neat_inode_t *inode, int *block_count){
+    int count = inode__blocks_for_size(inode__stored_size(inode));
+    int fragments = 0;
+
+    int prev_block_i = -1;
+    for (int i = 0; i < count; i++){
+        int block_i = inode__get_block_i(inode, i);
+        //a sparse file is left alone, moving its blocks together wouldn't make reading the holes any faster
+        if (block_i < 0 && inode__is_hole(inode, i)){
+            return 0;
+        }
+        if (block_i < 0){
+            printf("%sERROR: block %d of inode %d is invalid\n", DEFRAG_FILE_NAME, i, inode->inode_i);
+            return -1;
+        }
+        if (i > 0 && block_i != prev_block_i + 1){
+            fragments++;
+        }
+        prev_block_i = block_i;
+    }
+
+    if (block_count != NULL){
+        *block_count = count;
+    }
+    return fragments;
+}
+
+int defrag__defrag_inode(int inode_i){
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode == NULL || !bitmap_get(get_inode_bitmap(), inode_i)){
+        return -1;
+    }
+
+    int block_count;
+    int fragments = defrag__inode_fragments(inode, &block_count);
+    if (fragments <= 0){
+        return fragments;
+    }
+
+    //a shared block belongs to other files too, moving it would quietly unshare it. a shared indirect block
+    //would have to be copied before it could point at the run, which can fail halfway through
+    int shared = inode->indirect_i > 0 && block_is_shared(inode->indirect_i);
+    for (int i = 0; i < block_count && !shared; i++){
+        shared = block_is_shared(inode__get_block_i(inode, i));
+    }
+    if (shared){
+        progress.shared++;
+        return 0;
+    }
+
+    int run_start = find_free_block_run(block_count);
+    if (run_start < 0){
+        return -1;
+    }
+
+    //copy every block into the run first, the old blocks stay valid the whole time
+    uint32_t *fingerprints = get_block_fingerprints();
+    uint32_t *checksums = get_block_checksums();
+    int old_blocks[block_count];
+    int new_blocks[block_count];
+    for (int i = 0; i < block_count; i++){
+        int new_block_i = run_start + i;
+        old_blocks[i] = inode__get_block_i(inode, i);
+        new_blocks[i] = new_block_i;
+
+        mark_block_used(new_block_i, 1);
+        get_block_refs()[new_block_i] = 0;
+        memcpy(blocks_get_block(new_block_i), blocks_get_block(old_blocks[i]), BLOCK_SIZE);
+        //the data is the same, so dedup can keep matching it at its new home and its checksum still holds
+        fingerprints[new_block_i] = fingerprints[old_blocks[i]];
+        checksums[new_block_i] = checksums[old_blocks[i]];
+    }
+
+    stats__count(STATS_EVENT_BLOCKS_ALLOCATED, block_count);
+
+    //the copies are complete, only now does the map get pointed at them
+    for (int i = 0; i < block_count; i++){
+        if (inode__set_block_i(inode, i, new_blocks[i]) == 0){
+            continue;
+        }
+        //the map goes back to the old blocks (the slots set so far already went through the indirect block,
+        //so setting them again can't fail) and the run is given back
+        printf("%sERROR: failed to point inode %d at block %d, keeping the old blocks\n", DEFRAG_FILE_NAME,
+               inode_i, new_blocks[i]);
+        for (int j = 0; j < i; j++){
+            inode__set_block_i(inode, j, old_blocks[j]);
+        }
+        free_blocks(new_blocks, block_count);
+        return -1;
+    }
+    free_blocks(old_blocks, block_count);
+
+    printf("%sdefragged inode %d: %d blocks (%d fragments) -> %d..%d\n", DEFRAG_FILE_NAME,
+           inode_i, block_count, fragments, run_start, run_start + block_count - 1);
+    return block_count;
+}
+
+int defrag__step(){
+    int inode_count = inode__get_inode_count();
+    void *inbm = get_inode_bitmap();
+
+    //skip over free inodes so each step lands on real work
+    while (progress.cursor < inode_count && !bitmap_get(inbm, progress.cursor)){
+        progress.cursor++;
+    }
+
+    if (progress.cursor >= inode_count){
+        progress.cursor = 0;
+        progress.passes++;
+        progress.fragmented = pass_fragmented;
+        pass_fragmented = 0;
+        return 0;
+    }
+
+    int inode_i = progress.cursor++;
+    progress.inodes_scanned++;
+
+    int fragments = defrag__inode_fragments(inode__get_inode(inode_i), NULL);
+    if (fragments <= 0){
+        return 0;
+    }
+    pass_fragmented++;
+
+    int moved = defrag__defrag_inode(inode_i);
+    if (moved < 0){
+        progress.no_space++;
+        return -1;
+    }
+
+    progress.inodes_defragged++;
+    progress.blocks_moved += moved;
+    return moved;
+}
+
+void defrag__note_io(){
+    atomic_store(&last_io_ms, defrag__now_ms());
+}
+
+static void *defrag__thread_main(void *arg){
+    struct timespec tick = {0, DEFRAG_TICK_MS * 1000000L};
+
+    while (!atomic_load(&stop_requested)){
+        nanosleep(&tick, NULL);
+
+        //foreground I/O always wins, only move blocks once the image has been idle for a bit
+        if (defrag__now_ms() - atomic_load(&last_io_ms) < DEFRAG_IDLE_MS){
+            continue;
+        }
+
+        storage_lock();
+        defrag__step();
+        storage_unlock();
+    }
+    return NULL;
+}
+
+int defrag__start(){
+    atomic_store(&stop_requested, 0);
+    if (pthread_create(&defrag_thread, NULL, defrag__thread_main, NULL) != 0){
+        printf("%sERROR: failed to start the defrag thread\n", DEFRAG_FILE_NAME);
+        return -1;
+    }
+
+    storage_lock();
+    progress.running = 1;
+    storage_unlock();
+    return 0;
+}
+
+void defrag__stop(){
+    storage_lock();
+    int running = progress.running;
+    progress.running = 0;
+    storage_unlock();
+
+    if (!running){
+        return;
+    }
+    atomic_store(&stop_requested, 1);
+    pthread_join(defrag_thread, NULL);
+}
+
+void defrag__get_progress(neat_defrag_progress_t *out){
+    storage_lock();
+    *out = progress;
+    storage_unlock();
+}
@@ -0,0 +1,53 @@
+#ifndef NEAT_DEFRAG_H
+#define NEAT_DEFRAG_H
+
+#include <sys/ioctl.h>
+#include "neat_inode.h"
+
+//How long the image has to be free of foreground I/O before the defragmenter moves anything
+#define DEFRAG_IDLE_MS 200
+//How often the background thread wakes up to do (at most) one inode worth of work
+#define DEFRAG_TICK_MS 50
+
+typedef struct neat_defrag_progress {
+    int running;
+    int passes;             //completed sweeps over the whole inode table
+    int cursor;             //next inode index to be looked at
+    int inodes_scanned;
+    int inodes_defragged;
+    int blocks_moved;
+    int fragmented;         //fragmented inodes found during the last completed pass
+    int no_space;           //fragmented inodes skipped since no contiguous free run was big enough
+    int shared;             //fragmented inodes skipped since they share blocks with other files
+} neat_defrag_progress_t;
+
+//Ioctl on any file of the mount to read the defragmenter progress
+#define NUFS_IOC_DEFRAG_PROGRESS _IOR('N', 1, neat_defrag_progress_t)
+
+//Counts how many times the block map of [inode] jumps to a non-adjacent block
+//and stores the number of blocks in [block_count] if it isn't NULL
+//Returns the number of fragments past the first on success (0 for a file with holes, those are left alone), -1 on failure
+int defrag__inode_fragments(neat_inode_t *inode, int *block_count);
+
+//Relocates the blocks of the inode at [inode_i] into a contiguous free run,
+//switching the map over to the copies only once they are all written
+//Returns the number of blocks moved (0 if already contiguous or sharing blocks), -1 on failure
+int defrag__defrag_inode(int inode_i);
+
+//Looks at the next inode in the table and defragments it if needed (caller holds storage_lock)
+//Returns the number of blocks moved, -1 on failure
+int defrag__step();
+
+//Marks that foreground I/O just happened so the background thread throttles itself
+void defrag__note_io();
+
+//Starts the background defragmenter thread
+//Returns 0 on success, -1 on failure
+int defrag__start();
+
+//Stops the background defragmenter thread and waits for it to exit
+void defrag__stop();
+
+//Copies the current progress counters into [progress]
+void defrag__get_progress(neat_defrag_progress_t *progress);
+#endif
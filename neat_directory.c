@@ -1,7 +1,16 @@
 #include "neat_directory.h"
 #include "neat_inode.h"
 #include <string.h>
+#include <sys/stat.h>
 #include "bitmap.h"
+#include "neat_stats.h"
+#include "neat_checksum.h"
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define ERROR_MSG_INODE_I_FROM_PATH "%sERROR: failed to get %s index from path %s\n"
 
@@ -17,117 +26,494 @@ void dir__init_root(){
     }
     //allocate the first inode and name it properly
     neat_inode_t *inode = inode__alloc_inode();
-    if (inode->inode_i != 0 | inode->block_i != 2 ){
+    if (inode->inode_i != 0){
         //something went wrong!
         printf("%sERROR: tried to allocate root node, but was not index 0!\n", DIR_FILE_NAME);
     }
+    //the root is its own parent, so both of its entries point back at it
+    dir__add_dir_to_inode(inode, ".", inode->inode_i);
+    dir__add_dir_to_inode(inode, "..", inode->inode_i);
+    inode__add_link(inode->inode_i);
+    inode__add_link(inode->inode_i);
+}
+
+//Entries of an old fixed size directory per block, the leftover bytes at the end of each block stay unused
+static int dir__legacy_per_block(){
+    return BLOCK_SIZE / sizeof(neat_dir_t);
+}
+
+static int dir__packed(neat_inode_t *dd){
+    return (dd->flags & NEAT_INODE_PACKED_DIR) != 0;
+}
+
+//Checks if the block at [index] of the directory [dd] can't be read: its map entry isn't a block (nor a hole) or
+//the block fails its checksum
+//Returns 1 if it is damaged, 0 if not
+static int dir__block_damaged(neat_inode_t *dd, int index){
+    int block_i = inode__get_block_i(dd, index);
+    if (block_i < 0){
+        return !inode__is_hole(dd, index);
+    }
+    return checksum__verify(block_i) != 0;
+}
+
+//Gets the packed block at [index] of the directory [dd]
+//Returns the block on success, NULL if it is missing, fails its checksum or its header doesn't add up
+static neat_dir_block_t *dir__get_block(neat_inode_t *dd, int index){
+    int block_i = inode__get_block_i(dd, index);
+    if (block_i < 0){
+        return NULL;
+    }
+    if (checksum__verify(block_i) != 0){
+        printf("%sERROR: block %d of directory inode %d is damaged\n", DIR_FILE_NAME, index, dd->inode_i);
+        return NULL;
+    }
+    neat_dir_block_t *block = blocks_get_block(block_i);
+    if (block->count > DIR_BLOCK_MAX_ENTRIES || block->used > DIR_BLOCK_DATA_SIZE){
+        return NULL;
+    }
+    return block;
+}
+
+//Checks that entry [k] of [block] lies entirely within the data in use
+static inline __attribute__((always_inline)) int dir__entry_fits(neat_dir_block_t *block, int k){
+    int start = block->offsets[k];
+    return start + DIR_ENTRY_HEADER_SIZE <= block->used
+           && start + DIR_ENTRY_HEADER_SIZE + block->data[start + 4] <= block->used
+           && block->data[start + 4] < NEAT_DIR_NAME_LENGTH;
+}
+
+//Hashes a name of [length] bytes down to the one byte tag of its entry, optimized like the checksum kernels
+//since every lookup, add and remove runs it
+__attribute__((optimize("O2")))
+static uint8_t dir__tag(const char *name, int length){
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++){
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24);
+}
+
+//Compares the DIR_TAG_LANES tags at [tags] to [tag]
+//Returns a mask with bit i set if tags[i] matches
+static inline __attribute__((always_inline)) uint32_t dir__match_tags(const uint8_t *tags, uint8_t tag){
+#if defined(__SSE2__)
+    __m128i lanes = _mm_loadu_si128((const __m128i *) tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(lanes, _mm_set1_epi8(tag)));
+#else
+    uint32_t matches = 0;
+    for (int i = 0; i < DIR_TAG_LANES; i++){
+        matches |= (uint32_t) (tags[i] == tag) << i;
+    }
+    return matches;
+#endif
+}
+
+//Looks for the entry named [name] ([length] bytes, hashing to [tag]) in [block]
+//Returns its index within the block on success, -1 if it isn't there
+__attribute__((optimize("O2")))
+static int dir__find_in_block(neat_dir_block_t *block, const char *name, int length, uint8_t tag){
+    //DIR_BLOCK_MAX_ENTRIES is a multiple of DIR_TAG_LANES, so the last load still stays within tags
+    for (int base = 0; base < block->count; base += DIR_TAG_LANES){
+        uint32_t matches = dir__match_tags(block->tags + base, tag);
+        //tags past the last entry are whatever an earlier entry left behind
+        if (block->count - base < DIR_TAG_LANES){
+            matches &= (1u << (block->count - base)) - 1;
+        }
+
+        while (matches != 0){
+            int k = base + __builtin_ctz(matches);
+            matches &= matches - 1;
+            uint8_t *entry = block->data + block->offsets[k];
+            if (dir__entry_fits(block, k) && entry[4] == length && memcmp(entry + DIR_ENTRY_HEADER_SIZE, name, length) == 0){
+                return k;
+            }
+        }
+    }
+    return -1;
+}
+
+//Finds the entry named [name] in the packed directory [dd]
+//Returns the block holding it on success (with the index of the block in [index] and of the entry within it in
+//[k]), NULL if there is no such entry or a block it could be in is damaged (then [index] is DIR_DAMAGED)
+static neat_dir_block_t *dir__find_packed(neat_inode_t *dd, const char *name, int *index, int *k){
+    int length = strlen(name);
+    if (length >= NEAT_DIR_NAME_LENGTH){
+        return NULL;
+    }
+    uint8_t tag = dir__tag(name, length);
+    int scanned = 0;
+
+    for (*index = 0; *index < dd->size / BLOCK_SIZE; (*index)++){
+        neat_dir_block_t *block = dir__get_block(dd, *index);
+        if (block == NULL && dir__block_damaged(dd, *index)){
+            //the name may well be in there, so it can't be called missing
+            *index = DIR_DAMAGED;
+            return NULL;
+        }
+        if (block == NULL){
+            continue;
+        }
+        *k = dir__find_in_block(block, name, length, tag);
+        if (*k >= 0){
+            stats__count(STATS_EVENT_DIR_ENTRIES_SCANNED, scanned + *k + 1);
+            return block;
+        }
+        scanned += block->count;
+    }
+    stats__count(STATS_EVENT_DIR_ENTRIES_SCANNED, scanned);
+    return NULL;
+}
 
-    /*
-    neat_dir_t *dir_pntr = (neat_dir_t *)blocks_get_block(inode->block_i);
-    dir_pntr->inode_i = inode->inode_i;
-    strcpy(dir_pntr->name, "/");
-    dir_pntr->name[1] = '\0';*/
+int dir__entry_count(neat_inode_t *dd){
+    if (!dir__packed(dd)){
+        int per_block = dir__legacy_per_block();
+        return (dd->size / BLOCK_SIZE) * per_block + (dd->size % BLOCK_SIZE) / sizeof(neat_dir_t);
+    }
+
+    int count = 0;
+    for (int index = 0; index < dd->size / BLOCK_SIZE; index++){
+        neat_dir_block_t *block = dir__get_block(dd, index);
+        count += block != NULL ? block->count : 0;
+    }
+    return count;
+}
+
+//Finds the packed block holding the entry at [entry_i] of [dd]
+//Returns the block on success (with the index of the entry within it in [k] and of the block in [index]),
+//NULL if it is out of range or a block on the way is missing or damaged
+static neat_dir_block_t *dir__locate(neat_inode_t *dd, int entry_i, int *index, int *k){
+    for (*index = 0; *index < dd->size / BLOCK_SIZE && entry_i >= 0; (*index)++){
+        neat_dir_block_t *block = dir__get_block(dd, *index);
+        if (block == NULL){
+            return NULL;
+        }
+        if (entry_i < block->count){
+            *k = entry_i;
+            return block;
+        }
+        entry_i -= block->count;
+    }
+    return NULL;
+}
+
+//Gets the entry at [entry_i] of the old fixed size directory [dd], looking it up in its block map
+//Returns the entry on success, NULL if out of range or in a missing or damaged block
+static neat_dir_t *dir__get_legacy_entry(neat_inode_t *dd, int entry_i){
+    if (entry_i < 0 || entry_i >= dir__entry_count(dd)){
+        return NULL;
+    }
+
+    int per_block = dir__legacy_per_block();
+    int block_i = inode__get_block_i(dd, entry_i / per_block);
+    if (block_i < 0){
+        printf("%sERROR: directory inode %d is shorter than its size\n", DIR_FILE_NAME, dd->inode_i);
+        return NULL;
+    }
+    if (checksum__verify(block_i) != 0){
+        printf("%sERROR: block %d of directory inode %d is damaged\n", DIR_FILE_NAME, entry_i / per_block, dd->inode_i);
+        return NULL;
+    }
+    return (neat_dir_t *)blocks_get_block(block_i) + entry_i % per_block;
+}
+
+int dir__get_entry(neat_inode_t *dd, int entry_i, neat_dir_t *entry){
+    if (!dir__packed(dd)){
+        neat_dir_t *legacy = dir__get_legacy_entry(dd, entry_i);
+        if (legacy == NULL || memchr(legacy->name, '\0', NEAT_DIR_NAME_LENGTH) == NULL){
+            return -1;
+        }
+        *entry = *legacy;
+        return 0;
+    }
+
+    int index, k;
+    neat_dir_block_t *block = dir__locate(dd, entry_i, &index, &k);
+    if (block == NULL || !dir__entry_fits(block, k)){
+        return -1;
+    }
+    uint8_t *packed = block->data + block->offsets[k];
+    memcpy(&entry->inode_i, packed, sizeof(int));
+    memcpy(entry->name, packed + DIR_ENTRY_HEADER_SIZE, packed[4]);
+    entry->name[packed[4]] = '\0';
+    return 0;
 }
 
 int dir__inode_i_from_inode(neat_inode_t *dd, const char *name){
     //when looking for a directory name, a directory can also be a file
     //which points to an inode and then the data block
     //which is why we can assume all things in this diretory will also be a directory
-    neat_dir_t *data_pntr = (neat_dir_t *)blocks_get_block(dd->block_i);
-    int num_of_dir = dd->size / sizeof(neat_dir_t);
+    if (!dir__packed(dd)){
+        int per_block = dir__legacy_per_block();
+        neat_dir_t *data_pntr = NULL;
+        int num_of_dir = dir__entry_count(dd);
 
-    for (int i = 0; i < num_of_dir; i++){
-        neat_dir_t dir = data_pntr[i];
-        if (strcmp(dir.name, name) == 0){
-            //found the directory!
-            return dir.inode_i;
+        for (int i = 0; i < num_of_dir; i++){
+            //look up the next block of the directory once this one is used up
+            if (i % per_block == 0){
+                int block_i = inode__get_block_i(dd, i / per_block);
+                if (block_i < 0){
+                    break;
+                }
+                if (checksum__verify(block_i) != 0){
+                    printf("%sERROR: block %d of directory inode %d is damaged\n", DIR_FILE_NAME, i / per_block, dd->inode_i);
+                    return DIR_DAMAGED;
+                }
+                data_pntr = (neat_dir_t *)blocks_get_block(block_i);
+            }
+
+            neat_dir_t *dir = data_pntr + i % per_block;
+            if (strcmp(dir->name, name) == 0){
+                //found the directory!
+                stats__count(STATS_EVENT_DIR_ENTRIES_SCANNED, i + 1);
+                return dir->inode_i;
+            }
         }
+        //couldn't find it :(
+        stats__count(STATS_EVENT_DIR_ENTRIES_SCANNED, num_of_dir);
+        return -1;
     }
-    //couldn't find it :(
-    return -1;
+
+    int index, k;
+    neat_dir_block_t *block = dir__find_packed(dd, name, &index, &k);
+    if (block == NULL){
+        return index == DIR_DAMAGED ? DIR_DAMAGED : -1;
+    }
+    int inode_i;
+    memcpy(&inode_i, block->data + block->offsets[k], sizeof(int));
+    return inode_i;
 }
 
 int dir__inode_i_from_path(const char *path){
     //root node will always be inode index 0
     int curr_inode_i = 0;
-    neat_inode_t *curr_node = inode__get_inode(0);
-    
-    //if we just requested the root, return the root!
-    if (strcmp(path, "/") == 0){
-        return curr_inode_i;
-    }
+    char name[NEAT_DIR_NAME_LENGTH];
 
-    printf("got here in dir__inode_i_from_path... \n");
+    //walk the components in place instead of tokenizing, the path belongs to the caller
+    const char *component = path;
+    while (*component != '\0'){
+        //skip the slashes between components (also covers "//" and a trailing "/")
+        if (*component == '/'){
+            component++;
+            continue;
+        }
 
-    char *folder_token = strtok(path, "/");
-    while (folder_token != NULL){
-        curr_inode_i = dir__inode_i_from_inode(curr_node, folder_token);
-        curr_node = inode__get_inode(curr_inode_i);
-        if (curr_inode_i < 0){
+        size_t name_len = strcspn(component, "/");
+        neat_inode_t *curr_node = inode__get_inode(curr_inode_i);
+        if (name_len >= NEAT_DIR_NAME_LENGTH || !S_ISDIR(curr_node->mode)){
             //path failed here!
-            printf("%sERROR: dir_inode_from_path failed to return an inode!\n", DIR_FILE_NAME);
             return -1;
         }
 
-        //gets the next folder string
-        folder_token = strtok(NULL, " ");
+        memcpy(name, component, name_len);
+        name[name_len] = '\0';
+
+        curr_inode_i = dir__inode_i_from_inode(curr_node, name);
+        if (curr_inode_i < 0){
+            //path failed here!
+            return curr_inode_i;
+        }
+        component += name_len;
     }
 
     //done and we didn't fail, so this is it!
     return curr_inode_i;
 }
 
-int dir__add_dir_to_inode(neat_inode_t *dd, const char *name, int inum){
-    
-    //currently points to the end of the last neat_dir_t
-    neat_dir_t *new_dir_pntr = (neat_dir_t *)(blocks_get_block(dd->block_i) + dd->size);
-    neat_dir_t new_dir;
-    //grow by one neat_dir_t, and now the pointer new_dir_pntr is pointing to the start of the newly allocated neat_dir_t
-    inode__grow_inode(dd, dd->size + sizeof(neat_dir_t));
-
-    //now that we have grown, get the last block pntr start which is the new directory
-    new_dir.inode_i = inum;
-    strcpy(new_dir.name, name);
-    new_dir.name[strlen(name)] = '\0';
-    *new_dir_pntr = new_dir;
+int dir__lookup_errno(int inode_i){
+    return inode_i == DIR_DAMAGED ? -EIO : -ENOENT;
+}
 
-    return 0;
+//Gets the packed block at [index] of [dd] to change it, copying it first if it is shared with a snapshot or
+//clone (a hole comes back as a new, empty block)
+//Returns the block on success, NULL on failure
+static neat_dir_block_t *dir__get_writable_block(neat_inode_t *dd, int index, int *block_i){
+    *block_i = inode__get_writable_block_i(dd, index);
+    return *block_i >= 0 ? blocks_get_block(*block_i) : NULL;
 }
 
-int dir__rm_dir_from_inode(neat_inode_t *dd, const char *name){
-    neat_dir_t *dir_pntr = (neat_dir_t *)(blocks_get_block(dd->block_i));
-    int num_of_dir = dd->size / sizeof(neat_dir_t);
+//Adds the entry [name] -> [inum] to the first block of the packed directory [dd] with room for it, or to a new
+//block at the end
+//Returns 0 on success, -1 on failure
+static int dir__add_packed(neat_inode_t *dd, const char *name, int inum){
+    int length = strlen(name);
+    int needed = DIR_ENTRY_HEADER_SIZE + length;
+    int block_count = dd->size / BLOCK_SIZE;
 
-    int dir_entry_index = -1;
+    int index = 0;
+    for (; index < block_count; index++){
+        neat_dir_block_t *block = dir__get_block(dd, index);
+        if (block != NULL && block->count < DIR_BLOCK_MAX_ENTRIES && block->used + needed <= DIR_BLOCK_DATA_SIZE){
+            break;
+        }
+    }
+    //nothing has room, the new block is a hole until it is written, which makes it an empty one
+    if (index == block_count && inode__grow_inode(dd, (block_count + 1) * BLOCK_SIZE) != 0){
+        return -1;
+    }
 
-    for (int i = 0; i < num_of_dir; i++){
-        neat_dir_t dir = dir_pntr[i];
-        if (strcmp(dir.name, name) == 0){
-            dir_entry_index = i;
+    int block_i;
+    neat_dir_block_t *block = dir__get_writable_block(dd, index, &block_i);
+    if (block == NULL){
+        inode__shrink_inode(dd, block_count * BLOCK_SIZE);
+        return -1;
+    }
+
+    uint8_t *entry = block->data + block->used;
+    memcpy(entry, &inum, sizeof(int));
+    entry[4] = length;
+    memcpy(entry + DIR_ENTRY_HEADER_SIZE, name, length);
+    block->tags[block->count] = dir__tag(name, length);
+    block->offsets[block->count] = block->used;
+    block->count++;
+    block->used += needed;
+    checksum__seal(block_i);
+    return 0;
+}
+
+//Turns the old fixed size directory [dd] into a packed one, nothing happens to one that already is
+//Returns 0 on success, -1 if there isn't room to rewrite it (it is left as it was then)
+static int dir__pack(neat_inode_t *dd){
+    if (dir__packed(dd)){
+        return 0;
+    }
+
+    int count = dir__entry_count(dd);
+    neat_dir_t *entries = malloc(sizeof(neat_dir_t) * (count > 0 ? count : 1));
+    int blocks_needed = count > 0;
+    int used = 0, in_block = 0;
+    for (int i = 0; i < count; i++){
+        neat_dir_t *legacy = dir__get_legacy_entry(dd, i);
+        if (legacy == NULL && dir__block_damaged(dd, i / dir__legacy_per_block())){
+            //rewriting it would drop whatever the damaged block still holds for good
+            free(entries);
+            return -1;
+        }
+        if (legacy == NULL){
+            //the rest of the map is gone, so are the entries in it
+            count = i;
             break;
         }
+        entries[i] = *legacy;
+        entries[i].name[NEAT_DIR_NAME_LENGTH - 1] = '\0';
+
+        //filling blocks strictly in order never takes fewer blocks than dir__add_packed will
+        int needed = DIR_ENTRY_HEADER_SIZE + strlen(entries[i].name);
+        if (in_block == DIR_BLOCK_MAX_ENTRIES || used + needed > DIR_BLOCK_DATA_SIZE){
+            blocks_needed++;
+            used = in_block = 0;
+        }
+        used += needed;
+        in_block++;
     }
 
-    if (dir_entry_index == -1){
-        //couldn't find the directory in this i_node :(
+    //the old blocks may all be shared with a snapshot, so only go ahead if the new ones fit on top of them
+    if (blocks_needed + (blocks_needed > NEAT_INODE_DIRECT_BLOCKS) > count_free_blocks()){
+        printf("%sERROR: no room to pack directory inode %d\n", DIR_FILE_NAME, dd->inode_i);
+        free(entries);
+        return -1;
+    }
+
+    inode__shrink_inode(dd, 0);
+    dd->flags |= NEAT_INODE_PACKED_DIR;
+    int rv = 0;
+    for (int i = 0; i < count && rv == 0; i++){
+        rv = dir__add_packed(dd, entries[i].name, entries[i].inode_i);
+    }
+    free(entries);
+    printf("%spacked directory inode %d: %d entries in %d blocks\n", DIR_FILE_NAME, dd->inode_i, count,
+           dd->size / BLOCK_SIZE);
+    return rv;
+}
+
+int dir__add_dir_to_inode(neat_inode_t *dd, const char *name, int inum){
+    if (strlen(name) >= NEAT_DIR_NAME_LENGTH){
+        printf("%sERROR: name %s is too long for a directory entry\n", DIR_FILE_NAME, name);
         return -1;
     }
 
-    for (int i = dir_entry_index; i < num_of_dir - 1; i++){
-        
-        //now that we are past the dir index we want to remove, make
-        //the previous pntr point have the data from the one after it
-        //neat_dir_t *curr_dir_prev = dir_pntr + (i - 1);// * sizeof(neat_dir_t);
-        neat_dir_t new_dir;
+    //a directory without entries yet is as good as packed already
+    if (dd->size == 0){
+        dd->flags |= NEAT_INODE_PACKED_DIR;
+    }
+    if (dir__pack(dd) != 0 || dir__add_packed(dd, name, inum) != 0){
+        return -1;
+    }
 
-        new_dir.inode_i = dir_pntr[i+1].inode_i;
-        strcpy(new_dir.name, dir_pntr[i+1].name);
-        new_dir.name[strlen(dir_pntr[i+1].name)] = '\0';
+    dd->mtime = time(0);
+    dd->ctime = dd->mtime;
 
-        *(dir_pntr + (i - 1)) = new_dir;
+    return 0;
+}
+
+//Removes entry [k] of the block at [index] of the packed directory [dd]
+//Returns 0 on success, -1 on failure
+static int dir__rm_packed(neat_inode_t *dd, int index, int k){
+    int block_i;
+    neat_dir_block_t *block = dir__get_writable_block(dd, index, &block_i);
+    if (block == NULL){
+        return -1;
+    }
+
+    //close the gap in the data and in both arrays, the entries keep their order
+    int start = block->offsets[k];
+    int length = start < block->used ? DIR_ENTRY_HEADER_SIZE + block->data[start + 4] : 0;
+    length = start + length <= block->used ? length : block->used - start;
+    memmove(block->data + start, block->data + start + length, block->used - start - length);
+    memmove(block->tags + k, block->tags + k + 1, block->count - k - 1);
+    memmove(block->offsets + k, block->offsets + k + 1, (block->count - k - 1) * sizeof(uint16_t));
+    block->count--;
+    block->used -= length;
+    for (int j = 0; j < block->count; j++){
+        block->offsets[j] -= block->offsets[j] > start ? length : 0;
+    }
+    checksum__seal(block_i);
+
+    //empty blocks in the middle get filled again by later adds, the ones at the end go right away
+    int block_count = dd->size / BLOCK_SIZE;
+    while (block_count > 1 && (block = dir__get_block(dd, block_count - 1)) != NULL && block->count == 0){
+        block_count--;
+    }
+    inode__shrink_inode(dd, block_count * BLOCK_SIZE);
+
+    dd->mtime = time(0);
+    dd->ctime = dd->mtime;
+    return 0;
+}
+
+int dir__rm_entry(neat_inode_t *dd, int entry_i){
+    int index, k;
+    if (dir__pack(dd) != 0 || dir__locate(dd, entry_i, &index, &k) == NULL){
+        return -1;
+    }
+    return dir__rm_packed(dd, index, k);
+}
+
+int dir__relink(neat_inode_t *dd, const char *name, int inum){
+    int index, k;
+    if (dir__pack(dd) != 0 || dir__find_packed(dd, name, &index, &k) == NULL){
+        return -1;
+    }
+    int block_i;
+    neat_dir_block_t *block = dir__get_writable_block(dd, index, &block_i);
+    if (block == NULL){
+        return -1;
+    }
+
+    memcpy(block->data + block->offsets[k], &inum, sizeof(int));
+    checksum__seal(block_i);
+    dd->mtime = time(0);
+    dd->ctime = dd->mtime;
+    return 0;
+}
+
+int dir__rm_dir_from_inode(neat_inode_t *dd, const char *name){
+    int index, k;
+    if (dir__pack(dd) != 0 || dir__find_packed(dd, name, &index, &k) == NULL){
+        //couldn't find the directory in this i_node :(
+        return -1;
     }
-    
-    inode__shrink_inode(dd, dd->size - sizeof(neat_dir_t));
+    return dir__rm_packed(dd, index, k);
 }
 
 int dir__parent_child_from_path(const char *path, char *parent_path, char *child_name){
@@ -158,7 +544,7 @@ int dir__parent_child_from_path(const char *path, char *parent_path, char *child
     strncpy(parent_path, path, parent_len);
     parent_path[parent_len] = '\0';
 
-    char *offset_path = path + parent_len * sizeof(char);
+    const char *offset_path = path + parent_len * sizeof(char);
     memcpy(child_name, offset_path, child_name_len);
     child_name[child_name_len] = '\0';
 
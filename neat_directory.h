@@ -5,32 +5,75 @@
 #include "neat_inode.h"
 
 #define NEAT_DIR_NAME_LENGTH 48
+//What a lookup gets instead of -1 when a directory block it had to read fails its checksum (or can't be mapped),
+//the name may be in there so it isn't reported missing
+#define DIR_DAMAGED -2
 
+//A directory entry as callers get it, and also how directories from before packed entries store them: a plain
+//array of these, entries never straddling two blocks
 typedef struct neat_dir {
     char name[NEAT_DIR_NAME_LENGTH];
     int inode_i;
 } neat_dir_t;
 
+//Directories marked NEAT_INODE_PACKED_DIR (all new ones, and old ones the first time they change) are made of
+//neat_dir_block_t blocks instead. Each entry is its inode index, its name length and its name without the NUL,
+//packed back to back in data, plus a one byte hash of the name in tags. A lookup compares DIR_TAG_LANES tags at a
+//time and only reads the names whose tag matches. The size of a packed directory is a whole number of blocks.
+#define DIR_BLOCK_MAX_ENTRIES 256
+#define DIR_BLOCK_DATA_SIZE (BLOCK_SIZE - 2 * (int) sizeof(uint16_t) - DIR_BLOCK_MAX_ENTRIES * 3)
+//bytes in front of the name of a packed entry: the inode index and the name length
+#define DIR_ENTRY_HEADER_SIZE 5
+#define DIR_TAG_LANES 16
+
+typedef struct neat_dir_block {
+    uint16_t count;                             //entries in this block
+    uint16_t used;                              //bytes of data they take up
+    uint8_t tags[DIR_BLOCK_MAX_ENTRIES];        //name hash of each entry
+    uint16_t offsets[DIR_BLOCK_MAX_ENTRIES];    //where each entry starts in data
+    uint8_t data[DIR_BLOCK_DATA_SIZE];
+} neat_dir_block_t;
+
 //Initialize the root inode.
 //Returns 0 on success, -1 on failure
 void dir__init_root();
 
+//Gets the number of entries (including "." and "..") in the directory [dd]
+int dir__entry_count(neat_inode_t *dd);
+
+//Copies the entry at [entry_i] of the directory [dd] into [entry]
+//Returns 0 on success, -1 if it is out of range or lies in a missing or damaged block
+int dir__get_entry(neat_inode_t *dd, int entry_i, neat_dir_t *entry);
+
 //Gets an inode index from an inode [dd] based on the [name] of the directory
-//Returns the inode index on success, -1 on failure
+//Returns the inode index on success, -1 if there is no such name, DIR_DAMAGED if a block of [dd] is damaged
 int dir__inode_i_from_inode(neat_inode_t *dd, const char *name);
 
-//Gets an inode index from a [path]
-//Returns the inode index on success, -1 on failure
+//Gets an inode index from a [path], walking one directory per component (the path is not modified)
+//Returns the inode index on success, -1 if a component is missing, DIR_DAMAGED if a directory on the way is damaged
 int dir__inode_i_from_path(const char *path);
 
+//Gets the errno a lookup that returned [inode_i] should be reported with
+//Returns -EIO for DIR_DAMAGED, -ENOENT otherwise
+int dir__lookup_errno(int inode_i);
+
 //Adds a director to an inode [dd] with a the directory [name] and with the inode index [inum] it belongs to
 //Returns 0 on success, -1 on failure
 int dir__add_dir_to_inode(neat_inode_t *dd, const char *name, int inum);
 
+//Points the existing entry [name] of the directory [dd] at the inode [inum] instead, in place, so there is no
+//moment without the name (link counts are left to the caller)
+//Returns 0 on success, -1 if there is no such entry or no room to copy its block (nothing changes then)
+int dir__relink(neat_inode_t *dd, const char *name, int inum);
+
 //Removes a directory [name] from an inode [dd]
 //Returns 0 on success, -1 on failure
 int dir__rm_dir_from_inode(neat_inode_t *dd, const char *name);
 
+//Removes the entry at [entry_i] from the directory [dd], even one dir__get_entry can't read
+//Returns 0 on success, -1 on failure
+int dir__rm_entry(neat_inode_t *dd, int entry_i);
+
 //Populates the [parent_path] and [child_name] strings by seperating the path into each respectively
 //Returns 0 on success, -1 on failure
 int dir__parent_child_from_path(const char *path, char *parent_path, char *child_name);
@@ -2,13 +2,30 @@
 #include "neat_inode.h"
 #include "neat_directory.h"
 #include "bitmap.h"
+#include "neat_stats.h"
+#include "neat_dedup.h"
+#include "neat_xattr.h"
+#include "neat_checksum.h"
+#include <string.h>
 #include <unistd.h>
 
 #define INODE_FILE_NAME "neat_inode.c // "
 
+//open handles per inode, these only live as long as the mount so they aren't stored in the image
+static int open_handle_counts[INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(neat_inode_t)];
+//changes to the data per inode, and how many there had been at the last open the kernel kept its pages from.
+//the kernel has nothing cached of an image it hasn't seen yet, so both can start out at 0 at mount
+static unsigned data_generations[INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(neat_inode_t)];
+static unsigned cached_generations[INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(neat_inode_t)];
+//set while a snapshot is being viewed instead of the live table
+static void *view_bitmap = NULL;
+static void *view_table = NULL;
+
 int inode__init_inode_block(){
-    //reserve the 2nd block for inodes
-    bitmap_put(get_blocks_bitmap(), 1, 1);
+    //reserve the blocks after the bitmaps for inodes
+    for (int i = 0; i < INODE_TABLE_BLOCKS; i++){
+        mark_block_used(INODE_TABLE_FIRST_BLOCK + i, 1);
+    }
     return 0;
 }
 
@@ -23,17 +40,27 @@ neat_inode_t *inode__get_inode(int inode_i){
 }
 
 int inode__get_inode_count(){
-    return block_data_size() / sizeof(neat_dir_t) * BLOCK_COUNT; //should round down
+    //the inode table blocks are back to back, so only as many as fit in all of them
+    return INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(neat_inode_t); //should round down
 }
 
 //should always be blocks_get_block(1) if the
 //first block is for bitmaps (and all are meant to fit in there)
 void *inode__get_inode_base(){
-    return blocks_get_block(1);
+    return view_table != NULL ? view_table : blocks_get_block(INODE_TABLE_FIRST_BLOCK);
+}
+
+void *inode__get_inode_bitmap(){
+    return view_bitmap != NULL ? view_bitmap : get_inode_bitmap();
+}
+
+void inode__view_table(void *inode_bitmap, void *table){
+    view_bitmap = inode_bitmap;
+    view_table = table;
 }
 
 neat_inode_t *inode__alloc_inode(){
-    void *inbm = get_inode_bitmap();
+    void *inbm = inode__get_inode_bitmap();
 
     for (int inode_i = 0; inode_i < inode__get_inode_count(); inode_i++){
         if (!bitmap_get(inbm, inode_i)){
@@ -42,8 +69,19 @@ neat_inode_t *inode__alloc_inode(){
 
             inode->size = 0;
             inode->inode_i = inode_i;
-            inode->block_i = alloc_block();
+            for (int i = 0; i < NEAT_INODE_DIRECT_BLOCKS; i++){
+                inode->blocks[i] = -1;
+            }
+            //a new inode is all hole, its first write gets it a block
+            inode->indirect_i = -1;
             inode->mode = 040755;//R_OK ^ W_OK ^ X_OK ^ F_OK;
+            inode->nlink = 0;
+            inode->flags = 0;
+            inode->stored_size = 0;
+            xattr__clear(inode);
+            open_handle_counts[inode_i] = 0;
+            //pages cached for whatever had this inode before must not show up in the new file
+            data_generations[inode_i]++;
             inode->ctime = time(0);
             inode->mtime = time(0);
             inode->atime = time(0);
@@ -56,29 +94,526 @@ neat_inode_t *inode__alloc_inode(){
 }
 
 
-int inode__free_inode(int inode_i){
-    neat_inode_t *inode = inode__get_inode(inode_i);
-    int curr_block_i = inode->block_i;
-    int prev_block_i = inode->block_i;
+//Gathers every block the map of [inode] holds (the indirect block last) into [held], followed by the blocks
+//of its extended attributes if [with_xattrs] is set
+//Returns the number of blocks gathered
+static int inode__held_blocks(neat_inode_t *inode, int *held, int with_xattrs){
+    int held_count = 0;
+    int block_count = inode__blocks_for_size(inode__stored_size(inode));
+    for (int i = 0; i < block_count && held_count < BLOCK_COUNT; i++){
+        int block_i = inode__get_block_i(inode, i);
+        if (block_i > 0){
+            held[held_count++] = block_i;
+        }
+    }
+    if (inode->indirect_i > 0 && held_count < BLOCK_COUNT){
+        held[held_count++] = inode->indirect_i;
+    }
+    if (with_xattrs){
+        held_count += xattr__held_blocks(inode, held + held_count, BLOCK_COUNT - held_count);
+    }
+    return held_count;
+}
+
+//Same as inode__share_map, leaving out the extended attributes unless [with_xattrs] is set
+static int inode__share_blocks(neat_inode_t *inode, int with_xattrs){
+    int held[BLOCK_COUNT];
+    int held_count = inode__held_blocks(inode, held, with_xattrs);
 
-    inode__shrink_inode(inode, 0);
+    for (int i = 0; i < held_count; i++){
+        if (share_block(held[i]) != 0){
+            //give back the owners added so far
+            free_blocks(held, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Same as inode__drop_map, leaving the extended attributes alone unless [with_xattrs] is set
+static void inode__drop_blocks(neat_inode_t *inode, int with_xattrs){
+    //gather the whole map first so it goes back to the bitmap as one batch
+    int held[BLOCK_COUNT];
+    free_blocks(held, inode__held_blocks(inode, held, with_xattrs));
+
+    for (int i = 0; i < NEAT_INODE_DIRECT_BLOCKS; i++){
+        inode->blocks[i] = -1;
+    }
+    inode->indirect_i = -1;
+    if (with_xattrs){
+        xattr__clear(inode);
+    }
+}
+
+int inode__share_map(neat_inode_t *inode){
+    return inode__share_blocks(inode, 1);
+}
 
-    //while the curr block is valid and it is still in use
-    while (curr_block_i > 0 && bitmap_get(get_blocks_bitmap(), curr_block_i)){
-        prev_block_i = curr_block_i;
-        curr_block_i = get_next_block_i(curr_block_i);
-        free_block(prev_block_i);
+void inode__drop_map(neat_inode_t *inode){
+    inode__drop_blocks(inode, 1);
+}
+
+int inode__free_inode(int inode_i){
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode == NULL){
+        return -1;
     }
 
-    void *inbm = get_inode_bitmap();
+    inode__drop_map(inode);
+    inode->size = 0;
+    inode->nlink = 0;
+    inode->flags = 0;
+    inode->stored_size = 0;
+
+    void *inbm = inode__get_inode_bitmap();
     bitmap_put(inbm, inode_i, 0);
 
     
     return 0;
 }
 
+//Frees the inode once nothing can reach it anymore: no directory entry and no open handle
+//Returns 1 if it was reclaimed, 0 if not
+static int inode__reclaim_if_unused(int inode_i){
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode->nlink > 0 || open_handle_counts[inode_i] > 0){
+        return 0;
+    }
+
+    printf("%sreclaiming inode %d\n", INODE_FILE_NAME, inode_i);
+    inode__free_inode(inode_i);
+    return 1;
+}
+
+int inode__add_link(int inode_i){
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode == NULL){
+        return -1;
+    }
+
+    inode->nlink++;
+    inode->ctime = time(0);
+    return inode->nlink;
+}
+
+int inode__drop_link(int inode_i){
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode == NULL){
+        return -1;
+    }
+
+    if (inode->nlink > 0){
+        inode->nlink--;
+    }
+    inode->ctime = time(0);
+    return inode__reclaim_if_unused(inode_i);
+}
+
+int inode__open_handle(int inode_i){
+    if (inode__get_inode(inode_i) == NULL){
+        return -1;
+    }
+
+    open_handle_counts[inode_i]++;
+    return 0;
+}
+
+int inode__close_handle(int inode_i){
+    if (inode__get_inode(inode_i) == NULL || open_handle_counts[inode_i] <= 0){
+        return -1;
+    }
+
+    open_handle_counts[inode_i]--;
+    return inode__reclaim_if_unused(inode_i);
+}
+
+int inode__open_handle_count(int inode_i){
+    return open_handle_counts[inode_i];
+}
+
+void inode__bump_data_generation(neat_inode_t *inode){
+    data_generations[inode->inode_i]++;
+}
+
+int inode__claim_page_cache(int inode_i){
+    int unchanged = cached_generations[inode_i] == data_generations[inode_i];
+    cached_generations[inode_i] = data_generations[inode_i];
+    return unchanged;
+}
+
+int inode__blocks_for_size(int size){
+    int count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return count > 0 ? count : 1;
+}
+
+int inode__max_blocks(){
+    return NEAT_INODE_DIRECT_BLOCKS + BLOCK_SIZE / sizeof(int);
+}
+
+int inode__stored_size(neat_inode_t *inode){
+    return inode->flags & NEAT_INODE_COMPRESSED ? inode->stored_size : inode->size;
+}
+
+static int inode__valid_data_block(int block_i){
+    return block_i >= INODE_FIRST_DATA_BLOCK && block_i < BLOCK_COUNT;
+}
+
+//Gets the raw entry at [index] (within the map) of the map of [inode]: -1 or 0 for a hole, which is also what
+//everything past the direct entries is while there is no indirect block, BLOCK_COUNT if the indirect block is
+//invalid or fails its checksum (a flipped entry would send the read to some other file's block otherwise)
+static int inode__map_entry(neat_inode_t *inode, int index){
+    //the bytes of an inline symlink target aren't block indexes
+    if (inode->flags & NEAT_INODE_INLINE_LINK){
+        return -1;
+    }
+    if (index < NEAT_INODE_DIRECT_BLOCKS){
+        return inode->blocks[index];
+    }
+    if (inode->indirect_i <= 0){
+        return 0;
+    }
+    if (!inode__valid_data_block(inode->indirect_i)){
+        return BLOCK_COUNT;
+    }
+    if (checksum__verify(inode->indirect_i) != 0){
+        printf("%sERROR: indirect block %d of inode %d is damaged\n", INODE_FILE_NAME, inode->indirect_i, inode->inode_i);
+        return BLOCK_COUNT;
+    }
+    stats__count(STATS_EVENT_INDIRECT_LOOKUPS, 1);
+    return ((int *) blocks_get_block(inode->indirect_i))[index - NEAT_INODE_DIRECT_BLOCKS];
+}
+
+int inode__get_block_i(neat_inode_t *inode, int index){
+    if (index < 0 || index >= inode__max_blocks()){
+        return -1;
+    }
+
+    int block_i = inode__map_entry(inode, index);
+    return inode__valid_data_block(block_i) ? block_i : -1;
+}
+
+int inode__is_hole(neat_inode_t *inode, int index){
+    if (index < 0 || index >= inode__max_blocks()){
+        return 0;
+    }
+
+    int block_i = inode__map_entry(inode, index);
+    return block_i == -1 || block_i == 0;
+}
+
+int inode__allocated_blocks(neat_inode_t *inode){
+    int block_count = inode__blocks_for_size(inode__stored_size(inode));
+    int allocated = 0;
+    for (int i = 0; i < block_count; i++){
+        allocated += inode__get_block_i(inode, i) >= 0;
+    }
+    return allocated;
+}
+
+int inode__set_block_i(neat_inode_t *inode, int index, int block_i){
+    if (index < 0 || index >= inode__max_blocks()){
+        return -1;
+    }
+
+    if (index < NEAT_INODE_DIRECT_BLOCKS){
+        inode->blocks[index] = block_i >= 0 ? block_i : -1;
+        return 0;
+    }
+
+    //indirect slots hold 0 for a hole, which is all of them until there is an indirect block
+    block_i = block_i >= 0 ? block_i : 0;
+    if (inode->indirect_i <= 0 && block_i == 0){
+        return 0;
+    }
+    if (inode->indirect_i <= 0){
+        //alloc_block hands out zeroed blocks, so every slot starts out as "no block"
+        inode->indirect_i = alloc_block();
+        if (inode->indirect_i < 0){
+            return -1;
+        }
+    }
+    else if (!inode__valid_data_block(inode->indirect_i) || checksum__verify(inode->indirect_i) != 0){
+        //sealing it again below would make the damage look like a valid map
+        return -1;
+    }
+    else if (block_is_shared(inode->indirect_i) || block_is_behind_log(inode->indirect_i)){
+        //another inode (or snapshot) still lists its blocks through this one, or the log has moved past it
+        int shared = block_is_shared(inode->indirect_i);
+        int copy_i = alloc_block();
+        if (copy_i >= 0){
+            memcpy(blocks_get_block(copy_i), blocks_get_block(inode->indirect_i), BLOCK_SIZE);
+            free_block(inode->indirect_i);
+            inode->indirect_i = copy_i;
+            stats__count(shared ? STATS_EVENT_COW_COPIES : STATS_EVENT_LOG_COPIES, 1);
+        }
+        else if (shared){
+            return -1;
+        }
+    }
+    ((int *) blocks_get_block(inode->indirect_i))[index - NEAT_INODE_DIRECT_BLOCKS] = block_i;
+    checksum__seal(inode->indirect_i);
+    return 0;
+}
+
+int inode__get_writable_block_i(neat_inode_t *inode, int index){
+    int block_i = inode__get_block_i(inode, index);
+    if (block_i < 0 && !inode__is_hole(inode, index)){
+        return -1;
+    }
+
+    if (block_i < 0){
+        //the first write into a hole, alloc_block hands out zeroed blocks so it still reads the same
+        block_i = alloc_block();
+        if (block_i >= 0 && inode__set_block_i(inode, index, block_i) != 0){
+            free_block(block_i);
+            return -1;
+        }
+        return block_i;
+    }
+
+    //in log mode an unshared block is copied to the log head too, but it can still be changed in place
+    //if there is no room for the copy
+    int shared = block_is_shared(block_i);
+    if (shared || block_is_behind_log(block_i)){
+        int copy_i = alloc_block();
+        if (copy_i < 0 && shared){
+            return -1;
+        }
+        if (copy_i >= 0){
+            memcpy(blocks_get_block(copy_i), blocks_get_block(block_i), BLOCK_SIZE);
+            if (inode__set_block_i(inode, index, copy_i) != 0){
+                free_block(copy_i);
+                return -1;
+            }
+            //the copy has no fingerprint or checksum yet, the caller seals it once it is written
+            free_block(block_i);
+            stats__count(shared ? STATS_EVENT_COW_COPIES : STATS_EVENT_LOG_COPIES, 1);
+            return copy_i;
+        }
+    }
+
+    //the caller is about to change it, and seals it again once it has
+    get_block_fingerprints()[block_i] = 0;
+    checksum__forget(block_i);
+    return block_i;
+}
+
+//Writes the whole block [data] at [index] of [inode], pointing the map at an existing block holding the
+//same data instead if there is one
+//Returns the block index now at [index] on success, -1 on failure
+static int inode__write_block_deduped(neat_inode_t *inode, int index, const char *data){
+    uint32_t fingerprint = dedup__hash(data);
+    int block_i = inode__get_block_i(inode, index);
+    if (block_i < 0 && !inode__is_hole(inode, index)){
+        return -1;
+    }
+    int match_i = dedup__find(fingerprint, data);
+
+    if (match_i >= 0 && match_i == block_i){
+        //already holds exactly this
+        return block_i;
+    }
+    if (match_i >= 0 && share_block(match_i) == 0){
+        if (inode__set_block_i(inode, index, match_i) != 0){
+            free_block(match_i);
+            return -1;
+        }
+        if (block_i >= 0){
+            free_block(block_i);
+        }
+        stats__count(STATS_EVENT_DEDUP_HITS, 1);
+        return match_i;
+    }
+
+    block_i = inode__get_writable_block_i(inode, index);
+    if (block_i < 0){
+        return -1;
+    }
+    memcpy(blocks_get_block(block_i), data, BLOCK_SIZE);
+    checksum__seal(block_i);
+    dedup__remember(block_i, fingerprint);
+    return block_i;
+}
+
+//Writes the [count] whole blocks at [data] into the holes at [index] and after of [inode], as far as they go,
+//with one run of new blocks and a single copy. The run is halved until there is room for it
+//Returns the number of blocks written, 0 if the caller has to go block by block
+static int inode__write_hole_run(neat_inode_t *inode, int index, int count, const char *data){
+    int length = 0;
+    while (length < count && inode__is_hole(inode, index + length)){
+        length++;
+    }
+
+    //the run is overwritten right away, zeroing it first would only double the memory traffic
+    int run_start = -1;
+    while (length > 1 && (run_start = alloc_block_run_unzeroed(length)) < 0){
+        length /= 2;
+    }
+    if (run_start < 0){
+        return 0;
+    }
+
+    int run[length];
+    for (int i = 0; i < length; i++){
+        run[i] = run_start + i;
+    }
+    int had_indirect = inode->indirect_i > 0;
+    for (int i = 0; i < length; i++){
+        //the map may need an indirect block there is no room for (or end), nothing is written then
+        if (inode__set_block_i(inode, index + i, run[i]) != 0){
+            for (int j = 0; j < i; j++){
+                inode__set_block_i(inode, index + j, -1);
+            }
+            //an indirect block this run got the map is all holes again
+            if (!had_indirect && inode->indirect_i > 0){
+                free_block(inode->indirect_i);
+                inode->indirect_i = -1;
+            }
+            free_blocks(run, length);
+            return 0;
+        }
+    }
+
+    memcpy(blocks_get_block(run_start), data, (size_t) length * BLOCK_SIZE);
+    for (int i = 0; i < length; i++){
+        checksum__seal(run[i]);
+    }
+    return length;
+}
+
+//Moves [size] bytes at [offset] of the blocks of [inode], into them from [buf_read_from] if it is set,
+//out of them into [buf_write_to] otherwise
+//Returns the number of bytes moved on success, -1 if the map ends before anything was moved
+static int inode__data_io(neat_inode_t *inode, const char *buf_read_from, char *buf_write_to, int size, int offset){
+    int buff_offset = 0;
+
+    while (buff_offset < size){
+        int index = (offset + buff_offset) / BLOCK_SIZE;
+        int block_offset = (offset + buff_offset) % BLOCK_SIZE;
+        int data_length = BLOCK_SIZE - block_offset;
+        data_length = size - buff_offset < data_length ? size - buff_offset : data_length;
+
+        //a large write into holes (appending, mostly) gets its blocks in one go
+        if (buf_read_from != NULL && data_length == BLOCK_SIZE && !dedup__enabled()
+            && size - buff_offset >= 2 * BLOCK_SIZE){
+            int written = inode__write_hole_run(inode, index, (size - buff_offset) / BLOCK_SIZE,
+                                                buf_read_from + buff_offset);
+            if (written > 0){
+                buff_offset += written * BLOCK_SIZE;
+                continue;
+            }
+        }
+
+        int block_i;
+        if (buf_read_from != NULL && data_length == BLOCK_SIZE && dedup__enabled()){
+            block_i = inode__write_block_deduped(inode, index, buf_read_from + buff_offset);
+        }
+        else if (buf_read_from != NULL){
+            block_i = inode__get_writable_block_i(inode, index);
+            if (block_i >= 0){
+                memcpy((char *)blocks_get_block(block_i) + block_offset, buf_read_from + buff_offset, data_length);
+                checksum__seal(block_i);
+            }
+        }
+        else {
+            block_i = inode__get_block_i(inode, index);
+            if (block_i >= 0 && checksum__verify(block_i) != 0){
+                printf("%sERROR: block %d of inode %d is damaged\n", INODE_FILE_NAME, index, inode->inode_i);
+                return buff_offset > 0 ? buff_offset : -1;
+            }
+            if (block_i >= 0){
+                memcpy(buf_write_to + buff_offset, (char *)blocks_get_block(block_i) + block_offset, data_length);
+            }
+            else if (inode__is_hole(inode, index)){
+                memset(buf_write_to + buff_offset, 0, data_length);
+                block_i = 0;
+            }
+        }
+
+        if (block_i < 0){
+            printf("%sERROR: block %d of inode %d is missing\n", INODE_FILE_NAME, index, inode->inode_i);
+            return buff_offset > 0 ? buff_offset : -1;
+        }
+        buff_offset += data_length;
+    }
+
+    return buff_offset;
+}
+
+int inode__read_data(neat_inode_t *inode, char *buf, int size, int offset){
+    return inode__data_io(inode, NULL, buf, size, offset);
+}
+
+int inode__write_data(neat_inode_t *inode, const char *buf, int size, int offset){
+    return inode__data_io(inode, buf, NULL, size, offset);
+}
+
+int inode__write_link(neat_inode_t *inode, const char *target){
+    int length = strlen(target);
+    if (length > NEAT_INODE_LINK_MAX){
+        return -1;
+    }
+
+    if (length <= NEAT_INODE_INLINE_LINK_MAX){
+        memset(inode->blocks, 0, sizeof(inode->blocks));
+        memcpy(inode->blocks, target, length);
+        inode->flags |= NEAT_INODE_INLINE_LINK;
+        inode->size = length;
+        return 0;
+    }
+
+    inode->size = length;
+    if (inode__write_data(inode, target, length, 0) != length){
+        inode__shrink_inode(inode, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int inode__read_link(neat_inode_t *inode, char *buf, int size){
+    if (size <= 0){
+        return -1;
+    }
+
+    int length = inode->size < size - 1 ? inode->size : size - 1;
+    if (inode->flags & NEAT_INODE_INLINE_LINK){
+        memcpy(buf, inode->blocks, length);
+    }
+    else if (inode__read_data(inode, buf, length, 0) != length){
+        return -1;
+    }
+    buf[length] = '\0';
+    return 0;
+}
+
+//Drops the blocks at [from_index] and past from the map of [inode], holding [block_count] blocks so far
+static void inode__drop_blocks_from(neat_inode_t *inode, int from_index, int block_count){
+    int dropped[BLOCK_COUNT];
+    int dropped_count = 0;
+    //the indirect block goes too once nothing past the direct blocks is left, so its slots needn't be cleared
+    int keep_indirect = from_index > NEAT_INODE_DIRECT_BLOCKS;
+    for (int i = from_index; i < block_count && dropped_count < BLOCK_COUNT; i++){
+        int block_i = inode__get_block_i(inode, i);
+        if (block_i > 0){
+            dropped[dropped_count++] = block_i;
+        }
+        if (i < NEAT_INODE_DIRECT_BLOCKS){
+            inode->blocks[i] = -1;
+        }
+        else if (keep_indirect && inode->indirect_i > 0){
+            inode__set_block_i(inode, i, 0);
+        }
+    }
+
+    if (!keep_indirect && inode->indirect_i > 0 && dropped_count < BLOCK_COUNT){
+        dropped[dropped_count++] = inode->indirect_i;
+        inode->indirect_i = -1;
+    }
+    free_blocks(dropped, dropped_count);
+}
+
 int inode__grow_inode(neat_inode_t *inode, int size){
-    //increase inode size, and make sure to allocate next blocks if we need them
+    //increase inode size, the new part stays a hole until something is written to it
     
     //if size is the same, nothing to grow!
     if (inode->size == size){
@@ -90,23 +625,37 @@ int inode__grow_inode(neat_inode_t *inode, int size){
         return inode__shrink_inode(inode, size);
     }
 
-    int remainder_on_last_block = inode->size % block_data_size();
-    int size_diff = size - inode->size;
-    int remaining = size_diff + remainder_on_last_block;
+    int block_count = inode__blocks_for_size(inode->size);
+    int req_block_count = inode__blocks_for_size(size);
+    if (req_block_count > inode__max_blocks()){
+        return 1;
+    }
 
-    int curr_last_ext_block_i = get_last_ext_block_i(inode->block_i);
+    //bytes past the old end in the last block may be left over from before a shrink, they read back as zeros.
+    //a hole there already does, and the new blocks are all holes until something is written to them
+    int old_tail = inode->size - (block_count - 1) * BLOCK_SIZE;
+    if (block_count > 0 && old_tail < BLOCK_SIZE && inode__get_block_i(inode, block_count - 1) >= 0){
+        int last_block_i = inode__get_writable_block_i(inode, block_count - 1);
+        if (last_block_i < 0){
+            return 1;
+        }
+        memset(blocks_get_block(last_block_i) + old_tail, 0, BLOCK_SIZE - old_tail);
+        checksum__seal(last_block_i);
+    }
 
-    while (remaining > block_data_size()){
-        remaining -= block_data_size();
-        curr_last_ext_block_i = allocate_extension_block(curr_last_ext_block_i);
+    //a shrink always leaves holes behind, but fsck cuts maps short by just lowering the size
+    for (int i = block_count; i < req_block_count; i++){
+        if (!inode__is_hole(inode, i) && inode__set_block_i(inode, i, -1) != 0){
+            return 1;
+        }
     }
-    
+
     inode->size = size;
     return 0;
 }
 
 int inode__shrink_inode(neat_inode_t *inode, int size){
-    //decrease inode size, and make sure to free all extension blocks that are no longer used
+    //decrease inode size, and make sure to free all blocks that are no longer used
     
     //if size is the same, nothing to shrink!
     if (inode->size == size){
@@ -118,19 +667,142 @@ int inode__shrink_inode(neat_inode_t *inode, int size){
         return inode__grow_inode(inode, size);
     }
 
-    int remainder_on_last_block = inode->size % block_data_size();
-    int size_diff = inode->size - size;
-    int remaining = size_diff - remainder_on_last_block;
+    inode__drop_blocks_from(inode, inode__blocks_for_size(size), inode__blocks_for_size(inode->size));
 
-    int curr_last_ext_block_i = get_last_ext_block_i(inode->block_i);
+    inode->size = size;
+    return 0;
+}
 
-    while (remaining > 0){
-        remaining -= block_data_size();
-        free_block(curr_last_ext_block_i);
-        //not optimized but take care of later
-        curr_last_ext_block_i = get_last_ext_block_i(inode->block_i);
+int inode__clone_map(neat_inode_t *dst, neat_inode_t *src){
+    //the extra owners go on first, so a block that can't take one more leaves both inodes as they were.
+    //only the data is cloned, [dst] keeps its own extended attributes
+    if (inode__share_blocks(src, 0) != 0){
+        return -1;
     }
+    inode__drop_blocks(dst, 0);
 
-    inode->size = size;
+    memcpy(dst->blocks, src->blocks, sizeof(dst->blocks));
+    dst->indirect_i = src->indirect_i;
+    dst->size = src->size;
+    dst->stored_size = src->stored_size;
+    //how [dst] gets opened is its own, the rest of the flags describe the blocks it just took over
+    dst->flags = (src->flags & ~NEAT_INODE_DIRECT_IO) | (dst->flags & NEAT_INODE_DIRECT_IO);
+    return 0;
+}
+
+int inode__clone_blocks(neat_inode_t *dst, int dst_index, neat_inode_t *src, int src_index, int count){
+    int dst_block_count = inode__blocks_for_size(inode__stored_size(dst));
+
+    for (int i = 0; i < count; i++){
+        //a hole clones as a hole
+        int block_i = inode__get_block_i(src, src_index + i);
+        int hole = block_i < 0 && inode__is_hole(src, src_index + i);
+        if ((block_i < 0 && !hole) || (!hole && share_block(block_i) != 0)){
+            inode__drop_blocks_from(dst, dst_block_count, dst_index + i);
+            return -1;
+        }
+
+        int old_block_i = dst_index + i < dst_block_count ? inode__get_block_i(dst, dst_index + i) : -1;
+        if (inode__set_block_i(dst, dst_index + i, block_i) != 0){
+            if (!hole){
+                free_block(block_i);
+            }
+            inode__drop_blocks_from(dst, dst_block_count, dst_index + i);
+            return -1;
+        }
+        if (old_block_i >= 0){
+            free_block(old_block_i);
+        }
+    }
+    return 0;
+}
+
+//Writes zeros over [length] bytes at [offset] of [inode], leaving holes as they are
+//Returns 0 on success, -1 on failure
+static int inode__zero_range(neat_inode_t *inode, int offset, int length){
+    while (length > 0){
+        int index = offset / BLOCK_SIZE;
+        int block_offset = offset % BLOCK_SIZE;
+        int data_length = BLOCK_SIZE - block_offset < length ? BLOCK_SIZE - block_offset : length;
+        if (!inode__is_hole(inode, index)){
+            int block_i = inode__get_writable_block_i(inode, index);
+            if (block_i < 0){
+                return -1;
+            }
+            memset((char *)blocks_get_block(block_i) + block_offset, 0, data_length);
+            checksum__seal(block_i);
+        }
+        offset += data_length;
+        length -= data_length;
+    }
+    return 0;
+}
+
+int inode__preallocate(neat_inode_t *inode, int from_index, int count){
+    int held_indirect = inode->indirect_i > 0;
+    int holes[BLOCK_COUNT];
+    int hole_count = 0;
+    for (int i = from_index; i < from_index + count && hole_count < BLOCK_COUNT; i++){
+        if (inode__is_hole(inode, i)){
+            holes[hole_count++] = i;
+        }
+    }
+
+    //one run for all of them if there is room for it, so the file reads back without seeking around
+    int run_i = hole_count > 1 ? alloc_block_run(hole_count) : -1;
+    for (int i = 0; i < hole_count; i++){
+        int block_i = run_i >= 0 ? run_i + i : alloc_block();
+        if (block_i < 0 || inode__set_block_i(inode, holes[i], block_i) != 0){
+            printf("%sERROR: ran out of blocks preallocating inode %d\n", INODE_FILE_NAME, inode->inode_i);
+            if (block_i >= 0){
+                free_block(block_i);
+            }
+            for (int j = i + 1; run_i >= 0 && j < hole_count; j++){
+                free_block(run_i + j);
+            }
+            //all or nothing, the holes filled so far go back to being holes
+            for (int j = 0; j < i; j++){
+                free_block(inode__get_block_i(inode, holes[j]));
+                inode__set_block_i(inode, holes[j], -1);
+            }
+            if (!held_indirect && inode->indirect_i > 0){
+                free_block(inode->indirect_i);
+                inode->indirect_i = -1;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int inode__punch_hole(neat_inode_t *inode, int offset, int length){
+    int end = offset + length;
+    int first_whole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int end_whole = end / BLOCK_SIZE;
+
+    //whatever the range only covers part of keeps its block and gets zeros written over that part
+    if (first_whole > end_whole){
+        return inode__zero_range(inode, offset, length);
+    }
+    if (inode__zero_range(inode, offset, first_whole * BLOCK_SIZE - offset) != 0 ||
+        inode__zero_range(inode, end_whole * BLOCK_SIZE, end - end_whole * BLOCK_SIZE) != 0){
+        return -1;
+    }
+
+    int dropped[BLOCK_COUNT];
+    int dropped_count = 0;
+    for (int i = first_whole; i < end_whole; i++){
+        int block_i = inode__get_block_i(inode, i);
+        if (block_i < 0){
+            continue;
+        }
+        //a shared indirect block gets copied before its slot changes, which can run out of room
+        if (inode__set_block_i(inode, i, -1) != 0){
+            free_blocks(dropped, dropped_count);
+            return -1;
+        }
+        dropped[dropped_count++] = block_i;
+    }
+    free_blocks(dropped, dropped_count);
     return 0;
-}
\ No newline at end of file
+}
@@ -4,18 +4,48 @@
 #include <time.h>
 #include "blocks.h"
 
-#define INODE_BITMAP_SIZE BLOCK_SIZE - BLOCK_BITMAP_SIZE
+#define INODE_BITMAP_SIZE BLOCK_SUMMARY_OFFSET - BLOCK_BITMAP_SIZE
+
+//the inode table takes up the blocks right after block 0, data blocks start after it
+#define INODE_TABLE_FIRST_BLOCK 1
+#define INODE_TABLE_BLOCKS 2
+#define INODE_FIRST_DATA_BLOCK (INODE_TABLE_FIRST_BLOCK + INODE_TABLE_BLOCKS)
+
+//data blocks listed in the inode itself, the rest go in its indirect block
+#define NEAT_INODE_DIRECT_BLOCKS 6
 //#define MAX_INODE //INODE_BITMAP_SIZE / 8 // should round down b/c divinding by an int
 
+//bytes of extended attributes kept in the inode itself (rounds the inode up to 128 bytes)
+#define NEAT_INODE_XATTR_INLINE 44
+
+//inode flags
+#define NEAT_INODE_COMPRESSED 0x1       //the blocks hold compressed frames (see neat_compress.h)
+#define NEAT_INODE_INCOMPRESSIBLE 0x2   //compressing didn't save a block and the file hasn't changed since
+#define NEAT_INODE_INLINE_LINK 0x4      //a symlink with its target kept where the direct blocks go, no map at all
+#define NEAT_INODE_PACKED_DIR 0x8       //a directory of packed entries (see neat_directory.h)
+#define NEAT_INODE_DIRECT_IO 0x10       //opened around the kernel page cache, for files that are streamed through once
+
+//longest symlink target kept in the inode itself ("fast symlink"), longer ones go in a data block
+#define NEAT_INODE_INLINE_LINK_MAX (NEAT_INODE_DIRECT_BLOCKS * (int) sizeof(int))
+//longest symlink target at all, it has to fit in one block
+#define NEAT_INODE_LINK_MAX (BLOCK_SIZE - 1)
+
 typedef struct neat_inode {
     int size;
     int mode;
-    int block_i;
     int inode_i;
+    int nlink;      //directory entries pointing at this inode
+    int flags;
+    int stored_size;    //bytes actually in the blocks while compressed, size is always the logical size
+    int blocks[NEAT_INODE_DIRECT_BLOCKS];   //first data blocks, -1 past the end
+    int indirect_i;     //block of ints listing the data blocks past the direct ones, -1 if not needed
     
     time_t ctime;
     time_t mtime;
     time_t atime;
+
+    int xattr_i;        //block holding the extended attributes that don't fit inline, -1 if none
+    char xattrs[NEAT_INODE_XATTR_INLINE];  //the first extended attributes, packed like in the xattr block
 } neat_inode_t;
 
 //Initialzie the inode bitmap
@@ -30,7 +60,7 @@ int inode__init_inode_block();
 //Returns the inode on success, null on failure
 neat_inode_t *inode__get_inode(int inode_i);
 
-//Gets the inode count (currently a calculated max)
+//Gets the inode count (as many as fit in the inode table)
 //Returns the count on success, 1 on failure
 int inode__get_inode_count();
 
@@ -38,23 +68,138 @@ int inode__get_inode_count();
 //Returns the pointer on success, null on failure
 void *inode__get_inode_base();
 
+//Gets the bitmap of the inode table in use (the live one unless a snapshot is being viewed)
+//Returns the pointer
+void *inode__get_inode_bitmap();
+
+//Points every inode lookup at the copy of the table in [table] and its bitmap in [inode_bitmap],
+//NULL for both goes back to the live table
+void inode__view_table(void *inode_bitmap, void *table);
+
 //Allocates an inode in inode block region, marks inode bitmap
 //returns the inode, NULL on error
 neat_inode_t *inode__alloc_inode();
 
-//Mark it as freed in the bitmap (free_block) for all blocks used
+//Mark it as freed in the bitmap, dropping its hold on all blocks used
 //Returns 0 on success, -1 on failure
 int inode__free_inode(int inode_i);
 
-//Grow the size of the inode, and if too big for block,
-//mark the end of the block with the block index of the next one used (recursively)
-//Returns 0 on success, 1 on failure
+//Adds an owner to every block in the map of [inode] (its indirect block and extended attributes too),
+//for a copy of the inode that points at the same blocks
+//Returns 0 on success, -1 if some block can't take another owner (nothing is changed then)
+int inode__share_map(neat_inode_t *inode);
+
+//Drops the hold of [inode] on every block in its map and its extended attributes and empties both
+void inode__drop_map(neat_inode_t *inode);
+
+//Adds a link (directory entry) to the inode at [inode_i]
+//Returns the new link count on success, -1 on failure
+int inode__add_link(int inode_i);
+
+//Drops a link from the inode at [inode_i], reclaiming it if that was the last link and it isn't open
+//Returns 1 if the inode was reclaimed, 0 if it is still alive, -1 on failure
+int inode__drop_link(int inode_i);
+
+//Records an open handle on the inode at [inode_i] so it outlives its last unlink
+//Returns 0 on success, -1 on failure
+int inode__open_handle(int inode_i);
+
+//Closes an open handle on the inode at [inode_i], reclaiming it if it was unlinked meanwhile
+//Returns 1 if the inode was reclaimed, 0 if it is still alive, -1 on failure
+int inode__close_handle(int inode_i);
+
+//Gets the number of open handles on the inode at [inode_i]
+//Returns the count
+int inode__open_handle_count(int inode_i);
+
+//Counts a change to the data of [inode], so the kernel won't be let to keep the pages it cached of it
+void inode__bump_data_generation(neat_inode_t *inode);
+
+//Checks if the data of the inode at [inode_i] is unchanged since the last open that asked, then remembers
+//the current data as what the kernel has cached
+//Returns 1 if the kernel may keep its cached pages, 0 if it has to drop them
+int inode__claim_page_cache(int inode_i);
+
+//Grow the size of the inode, the new part is a hole that reads as zeros until it is written
+//Returns 0 on success, 1 on failure (the inode is left as it was)
 int inode__grow_inode(neat_inode_t *inode, int size);
 
 //Shrink the size
 //Returns 0 on success, 1 on failure
 int inode__shrink_inode(neat_inode_t *inode, int size);
 
+//Gets the number of blocks an inode of [size] bytes spans (always at least one, which may be a hole)
+//Returns the block count
+int inode__blocks_for_size(int size);
+
+//Gets the most blocks the map of an inode can hold
+//Returns the block count
+int inode__max_blocks();
+
+//Gets the number of bytes the blocks of [inode] actually hold (less than its size if compressed)
+//Returns the byte count
+int inode__stored_size(neat_inode_t *inode);
+
+//Gets the data block at [index] in the block map of [inode]
+//Returns the block index on success, -1 if there is none (or the map points somewhere invalid)
+int inode__get_block_i(neat_inode_t *inode, int index);
+
+//Checks if [index] in the block map of [inode] is a hole: no block behind it, it reads as zeros and
+//gets a block on its first write
+//Returns 1 if it is a hole, 0 if it has a block or the map points somewhere invalid
+int inode__is_hole(neat_inode_t *inode, int index);
+
+//Gets the number of data blocks the map of [inode] actually points at, holes not counted
+//Returns the block count
+int inode__allocated_blocks(neat_inode_t *inode);
+
+//Points [index] in the block map of [inode] at [block_i] (-1 for a hole), allocating the indirect block
+//if needed (or copying it first if it is shared)
+//Returns 0 on success, -1 on failure (an indirect block that is invalid or fails its checksum is left alone)
+int inode__set_block_i(neat_inode_t *inode, int index, int block_i);
+
+//Makes [dst] a copy of the data of [src] that shares all of its blocks, dropping whatever data [dst] held
+//before (the extended attributes of both stay as they were)
+//Returns 0 on success, -1 if some block of [src] can't take another owner (nothing is changed then)
+int inode__clone_map(neat_inode_t *dst, neat_inode_t *src);
+
+//Points [count] entries of the map of [dst] from [dst_index] on at the blocks of [src] from [src_index] on,
+//sharing them. Entries past the end of [dst] get appended, the caller sets the size that covers them
+//Returns 0 on success, -1 on failure (blocks cloned before that stay cloned, none get appended)
+int inode__clone_blocks(neat_inode_t *dst, int dst_index, neat_inode_t *src, int src_index, int count);
+
+//Gives every hole among the [count] entries of the map of [inode] from [from_index] on a zeroed block of
+//its own, in one contiguous run if there is room for it
+//Returns 0 on success, -1 if there aren't enough free blocks (the holes are left as they were)
+int inode__preallocate(neat_inode_t *inode, int from_index, int count);
+
+//Turns [length] bytes at [offset] of [inode] into a hole: the blocks it covers whole are given back,
+//the parts of blocks at either end get zeros written over them
+//Returns 0 on success, -1 on failure
+int inode__punch_hole(neat_inode_t *inode, int offset, int length);
+
+//Gets the data block at [index] of [inode] ready to be changed in place: a hole gets a block, a shared
+//block is swapped for a private copy first, and the block loses its dedup fingerprint since its data won't match it anymore
+//Returns the block index on success, -1 on failure
+int inode__get_writable_block_i(neat_inode_t *inode, int index);
+
+//Stores [target] as the target of the new symlink [inode], inline if it is short enough
+//Returns 0 on success, -1 if it is too long or there is no block for it
+int inode__write_link(neat_inode_t *inode, const char *target);
+
+//Reads the target of the symlink [inode] into [buf], NUL terminated and cut short to fit in [size] bytes
+//Returns 0 on success, -1 on failure
+int inode__read_link(neat_inode_t *inode, char *buf, int size);
+
+//Reads [size] bytes at [offset] of the blocks of [inode] into [buf] (as stored, no size checks)
+//Returns the number of bytes read on success, -1 if the map ends first
+int inode__read_data(neat_inode_t *inode, char *buf, int size, int offset);
+
+//Writes [size] bytes from [buf] at [offset] of the blocks of [inode] (as stored, the map must be long enough),
+//copying shared blocks before changing them and sharing whole blocks that already exist if dedup is on
+//Returns the number of bytes written on success, -1 on failure
+int inode__write_data(neat_inode_t *inode, const char *buf, int size, int offset);
+
 //Gets the base of where base of the pntr (accomodating for space the inode itself takes)
 //Return the base pntr on success
 void *inode__get_data_base_pntr(int inode_i);
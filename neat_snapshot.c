@@ -0,0 +1,148 @@
+#include "neat_snapshot.h"
+#include "neat_storage.h"
+#include "neat_checksum.h"
+#include "bitmap.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define SNAPSHOT_FILE_NAME "neat_snapshot.c // "
+
+//the snapshot every inode lookup goes to, 0 for the live table
+static int viewed_id = 0;
+
+neat_snapshot_t *snapshot__get(int snapshot_id){
+    if (snapshot_id < 1 || snapshot_id > SNAPSHOT_MAX){
+        return NULL;
+    }
+
+    neat_snapshot_t *snapshot = (neat_snapshot_t *) get_snapshot_table() + snapshot_id - 1;
+    return snapshot->first_block_i != 0 ? snapshot : NULL;
+}
+
+//Drops the hold of every inode below [up_to] in the snapshot copy at [first_block_i] on its blocks
+static void snapshot__drop_inodes(int first_block_i, int up_to){
+    void *bitmap_copy = blocks_get_block(first_block_i);
+    neat_inode_t *table_copy = blocks_get_block(first_block_i + 1);
+
+    for (int inode_i = 0; inode_i < up_to; inode_i++){
+        if (bitmap_get(bitmap_copy, inode_i)){
+            inode__drop_map(&table_copy[inode_i]);
+        }
+    }
+}
+
+//Gives back the run of blocks holding the snapshot copy at [first_block_i]
+static void snapshot__free_run(int first_block_i){
+    int run[SNAPSHOT_BLOCKS];
+    for (int i = 0; i < SNAPSHOT_BLOCKS; i++){
+        run[i] = first_block_i + i;
+    }
+    free_blocks(run, SNAPSHOT_BLOCKS);
+}
+
+int snapshot__create(){
+    storage_lock();
+    if (viewed_id != 0){
+        storage_unlock();
+        return -EROFS;
+    }
+
+    neat_snapshot_t *table = get_snapshot_table();
+    int slot = 0;
+    while (slot < SNAPSHOT_MAX && table[slot].first_block_i != 0){
+        slot++;
+    }
+    //the table copy is read through one pointer like the live one, so it needs blocks back to back
+    int first_block_i = slot < SNAPSHOT_MAX ? alloc_block_run(SNAPSHOT_BLOCKS) : -1;
+    if (first_block_i < 0){
+        storage_unlock();
+        printf("%sERROR: no room for another snapshot\n", SNAPSHOT_FILE_NAME);
+        return -ENOSPC;
+    }
+
+    void *bitmap_copy = blocks_get_block(first_block_i);
+    neat_inode_t *table_copy = blocks_get_block(first_block_i + 1);
+    memcpy(bitmap_copy, get_inode_bitmap(), INODE_BITMAP_SIZE);
+    memcpy(table_copy, blocks_get_block(INODE_TABLE_FIRST_BLOCK), INODE_TABLE_BLOCKS * BLOCK_SIZE);
+
+    int captured = 0;
+    for (int inode_i = 0; inode_i < inode__get_inode_count(); inode_i++){
+        if (!bitmap_get(bitmap_copy, inode_i)){
+            continue;
+        }
+
+        //only an open handle keeps an unlinked inode around, nothing in the snapshot can reach it
+        if (table_copy[inode_i].nlink == 0){
+            bitmap_put(bitmap_copy, inode_i, 0);
+            continue;
+        }
+        if (inode__share_map(&table_copy[inode_i]) != 0){
+            printf("%sERROR: inode %d has blocks that can't be shared again\n", SNAPSHOT_FILE_NAME, inode_i);
+            snapshot__drop_inodes(first_block_i, inode_i);
+            snapshot__free_run(first_block_i);
+            storage_unlock();
+            return -ENOSPC;
+        }
+        captured++;
+    }
+    //the copy never changes from here on, until the snapshot is deleted
+    for (int i = 0; i < SNAPSHOT_BLOCKS; i++){
+        checksum__seal(first_block_i + i);
+    }
+
+    table[slot].first_block_i = first_block_i;
+    table[slot].inode_count = captured;
+    table[slot].created = time(0);
+    storage_unlock();
+
+    printf("%stook snapshot %d of %d inodes at blocks %d..%d\n", SNAPSHOT_FILE_NAME,
+           slot + 1, captured, first_block_i, first_block_i + SNAPSHOT_BLOCKS - 1);
+    return slot + 1;
+}
+
+int snapshot__delete(int snapshot_id){
+    storage_lock();
+    neat_snapshot_t *snapshot = snapshot__get(snapshot_id);
+    if (snapshot == NULL || snapshot_id == viewed_id){
+        storage_unlock();
+        return snapshot == NULL ? -ENOENT : -EBUSY;
+    }
+
+    //whatever the live side still points at keeps its other owners, the rest goes back to the bitmap
+    snapshot__drop_inodes(snapshot->first_block_i, inode__get_inode_count());
+    snapshot__free_run(snapshot->first_block_i);
+    memset(snapshot, 0, sizeof(neat_snapshot_t));
+    storage_unlock();
+
+    printf("%sdeleted snapshot %d\n", SNAPSHOT_FILE_NAME, snapshot_id);
+    return 0;
+}
+
+void snapshot__list(neat_snapshot_list_t *list){
+    storage_lock();
+    memcpy(list->snapshots, get_snapshot_table(), sizeof(list->snapshots));
+    storage_unlock();
+}
+
+int snapshot__view(int snapshot_id){
+    if (snapshot_id == 0){
+        inode__view_table(NULL, NULL);
+        viewed_id = 0;
+        return 0;
+    }
+
+    neat_snapshot_t *snapshot = snapshot__get(snapshot_id);
+    if (snapshot == NULL){
+        return -ENOENT;
+    }
+    for (int i = 0; i < SNAPSHOT_BLOCKS; i++){
+        if (checksum__verify(snapshot->first_block_i + i) != 0){
+            return -EIO;
+        }
+    }
+    inode__view_table(blocks_get_block(snapshot->first_block_i), blocks_get_block(snapshot->first_block_i + 1));
+    viewed_id = snapshot_id;
+    return 0;
+}
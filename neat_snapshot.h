@@ -0,0 +1,52 @@
+#ifndef NEAT_SNAPSHOT_H
+#define NEAT_SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include "blocks.h"
+#include "neat_inode.h"
+
+//A snapshot is a frozen copy of the inode bitmap and the inode table in a run of blocks of its own. Taking one
+//adds an owner to every block the live inodes point at, so from then on the live side copies a block before
+//changing it and the snapshot keeps seeing the old data. Only what changes afterwards costs new blocks.
+#define SNAPSHOT_BLOCKS (1 + INODE_TABLE_BLOCKS)
+
+typedef struct neat_snapshot {
+    int first_block_i;  //block holding the bitmap copy, the table copy follows it. 0 for an unused slot
+    int inode_count;    //inodes captured
+    int64_t created;
+} neat_snapshot_t;
+
+//Slots in the snapshot table in block 0, snapshot ids run from 1 to this
+#define SNAPSHOT_MAX (BLOCK_SNAPSHOTS_SIZE / (int) sizeof(neat_snapshot_t))
+
+typedef struct neat_snapshot_list {
+    neat_snapshot_t snapshots[SNAPSHOT_MAX];    //indexed by id - 1
+} neat_snapshot_list_t;
+
+//Ioctls on any file of the mount: take a snapshot (fills in its id), delete one by id, list them all
+#define NUFS_IOC_SNAPSHOT_CREATE _IOR('N', 4, int)
+#define NUFS_IOC_SNAPSHOT_DELETE _IOW('N', 5, int)
+#define NUFS_IOC_SNAPSHOT_LIST _IOR('N', 6, neat_snapshot_list_t)
+
+//Gets the snapshot with id [snapshot_id]
+//Returns the snapshot on success, NULL if there is no such snapshot
+neat_snapshot_t *snapshot__get(int snapshot_id);
+
+//Takes a snapshot of the live inode table
+//Returns the new snapshot id on success, -ENOSPC if there is no free slot, no room for the copy or
+//some block can't take another owner, -EROFS while a snapshot is being viewed
+int snapshot__create();
+
+//Deletes the snapshot with id [snapshot_id], dropping its hold on every block it kept
+//Returns 0 on success, -ENOENT if there is no such snapshot, -EBUSY if it is the one being viewed
+int snapshot__delete(int snapshot_id);
+
+//Copies the snapshot table into [list]
+void snapshot__list(neat_snapshot_list_t *list);
+
+//Points every inode lookup at the snapshot with id [snapshot_id] (which must not be changed then),
+//0 goes back to the live inode table
+//Returns 0 on success, -ENOENT if there is no such snapshot, -EIO if its copy doesn't match its checksums
+int snapshot__view(int snapshot_id);
+#endif
@@ -0,0 +1,186 @@
+#include "neat_stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_FILE_NAME "neat_stats.c // "
+
+typedef struct stats_op_counters {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t latency_buckets[STATS_BUCKET_COUNT];
+} stats_op_counters_t;
+
+typedef struct neat_stats {
+    stats_op_counters_t ops[STATS_OP_COUNT];
+    uint64_t events[STATS_EVENT_COUNT];
+    struct neat_stats *next;
+} neat_stats_t;
+
+static const char *op_names[STATS_OP_COUNT] = {
+    "getattr", "access", "readdir", "mknod", "mkdir", "unlink", "link", "rmdir", "rename",
+    "chmod", "truncate", "open", "release", "read", "write", "utimens", "ioctl", "fallocate",
+    "setxattr", "getxattr", "listxattr", "removexattr",
+    "symlink", "readlink", "statfs", "fsync",
+};
+
+static const char *event_names[STATS_EVENT_COUNT] = {
+    "blocks_allocated", "blocks_freed", "indirect_lookups", "dir_entries_scanned",
+    "decompress_cache_hits", "decompress_cache_misses", "dedup_hits", "cow_copies", "checksum_failures",
+    "log_copies", "cleaner_moves", "page_cache_kept",
+};
+
+//every thread bumps its own copy without any locking, readers add them all up
+static __thread neat_stats_t *thread_stats = NULL;
+static neat_stats_t *all_stats = NULL;
+
+//the totals at the last reset, subtracted from everything rendered after it
+static neat_stats_t baseline;
+//scratch space for adding up the threads (too big for a FUSE thread's stack)
+static neat_stats_t totals;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//only the owning thread ever writes its counters, so a relaxed load + store is enough (no locked add)
+#define STATS_BUMP(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static neat_stats_t *stats__thread_stats(){
+    if (thread_stats == NULL){
+        neat_stats_t *stats = calloc(1, sizeof(neat_stats_t));
+
+        //threads register once and are never unlinked, so counts from exited threads still add up
+        pthread_mutex_lock(&stats_mutex);
+        stats->next = all_stats;
+        all_stats = stats;
+        pthread_mutex_unlock(&stats_mutex);
+
+        thread_stats = stats;
+    }
+    return thread_stats;
+}
+
+static int stats__bucket_for(uint64_t value){
+    if (value < STATS_SUB_BUCKETS){
+        return value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (value >> (msb - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (msb - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+//Gets the highest value that lands in [bucket], what percentiles are reported as
+static uint64_t stats__bucket_upper(int bucket){
+    if (bucket < STATS_SUB_BUCKETS){
+        return bucket;
+    }
+
+    int msb = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (msb - STATS_SUB_BUCKET_BITS);
+    return (1ULL << msb) + (bucket % STATS_SUB_BUCKETS) * width + width - 1;
+}
+
+long long stats__now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats__record_op(stats_op_t op, long long start_ns, long long bytes){
+    stats_op_counters_t *counters = &stats__thread_stats()->ops[op];
+    long long elapsed_ns = stats__now_ns() - start_ns;
+
+    STATS_BUMP(counters->calls, 1);
+    if (bytes > 0){
+        STATS_BUMP(counters->bytes, bytes);
+    }
+    STATS_BUMP(counters->latency_buckets[stats__bucket_for(elapsed_ns > 0 ? elapsed_ns : 0)], 1);
+}
+
+const char *stats__op_name(stats_op_t op){
+    return op >= 0 && op < STATS_OP_COUNT ? op_names[op] : NULL;
+}
+
+void stats__count(stats_event_t event, long long count){
+    STATS_BUMP(stats__thread_stats()->events[event], count);
+}
+
+//Adds up every thread's counters into [sum] (caller holds stats_mutex)
+static void stats__sum_threads(neat_stats_t *sum){
+    memset(sum, 0, sizeof(neat_stats_t));
+
+    for (neat_stats_t *stats = all_stats; stats != NULL; stats = stats->next){
+        for (int op = 0; op < STATS_OP_COUNT; op++){
+            sum->ops[op].calls += __atomic_load_n(&stats->ops[op].calls, __ATOMIC_RELAXED);
+            sum->ops[op].bytes += __atomic_load_n(&stats->ops[op].bytes, __ATOMIC_RELAXED);
+            for (int b = 0; b < STATS_BUCKET_COUNT; b++){
+                sum->ops[op].latency_buckets[b] += __atomic_load_n(&stats->ops[op].latency_buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+        for (int event = 0; event < STATS_EVENT_COUNT; event++){
+            sum->events[event] += __atomic_load_n(&stats->events[event], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void stats__reset(){
+    pthread_mutex_lock(&stats_mutex);
+    stats__sum_threads(&baseline);
+    pthread_mutex_unlock(&stats_mutex);
+    printf("%scounters reset\n", STATS_FILE_NAME);
+}
+
+//Gets the value at [percentile] (0-100) out of the histogram [buckets] holding [count] samples
+static uint64_t stats__percentile(uint64_t *buckets, uint64_t count, int percentile){
+    if (count == 0){
+        return 0;
+    }
+
+    uint64_t rank = (count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKET_COUNT; b++){
+        seen += buckets[b];
+        if (seen >= rank && buckets[b] > 0){
+            return stats__bucket_upper(b);
+        }
+    }
+    return 0;
+}
+
+int stats__render(char *buf, int size){
+    pthread_mutex_lock(&stats_mutex);
+    stats__sum_threads(&totals);
+
+    int len = snprintf(buf, size, "# op calls bytes p50_ns p90_ns p99_ns max_ns\n");
+    for (int op = 0; op < STATS_OP_COUNT && len < size; op++){
+        stats_op_counters_t *counters = &totals.ops[op];
+        stats_op_counters_t *base = &baseline.ops[op];
+
+        counters->calls -= base->calls;
+        counters->bytes -= base->bytes;
+        for (int b = 0; b < STATS_BUCKET_COUNT; b++){
+            counters->latency_buckets[b] -= base->latency_buckets[b];
+        }
+
+        len += snprintf(buf + len, size - len, "%s %lu %lu %lu %lu %lu %lu\n", op_names[op],
+                        counters->calls, counters->bytes,
+                        stats__percentile(counters->latency_buckets, counters->calls, 50),
+                        stats__percentile(counters->latency_buckets, counters->calls, 90),
+                        stats__percentile(counters->latency_buckets, counters->calls, 99),
+                        stats__percentile(counters->latency_buckets, counters->calls, 100));
+    }
+
+    if (len < size){
+        len += snprintf(buf + len, size - len, "# event count\n");
+    }
+    for (int event = 0; event < STATS_EVENT_COUNT && len < size; event++){
+        len += snprintf(buf + len, size - len, "%s %lu\n", event_names[event],
+                        totals.events[event] - baseline.events[event]);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    return len < size ? len : size - 1;
+}
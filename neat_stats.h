@@ -0,0 +1,87 @@
+#ifndef NEAT_STATS_H
+#define NEAT_STATS_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+//Read-only virtual file at the root of the mount that renders all of the counters below
+#define NUFS_STATS_PATH "/.nufs_stats"
+//Upper bound on the rendered size of the stats file
+#define NUFS_STATS_RENDER_MAX 16384
+
+//Ioctl on any file of the mount to zero every counter
+#define NUFS_IOC_STATS_RESET _IO('N', 2)
+
+//Latency histograms are log-linear like HDR histograms: every power of two is
+//split into 2^STATS_SUB_BUCKET_BITS linear buckets (so ~12% precision with 3 bits)
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKET_COUNT ((64 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef enum stats_op {
+    STATS_OP_GETATTR,
+    STATS_OP_ACCESS,
+    STATS_OP_READDIR,
+    STATS_OP_MKNOD,
+    STATS_OP_MKDIR,
+    STATS_OP_UNLINK,
+    STATS_OP_LINK,
+    STATS_OP_RMDIR,
+    STATS_OP_RENAME,
+    STATS_OP_CHMOD,
+    STATS_OP_TRUNCATE,
+    STATS_OP_OPEN,
+    STATS_OP_RELEASE,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_UTIMENS,
+    STATS_OP_IOCTL,
+    STATS_OP_FALLOCATE,
+    STATS_OP_SETXATTR,
+    STATS_OP_GETXATTR,
+    STATS_OP_LISTXATTR,
+    STATS_OP_REMOVEXATTR,
+    STATS_OP_SYMLINK,
+    STATS_OP_READLINK,
+    STATS_OP_STATFS,
+    STATS_OP_FSYNC,
+    STATS_OP_COUNT
+} stats_op_t;
+
+typedef enum stats_event {
+    STATS_EVENT_BLOCKS_ALLOCATED,
+    STATS_EVENT_BLOCKS_FREED,
+    STATS_EVENT_INDIRECT_LOOKUPS,       //block map lookups that had to go through an indirect block
+    STATS_EVENT_DIR_ENTRIES_SCANNED,    //entries compared in dir__inode_i_from_inode
+    STATS_EVENT_CACHE_HITS,             //compressed frames served from the decompression cache
+    STATS_EVENT_CACHE_MISSES,           //compressed frames that had to be decompressed
+    STATS_EVENT_DEDUP_HITS,             //whole block writes that shared an existing block instead
+    STATS_EVENT_COW_COPIES,             //shared blocks copied before being written
+    STATS_EVENT_CHECKSUM_FAILURES,      //blocks found not to match their checksum, on read or by the scrubber
+    STATS_EVENT_LOG_COPIES,             //blocks copied to the log head before being written, in log mode
+    STATS_EVENT_CLEANER_MOVES,          //live blocks the cleaner moved out of a segment it was freeing up
+    STATS_EVENT_PAGE_CACHE_KEPT,        //opens that let the kernel keep the pages it had cached of the file
+    STATS_EVENT_COUNT
+} stats_event_t;
+
+//Gets a monotonic timestamp for timing an op
+//Returns the time in nanoseconds
+long long stats__now_ns();
+
+//Records one call of [op] that started at [start_ns] and moved [bytes] bytes
+void stats__record_op(stats_op_t op, long long start_ns, long long bytes);
+
+//Gets the name [op] goes by in the stats file
+//Returns the name, NULL if [op] isn't one
+const char *stats__op_name(stats_op_t op);
+
+//Adds [count] to the internal [event] counter
+void stats__count(stats_event_t event, long long count);
+
+//Zeroes every counter as seen by stats__render (the per-thread counters keep running underneath)
+void stats__reset();
+
+//Renders all counters as text into [buf] of [size] bytes
+//Returns the rendered length
+int stats__render(char *buf, int size);
+#endif
@@ -3,7 +3,17 @@
 #include "neat_inode.h"
 #include "neat_directory.h"
 #include "bitmap.h"
-
+#include "neat_defrag.h"
+#include "neat_cleaner.h"
+#include "neat_stats.h"
+#include "neat_compress.h"
+#include "neat_dedup.h"
+#include "neat_snapshot.h"
+#include "neat_checksum.h"
+#include "neat_xattr.h"
+
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
@@ -12,10 +22,107 @@
 
 #define STORAGE_FILE_NAME "neat_storage.c // "
 
-void storage_init(const char *path){
-    blocks_init(path);
+static pthread_mutex_t storage_mutex;
+static pthread_once_t storage_mutex_once = PTHREAD_ONCE_INIT;
+//compress files once their last handle is closed
+static int compression_enabled = 0;
+//open every file around the kernel page cache, not just the ones flagged NEAT_INODE_DIRECT_IO
+static int direct_io_enabled = 0;
+//set when a snapshot is mounted, nothing may change then
+static int read_only = 0;
+
+//Sets up the lock and everything on top of the blocks once the image is mapped
+static void storage_init_mutex(){
+    //recursive so storage_* calls that nest (rename -> link/unlink) can be locked by the caller
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&storage_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void storage_init_layers(){
+    //the lock outlives the image, a process that mounts again (nufs-bench, nufs-test) keeps the same one
+    pthread_once(&storage_mutex_once, storage_init_mutex);
+
+    //a snapshot viewed by an earlier mount pointed into a mapping that is gone now
+    snapshot__view(0);
     inode__init_inode_block();
     dir__init_root();
+    dedup__init();
+    checksum__init();
+}
+
+void storage_init(const char *path){
+    blocks_init(path);
+    storage_init_layers();
+}
+
+void storage_init_read_only(const char *path){
+    blocks_set_read_only(1);
+    blocks_init(path);
+    storage_init_layers();
+    read_only = 1;
+}
+
+void storage_init_memory(const char *path){
+    blocks_init_memory(path);
+    storage_init_layers();
+}
+
+int storage_save(const char *path){
+    storage_lock();
+    int rv = blocks_save(path);
+    storage_unlock();
+    return rv;
+}
+
+void storage_free(){
+    storage_lock();
+    blocks_free();
+    read_only = 0;
+    storage_unlock();
+}
+
+void storage_set_compression(int enabled){
+    compression_enabled = enabled;
+}
+
+void storage_set_dedup(int enabled){
+    dedup__set_enabled(enabled);
+}
+
+void storage_set_log(int enabled){
+    blocks_set_log_mode(enabled);
+}
+
+void storage_set_checksums(int enabled){
+    checksum__set_enabled(enabled);
+}
+
+void storage_set_direct_io(int enabled){
+    direct_io_enabled = enabled;
+}
+
+int storage_mount_snapshot(int snapshot_id){
+    int rv = snapshot__view(snapshot_id);
+    if (rv != 0){
+        return rv;
+    }
+    read_only = 1;
+    return 0;
+}
+
+int storage_read_only(){
+    return read_only;
+}
+
+void storage_lock(){
+    pthread_mutex_lock(&storage_mutex);
+}
+
+void storage_unlock(){
+    pthread_mutex_unlock(&storage_mutex);
 }
 
 int storage_stat(const char *path, struct stat *st){
@@ -23,19 +130,59 @@ int storage_stat(const char *path, struct stat *st){
     int inode_i = dir__inode_i_from_path(path);
     if (inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_stat inode", path);
-        return -ENOENT;
+        return dir__lookup_errno(inode_i);
     }
+
+    return storage_stat_inode(inode_i, st);
+}
+
+int storage_stat_inode(int inode_i, struct stat *st){
     neat_inode_t *inode = inode__get_inode(inode_i);
+    if (inode == NULL){
+        return -ENOENT;
+    }
     
     //put all of its stats in the stat pointer
-    st->st_ino = inode->inode_i;
+    //(inode numbers are shifted by one so the root is 1 like FUSE_ROOT_ID, 0 reads as "no inode")
+    st->st_ino = inode->inode_i + 1;
     st->st_mode = inode->mode;
     st->st_size = inode->size;
+    st->st_nlink = inode->nlink;
     st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = inode__allocated_blocks(inode) * (BLOCK_SIZE / 512);
+    st->st_atime = inode->atime;
+    st->st_mtime = inode->mtime;
+    st->st_ctime = inode->ctime;
     
     return 0;
 }
 
+int storage_statfs(struct statvfs *st){
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = BLOCK_COUNT;
+    st->f_bfree = count_free_blocks();
+    st->f_bavail = read_only ? 0 : st->f_bfree;
+
+    //64 bits, not worth a summary of their own
+    void *inbm = inode__get_inode_bitmap();
+    st->f_files = inode__get_inode_count();
+    for (int inode_i = 0; inode_i < inode__get_inode_count(); inode_i++){
+        st->f_ffree += !bitmap_get(inbm, inode_i);
+    }
+    st->f_favail = read_only ? 0 : st->f_ffree;
+    st->f_namemax = NEAT_DIR_NAME_LENGTH - 1;
+    st->f_flag = read_only ? ST_RDONLY : 0;
+    return 0;
+}
+
+int storage_fsync(){
+    return blocks_flush() == 0 ? 0 : -EIO;
+}
+
 int storage_read(const char *path, char *buf, size_t size, off_t offset){
 
     return storage_get_data(path, NULL, buf, size, offset, 0);
@@ -46,19 +193,33 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset){
     return storage_get_data(path, buf, NULL, size, offset, 1);
 }
 
-int storage_get_data(const char *path, const char *buf_read_from, char *buf_write_to, size_t size, off_t offset, int readOrWrite){
-    //get inode from path
-    int inode_i = dir__inode_i_from_path(path);
-    if (inode_i < 0){
-        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_get_data inode", path);
-        -ENOENT;
+//Moves the data of [inode] like storage_get_data does for a path
+static int storage_get_inode_data(neat_inode_t *inode, const char *buf_read_from, char *buf_write_to, size_t size, off_t offset, int readOrWrite){
+    if (readOrWrite == 1 && read_only){
+        return -EROFS;
     }
-    neat_inode_t *inode = inode__get_inode(inode_i);
 
-    //so we can adjust the base of the pnts without changing the ones we need to
-    int buff_offset = 0;
+    //let the defragmenter, the cleaner and the scrubber know foreground I/O is happening so they back off
+    defrag__note_io();
+    cleaner__note_io();
+    checksum__note_io();
 
-    int curr_block_i = inode->block_i;
+    //bound the request on the full off_t / size_t first, what is left of it fits the int offsets of the map
+    if (readOrWrite == 1){
+        //the map only reaches so far
+        if (offset + (off_t) size > (off_t) inode__max_blocks() * BLOCK_SIZE){
+            return -EFBIG;
+        }
+    }
+    else {
+        //only read the size we have available
+        if (offset >= inode->size){
+            return 0;
+        }
+        if ((off_t) size > inode->size - offset){
+            size = inode->size - offset;
+        }
+    }
 
     //save casted as int
     int remaining_size = size;
@@ -66,85 +227,117 @@ int storage_get_data(const char *path, const char *buf_read_from, char *buf_writ
     
     //grow the inode for the new data we are writing to if necessary
     if (readOrWrite == 1){
+        //compressed files go back to plain blocks before they change
+        if ((inode->flags & NEAT_INODE_COMPRESSED) && compress__inflate_inode(inode, inode->size) != 0){
+            return -ENOSPC;
+        }
+        inode->flags &= ~NEAT_INODE_INCOMPRESSIBLE;
+
         int req_size = offset_int + remaining_size;
-        if (inode->size < req_size){
-            inode__grow_inode(inode, req_size);
+        if (inode->size < req_size && inode__grow_inode(inode, req_size) != 0){
+            return -ENOSPC;
         }
+        inode->mtime = time(0);
+        inode->ctime = inode->mtime;
+        inode__bump_data_generation(inode);
     }
-
-    //get data of inode starting from [offset]
-    void *block_pntr = blocks_get_block(inode->block_i);
-    block_pntr += offset_int;
-
-    while (remaining_size > 0){
-
-        int data_length = remaining_size > block_data_size() ? block_data_size() : remaining_size;
-
-        if (readOrWrite == 0){
-            //we are reading data from storage, writing to buf
-            //only read the size we want or have available
-            data_length = inode->size < data_length ? inode->size : data_length;
-
-            strncpy(buf_write_to + buff_offset, block_pntr, data_length);
+    else {
+        //relatime: only bother updating atime once it falls behind the last modification
+        if (inode->atime <= inode->mtime && !read_only){
+            inode->atime = time(0);
         }
-        else if (readOrWrite == 1) {
-            //we are wriiting data from the buf to the storage
-            
-            strncpy((char *)block_pntr, buf_read_from + buff_offset, data_length);
+
+        if (inode->flags & NEAT_INODE_COMPRESSED){
+            int rv = compress__read_inode(inode, buf_write_to, remaining_size, offset_int);
+            return rv < 0 ? -EIO : rv;
         }
+    }
 
+    int rv = readOrWrite == 1 ? inode__write_data(inode, buf_read_from, remaining_size, offset_int)
+                              : inode__read_data(inode, buf_write_to, remaining_size, offset_int);
+    if (rv < 0){
+        printf("%sERROR: blocks of inode %d ended before its size\n", STORAGE_FILE_NAME, inode->inode_i);
+        return -EIO;
+    }
 
-        remaining_size -= block_data_size();
-        buff_offset += data_length;
+    //the number of bytes actually moved, which is what read/write report back
+    return rv;
+}
 
-        curr_block_i = get_next_block_i(curr_block_i);
+//Checks if [inode_i] is a handle storage_open handed out and nobody released yet
+static int storage_valid_handle(int inode_i){
+    return inode_i >= 0 && inode_i < inode__get_inode_count() && inode__open_handle_count(inode_i) > 0;
+}
 
-        if (remaining_size > 0 && curr_block_i <= 0){
-            if (readOrWrite == 0){
-                //nothing left to read so the rest of the buffer to write to can remain the same!
-                return 0;
-            }
-            else if (readOrWrite == 1){
-                printf("%sERROR: tried to write past the file size for file: %s", STORAGE_FILE_NAME, path);
-                return -ENOENT;
-            }
-        }
+int storage_read_handle(int inode_i, char *buf, size_t size, off_t offset){
+    if (!storage_valid_handle(inode_i)){
+        return -EBADF;
+    }
+    return storage_get_inode_data(inode__get_inode(inode_i), NULL, buf, size, offset, 0);
+}
 
-        //move to next block in case we still have data in next block on next while iteration
-        block_pntr = blocks_get_block(curr_block_i);
+int storage_write_handle(int inode_i, const char *buf, size_t size, off_t offset){
+    if (!storage_valid_handle(inode_i)){
+        return -EBADF;
     }
+    return storage_get_inode_data(inode__get_inode(inode_i), buf, NULL, size, offset, 1);
+}
 
-    return 0;
+int storage_get_data(const char *path, const char *buf_read_from, char *buf_write_to, size_t size, off_t offset, int readOrWrite){
+    //get inode from path
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_get_data inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    return storage_get_inode_data(inode__get_inode(inode_i), buf_read_from, buf_write_to, size, offset, readOrWrite);
 }
 
 
 int storage_truncate(const char *path, off_t size){
+    if (read_only){
+        return -EROFS;
+    }
+
     //get inode from path
     int inode_i = dir__inode_i_from_path(path);
     if (inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_truncate inode", path);
-        return -ENOENT;
+        return dir__lookup_errno(inode_i);
     }
     neat_inode_t *inode = inode__get_inode(inode_i);
+    if (size < 0){
+        return -EINVAL;
+    }
+    if (size > (off_t) inode__max_blocks() * BLOCK_SIZE){
+        return -EFBIG;
+    }
+    if (size == inode->size){
+        return 0;
+    }
 
-    //make to designated size
-    if (size > inode->size){
-        inode__grow_inode(inode, size);
+    //only what survives the truncate needs decompressing
+    if ((inode->flags & NEAT_INODE_COMPRESSED) && compress__inflate_inode(inode, size) != 0){
+        return -ENOSPC;
     }
-    else if (size < inode->size){
-        inode__shrink_inode(inode, size);
+    inode->flags &= ~NEAT_INODE_INCOMPRESSIBLE;
+
+    //make to designated size, growing only fails when a block to zero the old tail in can't be had
+    int rv = size > inode->size ? inode__grow_inode(inode, size) : inode__shrink_inode(inode, size);
+    if (rv != 0){
+        return -ENOSPC;
     }
-                
-    //if == size
+
+    inode->mtime = time(0);
+    inode->ctime = inode->mtime;
+    inode__bump_data_generation(inode);
     return 0;
 }
 
 int storage_mknod(const char *path, int mode){
-    //make the inode first
-    neat_inode_t *new_child_inode = inode__alloc_inode();
-    
-    new_child_inode->mode = mode;
-    new_child_inode->size = 0;
+    if (read_only){
+        return -EROFS;
+    }
 
     //the path recieved is the full parent directory + new node path
     //split it to get just the parent, then the child as the name
@@ -156,26 +349,63 @@ int storage_mknod(const char *path, int mode){
         printf("%sERROR: failed to get the parent and child paths from the full path path %s\n", STORAGE_FILE_NAME, path);
         return -ENOENT;
     }
+    if (strlen(child_name) >= NEAT_DIR_NAME_LENGTH){
+        return -ENAMETOOLONG;
+    }
 
+    //find the parent before making the inode so a bad path doesn't leak one
     int parent_inode_i = dir__inode_i_from_path(parent_path);
-    if (parent_inode_i != 0){
+    if (parent_inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "parent_inode", parent_path);
-        return -ENOENT;
+        return dir__lookup_errno(parent_inode_i);
     }
     neat_inode_t *parent_inode = inode__get_inode(parent_inode_i);
+    if (!S_ISDIR(parent_inode->mode)){
+        return -ENOTDIR;
+    }
+
+    int existing_inode_i = dir__inode_i_from_inode(parent_inode, child_name);
+    if (existing_inode_i >= 0 || existing_inode_i == DIR_DAMAGED){
+        return existing_inode_i >= 0 ? -EEXIST : -EIO;
+    }
+
+    neat_inode_t *new_child_inode = inode__alloc_inode();
+    if (new_child_inode == NULL){
+        return -ENOSPC;
+    }
+    int child_inode_i = new_child_inode->inode_i;
     
+    new_child_inode->mode = mode;
+    new_child_inode->size = 0;
+
+    //a new directory starts out with its "." and ".." entries, which are links like any other
+    if (S_ISDIR(mode)){
+        if (dir__add_dir_to_inode(new_child_inode, ".", child_inode_i) != 0
+            || dir__add_dir_to_inode(new_child_inode, "..", parent_inode_i) != 0){
+            inode__free_inode(child_inode_i);
+            return -ENOSPC;
+        }
+        inode__add_link(child_inode_i);
+        inode__add_link(parent_inode_i);
+    }
 
     //now link it in the directory
-    rv = dir__add_dir_to_inode(parent_inode, child_name, new_child_inode->inode_i);
+    rv = dir__add_dir_to_inode(parent_inode, child_name, child_inode_i);
     if (rv != 0){
         printf("%sERROR: failed to add the directory to the inode index %d\n", STORAGE_FILE_NAME, parent_inode_i);
-        return -ENOENT;
+        if (S_ISDIR(mode)){
+            inode__drop_link(parent_inode_i);
+        }
+        inode__free_inode(child_inode_i);
+        return -ENOSPC;
     }
+    inode__add_link(child_inode_i);
 
     return 0;
 }
 
-int storage_unlink(const char *path){
+//Removes the entry at [path] from its parent and drops the link it held, whatever the inode type
+static int storage__unlink_entry(const char *path){
     //the path given is the full child directory, split it up
     char parent_path[strlen(path)];
     char child_name[strlen(path)];
@@ -189,77 +419,605 @@ int storage_unlink(const char *path){
     int parent_inode_i = dir__inode_i_from_path(parent_path);
     if (parent_inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "parent_inode", parent_path);
-        return -ENOENT;
+        return dir__lookup_errno(parent_inode_i);
     }
     neat_inode_t *parent_inode = inode__get_inode(parent_inode_i);
 
+    int child_inode_i = dir__inode_i_from_inode(parent_inode, child_name);
+    if (child_inode_i < 0){
+        return dir__lookup_errno(child_inode_i);
+    }
+
+    //the entry is there, so only copying a shared directory block can fail
     rv = dir__rm_dir_from_inode(parent_inode, child_name);
     if (rv != 0){
-        return -ENOENT;
+        return -ENOSPC;
     }
+
+    //the inode (and its blocks) only go away with its last link and last open handle
+    inode__drop_link(child_inode_i);
     
     return 0;
 }
 
-int storage_link(const char *from, const char *to){
-    //from is the full child directory
-    //to is the new parent director
-    char dummy_parent_path[strlen(from)];
-    char child_name[strlen(from)];
+//Adds an entry at [path] for the existing inode [inode_i] and counts the link
+static int storage__link_inode(int inode_i, const char *path){
+    char parent_path[strlen(path)];
+    char child_name[strlen(path)];
 
-    int rv = dir__parent_child_from_path(from, dummy_parent_path, child_name);
+    int rv = dir__parent_child_from_path(path, parent_path, child_name);
     if (rv != 0){
-        printf("%sERROR: failed to get the parent and child paths from the full path path %s\n", STORAGE_FILE_NAME, from);
+        printf("%sERROR: failed to get the parent and child paths from the full path path %s\n", STORAGE_FILE_NAME, path);
         return -ENOENT;
     }
+    if (strlen(child_name) >= NEAT_DIR_NAME_LENGTH){
+        return -ENAMETOOLONG;
+    }
 
-    int new_parent_inode_i = dir__inode_i_from_path(to);
-    if (new_parent_inode_i < 0){
-        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "new_parent_inode", to);
-        return -ENOENT;
+    int parent_inode_i = dir__inode_i_from_path(parent_path);
+    if (parent_inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "new_parent_inode", parent_path);
+        return dir__lookup_errno(parent_inode_i);
+    }
+    neat_inode_t *parent_inode = inode__get_inode(parent_inode_i);
+    if (!S_ISDIR(parent_inode->mode)){
+        return -ENOTDIR;
+    }
+
+    int existing_inode_i = dir__inode_i_from_inode(parent_inode, child_name);
+    if (existing_inode_i >= 0 || existing_inode_i == DIR_DAMAGED){
+        return existing_inode_i >= 0 ? -EEXIST : -EIO;
+    }
+
+    rv = dir__add_dir_to_inode(parent_inode, child_name, inode_i);
+    if (rv != 0){
+        return -ENOSPC;
+    }
+    inode__add_link(inode_i);
+    
+    return 0;
+}
+
+int storage_unlink(const char *path){
+    if (read_only){
+        return -EROFS;
     }
-    neat_inode_t *new_parent_inode = inode__get_inode(new_parent_inode_i);
 
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_unlink inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    if (S_ISDIR(inode__get_inode(inode_i)->mode)){
+        return -EISDIR;
+    }
+
+    return storage__unlink_entry(path);
+}
+
+int storage_rmdir(const char *path){
+    if (read_only){
+        return -EROFS;
+    }
+
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_rmdir inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    if (inode_i == 0){
+        return -EBUSY;
+    }
+
+    neat_inode_t *dd = inode__get_inode(inode_i);
+    if (!S_ISDIR(dd->mode)){
+        return -ENOTDIR;
+    }
+    //anything past "." and ".." means it isn't empty
+    if (dir__entry_count(dd) > 2){
+        return -ENOTEMPTY;
+    }
+
+    int parent_inode_i = dir__inode_i_from_inode(dd, "..");
+    int rv = storage__unlink_entry(path);
+    if (rv != 0){
+        return rv;
+    }
+
+    //".." was holding a link on the parent and "." one on the directory itself,
+    //dropping that last one reclaims the directory
+    inode__drop_link(parent_inode_i);
+    inode__drop_link(inode_i);
+    
+    return 0;
+}
+
+int storage_link(const char *from, const char *to){
+    if (read_only){
+        return -EROFS;
+    }
+
+    //from is the full path of the existing child
+    //to is the full path of the new link (new parent directory + new name)
     int child_inode_i = dir__inode_i_from_path(from);
     if (child_inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "child_inode", from);
-        return -ENOENT;
+        return dir__lookup_errno(child_inode_i);
+    }
+
+    //hard links to directories would let the tree loop
+    if (S_ISDIR(inode__get_inode(child_inode_i)->mode)){
+        return -EPERM;
     }
 
-    rv = dir__add_dir_to_inode(new_parent_inode, child_name, child_inode_i);
+    return storage__link_inode(child_inode_i, to);
+}
+
+//Points the existing entry at [path] at the inode [inode_i] instead, see dir__relink
+//Returns 0 on success, a negative errno on failure (the entry is left as it was)
+static int storage__relink_entry(const char *path, int inode_i){
+    char parent_path[strlen(path)];
+    char child_name[strlen(path)];
+
+    int rv = dir__parent_child_from_path(path, parent_path, child_name);
     if (rv != 0){
+        printf("%sERROR: failed to get the parent and child paths from the full path path %s\n", STORAGE_FILE_NAME, path);
         return -ENOENT;
     }
-    
-    return 0;
+
+    int parent_inode_i = dir__inode_i_from_path(parent_path);
+    if (parent_inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "parent_inode", parent_path);
+        return dir__lookup_errno(parent_inode_i);
+    }
+
+    //the entry is there, so only copying a shared directory block can fail
+    return dir__relink(inode__get_inode(parent_inode_i), child_name, inode_i) == 0 ? 0 : -ENOSPC;
 }
 
 int storage_rename(const char *from, const char *to){
-    //link the new one before unlinking so we can still find
-    //it via its old link path
-    int rv = storage_link(from, to);
-    if (rv != 0){
-        return -ENOENT;
+    if (read_only){
+        return -EROFS;
+    }
+
+    int from_inode_i = dir__inode_i_from_path(from);
+    if (from_inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_rename inode", from);
+        return dir__lookup_errno(from_inode_i);
+    }
+    neat_inode_t *from_inode = inode__get_inode(from_inode_i);
+    int is_dir = S_ISDIR(from_inode->mode);
+
+    //a directory can't be moved somewhere inside itself
+    size_t from_len = strlen(from);
+    if (is_dir && strncmp(to, from, from_len) == 0 && to[from_len] == '/'){
+        return -EINVAL;
+    }
+
+    //renaming onto an existing name replaces it, unless both are already the same inode
+    int to_inode_i = dir__inode_i_from_path(to);
+    if (to_inode_i == from_inode_i){
+        return 0;
+    }
+    if (to_inode_i == DIR_DAMAGED){
+        return -EIO;
+    }
+    if (to_inode_i >= 0){
+        neat_inode_t *to_inode = inode__get_inode(to_inode_i);
+        int to_is_dir = S_ISDIR(to_inode->mode);
+        if (is_dir != to_is_dir){
+            return is_dir ? -ENOTDIR : -EISDIR;
+        }
+        if (to_inode_i == 0){
+            return -EBUSY;
+        }
+        //anything past "." and ".." means it isn't empty
+        if (to_is_dir && dir__entry_count(to_inode) > 2){
+            return -ENOTEMPTY;
+        }
     }
 
-    rv = storage_unlink(from);
+    //a moved directory has to point its ".." at the new parent
+    int old_parent_inode_i = -1;
+    int new_parent_inode_i = -1;
+    if (is_dir){
+        char new_parent_path[strlen(to)];
+        char new_name[strlen(to)];
+        if (dir__parent_child_from_path(to, new_parent_path, new_name) != 0){
+            return -ENOENT;
+        }
+        old_parent_inode_i = dir__inode_i_from_inode(from_inode, "..");
+        new_parent_inode_i = dir__inode_i_from_path(new_parent_path);
+        if (old_parent_inode_i < 0 || new_parent_inode_i < 0){
+            return old_parent_inode_i < 0 ? -EIO : dir__lookup_errno(new_parent_inode_i);
+        }
+    }
+    int moves_parent = is_dir && old_parent_inode_i != new_parent_inode_i;
+
+    //every step that can fail (copying a shared directory block, mostly) comes first and is undone if a later
+    //one fails, the old target is only let go of once nothing can anymore
+    if (moves_parent && dir__relink(from_inode, "..", new_parent_inode_i) != 0){
+        return -ENOSPC;
+    }
+
+    //an existing target has its entry pointed at the inode in place, otherwise the new entry is linked before
+    //the old one goes, so the link count never hits 0 in between
+    int rv;
+    if (to_inode_i >= 0){
+        rv = storage__relink_entry(to, from_inode_i);
+        if (rv == 0){
+            inode__add_link(from_inode_i);
+        }
+    }
+    else {
+        rv = storage__link_inode(from_inode_i, to);
+    }
+
+    if (rv == 0){
+        rv = storage__unlink_entry(from);
+        //both entries live in blocks that were just written, so putting them back doesn't need new blocks
+        if (rv != 0 && to_inode_i >= 0){
+            storage__relink_entry(to, to_inode_i);
+            inode__drop_link(from_inode_i);
+        }
+        else if (rv != 0){
+            storage__unlink_entry(to);
+        }
+    }
     if (rv != 0){
-        return -ENOENT;
+        if (moves_parent){
+            dir__relink(from_inode, "..", old_parent_inode_i);
+        }
+        return rv;
+    }
+
+    if (moves_parent){
+        inode__add_link(new_parent_inode_i);
+        inode__drop_link(old_parent_inode_i);
+    }
+    //the old target lost its entry, a directory also the links its "." and ".." held (on itself and on the
+    //parent it shared with the new name)
+    if (to_inode_i >= 0){
+        if (is_dir){
+            inode__drop_link(new_parent_inode_i);
+            inode__drop_link(to_inode_i);
+        }
+        inode__drop_link(to_inode_i);
+    }
+
+    return 0;
+}
+
+int storage_clone(const char *to, const char *from, off_t from_offset, off_t length, off_t to_offset){
+    if (read_only){
+        return -EROFS;
+    }
+
+    int from_inode_i = dir__inode_i_from_path(from);
+    int to_inode_i = dir__inode_i_from_path(to);
+    if (from_inode_i < 0 || to_inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_clone inode", from_inode_i < 0 ? from : to);
+        return dir__lookup_errno(from_inode_i < 0 ? from_inode_i : to_inode_i);
+    }
+    neat_inode_t *src = inode__get_inode(from_inode_i);
+    neat_inode_t *dst = inode__get_inode(to_inode_i);
+    if (S_ISDIR(src->mode) || S_ISDIR(dst->mode)){
+        return -EISDIR;
+    }
+    if (!S_ISREG(src->mode) || !S_ISREG(dst->mode) || from_offset < 0 || length < 0 || to_offset < 0){
+        return -EINVAL;
+    }
+
+    //the whole file: the destination just takes over the block map of the source, compressed or not. only
+    //asked for with 0 / 0 / 0, any other range keeps whatever of the destination comes after it
+    if (from_offset == 0 && to_offset == 0 && length == 0){
+        if (from_inode_i == to_inode_i){
+            return 0;
+        }
+        if (inode__clone_map(dst, src) != 0){
+            return -ENOSPC;
+        }
+        if (dst->flags & NEAT_INODE_COMPRESSED){
+            compress__forget_frames();
+        }
+        dst->mtime = time(0);
+        dst->ctime = dst->mtime;
+        inode__bump_data_generation(dst);
+        return 0;
+    }
+
+    if (from_offset >= src->size){
+        return 0;
+    }
+    if (length == 0 || length > src->size - from_offset){
+        length = src->size - from_offset;
+    }
+    //checked before anything gets narrowed to the int offsets of the block map
+    if (to_offset > (off_t) inode__max_blocks() * BLOCK_SIZE - length){
+        return -EFBIG;
+    }
+
+    //only whole blocks can be shared, apart from the last one of the source if nothing of the destination
+    //comes after it (the bytes past the end of the source in that block would show up otherwise)
+    int whole_blocks = length % BLOCK_SIZE == 0 || (from_offset + length == src->size && to_offset + length >= dst->size);
+    if (from_offset % BLOCK_SIZE != 0 || to_offset % BLOCK_SIZE != 0 || !whole_blocks){
+        return -EINVAL;
+    }
+    if (from_inode_i == to_inode_i && from_offset < to_offset + length && to_offset < from_offset + length){
+        return -EINVAL;
+    }
+
+    //ranges are counted in plain blocks, so neither side can stay compressed
+    if (((src->flags & NEAT_INODE_COMPRESSED) && compress__inflate_inode(src, src->size) != 0)
+        || ((dst->flags & NEAT_INODE_COMPRESSED) && compress__inflate_inode(dst, dst->size) != 0)){
+        return -ENOSPC;
+    }
+    dst->flags &= ~NEAT_INODE_INCOMPRESSIBLE;
+
+    //a gap between the end of the destination and [to_offset] reads back as zeros like any other growth
+    if (dst->size < to_offset && inode__grow_inode(dst, to_offset) != 0){
+        return -ENOSPC;
+    }
+
+    int block_count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (inode__clone_blocks(dst, to_offset / BLOCK_SIZE, src, from_offset / BLOCK_SIZE, block_count) != 0){
+        return -ENOSPC;
+    }
+    if (dst->size < to_offset + length){
+        dst->size = to_offset + length;
+    }
+    dst->mtime = time(0);
+    dst->ctime = dst->mtime;
+    inode__bump_data_generation(dst);
+    return 0;
+}
+
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length){
+    if (read_only){
+        return -EROFS;
+    }
+
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_fallocate inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (S_ISDIR(inode->mode)){
+        return -EISDIR;
+    }
+    if (!S_ISREG(inode->mode) || offset < 0 || length <= 0){
+        return -EINVAL;
+    }
+    //a hole punched past the end can't change the size, so it has to come with FALLOC_FL_KEEP_SIZE like on linux
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0
+        || mode == FALLOC_FL_PUNCH_HOLE){
+        return -EOPNOTSUPP;
+    }
+    off_t end = offset + length;
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) && end > (off_t) inode__max_blocks() * BLOCK_SIZE){
+        return -EFBIG;
+    }
+
+    //holes are counted in plain blocks, so the file can't stay compressed
+    if ((inode->flags & NEAT_INODE_COMPRESSED) && compress__inflate_inode(inode, inode->size) != 0){
+        return -ENOSPC;
+    }
+    inode->flags &= ~NEAT_INODE_INCOMPRESSIBLE;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE){
+        end = end < inode->size ? end : inode->size;
+        if (offset < end && inode__punch_hole(inode, offset, end - offset) != 0){
+            return -ENOSPC;
+        }
+    }
+    else {
+        //the map holds nothing past the end, so a kept size just fills the holes inside the file
+        int size = inode->size;
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && end > size && inode__grow_inode(inode, end) != 0){
+            return -ENOSPC;
+        }
+        off_t fill_end = end < inode->size ? end : inode->size;
+        int from_index = offset / BLOCK_SIZE;
+        int to_index = (fill_end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (from_index < to_index && inode__preallocate(inode, from_index, to_index - from_index) != 0){
+            inode__shrink_inode(inode, size);
+            return -ENOSPC;
+        }
     }
 
+    inode->mtime = time(0);
+    inode->ctime = inode->mtime;
+    inode__bump_data_generation(inode);
+    return 0;
+}
+
+int storage_open(const char *path){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_open inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+
+    inode__open_handle(inode_i);
+    return inode_i;
+}
+
+int storage_open_cache_policy(int inode_i){
+    if (direct_io_enabled || (inode__get_inode(inode_i)->flags & NEAT_INODE_DIRECT_IO)){
+        return STORAGE_OPEN_DIRECT_IO;
+    }
+    if (!inode__claim_page_cache(inode_i)){
+        return 0;
+    }
+    stats__count(STATS_EVENT_PAGE_CACHE_KEPT, 1);
+    return STORAGE_OPEN_KEEP_CACHE;
+}
+
+int storage_set_file_direct_io(const char *path, int enabled){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_set_file_direct_io inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    if (read_only){
+        return -EROFS;
+    }
+
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (!S_ISREG(inode->mode)){
+        return -EINVAL;
+    }
+    if (enabled){
+        inode->flags |= NEAT_INODE_DIRECT_IO;
+    }
+    else {
+        inode->flags &= ~NEAT_INODE_DIRECT_IO;
+    }
+    inode->ctime = time(0);
+    return 0;
+}
+
+int storage_release(int inode_i){
+    int rv = inode__close_handle(inode_i);
+    if (rv < 0){
+        return -EBADF;
+    }
+
+    //nobody has it open anymore, so it won't be written to again any time soon
+    if (rv == 0 && compression_enabled && !read_only && inode__open_handle_count(inode_i) == 0){
+        compress__compress_inode(inode__get_inode(inode_i));
+    }
     return 0;
 }
 
 int storage_set_time(const char *path, const struct timespec ts[2]){
+    if (read_only){
+        return -EROFS;
+    }
+
     int inode_i = dir__inode_i_from_path(path);
     if (inode_i < 0){
         dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_set_time inode", path);
-        return -ENOENT;
+        return dir__lookup_errno(inode_i);
     }
     neat_inode_t *inode = inode__get_inode(inode_i);
 
     inode->atime = ts[0].tv_sec;
     inode->mtime = ts[1].tv_sec;
+    inode->ctime = time(0);
+
+    return 0;
+}
+
+int storage_chmod(const char *path, int mode){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_chmod inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    if (read_only){
+        return -EROFS;
+    }
+
+    //only the permission bits change, the file type stays what it was
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    inode->mode = (inode->mode & S_IFMT) | (mode & 07777);
+    inode->ctime = time(0);
+    return 0;
+}
+
+int storage_symlink(const char *target, const char *path){
+    if (read_only){
+        return -EROFS;
+    }
+    if (strlen(target) > NEAT_INODE_LINK_MAX){
+        return -ENAMETOOLONG;
+    }
+
+    int rv = storage_mknod(path, S_IFLNK | 0777);
+    if (rv != 0){
+        return rv;
+    }
 
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path(path));
+    if (inode__write_link(inode, target) != 0){
+        storage_unlink(path);
+        return -ENOSPC;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int storage_readlink(const char *path, char *buf, size_t size){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_readlink inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    if (!S_ISLNK(inode->mode)){
+        return -EINVAL;
+    }
+
+    //relatime like reads, so resolving a link over and over doesn't keep touching its inode
+    if (inode->atime <= inode->mtime && !read_only){
+        inode->atime = time(0);
+    }
+    return inode__read_link(inode, buf, size) == 0 ? 0 : -EIO;
+}
+
+int storage_setxattr(const char *path, const char *name, const char *value, size_t size, int flags){
+    if (read_only){
+        return -EROFS;
+    }
+
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_setxattr inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    neat_inode_t *inode = inode__get_inode(inode_i);
+
+    int rv = xattr__set(inode, name, value, size, flags);
+    if (rv == 0){
+        inode->ctime = time(0);
+    }
+    return rv;
+}
+
+int storage_getxattr(const char *path, const char *name, char *value, size_t size){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_getxattr inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    return xattr__get(inode__get_inode(inode_i), name, value, size);
+}
+
+int storage_listxattr(const char *path, char *list, size_t size){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_listxattr inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    return xattr__list(inode__get_inode(inode_i), list, size);
+}
+
+int storage_removexattr(const char *path, const char *name){
+    if (read_only){
+        return -EROFS;
+    }
+
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        dir__print_error__inode_i_from_path(STORAGE_FILE_NAME, "storage_removexattr inode", path);
+        return dir__lookup_errno(inode_i);
+    }
+    neat_inode_t *inode = inode__get_inode(inode_i);
+
+    int rv = xattr__remove(inode, name);
+    if (rv == 0){
+        inode->ctime = time(0);
+    }
+    return rv;
+}
@@ -1,20 +1,153 @@
 #ifndef NEAT_STORAGE_H
 #define NEAT_STORAGE_H
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#define NUFS_CLONE_PATH_MAX 256
+
+//Ioctl on the destination file: clones a range of [src_path] (from the root of the mount) into it,
+//see storage_clone. FUSE 2 has no copy_file_range, so this is the only way to get there
+typedef struct neat_clone_range {
+    char src_path[NUFS_CLONE_PATH_MAX];
+    long long src_offset;
+    long long length;
+    long long dst_offset;
+} neat_clone_range_t;
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 7, neat_clone_range_t)
+
+//Ioctl on a file: nonzero opens it around the kernel page cache from now on, 0 lets it be cached again,
+//see storage_set_file_direct_io
+#define NUFS_IOC_DIRECT_IO _IOW('N', 10, int)
+
+//How the kernel should cache a handle storage_open handed out, see storage_open_cache_policy
+#define STORAGE_OPEN_KEEP_CACHE 0x1     //the data is unchanged since the last open, the pages cached of it still hold
+#define STORAGE_OPEN_DIRECT_IO 0x2      //reads and writes go around the page cache
+
 void storage_init(const char *path);
+
+//Same as storage_init, but nothing is ever written back to the image at [path], which has to exist already
+//(for mounting a snapshot next to the live mount, see storage_mount_snapshot)
+void storage_init_read_only(const char *path);
+
+//Same as storage_init, but the image only lives in memory (see blocks_init_memory), starting out as a copy
+//of the one at [path] if it exists
+void storage_init_memory(const char *path);
+
+//Writes a consistent copy of the whole image to [path], nothing changes while it is being written
+//Returns 0 on success, -1 on failure
+int storage_save(const char *path);
+
+//Closes the image, writing out the free block summary so the next mount can trust it
+void storage_free();
+
+//Turns compressing files on their last release on or off (compressed files are always readable)
+void storage_set_compression(int enabled);
+
+//Turns sharing identical whole blocks between writes on or off (shared blocks stay shared either way)
+void storage_set_dedup(int enabled);
+
+//Turns appending every block that gets written at the log head (see blocks.h) on or off
+void storage_set_log(int enabled);
+
+//Turns checksumming blocks as they are written (and checking them as they are read) on or off
+void storage_set_checksums(int enabled);
+
+//Turns opening every file around the kernel page cache on or off (flagged files always are)
+void storage_set_direct_io(int enabled);
+
+//Serves the snapshot with id [snapshot_id] instead of the live files, read only (after storage_init)
+//Returns 0 on success, -ENOENT if there is no such snapshot, -EIO if it is damaged
+int storage_mount_snapshot(int snapshot_id);
+
+//Checks if the storage is read only (a snapshot is mounted), anything that would change it fails with -EROFS
+//Returns 1 if it is, 0 if not
+int storage_read_only();
+
+//Serializes access to the image between the FUSE callbacks and background workers (recursive)
+void storage_lock();
+void storage_unlock();
+
 int storage_stat(const char *path, struct stat *st);
+int storage_stat_inode(int inode_i, struct stat *st);
+//Fills [st] with the size of the image and how much of it is free, from the free block summary
+//Returns 0
+int storage_statfs(struct statvfs *st);
+
+//Writes everything that changed out to the backing files of the image and waits for them to have it
+//Returns 0 on success, -EIO on failure
+int storage_fsync();
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
+//Reads/writes move [size] bytes at [offset] (reads stop at the end of the file)
+//Returns the number of bytes moved on success, a negative errno on failure
 int storage_get_data(const char *path, const char *buf_read_from, char *buf_write_to, size_t size, off_t offset, int readOrWrite);
+//Reads/writes through the handle [inode_i] taken by storage_open, which skips resolving the path on every call
+//Returns the number of bytes moved on success, -EBADF if it isn't an open handle, a negative errno on failure
+int storage_read_handle(int inode_i, char *buf, size_t size, off_t offset);
+int storage_write_handle(int inode_i, const char *buf, size_t size, off_t offset);
+//Sets the size of the file at [path], cutting it short or growing it with a hole that reads as zeros
+//Returns 0 on success, -ENOENT if there is no such file, -EINVAL for a negative size, -EFBIG for a size
+//past what the block map can hold, -ENOSPC if there are no blocks left, -EROFS on a read only mount
 int storage_truncate(const char *path, off_t size);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
+int storage_rmdir(const char *path);
 int storage_link(const char *from, const char *to);
+//Moves the entry at [from] to [to], replacing an existing [to] of the same kind (a directory only if it is empty)
+//Returns 0 on success, a negative errno on failure, both names are left as they were then
 int storage_rename(const char *from, const char *to);
+//Makes [length] bytes at [to_offset] of the file at [to] share the blocks holding [length] bytes at
+//[from_offset] of the file at [from], instead of copying them. All three have to be block aligned,
+//except a [length] that runs to the end of [from] and past the end of [to]. A [length] of 0 means up
+//to the end of [from], and 0 / 0 / 0 turns [to] into a whole copy of [from], whatever its size
+//Returns 0 on success, -EFBIG if the range would end past what the block map of [to] can hold, a negative
+//errno on other failures
+int storage_clone(const char *to, const char *from, off_t from_offset, off_t length, off_t to_offset);
+
+//Makes sure [length] bytes at [offset] of the file at [path] have blocks behind them, growing it to cover
+//them unless [mode] has FALLOC_FL_KEEP_SIZE. With FALLOC_FL_PUNCH_HOLE (and FALLOC_FL_KEEP_SIZE) the
+//range is turned into a hole instead, giving back the blocks it covers whole
+//Returns 0 on success, a negative errno on failure
+int storage_fallocate(const char *path, int mode, off_t offset, off_t length);
+
+//Opens a handle on the inode at [path] so it outlives its last unlink until released
+//Returns the inode index on success, -ENOENT on failure
+int storage_open(const char *path);
+//Picks how the kernel caches the handle on [inode_i] that storage_open just handed out, and counts this open
+//as the last one the kernel cached the data from
+//Returns STORAGE_OPEN_DIRECT_IO for files opened around the page cache, STORAGE_OPEN_KEEP_CACHE if nothing
+//changed the data since the last open, 0 if the kernel has to drop what it cached
+int storage_open_cache_policy(int inode_i);
+
+//Flags the regular file at [path] to be opened around the page cache (or not), handles already open stay as
+//they were
+//Returns 0 on success, -ENOENT if there is no such file, -EINVAL if it isn't a regular file, -EROFS on a
+//read only mount
+int storage_set_file_direct_io(const char *path, int enabled);
+
+//Releases a handle taken by storage_open on [inode_i]
+int storage_release(int inode_i);
 int storage_set_time(const char *path, const struct timespec ts[2]);
+//Changes the permission bits of [path] to those of [mode], the file type stays
+//Returns 0 on success, -ENOENT if there is no such file, -EROFS on a read only mount
+int storage_chmod(const char *path, int mode);
+
+//Makes a symlink at [path] pointing at [target], see inode__write_link
+//Returns 0 on success, a negative errno on failure
+int storage_symlink(const char *target, const char *path);
+//Reads the target of the symlink at [path] into [buf], NUL terminated and cut short to fit in [size] bytes
+//Returns 0 on success, -EINVAL if it isn't a symlink, a negative errno on failure
+int storage_readlink(const char *path, char *buf, size_t size);
+
+//Extended attributes of the file at [path], see neat_xattr.h
+//Returns what the xattr__ call does, -ENOENT if there is no such file, -EROFS for changes to a snapshot
+int storage_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+int storage_getxattr(const char *path, const char *name, char *value, size_t size);
+int storage_listxattr(const char *path, char *list, size_t size);
+int storage_removexattr(const char *path, const char *name);
 #endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "neat_trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_FILE_NAME "neat_trace.c // "
+
+static FILE *trace_file = NULL;
+static char *trace_buffer = NULL;
+static long long trace_start_ns = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_int next_thread_id;
+static __thread int thread_id = -1;
+
+int trace__start(const char *path){
+    FILE *file = fopen(path, "w");
+    if (file == NULL){
+        printf("%sERROR: can't create the trace file %s\n", TRACE_FILE_NAME, path);
+        return -1;
+    }
+    trace_buffer = malloc(TRACE_BUFFER_SIZE);
+    setvbuf(file, trace_buffer, _IOFBF, TRACE_BUFFER_SIZE);
+
+    neat_trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, sizeof(neat_trace_record_t)};
+    fwrite(&header, sizeof(header), 1, file);
+
+    trace_start_ns = stats__now_ns();
+    atomic_store(&next_thread_id, 0);
+    trace_file = file;
+    printf("%srecording a trace into %s\n", TRACE_FILE_NAME, path);
+    return 0;
+}
+
+void trace__stop(){
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL){
+        fclose(trace_file);
+        free(trace_buffer);
+        trace_file = NULL;
+        trace_buffer = NULL;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static uint16_t trace__path_len(const char *path){
+    if (path == NULL){
+        return 0;
+    }
+    size_t length = strlen(path);
+    return length < TRACE_PATH_MAX ? length : TRACE_PATH_MAX;
+}
+
+void trace__record(stats_op_t op, long long start_ns, const char *path, const char *path2,
+                   int64_t offset, uint32_t size, int32_t arg, int32_t rv){
+    if (trace_file == NULL || (path != NULL && strcmp(path, NUFS_STATS_PATH) == 0)){
+        return;
+    }
+    long long now_ns = stats__now_ns();
+    if (thread_id < 0){
+        thread_id = atomic_fetch_add(&next_thread_id, 1);
+    }
+
+    neat_trace_record_t record = {
+        .start_ns = start_ns - trace_start_ns,
+        .offset = offset,
+        .size = size,
+        .duration_ns = now_ns - start_ns < UINT32_MAX ? now_ns - start_ns : UINT32_MAX,
+        .arg = arg,
+        .rv = rv,
+        .path_len = trace__path_len(path),
+        .path2_len = trace__path_len(path2),
+        .thread = thread_id,
+        .op = op,
+    };
+
+    //one record at a time, so they never interleave, the file buffer makes this a memcpy most of the time
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL){
+        fwrite(&record, sizeof(record), 1, trace_file);
+        fwrite(path, 1, record.path_len, trace_file);
+        fwrite(path2, 1, record.path2_len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+int trace__read_header(FILE *file){
+    neat_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0){
+        printf("%sERROR: not a nufs trace\n", TRACE_FILE_NAME);
+        return -1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(neat_trace_record_t)){
+        printf("%sERROR: trace version %u isn't supported\n", TRACE_FILE_NAME, header.version);
+        return -1;
+    }
+    return 0;
+}
+
+int trace__read_record(FILE *file, neat_trace_record_t *record, char *path, char *path2){
+    size_t got = fread(record, 1, sizeof(*record), file);
+    if (got == 0 && feof(file)){
+        return 0;
+    }
+    if (got != sizeof(*record) || record->op >= STATS_OP_COUNT
+        || record->path_len > TRACE_PATH_MAX || record->path2_len > TRACE_PATH_MAX
+        || fread(path, 1, record->path_len, file) != record->path_len
+        || fread(path2, 1, record->path2_len, file) != record->path2_len){
+        printf("%sERROR: the trace is cut short or damaged\n", TRACE_FILE_NAME);
+        return -1;
+    }
+    path[record->path_len] = '\0';
+    path2[record->path2_len] = '\0';
+    return 1;
+}
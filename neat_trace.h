@@ -0,0 +1,58 @@
+#ifndef NEAT_TRACE_H
+#define NEAT_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "neat_stats.h"
+
+//A trace is a header followed by one record per FUSE call, in the order the calls finished. Each record is
+//a fixed size part and then its path (and second path, if any) without a trailing NUL. All of it is in host
+//byte order, a trace is only meant to be replayed on the kind of machine it was recorded on.
+#define TRACE_MAGIC "NUFSTRC"
+#define TRACE_VERSION 1
+//Records are buffered this much before they go out to the file
+#define TRACE_BUFFER_SIZE (1 << 20)
+//Longest path (or second path) a record keeps, longer ones are cut short
+#define TRACE_PATH_MAX 4096
+
+typedef struct neat_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   //sizeof(neat_trace_record_t) when it was recorded
+} neat_trace_header_t;
+
+typedef struct neat_trace_record {
+    int64_t start_ns;       //since the trace started
+    int64_t offset;         //read / write / fallocate offset, the handle for open / release
+    uint32_t size;          //bytes asked for, the new size for truncate, the length for fallocate
+    uint32_t duration_ns;   //how long the call took when it was recorded
+    int32_t arg;            //mode for mknod / mkdir / chmod, flags for setxattr, mode for fallocate, cmd for ioctl
+    int32_t rv;             //what the call returned
+    uint16_t path_len;
+    uint16_t path2_len;     //other side of link / rename, symlink target, xattr name
+    uint16_t thread;        //small id of the FUSE thread that made the call, in order of first appearance
+    uint8_t op;             //a stats_op_t
+    uint8_t reserved;
+} neat_trace_record_t;
+
+//Starts recording into a new trace file at [path]
+//Returns 0 on success, -1 on failure
+int trace__start(const char *path);
+
+//Flushes the buffered records and closes the trace file
+void trace__stop();
+
+//Records one call of [op] that started at [start_ns] (from stats__now_ns) on [path] and [path2] (NULL if the op
+//only has one), does nothing unless a trace is being recorded
+void trace__record(stats_op_t op, long long start_ns, const char *path, const char *path2,
+                   int64_t offset, uint32_t size, int32_t arg, int32_t rv);
+
+//Reads and checks the header of the trace in [file]
+//Returns 0 on success, -1 if it isn't a trace this build can read
+int trace__read_header(FILE *file);
+
+//Reads the next record of the trace in [file] into [record], its paths into [path] and [path2]
+//(TRACE_PATH_MAX + 1 bytes each, NUL terminated)
+//Returns 1 on success, 0 at the end of the trace, -1 if it is cut short or damaged
+int trace__read_record(FILE *file, neat_trace_record_t *record, char *path, char *path2);
+#endif
@@ -0,0 +1,450 @@
+#include "neat_xattr.h"
+#include "neat_dedup.h"
+#include "neat_checksum.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/xattr.h>
+
+#define XATTR_FILE_NAME "neat_xattr.c // "
+
+//every entry an inode can hold, the inline area and the xattr block back to back
+#define XATTR_LIST_MAX (NEAT_INODE_XATTR_INLINE + BLOCK_SIZE)
+
+//FNV-1a over the [name_len] bytes of [name]
+static uint32_t xattr__hash(const char *name, int name_len){
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < name_len; i++){
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//Gets the bytes an entry with a [name_len] byte name and [inline_len] bytes of value after it takes up
+static int xattr__entry_len(int name_len, int inline_len){
+    return (sizeof(neat_xattr_t) + name_len + inline_len + 3) & ~3;
+}
+
+static int xattr__valid_block(int block_i){
+    return block_i >= INODE_FIRST_DATA_BLOCK && block_i < BLOCK_COUNT;
+}
+
+//Checks if the value of [entry] sits in a run of data blocks that fits in the image
+static int xattr__valid_run(neat_xattr_t *entry){
+    return xattr__valid_block(entry->value_block)
+           && entry->value_block + inode__blocks_for_size(entry->value_len) <= BLOCK_COUNT;
+}
+
+//Gets the entry at [offset] of the list in the [cap] bytes at [area]
+//Returns the entry on success, NULL at the end of the list (or where it stops making sense)
+static neat_xattr_t *xattr__entry_at(char *area, int cap, int offset){
+    if (offset + (int) sizeof(neat_xattr_t) > cap){
+        return NULL;
+    }
+
+    neat_xattr_t *entry = (neat_xattr_t *)(area + offset);
+    if (entry->entry_len == 0 || entry->entry_len % 4 != 0 || offset + entry->entry_len > cap
+        || entry->name_len == 0 || entry->value_len < 0 || entry->value_len > NEAT_XATTR_VALUE_MAX){
+        return NULL;
+    }
+    int inline_len = entry->value_block < 0 ? entry->value_len : 0;
+    return xattr__entry_len(entry->name_len, inline_len) <= entry->entry_len ? entry : NULL;
+}
+
+//Checks if the xattr block of [inode] fails its checksum, its entries can't be trusted then
+//Returns 1 if it is damaged, 0 if it matches (or there is none)
+static int xattr__damaged(neat_inode_t *inode){
+    if (xattr__valid_block(inode->xattr_i) && checksum__verify(inode->xattr_i) != 0){
+        printf("%sERROR: xattr block %d of inode %d is damaged\n", XATTR_FILE_NAME, inode->xattr_i, inode->inode_i);
+        return 1;
+    }
+    return 0;
+}
+
+//Gets area [area_i] of the entries of [inode]: 0 is the inline one, 1 the xattr block
+//Returns the start of the area and stores its size in [cap], NULL if [inode] has no such area (or its xattr
+//block fails its checksum)
+static char *xattr__area(neat_inode_t *inode, int area_i, int *cap){
+    if (area_i == 0){
+        *cap = NEAT_INODE_XATTR_INLINE;
+        return inode->xattrs;
+    }
+    if (area_i == 1 && xattr__valid_block(inode->xattr_i) && checksum__verify(inode->xattr_i) == 0){
+        *cap = BLOCK_SIZE;
+        return blocks_get_block(inode->xattr_i);
+    }
+    return NULL;
+}
+
+//Steps through the entries of [inode], the inline ones first, starting from 0 in both [area_i] and [offset]
+//Returns the next entry, NULL once there are none left
+static neat_xattr_t *xattr__next(neat_inode_t *inode, int *area_i, int *offset){
+    while (*area_i < 2){
+        int cap;
+        char *area = xattr__area(inode, *area_i, &cap);
+        neat_xattr_t *entry = area != NULL ? xattr__entry_at(area, cap, *offset) : NULL;
+        if (entry != NULL){
+            *offset += entry->entry_len;
+            return entry;
+        }
+        (*area_i)++;
+        *offset = 0;
+    }
+    return NULL;
+}
+
+//Gets the value of [entry]
+//Returns the value on success, NULL if its run of blocks is invalid or fails its checksums
+static char *xattr__value(neat_xattr_t *entry){
+    if (entry->value_block >= 0){
+        if (!xattr__valid_run(entry)){
+            return NULL;
+        }
+        for (int i = 0; i < inode__blocks_for_size(entry->value_len); i++){
+            if (checksum__verify(entry->value_block + i) != 0){
+                printf("%sERROR: block %d of an xattr value is damaged\n", XATTR_FILE_NAME, entry->value_block + i);
+                return NULL;
+            }
+        }
+        //the run is contiguous, so the image already holds the value in one piece
+        return blocks_get_block(entry->value_block);
+    }
+    return (char *)(entry + 1) + entry->name_len;
+}
+
+//Looks up the attribute [name] of [inode], checking the name hash before comparing any names
+//Returns the entry on success, NULL if there is none
+static neat_xattr_t *xattr__find(neat_inode_t *inode, const char *name){
+    int name_len = strlen(name);
+    uint32_t hash = xattr__hash(name, name_len);
+
+    int area_i = 0;
+    int offset = 0;
+    neat_xattr_t *entry;
+    while ((entry = xattr__next(inode, &area_i, &offset)) != NULL){
+        if (entry->hash == hash && entry->name_len == name_len && memcmp(entry + 1, name, name_len) == 0){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+//Gives back the run of blocks at [block_i] holding a value of [value_len] bytes
+static void xattr__free_run(int block_i, int value_len){
+    int run[NEAT_XATTR_VALUE_MAX / BLOCK_SIZE];
+    int run_length = inode__blocks_for_size(value_len);
+    for (int i = 0; i < run_length; i++){
+        run[i] = block_i + i;
+    }
+    free_blocks(run, run_length);
+}
+
+//Copies every entry of [inode] except [skip] into [list]
+//Returns the number of bytes copied
+static int xattr__gather(neat_inode_t *inode, neat_xattr_t *skip, char *list){
+    int length = 0;
+    int area_i = 0;
+    int offset = 0;
+    neat_xattr_t *entry;
+    while ((entry = xattr__next(inode, &area_i, &offset)) != NULL){
+        if (entry != skip){
+            memcpy(list + length, entry, entry->entry_len);
+            length += entry->entry_len;
+        }
+    }
+    return length;
+}
+
+//Rewrites the attributes of [inode] from the [length] bytes of entries in [list]: inline as far as they fit,
+//the rest into a new xattr block, or one already holding exactly the same
+//Returns 0 on success, -ENOSPC if they don't fit or there is no block for them (nothing is changed then)
+static int xattr__store(neat_inode_t *inode, char *list, int length){
+    char inline_area[NEAT_INODE_XATTR_INLINE] = {0};
+    char block[BLOCK_SIZE] = {0};
+    int inline_used = 0;
+    int block_used = 0;
+    int has_runs = 0;
+
+    for (int offset = 0; offset < length; ){
+        neat_xattr_t *entry = (neat_xattr_t *)(list + offset);
+        if (inline_used + entry->entry_len <= NEAT_INODE_XATTR_INLINE){
+            memcpy(inline_area + inline_used, entry, entry->entry_len);
+            inline_used += entry->entry_len;
+        }
+        else if (block_used + entry->entry_len <= BLOCK_SIZE){
+            memcpy(block + block_used, entry, entry->entry_len);
+            block_used += entry->entry_len;
+            has_runs |= entry->value_block >= 0;
+        }
+        else {
+            printf("%sERROR: the attributes of inode %d don't fit in a block\n", XATTR_FILE_NAME, inode->inode_i);
+            return -ENOSPC;
+        }
+        offset += entry->entry_len;
+    }
+
+    int xattr_i = -1;
+    if (block_used > 0){
+        //a block pointing at value runs is the only owner of those runs, so only the others are shared
+        uint32_t fingerprint = has_runs ? 0 : dedup__hash(block);
+        xattr_i = has_runs ? -1 : dedup__find(fingerprint, block);
+        if (xattr_i >= 0 && share_block(xattr_i) != 0){
+            xattr_i = -1;
+        }
+        if (xattr_i < 0){
+            xattr_i = alloc_block();
+            if (xattr_i < 0){
+                return -ENOSPC;
+            }
+            memcpy(blocks_get_block(xattr_i), block, BLOCK_SIZE);
+            checksum__seal(xattr_i);
+            if (!has_runs){
+                dedup__remember(xattr_i, fingerprint);
+            }
+        }
+    }
+
+    //the old block is never written to, whoever else points at it keeps seeing it as it was
+    if (xattr__valid_block(inode->xattr_i)){
+        free_block(inode->xattr_i);
+    }
+    inode->xattr_i = xattr_i;
+    memcpy(inode->xattrs, inline_area, NEAT_INODE_XATTR_INLINE);
+    return 0;
+}
+
+int xattr__get(neat_inode_t *inode, const char *name, char *value, size_t size){
+    if (xattr__damaged(inode)){
+        return -EIO;
+    }
+    neat_xattr_t *entry = xattr__find(inode, name);
+    if (entry == NULL){
+        return -ENODATA;
+    }
+    if (size == 0){
+        return entry->value_len;
+    }
+    if (size < (size_t) entry->value_len){
+        return -ERANGE;
+    }
+
+    char *stored = xattr__value(entry);
+    if (stored == NULL){
+        return -EIO;
+    }
+    memcpy(value, stored, entry->value_len);
+    return entry->value_len;
+}
+
+int xattr__set(neat_inode_t *inode, const char *name, const char *value, size_t size, int flags){
+    int name_len = strlen(name);
+    if (name_len == 0 || name_len > NEAT_XATTR_NAME_MAX){
+        return -ERANGE;
+    }
+    if (size > NEAT_XATTR_VALUE_MAX){
+        return -E2BIG;
+    }
+    //rewriting the list would drop whatever the damaged block still holds for good
+    if (xattr__damaged(inode)){
+        return -EIO;
+    }
+
+    neat_xattr_t *old = xattr__find(inode, name);
+    if (old != NULL && (flags & XATTR_CREATE)){
+        return -EEXIST;
+    }
+    if (old == NULL && (flags & XATTR_REPLACE)){
+        return -ENODATA;
+    }
+    //the old entry lives in the areas getting rewritten, so what it held has to be noted first
+    int old_run_i = old != NULL ? old->value_block : -1;
+    int old_len = old != NULL ? old->value_len : 0;
+
+    char list[XATTR_LIST_MAX];
+    int length = xattr__gather(inode, old, list);
+    int own_blocks = size > NEAT_XATTR_OWN_BLOCKS_MIN;
+    int entry_len = xattr__entry_len(name_len, own_blocks ? 0 : size);
+    if (length + entry_len > XATTR_LIST_MAX){
+        return -ENOSPC;
+    }
+
+    neat_xattr_t *entry = (neat_xattr_t *)(list + length);
+    memset(entry, 0, entry_len);
+    entry->hash = xattr__hash(name, name_len);
+    entry->name_len = name_len;
+    entry->entry_len = entry_len;
+    entry->value_len = size;
+    entry->value_block = -1;
+    memcpy(entry + 1, name, name_len);
+    if (own_blocks){
+        entry->value_block = alloc_block_run(inode__blocks_for_size(size));
+        if (entry->value_block < 0){
+            printf("%sERROR: no run of blocks for a %zu byte value\n", XATTR_FILE_NAME, size);
+            return -ENOSPC;
+        }
+        memcpy(blocks_get_block(entry->value_block), value, size);
+        for (int i = 0; i < inode__blocks_for_size(size); i++){
+            checksum__seal(entry->value_block + i);
+        }
+    }
+    else {
+        memcpy((char *)(entry + 1) + name_len, value, size);
+    }
+
+    int new_run_i = entry->value_block;
+    int rv = xattr__store(inode, list, length + entry_len);
+    if (rv != 0){
+        if (new_run_i >= 0){
+            xattr__free_run(new_run_i, size);
+        }
+        return rv;
+    }
+    if (old_run_i >= 0){
+        xattr__free_run(old_run_i, old_len);
+    }
+    return 0;
+}
+
+int xattr__remove(neat_inode_t *inode, const char *name){
+    if (xattr__damaged(inode)){
+        return -EIO;
+    }
+    neat_xattr_t *old = xattr__find(inode, name);
+    if (old == NULL){
+        return -ENODATA;
+    }
+    int old_run_i = old->value_block;
+    int old_len = old->value_len;
+
+    char list[XATTR_LIST_MAX];
+    int rv = xattr__store(inode, list, xattr__gather(inode, old, list));
+    if (rv == 0 && old_run_i >= 0){
+        xattr__free_run(old_run_i, old_len);
+    }
+    return rv;
+}
+
+int xattr__list(neat_inode_t *inode, char *list, size_t size){
+    if (xattr__damaged(inode)){
+        return -EIO;
+    }
+    size_t length = 0;
+    int area_i = 0;
+    int offset = 0;
+    neat_xattr_t *entry;
+    while ((entry = xattr__next(inode, &area_i, &offset)) != NULL){
+        if (size != 0 && length + entry->name_len + 1 > size){
+            return -ERANGE;
+        }
+        if (size != 0){
+            memcpy(list + length, entry + 1, entry->name_len);
+            list[length + entry->name_len] = '\0';
+        }
+        length += entry->name_len + 1;
+    }
+    return length;
+}
+
+int xattr__held_blocks(neat_inode_t *inode, int *held, int max){
+    int held_count = 0;
+    if (xattr__valid_block(inode->xattr_i) && held_count < max){
+        held[held_count++] = inode->xattr_i;
+    }
+
+    int area_i = 0;
+    int offset = 0;
+    neat_xattr_t *entry;
+    while ((entry = xattr__next(inode, &area_i, &offset)) != NULL){
+        if (entry->value_block < 0 || !xattr__valid_run(entry)){
+            continue;
+        }
+        int run_length = inode__blocks_for_size(entry->value_len);
+        for (int i = 0; i < run_length && held_count < max; i++){
+            held[held_count++] = entry->value_block + i;
+        }
+    }
+    return held_count;
+}
+
+int xattr__move_runs(neat_inode_t *inode, int first_block_i, int block_count){
+    //a shared xattr block (and the runs it points at) belongs to a snapshot as much as to [inode]
+    if (xattr__valid_block(inode->xattr_i) && block_is_shared(inode->xattr_i)){
+        return 0;
+    }
+
+    int moved = 0;
+    int block_changed = 0;
+    int area_i = 0;
+    int offset = 0;
+    neat_xattr_t *entry;
+    while (moved >= 0 && (entry = xattr__next(inode, &area_i, &offset)) != NULL){
+        if (entry->value_block < 0 || !xattr__valid_run(entry)){
+            continue;
+        }
+        int run_length = inode__blocks_for_size(entry->value_len);
+        int in_range = entry->value_block < first_block_i + block_count && entry->value_block + run_length > first_block_i;
+        for (int i = 0; in_range && i < run_length; i++){
+            in_range = !block_is_shared(entry->value_block + i);
+        }
+        if (!in_range){
+            continue;
+        }
+
+        int run_i = alloc_block_run_unzeroed(run_length);
+        if (run_i >= 0 && run_i < first_block_i + block_count && run_i + run_length > first_block_i){
+            //nowhere else to go, moving the run within the range gets nothing back
+            xattr__free_run(run_i, entry->value_len);
+            run_i = -1;
+        }
+        if (run_i < 0){
+            moved = -1;
+            break;
+        }
+        memcpy(blocks_get_block(run_i), blocks_get_block(entry->value_block), run_length * BLOCK_SIZE);
+        //the data is the same, so its checksums still hold
+        for (int i = 0; i < run_length; i++){
+            get_block_checksums()[run_i + i] = get_block_checksums()[entry->value_block + i];
+        }
+        xattr__free_run(entry->value_block, entry->value_len);
+        entry->value_block = run_i;
+        block_changed |= area_i == 1;
+        moved += run_length;
+    }
+
+    //nobody else points at the block, so it is changed in place (whoever moves it next copies it as it is now)
+    if (block_changed){
+        checksum__seal(inode->xattr_i);
+    }
+    return moved;
+}
+
+int xattr__check(neat_inode_t *inode){
+    if (inode->xattr_i != -1 && !xattr__valid_block(inode->xattr_i)){
+        return -1;
+    }
+    if (xattr__damaged(inode)){
+        return -1;
+    }
+
+    for (int area_i = 0; area_i < 2; area_i++){
+        int cap;
+        char *area = xattr__area(inode, area_i, &cap);
+        int offset = 0;
+        //the list ends at a zero entry length or where the area can't hold another header, anything else is damage
+        while (area != NULL && offset + (int) sizeof(neat_xattr_t) <= cap
+               && ((neat_xattr_t *)(area + offset))->entry_len != 0){
+            neat_xattr_t *entry = xattr__entry_at(area, cap, offset);
+            if (entry == NULL || (entry->value_block != -1 && !xattr__valid_run(entry))
+                || entry->hash != xattr__hash((char *)(entry + 1), entry->name_len)){
+                return -1;
+            }
+            offset += entry->entry_len;
+        }
+    }
+    return 0;
+}
+
+void xattr__clear(neat_inode_t *inode){
+    inode->xattr_i = -1;
+    memset(inode->xattrs, 0, NEAT_INODE_XATTR_INLINE);
+}
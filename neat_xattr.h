@@ -0,0 +1,66 @@
+#ifndef NEAT_XATTR_H
+#define NEAT_XATTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "blocks.h"
+#include "neat_inode.h"
+
+//Extended attributes of an inode live in its inline area first, then in its xattr block. Both hold the same
+//list of entries back to back, each a header, the name and (unless it has blocks of its own) the value.
+//An xattr block without values in blocks of their own is fingerprinted like a dedup'd data block, so inodes
+//tagged with the same attributes end up pointing at one shared block.
+typedef struct neat_xattr {
+    uint32_t hash;          //of the name, compared before the name itself is
+    uint16_t name_len;
+    uint16_t entry_len;     //bytes the whole entry takes up (a multiple of 4), 0 ends the list
+    int value_len;
+    int value_block;        //first block of the run holding the value, -1 if the value follows the name
+} neat_xattr_t;
+
+//Longest name and value, as on linux
+#define NEAT_XATTR_NAME_MAX 255
+#define NEAT_XATTR_VALUE_MAX (16 * BLOCK_SIZE)
+//Values longer than this get a run of blocks of their own instead of crowding the xattr block
+#define NEAT_XATTR_OWN_BLOCKS_MIN (BLOCK_SIZE / 4)
+
+//Gets the value of the attribute [name] of [inode] into [value], [size] 0 only asks for its length
+//Returns the value length on success, -ENODATA if there is no such attribute, -ERANGE if [size] is too small,
+//-EIO if the xattr block or the blocks of the value fail their checksums
+int xattr__get(neat_inode_t *inode, const char *name, char *value, size_t size);
+
+//Sets the attribute [name] of [inode] to [size] bytes of [value], [flags] can hold XATTR_CREATE or XATTR_REPLACE
+//Returns 0 on success, -EEXIST / -ENODATA if [flags] don't allow it, -ERANGE if the name is too long,
+//-E2BIG if the value is, -ENOSPC if there is no room left (the attributes are left as they were), -EIO if the
+//xattr block fails its checksum
+int xattr__set(neat_inode_t *inode, const char *name, const char *value, size_t size, int flags);
+
+//Removes the attribute [name] of [inode]
+//Returns 0 on success, -ENODATA if there is no such attribute, -ENOSPC if the rest doesn't fit anymore, -EIO if
+//the xattr block fails its checksum
+int xattr__remove(neat_inode_t *inode, const char *name);
+
+//Lists the attribute names of [inode] into [list] one after the other, each ending in a NUL,
+//[size] 0 only asks for the length of the list
+//Returns the list length on success, -ERANGE if [size] is too small, -EIO if the xattr block fails its checksum
+int xattr__list(neat_inode_t *inode, char *list, size_t size);
+
+//Gathers every block the attributes of [inode] hold (the xattr block and the runs of its values)
+//into [held], at most [max] of them
+//Returns the number of blocks gathered
+int xattr__held_blocks(neat_inode_t *inode, int *held, int max);
+
+//Moves every value run of [inode] with a block among the [block_count] blocks from [first_block_i] to a new run
+//outside them, for the cleaner. Runs shared with a snapshot stay where they are
+//Returns the number of blocks moved, -1 if there was no room for a run outside them (the runs moved until
+//then stay moved)
+int xattr__move_runs(neat_inode_t *inode, int first_block_i, int block_count);
+
+//Checks that the attributes of [inode] are well formed, only point at data blocks and that the xattr block
+//matches its checksum
+//Returns 0 if they are, -1 if not
+int xattr__check(neat_inode_t *inode);
+
+//Forgets every attribute of [inode] without giving back the blocks they held
+void xattr__clear(neat_inode_t *inode);
+#endif
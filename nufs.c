@@ -4,7 +4,14 @@
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,9 +23,81 @@
 #include "neat_storage.h"
 #include "neat_directory.h"
 #include "neat_inode.h"
+#include "neat_defrag.h"
+#include "neat_cleaner.h"
+#include "neat_stats.h"
+#include "neat_dedup.h"
+#include "neat_snapshot.h"
+#include "neat_checksum.h"
+#include "neat_trace.h"
 
 #define NUFS_FILE_NAME "nufs.c // "
 
+// Let the kernel keep lookups and attributes around instead of asking on every
+// operation. Every change goes through this mount, so the kernel drops its own
+// cached copies whenever it sends us one. Anything given with -o still wins.
+#define NUFS_DEFAULT_CACHE_OPTS "-oentry_timeout=5,attr_timeout=5,negative_timeout=1,use_ino"
+
+// Without big_writes every write comes in 4K at a time, each one a round trip
+// through the kernel and the storage lock. Ask for up to 1MB per read and write,
+// libfuse and the kernel cut that down to what they can do (128K for FUSE 2).
+// Lower it with -o max_write=N / -o max_read=N.
+#define NUFS_DEFAULT_IO_OPTS "-obig_writes,max_write=1048576,max_read=1048576"
+
+// Mount options of our own, everything else goes on to FUSE.
+//   -o compress   compress files once their last handle is closed
+//   -o dedup      share identical blocks written in full instead of storing them twice
+//   -o log        append every block that gets written at the head of a log (see blocks.h) instead of
+//                 writing it in place, with a cleaner freeing whole segments up while idle
+//   -o checksum   checksum blocks as they are written, check them on read and scrub the image while idle
+//   -o snapshot=N mount snapshot N (see neat_snapshot.h) read only instead of the live files
+//   -o trace=FILE record every call into FILE (see neat_trace.h) for nufs-replay
+//   -o stripe=N   stripe unit in blocks (a power of two) of a new image made of several files, given as
+//                 one comma separated image path
+//   -o memory     keep the image in memory only, starting out as a copy of the image file if it exists
+//   -o persist    with -o memory, write the image back at unmount and whenever SIGUSR1 arrives
+//   -o direct_io  open every file around the kernel page cache, for files that are streamed through once
+//                 (taken in place of the FUSE option of the same name, single files can be flagged with
+//                 the NUFS_IOC_DIRECT_IO ioctl instead)
+struct nufs_options {
+  int compress;
+  int dedup;
+  int log;
+  int checksum;
+  int snapshot;
+  int stripe;
+  char *trace;
+  int memory;
+  int persist;
+  int direct_io;
+};
+
+static struct fuse_opt nufs_opts[] = {
+  {"compress", offsetof(struct nufs_options, compress), 1},
+  {"dedup", offsetof(struct nufs_options, dedup), 1},
+  {"log", offsetof(struct nufs_options, log), 1},
+  {"checksum", offsetof(struct nufs_options, checksum), 1},
+  {"snapshot=%d", offsetof(struct nufs_options, snapshot), 0},
+  {"stripe=%d", offsetof(struct nufs_options, stripe), 0},
+  {"trace=%s", offsetof(struct nufs_options, trace), 0},
+  {"memory", offsetof(struct nufs_options, memory), 1},
+  {"persist", offsetof(struct nufs_options, persist), 1},
+  {"direct_io", offsetof(struct nufs_options, direct_io), 1},
+  FUSE_OPT_END
+};
+
+// Where a memory-only image gets written back to, NULL if it doesn't.
+static const char *persist_path = NULL;
+static pthread_t persist_thread;
+// Set once nufs_init got the persist thread going, there is nothing to stop or join otherwise.
+static int persist_started = 0;
+static atomic_int persist_stop;
+
+// The stats file only exists in here, it never touches the image.
+static int nufs_is_stats_path(const char *path) {
+  return strcmp(path, NUFS_STATS_PATH) == 0;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
@@ -30,12 +109,17 @@ int nufs_access(const char *path, int mask) {
   //W_OK = if the file exists and grants write access
   //X_OK = if the file exists and grants execute permissions
 
+  long long start_ns = stats__now_ns();
   int rv = 0;
   
+  storage_lock();
   int inode_i = dir__inode_i_from_path(path);
-  if (inode_i < 0){
+  if (nufs_is_stats_path(path)){
+    rv = mask & (W_OK | X_OK) ? -EACCES : 0;
+  }
+  else if (inode_i < 0){
     dir__print_error__inode_i_from_path(NUFS_FILE_NAME, "nufs_access inode", path);
-    rv = -ENOENT;
+    rv = dir__lookup_errno(inode_i);
   }
 
   else if (mask != F_OK){
@@ -45,7 +129,10 @@ int nufs_access(const char *path, int mask) {
     neat_inode_t *inode = inode__get_inode(inode_i);
     rv = inode->mode & mask == mask ? rv : -EACCES;
   }
+  storage_unlock();
   printf("access(%s, %04o) -> %d\n", path, mask, rv);
+  stats__record_op(STATS_OP_ACCESS, start_ns, 0);
+  trace__record(STATS_OP_ACCESS, start_ns, path, NULL, 0, 0, mask, rv);
   return rv;
 }
 
@@ -53,17 +140,41 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
+  long long start_ns = stats__now_ns();
+  int rv = 0;
 
-  if (strcmp(path, "/hello.txt") == 0) {
-    st->st_mode = 0100644; // regular file
-    st->st_size = 6;
+  storage_lock();
+  if (nufs_is_stats_path(path)){
+    //size 0 like a /proc file, the contents only exist once it is opened
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_ino = inode__get_inode_count() + 1;
     st->st_uid = getuid();
-    return 0;
+    st->st_gid = getgid();
   }
-
-  int rv = storage_stat(path, st);
+  else {
+    rv = storage_stat(path, st);
+  }
+  storage_unlock();
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
          st->st_size);
+  stats__record_op(STATS_OP_GETATTR, start_ns, 0);
+  trace__record(STATS_OP_GETATTR, start_ns, path, NULL, 0, 0, 0, rv);
+  return rv;
+}
+
+// Reports the size of the filesystem and how much of it is free.
+// Implementation for: man 2 statfs
+int nufs_statfs(const char *path, struct statvfs *st) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_statfs(st);
+  storage_unlock();
+  printf("statfs(%s) -> (%d) {free blocks: %ld, free inodes: %ld}\n", path, rv, (long) st->f_bfree,
+         (long) st->f_ffree);
+  stats__record_op(STATS_OP_STATFS, start_ns, 0);
+  trace__record(STATS_OP_STATFS, start_ns, path, NULL, 0, 0, 0, rv);
   return rv;
 }
 
@@ -74,53 +185,45 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   
   //doesn't look like I need to worry about the offset and fi...
   
+  long long start_ns = stats__now_ns();
   int rv = 0;
   struct stat st;
-  rv = storage_stat("/", &st);
-  if (rv != 0){
-    printf("Error in nufs readdir with storage_stat...\n");
-    rv = -ENOENT;
-  }
-  filler(buf, ".", &st, 0);
-  printf("\nstarted readdir...\n\n");
+  storage_lock();
   int inode_i = dir__inode_i_from_path(path);
   if (inode_i < 0){
     dir__print_error__inode_i_from_path(NUFS_FILE_NAME, "nufs_readdir inode", path);
-    rv = -ENOENT;
+    rv = dir__lookup_errno(inode_i);
   }
-  neat_inode_t *inode = inode__get_inode(inode_i);
-
-  int dir_content_count = inode->size / sizeof(neat_dir_t);
-
-  for(int i = 0; i < dir_content_count; i++){
-    neat_dir_t *dir = (neat_dir_t *)blocks_get_block(inode->block_i) + i;
-    if (dir == NULL){
-      rv = -ENOENT;
-      break;
-    }
+  else if (!S_ISDIR(inode__get_inode(inode_i)->mode)){
+    rv = -ENOTDIR;
+  }
+  else {
+    neat_inode_t *inode = inode__get_inode(inode_i);
 
-    //all of the next chunk is just to correctly populate the st
-
-    //plus 1 to accomodate for extra '/'
-    const int new_full_path_len = strlen(path) + strlen(dir->name) + 1;
-    char new_full_path[new_full_path_len];
-    //new_full_path = path + / + dir->name
-    strcpy(new_full_path, path);
-    strcat(new_full_path, "/");
-    strcat(new_full_path, dir->name);
-    rv = storage_stat(new_full_path, &st);
-    if (rv != 0){
-      //something went wrong
-      printf("Error in nufs readdir with storage_stat...\n");
-      rv = -ENOENT;
-      break;
+    //"." and ".." are stored like every other entry, so they come out of this loop too
+    int dir_content_count = dir__entry_count(inode);
+    neat_dir_t dir;
+    for(int i = 0; i < dir_content_count; i++){
+      if (dir__get_entry(inode, i, &dir) != 0){
+        rv = -EIO;
+        break;
+      }
+
+      memset(&st, 0, sizeof(st));
+      rv = storage_stat_inode(dir.inode_i, &st);
+      if (rv != 0){
+        //something went wrong
+        printf("Error in nufs readdir with storage_stat_inode...\n");
+        break;
+      }
+      filler(buf, dir.name, &st, 0);
     }
-    printf("DEBUG_REEADADDR: dir entry name = %s\n", dir->name);
-    filler(buf, dir->name, &st, 0);
   }
+  storage_unlock();
 
-  
   printf("readdir(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_READDIR, start_ns, 0);
+  trace__record(STATS_OP_READDIR, start_ns, path, NULL, 0, 0, 0, rv);
   return rv;
 }
 
@@ -134,22 +237,28 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
   */
-  int rv = storage_mknod(path, mode);
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = nufs_is_stats_path(path) ? -EEXIST : storage_mknod(path, mode);
+  storage_unlock();
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  stats__record_op(STATS_OP_MKNOD, start_ns, 0);
+  trace__record(STATS_OP_MKNOD, start_ns, path, NULL, 0, 0, mode, rv);
   return rv;
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
-  /*
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
-  return rv;
-  */
-
-  int rv = nufs_mknod(path, mode, 0);
+  //FUSE hands mkdir only the permission bits, the type has to be added here
+  long long start_ns = stats__now_ns();
+  mode |= S_IFDIR;
+  storage_lock();
+  int rv = nufs_is_stats_path(path) ? -EEXIST : storage_mknod(path, mode);
+  storage_unlock();
   printf("mkdir(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_MKDIR, start_ns, 0);
+  trace__record(STATS_OP_MKDIR, start_ns, path, NULL, 0, 0, mode, rv);
   return rv;
 }
 
@@ -160,8 +269,13 @@ int nufs_unlink(const char *path) {
   return rv;
   */
 
+  long long start_ns = stats__now_ns();
+  storage_lock();
   int rv = storage_unlink(path);
+  storage_unlock();
   printf("unlink(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_UNLINK, start_ns, 0);
+  trace__record(STATS_OP_UNLINK, start_ns, path, NULL, 0, 0, 0, rv);
   return rv;
 }
 
@@ -171,8 +285,13 @@ int nufs_link(const char *from, const char *to) {
   printf("link(%s => %s) -> %d\n", from, to, rv);
   return rv;
   */
+  long long start_ns = stats__now_ns();
+  storage_lock();
   int rv = storage_link(from , to);
+  storage_unlock();
   printf("link(%s => %s) -> %d\n", from, to, rv);
+  stats__record_op(STATS_OP_LINK, start_ns, 0);
+  trace__record(STATS_OP_LINK, start_ns, from, to, 0, 0, 0, rv);
   return rv;
 }
 
@@ -183,55 +302,119 @@ int nufs_rmdir(const char *path) {
   return rv;
   */
   
-  int inode_i = dir__inode_i_from_path(path);
-  if (inode_i < 0){
-    dir__print_error__inode_i_from_path(NUFS_FILE_NAME, "nufs_rmdir inode", path);
-    return -ENOENT;
-  }
-
-  storage_unlink(path);
-  inode__free_inode(inode_i);
-  return 0;
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_rmdir(path);
+  storage_unlock();
+  printf("rmdir(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_RMDIR, start_ns, 0);
+  trace__record(STATS_OP_RMDIR, start_ns, path, NULL, 0, 0, 0, rv);
+  return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
   int rv = storage_rename(from, to);
+  storage_unlock();
   printf("rename(%s => %s) -> %d\n", from, to, rv);
+  stats__record_op(STATS_OP_RENAME, start_ns, 0);
+  trace__record(STATS_OP_RENAME, start_ns, from, to, 0, 0, 0, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
-  int rv = 0;
-
-  int inode_i = dir__inode_i_from_path(path);
-  if (inode_i < 0){
-    dir__print_error__inode_i_from_path(NUFS_FILE_NAME, "nufs_chmod inode", path);
-    rv = -ENOENT;
-  }
-  else{
-    neat_inode_t *inode = inode__get_inode(inode_i);
-    inode->mode = mode;
-  }
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_chmod(path, mode);
+  storage_unlock();
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  stats__record_op(STATS_OP_CHMOD, start_ns, 0);
+  trace__record(STATS_OP_CHMOD, start_ns, path, NULL, 0, 0, mode, rv);
   return rv;
 }
 
 int nufs_truncate(const char *path, off_t size) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
   int rv = storage_truncate(path, size);
+  storage_unlock();
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  stats__record_op(STATS_OP_TRUNCATE, start_ns, 0);
+  trace__record(STATS_OP_TRUNCATE, start_ns, path, NULL, 0, size, 0, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// This is called on open. The inode index is kept in the handle so release
+// can find the inode again even if every path to it was unlinked meanwhile.
+// The kernel drops the pages it cached of a file on every open unless told to
+// keep them, which it is whenever nothing changed the data since the last open.
+// The stats file gets rendered once here instead, so every read of one open
+// sees the same snapshot, and its handle holds that rendered text.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  //checks if this is accesible
-  int rv = nufs_access(path, F_OK);
+  long long start_ns = stats__now_ns();
+  int rv = 0;
+
+  if (nufs_is_stats_path(path)){
+    if ((fi->flags & O_ACCMODE) != O_RDONLY){
+      rv = -EACCES;
+    }
+    else {
+      char *rendered = malloc(NUFS_STATS_RENDER_MAX);
+      stats__render(rendered, NUFS_STATS_RENDER_MAX);
+      fi->fh = (uint64_t) (uintptr_t) rendered;
+      //the size from getattr is 0, so the page cache must not be trusted for it
+      fi->direct_io = 1;
+    }
+  }
+  else {
+    storage_lock();
+    rv = storage_open(path);
+    int policy = rv >= 0 ? storage_open_cache_policy(rv) : 0;
+    storage_unlock();
+    if (rv >= 0){
+      fi->fh = rv;
+      fi->keep_cache = (policy & STORAGE_OPEN_KEEP_CACHE) != 0;
+      fi->direct_io = (policy & STORAGE_OPEN_DIRECT_IO) != 0;
+      rv = 0;
+    }
+  }
   printf("open(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_OPEN, start_ns, 0);
+  trace__record(STATS_OP_OPEN, start_ns, path, NULL, fi->fh, 0, fi->flags, rv);
+  return rv;
+}
+
+// Called once the last file descriptor sharing this handle is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  long long start_ns = stats__now_ns();
+  int rv = 0;
+
+  if (nufs_is_stats_path(path)){
+    free((char *) (uintptr_t) fi->fh);
+  }
+  else {
+    storage_lock();
+    rv = storage_release(fi->fh);
+    storage_unlock();
+  }
+  printf("release(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_RELEASE, start_ns, 0);
+  trace__record(STATS_OP_RELEASE, start_ns, path, NULL, fi->fh, 0, 0, rv);
+  return rv;
+}
+
+// The whole image is flushed, it is small enough that picking out the blocks of [path] wouldn't pay off.
+// This doesn't take the storage lock, everything written before the call is already in the mapping, and
+// other calls can go on while the backing files catch up.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  long long start_ns = stats__now_ns();
+  int rv = storage_fsync();
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  stats__record_op(STATS_OP_FSYNC, start_ns, 0);
+  trace__record(STATS_OP_FSYNC, start_ns, path, NULL, 0, 0, datasync, rv);
   return rv;
 }
 
@@ -239,11 +422,26 @@ int nufs_open(const char *path, struct fuse_file_info *fi) {
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
   
-  int rv = storage_read(path, buf, size, offset);
-  if (rv == 0){
-    rv = size;
+  long long start_ns = stats__now_ns();
+  int rv = 0;
+
+  if (nufs_is_stats_path(path)){
+    const char *rendered = (const char *) (uintptr_t) fi->fh;
+    int length = strlen(rendered);
+    if (offset < length){
+      rv = length - offset < size ? length - offset : size;
+      memcpy(buf, rendered + offset, rv);
+    }
+  }
+  else {
+    storage_lock();
+    //the handle from open is the inode, no need to walk the path again
+    rv = storage_read_handle(fi->fh, buf, size, offset);
+    storage_unlock();
   }
   printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  stats__record_op(STATS_OP_READ, start_ns, rv);
+  trace__record(STATS_OP_READ, start_ns, path, NULL, offset, size, 0, rv);
   return rv;
 }
 
@@ -251,33 +449,241 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
   
-  int rv = storage_write(path, buf, size, offset);
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_write_handle(fi->fh, buf, size, offset);
+  storage_unlock();
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  stats__record_op(STATS_OP_WRITE, start_ns, rv);
+  trace__record(STATS_OP_WRITE, start_ns, path, NULL, offset, size, 0, rv);
   return rv;
 }
 
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
   int rv = storage_set_time(path, ts);
+  storage_unlock();
   printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  stats__record_op(STATS_OP_UTIMENS, start_ns, 0);
+  trace__record(STATS_OP_UTIMENS, start_ns, path, NULL, 0, 0, 0, rv);
+  return rv;
+}
+
+// Make a symlink at [from] pointing at [to], short targets are kept in the inode.
+int nufs_symlink(const char *to, const char *from) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = nufs_is_stats_path(from) ? -EEXIST : storage_symlink(to, from);
+  storage_unlock();
+  printf("symlink(%s => %s) -> %d\n", from, to, rv);
+  stats__record_op(STATS_OP_SYMLINK, start_ns, 0);
+  trace__record(STATS_OP_SYMLINK, start_ns, from, to, 0, 0, 0, rv);
+  return rv;
+}
+
+int nufs_readlink(const char *path, char *buf, size_t size) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_readlink(path, buf, size);
+  storage_unlock();
+  printf("readlink(%s) -> %d\n", path, rv);
+  stats__record_op(STATS_OP_READLINK, start_ns, 0);
+  trace__record(STATS_OP_READLINK, start_ns, path, NULL, 0, size, 0, rv);
+  return rv;
+}
+
+// Set an extended attribute, [flags] can hold XATTR_CREATE or XATTR_REPLACE.
+int nufs_setxattr(const char *path, const char *name, const char *value,
+                  size_t size, int flags) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_setxattr(path, name, value, size, flags);
+  storage_unlock();
+  printf("setxattr(%s, %s, %ld bytes, %d) -> %d\n", path, name, size, flags, rv);
+  stats__record_op(STATS_OP_SETXATTR, start_ns, rv == 0 ? size : 0);
+  trace__record(STATS_OP_SETXATTR, start_ns, path, name, 0, size, flags, rv);
+  return rv;
+}
+
+// Get an extended attribute, a [size] of 0 asks for the length of its value.
+int nufs_getxattr(const char *path, const char *name, char *value, size_t size) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_getxattr(path, name, value, size);
+  storage_unlock();
+  printf("getxattr(%s, %s, %ld bytes) -> %d\n", path, name, size, rv);
+  stats__record_op(STATS_OP_GETXATTR, start_ns, rv);
+  trace__record(STATS_OP_GETXATTR, start_ns, path, name, 0, size, 0, rv);
+  return rv;
+}
+
+// List the names of the extended attributes, each followed by a NUL.
+int nufs_listxattr(const char *path, char *list, size_t size) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_listxattr(path, list, size);
+  storage_unlock();
+  printf("listxattr(%s, %ld bytes) -> %d\n", path, size, rv);
+  stats__record_op(STATS_OP_LISTXATTR, start_ns, rv);
+  trace__record(STATS_OP_LISTXATTR, start_ns, path, NULL, 0, size, 0, rv);
+  return rv;
+}
+
+int nufs_removexattr(const char *path, const char *name) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_removexattr(path, name);
+  storage_unlock();
+  printf("removexattr(%s, %s) -> %d\n", path, name, rv);
+  stats__record_op(STATS_OP_REMOVEXATTR, start_ns, 0);
+  trace__record(STATS_OP_REMOVEXATTR, start_ns, path, name, 0, 0, 0, rv);
+  return rv;
+}
+
+// Preallocate blocks for a range of a file, or punch a hole in it with
+// FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE.
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  long long start_ns = stats__now_ns();
+  storage_lock();
+  int rv = storage_fallocate(path, mode, offset, length);
+  storage_unlock();
+  printf("fallocate(%s, %d, %ld bytes, @+%ld) -> %d\n", path, mode, length, offset, rv);
+  stats__record_op(STATS_OP_FALLOCATE, start_ns, rv);
+  trace__record(STATS_OP_FALLOCATE, start_ns, path, NULL, offset, length, mode, rv);
   return rv;
 }
 
 // Extended operations
+// Only fixed size (restricted) ioctls are supported, FUSE hands us a [data] buffer
+// of _IOC_SIZE(cmd) bytes to fill for the _IOR ones.
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
+  long long start_ns = stats__now_ns();
   int rv = 0;
+
+  switch ((unsigned int) cmd) {
+  case NUFS_IOC_DEFRAG_PROGRESS:
+    defrag__get_progress((neat_defrag_progress_t *) data);
+    break;
+  case NUFS_IOC_STATS_RESET:
+    stats__reset();
+    break;
+  case NUFS_IOC_DEDUP_INFO:
+    dedup__get_info((neat_dedup_info_t *) data);
+    break;
+  case NUFS_IOC_SNAPSHOT_CREATE:
+    rv = snapshot__create();
+    if (rv > 0) {
+      *(int *) data = rv;
+      rv = 0;
+    }
+    break;
+  case NUFS_IOC_SNAPSHOT_DELETE:
+    rv = snapshot__delete(*(int *) data);
+    break;
+  case NUFS_IOC_SNAPSHOT_LIST:
+    snapshot__list((neat_snapshot_list_t *) data);
+    break;
+  case NUFS_IOC_CLEANER_PROGRESS:
+    cleaner__get_progress((neat_cleaner_progress_t *) data);
+    break;
+  case NUFS_IOC_SCRUB_PROGRESS:
+    checksum__get_scrub_progress((neat_scrub_progress_t *) data);
+    break;
+  case NUFS_IOC_CLONE_RANGE: {
+    //the kernel only sees the new size of [path] once its cached attributes time out (attr_timeout)
+    neat_clone_range_t *range = data;
+    range->src_path[NUFS_CLONE_PATH_MAX - 1] = '\0';
+    storage_lock();
+    rv = storage_clone(path, range->src_path, range->src_offset, range->length, range->dst_offset);
+    storage_unlock();
+    break;
+  }
+  case NUFS_IOC_DIRECT_IO:
+    storage_lock();
+    rv = storage_set_file_direct_io(path, *(int *) data);
+    storage_unlock();
+    break;
+  default:
+    rv = -ENOTTY;
+  }
+
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  stats__record_op(STATS_OP_IOCTL, start_ns, 0);
+  trace__record(STATS_OP_IOCTL, start_ns, path, NULL, 0, 0, cmd, rv);
   return rv;
+}
+
+// Writes the memory-only image back every time SIGUSR1 arrives, which main blocks
+// in every other thread so it always ends up here.
+static void *nufs_persist_main(void *arg) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  int sig;
+  while (sigwait(&set, &sig) == 0 && !atomic_load(&persist_stop)) {
+    int rv = storage_save(persist_path);
+    printf("persist(%s) -> %d\n", persist_path, rv);
+  }
+  return NULL;
+}
+
+// Called once the mount is up (after FUSE has daemonized), so it is safe to start threads here.
+void *nufs_init(struct fuse_conn_info *conn) {
+  //a mounted snapshot is never changed, not even by moving its blocks around, and in log mode the
+  //cleaner moves blocks instead (pulling files together would scatter the log again)
+  int rv = 0;
+  if (!storage_read_only()) {
+    rv = blocks_log_mode() ? cleaner__start() : defrag__start();
+  }
+  if (rv == 0 && checksum__enabled()) {
+    rv = checksum__scrub_start();
+  }
+  if (rv == 0 && persist_path != NULL) {
+    rv = pthread_create(&persist_thread, NULL, nufs_persist_main, NULL) == 0 ? 0 : -1;
+    persist_started = rv == 0;
+  }
+  printf("init() -> %d\n", rv);
+  if (rv != 0) {
+    //FUSE 2 has no way for init to fail the mount, so end the session before the first request instead.
+    //destroy still runs and stops whatever did start
+    fprintf(stderr, "%sERROR: couldn't start the background threads, unmounting\n", NUFS_FILE_NAME);
+    fuse_exit(fuse_get_context()->fuse);
+  }
+  return NULL;
+}
 
-  //what does this even do?
+void nufs_destroy(void *private_data) {
+  checksum__scrub_stop();
+  cleaner__stop();
+  defrag__stop();
+  trace__stop();
+  if (persist_started) {
+    atomic_store(&persist_stop, 1);
+    pthread_kill(persist_thread, SIGUSR1);
+    pthread_join(persist_thread, NULL);
+    persist_started = 0;
+  }
+  if (persist_path != NULL) {
+    //nothing else runs anymore, so this is the image as the last call left it
+    if (storage_save(persist_path) != 0) {
+      fprintf(stderr, "%sERROR: couldn't write the image back to %s\n", NUFS_FILE_NAME, persist_path);
+    }
+  }
+  storage_free();
+  printf("destroy()\n");
 }
 
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->statfs = nufs_statfs;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
   // ops->create   = nufs_create; // alternative to mknod
@@ -289,17 +695,83 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->fallocate = nufs_fallocate;
+  ops->symlink = nufs_symlink;
+  ops->readlink = nufs_readlink;
+  ops->setxattr = nufs_setxattr;
+  ops->getxattr = nufs_getxattr;
+  ops->listxattr = nufs_listxattr;
+  ops->removexattr = nufs_removexattr;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  assert(argc > 2);
+  const char *image_path = argv[--argc];
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct nufs_options options = {0};
+  if (fuse_opt_parse(&args, &options, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+  if (options.persist && !options.memory) {
+    fprintf(stderr, "%sERROR: -o persist only goes with -o memory\n", NUFS_FILE_NAME);
+    return 1;
+  }
+  if (options.stripe != 0 && blocks_set_stripe_blocks(options.stripe) != 0) {
+    fprintf(stderr, "%sERROR: -o stripe=%d isn't a power of two up to %d\n", NUFS_FILE_NAME, options.stripe, BLOCK_COUNT);
+    return 1;
+  }
+  if (options.memory) {
+    storage_init_memory(image_path);
+  }
+  else if (options.snapshot != 0) {
+    //the live mount may be using the image meanwhile, so not even block 0 gets written
+    storage_init_read_only(image_path);
+  }
+  else {
+    storage_init(image_path);
+  }
+  if (options.persist) {
+    //the persist thread started by nufs_init is the only one left to take SIGUSR1
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    persist_path = image_path;
+  }
+  storage_set_compression(options.compress);
+  storage_set_dedup(options.dedup);
+  storage_set_log(options.log);
+  storage_set_checksums(options.checksum);
+  storage_set_direct_io(options.direct_io);
+  if (options.snapshot != 0) {
+    int snapshot_rv = storage_mount_snapshot(options.snapshot);
+    if (snapshot_rv != 0) {
+      fprintf(stderr, "%sERROR: can't mount snapshot %d: %s\n", NUFS_FILE_NAME, options.snapshot,
+              strerror(-snapshot_rv));
+      return 1;
+    }
+    fuse_opt_insert_arg(&args, 1, "-oro");
+  }
+  //opened before FUSE daemonizes and moves to /, so a relative path still means what it did
+  if (options.trace != NULL && trace__start(options.trace) != 0) {
+    fprintf(stderr, "%sERROR: can't record a trace into %s\n", NUFS_FILE_NAME, options.trace);
+    return 1;
+  }
+  fuse_opt_insert_arg(&args, 1, NUFS_DEFAULT_CACHE_OPTS);
+  fuse_opt_insert_arg(&args, 1, NUFS_DEFAULT_IO_OPTS);
+  int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+  fuse_opt_free_args(&args);
+  return rv;
 }
@@ -0,0 +1,568 @@
+// nufs-bench: in-process benchmarks for the storage layer, no FUSE involved
+//
+// usage: nufs-bench [-n ops] [-s seed] [workload ...]
+//
+// Each workload runs against a fresh image in /tmp and prints one JSON object
+// per line on stdout (ops/sec, p50/p99 latency, bytes/sec), so runs can be
+// diffed or fed to a tracker. Everything the storage layer prints itself goes
+// to /dev/null. With no workload names given, all of them run.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "neat_checksum.h"
+#include "neat_cleaner.h"
+#include "neat_directory.h"
+#include "neat_inode.h"
+#include "neat_storage.h"
+
+#define BENCH_FILE_NAME "nufs_bench.c // "
+
+#define BENCH_DEFAULT_OPS 10000
+#define BENCH_IO_SIZE 4096
+//what a write with big_writes on comes in as under FUSE 2
+#define BENCH_BIG_IO_SIZE (128 * 1024)
+//the data file used by the read/write workloads, about half the image
+#define BENCH_FILE_SIZE (128 * BLOCK_SIZE)
+#define BENCH_TRUNCATE_MAX (64 * BLOCK_SIZE)
+//files appended to round robin by the interleaved workloads, the way an ingest node writes
+#define BENCH_APPEND_FILES 8
+#define BENCH_XATTR_FILES 16
+//backing files flush_striped spreads the image over
+#define BENCH_STRIPES_MAX 4
+#define BENCH_XATTR_VALUE_SIZE 100
+//entries lookup_large_dir puts in its directory, all hard links to one file since the inode table only
+//holds a few dozen files
+#define BENCH_DIR_ENTRIES 1000
+
+typedef struct bench_run {
+    const char *name;
+    int ops;
+    long long *latencies_ns;
+    long long bytes;
+    long long elapsed_ns;
+    unsigned int seed;
+} bench_run_t;
+
+typedef void (*bench_workload_fn)(bench_run_t *run, int ops);
+
+typedef struct bench_workload {
+    const char *name;
+    bench_workload_fn fn;
+} bench_workload_t;
+
+static FILE *results;
+//results nothing else looks at go here, so the compiler can't drop the work behind them
+static volatile uint32_t bench_sink;
+static char image_path[] = "/tmp/nufs-bench-XXXXXX";
+
+static long long bench__now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//Times a single operation [expr] and records it as one op of [run]
+#define BENCH_OP(run, expr) do { \
+        long long bench_op_start = bench__now_ns(); \
+        expr; \
+        long long bench_op_ns = bench__now_ns() - bench_op_start; \
+        (run)->latencies_ns[(run)->ops++] = bench_op_ns; \
+        (run)->elapsed_ns += bench_op_ns; \
+    } while (0)
+
+static void bench__fresh_image(){
+    int fd = mkstemp(image_path);
+    if (fd < 0){
+        fprintf(stderr, "%sERROR: can't create a scratch image: %s\n", BENCH_FILE_NAME, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    storage_init(image_path);
+}
+
+static void bench__drop_image(){
+    blocks_free();
+    unlink(image_path);
+    strcpy(image_path + strlen(image_path) - 6, "XXXXXX");
+}
+
+//Fills [path] with BENCH_FILE_SIZE bytes of a repeating pattern
+static void bench__make_data_file(const char *path){
+    char buf[BENCH_IO_SIZE];
+    for (int i = 0; i < BENCH_IO_SIZE; i++){
+        buf[i] = 'a' + i % 26;
+    }
+
+    storage_mknod(path, 0100644);
+    for (int offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_IO_SIZE){
+        storage_write(path, buf, BENCH_IO_SIZE, offset);
+    }
+}
+
+//Fills [path] with BENCH_FILE_SIZE bytes of log lines, the kind of text compression is aimed at
+static void bench__make_log_file(const char *path, unsigned int *seed){
+    char buf[BENCH_FILE_SIZE + 128];
+    int length = 0;
+    while (length < BENCH_FILE_SIZE){
+        length += sprintf(buf + length, "2021-04-%02d %02d:%02d:%02d INFO worker %d served request %d\n",
+                          1 + rand_r(seed) % 30, rand_r(seed) % 24, rand_r(seed) % 60, rand_r(seed) % 60,
+                          rand_r(seed) % 8, rand_r(seed) % 100000);
+    }
+
+    storage_mknod(path, 0100644);
+    storage_write(path, buf, BENCH_FILE_SIZE, 0);
+}
+
+static int bench__cmp_ll(const void *a, const void *b){
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench__report(bench_run_t *run){
+    if (run->ops == 0){
+        return;
+    }
+    qsort(run->latencies_ns, run->ops, sizeof(long long), bench__cmp_ll);
+
+    double secs = run->elapsed_ns / 1e9;
+    fprintf(results, "{\"workload\":\"%s\",\"ops\":%d,\"secs\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"p50_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld,\"bytes\":%lld,\"bytes_per_sec\":%.1f}\n",
+            run->name, run->ops, secs, run->ops / secs,
+            run->latencies_ns[run->ops / 2], run->latencies_ns[(run->ops * 99) / 100],
+            run->latencies_ns[run->ops - 1], run->bytes, run->bytes / secs);
+    fflush(results);
+}
+
+static void bench__alloc_churn(bench_run_t *run, int ops){
+    for (int i = 0; i < ops; i++){
+        BENCH_OP(run, free_block(alloc_block()));
+    }
+}
+
+static void bench__lookup_large_dir(bench_run_t *run, int ops){
+    char path[64];
+    storage_mknod("/big", 040755);
+
+    //links all take an entry of their own, so the directory gets far bigger than the inode table would let it
+    storage_mknod("/big/file_0000", 0100644);
+    int file_count = 1;
+    for (; file_count < BENCH_DIR_ENTRIES; file_count++){
+        sprintf(path, "/big/file_%04d", file_count);
+        if (storage_link("/big/file_0000", path) != 0){
+            break;
+        }
+    }
+    if (file_count < BENCH_DIR_ENTRIES){
+        fprintf(stderr, "%sWARNING: lookup_large_dir only got %d of %d entries\n", BENCH_FILE_NAME, file_count,
+                BENCH_DIR_ENTRIES);
+    }
+
+    for (int i = 0; i < ops; i++){
+        sprintf(path, "/big/file_%04d", rand_r(&run->seed) % file_count);
+        BENCH_OP(run, dir__inode_i_from_path(path));
+    }
+}
+
+static void bench__seq_write(bench_run_t *run, int ops){
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'w', sizeof(buf));
+    storage_mknod("/seq", 0100644);
+
+    for (int i = 0; i < ops; i++){
+        int offset = (i * BENCH_IO_SIZE) % BENCH_FILE_SIZE;
+        BENCH_OP(run, run->bytes += storage_write("/seq", buf, BENCH_IO_SIZE, offset));
+    }
+}
+
+static void bench__seq_read(bench_run_t *run, int ops){
+    char buf[BENCH_IO_SIZE];
+    bench__make_data_file("/seq");
+
+    for (int i = 0; i < ops; i++){
+        int offset = (i * BENCH_IO_SIZE) % BENCH_FILE_SIZE;
+        BENCH_OP(run, run->bytes += storage_read("/seq", buf, BENCH_IO_SIZE, offset));
+    }
+}
+
+//Appends [io_size] bytes at a time through an open handle, starting the file over once it is BENCH_FILE_SIZE
+static void bench__append_common(bench_run_t *run, int ops, int io_size){
+    char *buf = malloc(io_size);
+    memset(buf, 'a', io_size);
+    storage_mknod("/append", 0100644);
+    int handle = storage_open("/append");
+
+    for (int i = 0; i < ops; i++){
+        int offset = ((long long) i * io_size) % BENCH_FILE_SIZE;
+        if (offset == 0){
+            storage_truncate("/append", 0);
+        }
+        BENCH_OP(run, run->bytes += storage_write_handle(handle, buf, io_size, offset));
+    }
+    storage_release(handle);
+    free(buf);
+}
+
+static void bench__append_write(bench_run_t *run, int ops){
+    bench__append_common(run, ops, BENCH_IO_SIZE);
+}
+
+static void bench__append_write_big(bench_run_t *run, int ops){
+    bench__append_common(run, ops, BENCH_BIG_IO_SIZE);
+}
+
+//Appends a block at a time to BENCH_APPEND_FILES files in turn, starting each over once it gets to its
+//share of BENCH_FILE_SIZE, [log] runs it in log mode with the cleaner getting a step in between the ops
+static void bench__append_interleaved_common(bench_run_t *run, int ops, int log){
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'i', sizeof(buf));
+    char paths[BENCH_APPEND_FILES][16];
+    int handles[BENCH_APPEND_FILES];
+    storage_set_log(log);
+    for (int f = 0; f < BENCH_APPEND_FILES; f++){
+        sprintf(paths[f], "/ingest%d", f);
+        storage_mknod(paths[f], 0100644);
+        handles[f] = storage_open(paths[f]);
+    }
+
+    for (int i = 0; i < ops; i++){
+        int f = i % BENCH_APPEND_FILES;
+        int offset = ((long long) (i / BENCH_APPEND_FILES) * BENCH_IO_SIZE) % (BENCH_FILE_SIZE / BENCH_APPEND_FILES);
+        if (offset == 0){
+            storage_truncate(paths[f], 0);
+        }
+        BENCH_OP(run, run->bytes += storage_write_handle(handles[f], buf, BENCH_IO_SIZE, offset));
+        if (log){
+            cleaner__step();
+        }
+    }
+    for (int f = 0; f < BENCH_APPEND_FILES; f++){
+        storage_release(handles[f]);
+    }
+    storage_set_log(0);
+}
+
+static void bench__append_interleaved(bench_run_t *run, int ops){
+    bench__append_interleaved_common(run, ops, 0);
+}
+
+static void bench__append_interleaved_log(bench_run_t *run, int ops){
+    bench__append_interleaved_common(run, ops, 1);
+}
+
+//seq_write and seq_read again with checksums on, what they cost is the difference between the two
+static void bench__seq_write_checksummed(bench_run_t *run, int ops){
+    storage_set_checksums(1);
+    bench__seq_write(run, ops);
+    storage_set_checksums(0);
+}
+
+static void bench__seq_read_checksummed(bench_run_t *run, int ops){
+    storage_set_checksums(1);
+    bench__seq_read(run, ops);
+    storage_set_checksums(0);
+}
+
+//Checksums a whole block of the data file per op, [portable] skips the SSE4.2 kernel
+static void bench__crc32c_common(bench_run_t *run, int ops, int portable){
+    bench__make_data_file("/crc");
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path("/crc"));
+    int block_count = inode__blocks_for_size(inode->size);
+    uint32_t crc = 0;
+
+    for (int i = 0; i < ops; i++){
+        const void *block = blocks_get_block(inode__get_block_i(inode, i % block_count));
+        BENCH_OP(run, crc ^= portable ? checksum__crc32c_portable(0, block, BLOCK_SIZE)
+                                      : checksum__crc32c(0, block, BLOCK_SIZE);
+                 run->bytes += BLOCK_SIZE);
+    }
+    bench_sink = crc;
+}
+
+static void bench__crc32c(bench_run_t *run, int ops){
+    bench__crc32c_common(run, ops, 0);
+}
+
+static void bench__crc32c_portable(bench_run_t *run, int ops){
+    bench__crc32c_common(run, ops, 1);
+}
+
+static void bench__rand_write(bench_run_t *run, int ops){
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'r', sizeof(buf));
+    bench__make_data_file("/rand");
+
+    for (int i = 0; i < ops; i++){
+        int offset = rand_r(&run->seed) % (BENCH_FILE_SIZE - BENCH_IO_SIZE);
+        BENCH_OP(run, run->bytes += storage_write("/rand", buf, BENCH_IO_SIZE, offset));
+    }
+}
+
+static void bench__rand_read(bench_run_t *run, int ops){
+    char buf[BENCH_IO_SIZE];
+    bench__make_data_file("/rand");
+
+    for (int i = 0; i < ops; i++){
+        int offset = rand_r(&run->seed) % (BENCH_FILE_SIZE - BENCH_IO_SIZE);
+        BENCH_OP(run, run->bytes += storage_read("/rand", buf, BENCH_IO_SIZE, offset));
+    }
+}
+
+static void bench__text_read_common(bench_run_t *run, int ops, int compressed){
+    char buf[BENCH_IO_SIZE];
+    storage_set_compression(compressed);
+    bench__make_log_file("/log", &run->seed);
+
+    //the file only gets compressed once its last handle is closed
+    storage_release(storage_open("/log"));
+
+    for (int i = 0; i < ops; i++){
+        int offset = rand_r(&run->seed) % (BENCH_FILE_SIZE - BENCH_IO_SIZE);
+        BENCH_OP(run, run->bytes += storage_read("/log", buf, BENCH_IO_SIZE, offset));
+    }
+    storage_set_compression(0);
+}
+
+static void bench__text_read(bench_run_t *run, int ops){
+    bench__text_read_common(run, ops, 0);
+}
+
+static void bench__text_read_compressed(bench_run_t *run, int ops){
+    bench__text_read_common(run, ops, 1);
+}
+
+//Same as seq_write but every block written is identical, across two files, so all of them end up on one block
+static void bench__dedup_write(bench_run_t *run, int ops){
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'd', sizeof(buf));
+    storage_set_dedup(1);
+    storage_mknod("/dup_a", 0100644);
+    storage_mknod("/dup_b", 0100644);
+
+    for (int i = 0; i < ops; i++){
+        int offset = ((i / 2) * BENCH_IO_SIZE) % BENCH_FILE_SIZE;
+        BENCH_OP(run, run->bytes += storage_write(i % 2 ? "/dup_b" : "/dup_a", buf, BENCH_IO_SIZE, offset));
+    }
+    storage_set_dedup(0);
+}
+
+//Whole file clones of a file half the size of the image, which only works if no data gets copied
+static void bench__clone_file(bench_run_t *run, int ops){
+    bench__make_data_file("/orig");
+    storage_mknod("/clone", 0100644);
+
+    for (int i = 0; i < ops; i++){
+        BENCH_OP(run, storage_clone("/clone", "/orig", 0, 0, 0); run->bytes += BENCH_FILE_SIZE);
+    }
+}
+
+static void bench__xattr_tag(bench_run_t *run, int ops){
+    static const char *tags[] = {"red", "green", "blue", "archived-2024-q3"};
+    char path[64];
+    char value[BENCH_XATTR_VALUE_SIZE];
+    memset(value, 'x', sizeof(value));
+
+    //two small attributes fit inline, the third one spills into an xattr block the files end up sharing
+    for (int i = 0; i < BENCH_XATTR_FILES; i++){
+        sprintf(path, "/tagged_%d", i);
+        storage_mknod(path, 0100644);
+        storage_setxattr(path, "user.owner", "bench", 5, 0);
+        storage_setxattr(path, "user.notes", value, sizeof(value), 0);
+    }
+
+    //every op retags a file and reads back another attribute, like a tagging tool walking a tree
+    for (int i = 0; i < ops; i++){
+        sprintf(path, "/tagged_%d", rand_r(&run->seed) % BENCH_XATTR_FILES);
+        const char *tag = tags[rand_r(&run->seed) % 4];
+        BENCH_OP(run, storage_setxattr(path, "user.tag", tag, strlen(tag), 0);
+                 storage_getxattr(path, "user.owner", value, sizeof(value)));
+    }
+}
+
+static void bench__truncate_storm(bench_run_t *run, int ops){
+    storage_mknod("/trunc", 0100644);
+
+    for (int i = 0; i < ops; i++){
+        int size = rand_r(&run->seed) % BENCH_TRUNCATE_MAX;
+        BENCH_OP(run, storage_truncate("/trunc", size));
+    }
+}
+
+static void bench__mknod_unlink(bench_run_t *run, int ops){
+    char path[64];
+
+    //every op is one create + one delete, so the image never fills up
+    for (int i = 0; i < ops; i++){
+        sprintf(path, "/flood_%d", i);
+        BENCH_OP(run, storage_mknod(path, 0100644); storage_unlink(path));
+    }
+}
+
+//Mounts the image again [ops] times, each time up to the first statfs, which is what needs the free block counts
+static void bench__mount_common(bench_run_t *run, int ops, int stale){
+    struct statvfs st;
+    bench__make_data_file("/data");
+
+    for (int i = 0; i < ops; i++){
+        blocks_free();
+        if (stale){
+            //what a crash leaves behind, the summary isn't marked clean so every region gets counted
+            int fd = open(image_path, O_WRONLY);
+            uint32_t magic = 0;
+            pwrite(fd, &magic, sizeof(magic), BLOCK_SUMMARY_OFFSET + offsetof(blocks_summary_t, magic));
+            close(fd);
+        }
+        BENCH_OP(run, storage_init(image_path); storage_statfs(&st));
+    }
+}
+
+static void bench__mount(bench_run_t *run, int ops){
+    bench__mount_common(run, ops, 0);
+}
+
+static void bench__mount_stale(bench_run_t *run, int ops){
+    bench__mount_common(run, ops, 1);
+}
+
+//Rewrites the data file and times the fsync that writes it out, with the image spread over [stripes] files
+//(the extra ones next to the scratch image) for anything more than one
+static void bench__flush_common(bench_run_t *run, int ops, int stripes){
+    char spec[BENCH_STRIPES_MAX * (sizeof(image_path) + 4)];
+    strcpy(spec, image_path);
+    for (int i = 1; i < stripes; i++){
+        sprintf(spec + strlen(spec), ",%s.%d", image_path, i);
+    }
+    //the scratch image is a single file already, the striped one starts over from nothing
+    blocks_free();
+    unlink(image_path);
+    storage_init(spec);
+
+    char buf[BENCH_IO_SIZE];
+    memset(buf, 'f', sizeof(buf));
+    storage_mknod("/flush", 0100644);
+    for (int i = 0; i < ops; i++){
+        for (int offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_IO_SIZE){
+            buf[0] = i;
+            storage_write("/flush", buf, BENCH_IO_SIZE, offset);
+        }
+        BENCH_OP(run, storage_fsync(); run->bytes += BENCH_FILE_SIZE);
+    }
+
+    //back to the plain scratch image bench__drop_image expects
+    blocks_free();
+    for (int i = 1; i < stripes; i++){
+        char path[sizeof(image_path) + 4];
+        sprintf(path, "%s.%d", image_path, i);
+        unlink(path);
+    }
+    unlink(image_path);
+    storage_init(image_path);
+}
+
+static void bench__flush(bench_run_t *run, int ops){
+    bench__flush_common(run, ops, 1);
+}
+
+static void bench__flush_striped(bench_run_t *run, int ops){
+    bench__flush_common(run, ops, BENCH_STRIPES_MAX);
+}
+
+static bench_workload_t workloads[] = {
+    {"alloc_churn", bench__alloc_churn},
+    {"lookup_large_dir", bench__lookup_large_dir},
+    {"seq_write", bench__seq_write},
+    {"seq_read", bench__seq_read},
+    {"append_write", bench__append_write},
+    {"append_write_big", bench__append_write_big},
+    {"append_interleaved", bench__append_interleaved},
+    {"append_interleaved_log", bench__append_interleaved_log},
+    {"seq_write_checksummed", bench__seq_write_checksummed},
+    {"seq_read_checksummed", bench__seq_read_checksummed},
+    {"crc32c", bench__crc32c},
+    {"crc32c_portable", bench__crc32c_portable},
+    {"rand_write", bench__rand_write},
+    {"rand_read", bench__rand_read},
+    {"text_read", bench__text_read},
+    {"text_read_compressed", bench__text_read_compressed},
+    {"dedup_write", bench__dedup_write},
+    {"clone_file", bench__clone_file},
+    {"xattr_tag", bench__xattr_tag},
+    {"truncate_storm", bench__truncate_storm},
+    {"mknod_unlink", bench__mknod_unlink},
+    {"mount", bench__mount},
+    {"mount_stale", bench__mount_stale},
+    {"flush", bench__flush},
+    {"flush_striped", bench__flush_striped},
+};
+#define BENCH_WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static int bench__selected(const char *name, int argc, char *argv[]){
+    if (argc == 0){
+        return 1;
+    }
+    for (int i = 0; i < argc; i++){
+        if (strcmp(argv[i], name) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int ops = BENCH_DEFAULT_OPS;
+    unsigned int seed = 3650;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1){
+        switch (opt){
+        case 'n':
+            ops = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n ops] [-s seed] [workload ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ops < 1){
+        fprintf(stderr, "%sERROR: need at least one op per workload\n", BENCH_FILE_NAME);
+        return 1;
+    }
+
+    //keep the real stdout for the results, the storage layer logs every call with printf
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL){
+        fprintf(stderr, "%sERROR: can't redirect stdout\n", BENCH_FILE_NAME);
+        return 1;
+    }
+
+    long long *latencies_ns = malloc(sizeof(long long) * ops);
+    for (int i = 0; i < BENCH_WORKLOAD_COUNT; i++){
+        if (!bench__selected(workloads[i].name, argc - optind, argv + optind)){
+            continue;
+        }
+
+        bench_run_t run = {workloads[i].name, 0, latencies_ns, 0, 0, seed};
+        bench__fresh_image();
+        workloads[i].fn(&run, ops);
+        bench__drop_image();
+        bench__report(&run);
+    }
+
+    free(latencies_ns);
+    fclose(results);
+    return 0;
+}
@@ -0,0 +1,619 @@
+// nufs-fsck: offline consistency checker (and optional repair) for nufs images
+//
+// usage: nufs-fsck [-r] [-j threads] disk_image
+//
+// The inode table is scanned by [threads] workers at once, each one walking the
+// block maps and directory entries of its share of the inodes and recording
+// block ownership / entry references in shared atomic counters. The cross checks
+// against the bitmaps, share counts and link counts (and the repair, if asked
+// for) then run single threaded. Snapshots only get their block maps walked, as
+// owners of the blocks they keep; a damaged one is dropped by the repair. Damaged
+// extended attributes are dropped as a whole. A block that doesn't match its
+// checksum can't be fixed, the repair only checksums it again as it is now.
+// An image spread over several backing files is given as their comma separated
+// paths, in the order it was made with.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "neat_directory.h"
+#include "neat_inode.h"
+#include "neat_snapshot.h"
+#include "neat_xattr.h"
+#include "neat_checksum.h"
+
+#define FSCK_FILE_NAME "nufs_fsck.c // "
+
+//exit codes follow fsck(8)
+#define FSCK_EXIT_OK 0
+#define FSCK_EXIT_REPAIRED 1
+#define FSCK_EXIT_UNCORRECTED 4
+#define FSCK_EXIT_USAGE 8
+
+typedef struct fsck_worker {
+    pthread_t thread;
+    int worker_i;
+    int worker_count;
+} fsck_worker_t;
+
+static atomic_int block_owners[BLOCK_COUNT];
+static atomic_int block_first_owner[BLOCK_COUNT];
+//every entry counts towards the link count, but only named ones (not "." / "..") keep an inode reachable
+static atomic_int *inode_refs;
+static atomic_int *inode_named_refs;
+static atomic_int problem_count;
+//set while re-checking in the middle of a repair, where the problems were already reported
+static int quiet = 0;
+
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void fsck__report(const char *fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+
+    if (!quiet){
+        pthread_mutex_lock(&report_mutex);
+        printf("%s", FSCK_FILE_NAME);
+        vprintf(fmt, args);
+        printf("\n");
+        pthread_mutex_unlock(&report_mutex);
+    }
+
+    va_end(args);
+    atomic_fetch_add(&problem_count, 1);
+}
+
+static int fsck__is_dir(neat_inode_t *inode){
+    return S_ISDIR(inode->mode);
+}
+
+static int fsck__valid_inode_i(int inode_i){
+    return inode_i >= 0 && inode_i < inode__get_inode_count() && bitmap_get(get_inode_bitmap(), inode_i);
+}
+
+//Keeps the lowest inode index claiming [block_i], so repairs are deterministic no matter the thread order
+static void fsck__claim_block(int block_i, int inode_i){
+    atomic_fetch_add(&block_owners[block_i], 1);
+
+    int curr_owner = atomic_load(&block_first_owner[block_i]);
+    while ((curr_owner < 0 || inode_i < curr_owner)
+           && !atomic_compare_exchange_weak(&block_first_owner[block_i], &curr_owner, inode_i)){
+    }
+}
+
+static int fsck__valid_data_block(int block_i){
+    return block_i >= INODE_FIRST_DATA_BLOCK && block_i < BLOCK_COUNT;
+}
+
+//Checks that an inode with its symlink target inline is a symlink whose target fits there
+static int fsck__valid_inline_link(neat_inode_t *inode){
+    return !(inode->flags & NEAT_INODE_INLINE_LINK)
+           || (S_ISLNK(inode->mode) && inode->size >= 0 && inode->size <= NEAT_INODE_INLINE_LINK_MAX);
+}
+
+//Walks the block map and the extended attributes of [inode], recording it as an owner of every block they point at
+static void fsck__scan_map(neat_inode_t *inode){
+    if (!fsck__valid_inline_link(inode)){
+        fsck__report("inode %d: inline symlink target of %d bytes doesn't fit", inode->inode_i, inode->size);
+    }
+    if (xattr__check(inode) != 0){
+        fsck__report("inode %d: extended attributes are damaged", inode->inode_i);
+    }
+    else {
+        int held[BLOCK_COUNT];
+        int held_count = xattr__held_blocks(inode, held, BLOCK_COUNT);
+        for (int i = 0; i < held_count; i++){
+            fsck__claim_block(held[i], inode->inode_i);
+        }
+    }
+
+    int expected = inode__blocks_for_size(inode__stored_size(inode));
+    if (expected > inode__max_blocks()){
+        fsck__report("inode %d: size %d is more than a block map can hold", inode->inode_i, inode__stored_size(inode));
+        expected = inode__max_blocks();
+    }
+
+    //no indirect block (-1) is fine however big the file is, everything past the direct blocks is a hole then
+    if (inode->indirect_i != -1 && !fsck__valid_data_block(inode->indirect_i)){
+        fsck__report("inode %d: points at invalid indirect block %d", inode->inode_i, inode->indirect_i);
+        expected = expected < NEAT_INODE_DIRECT_BLOCKS ? expected : NEAT_INODE_DIRECT_BLOCKS;
+    }
+    else if (inode->indirect_i != -1 && expected <= NEAT_INODE_DIRECT_BLOCKS){
+        fsck__report("inode %d: has indirect block %d it doesn't need", inode->inode_i, inode->indirect_i);
+    }
+    else if (inode->indirect_i != -1){
+        fsck__claim_block(inode->indirect_i, inode->inode_i);
+    }
+
+    for (int i = 0; i < expected; i++){
+        int block_i = inode__get_block_i(inode, i);
+        if (block_i < 0 && !inode__is_hole(inode, i)){
+            fsck__report("inode %d: block %d of %d is invalid", inode->inode_i, i, expected);
+            continue;
+        }
+        if (block_i < 0){
+            continue;
+        }
+        fsck__claim_block(block_i, inode->inode_i);
+    }
+}
+
+//Checks if the snapshot table slot [snapshot] points at a run of blocks that can hold a snapshot
+static int fsck__valid_snapshot_run(neat_snapshot_t *snapshot){
+    return snapshot->first_block_i >= INODE_FIRST_DATA_BLOCK
+           && snapshot->first_block_i + SNAPSHOT_BLOCKS <= BLOCK_COUNT;
+}
+
+//Walks the block maps of every inode in every snapshot, recording the snapshot as one more owner of their blocks
+static void fsck__scan_snapshots(){
+    for (int snapshot_id = 1; snapshot_id <= SNAPSHOT_MAX; snapshot_id++){
+        neat_snapshot_t *snapshot = snapshot__get(snapshot_id);
+        if (snapshot == NULL){
+            continue;
+        }
+        if (!fsck__valid_snapshot_run(snapshot)){
+            fsck__report("snapshot %d: points at invalid block %d", snapshot_id, snapshot->first_block_i);
+            continue;
+        }
+        if (!quiet){
+            printf("%schecking the block maps of snapshot %d\n", FSCK_FILE_NAME, snapshot_id);
+        }
+
+        for (int i = 0; i < SNAPSHOT_BLOCKS; i++){
+            fsck__claim_block(snapshot->first_block_i + i, -1);
+        }
+        snapshot__view(snapshot_id);
+        void *inbm = inode__get_inode_bitmap();
+        for (int inode_i = 0; inode_i < inode__get_inode_count(); inode_i++){
+            if (bitmap_get(inbm, inode_i)){
+                fsck__scan_map(inode__get_inode(inode_i));
+            }
+        }
+        snapshot__view(0);
+    }
+}
+
+//Checks every entry of the directory [dd] and counts the references to the inodes they point at
+static void fsck__scan_dir(neat_inode_t *dd){
+    int num_of_dir = dir__entry_count(dd);
+
+    if (dir__inode_i_from_inode(dd, ".") != dd->inode_i){
+        fsck__report("inode %d: directory has no \".\" entry pointing at itself", dd->inode_i);
+    }
+    if (dir__inode_i_from_inode(dd, "..") < 0){
+        fsck__report("inode %d: directory has no \"..\" entry", dd->inode_i);
+    }
+
+    if ((dd->flags & NEAT_INODE_PACKED_DIR) && dd->size % BLOCK_SIZE != 0){
+        fsck__report("inode %d: packed directory size %d isn't a whole number of blocks", dd->inode_i, dd->size);
+    }
+
+    neat_dir_t entry;
+    for (int i = 0; i < num_of_dir; i++){
+        if (dir__get_entry(dd, i, &entry) != 0){
+            fsck__report("inode %d: entry %d lies in a missing block or is damaged", dd->inode_i, i);
+            continue;
+        }
+
+        int target_i = entry.inode_i;
+        if (!fsck__valid_inode_i(target_i)){
+            fsck__report("inode %d: entry '%s' points at free inode %d", dd->inode_i, entry.name, target_i);
+            continue;
+        }
+        atomic_fetch_add(&inode_refs[target_i], 1);
+        if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0){
+            atomic_fetch_add(&inode_named_refs[target_i], 1);
+        }
+    }
+}
+
+static void *fsck__worker_main(void *arg){
+    fsck_worker_t *worker = arg;
+    int inode_count = inode__get_inode_count();
+    void *inbm = get_inode_bitmap();
+
+    for (int inode_i = worker->worker_i; inode_i < inode_count; inode_i += worker->worker_count){
+        if (!bitmap_get(inbm, inode_i)){
+            continue;
+        }
+
+        neat_inode_t *inode = inode__get_inode(inode_i);
+        if (inode->inode_i != inode_i){
+            fsck__report("inode %d: records its own index as %d", inode_i, inode->inode_i);
+        }
+
+        fsck__scan_map(inode);
+        if (fsck__is_dir(inode)){
+            fsck__scan_dir(inode);
+        }
+    }
+    return NULL;
+}
+
+//Runs the parallel inode table scan followed by the bitmap / reference cross checks
+//Returns the number of problems found
+static int fsck__check(int worker_count){
+    int inode_count = inode__get_inode_count();
+
+    atomic_store(&problem_count, 0);
+    for (int i = 0; i < BLOCK_COUNT; i++){
+        atomic_store(&block_owners[i], 0);
+        atomic_store(&block_first_owner[i], -1);
+    }
+    for (int i = 0; i < inode_count; i++){
+        atomic_store(&inode_refs[i], 0);
+        atomic_store(&inode_named_refs[i], 0);
+    }
+
+    if (!fsck__valid_inode_i(0) || !fsck__is_dir(inode__get_inode(0))){
+        fsck__report("root inode 0 is missing or not a directory");
+        return atomic_load(&problem_count);
+    }
+
+    fsck_worker_t workers[worker_count];
+    for (int i = 0; i < worker_count; i++){
+        workers[i].worker_i = i;
+        workers[i].worker_count = worker_count;
+        pthread_create(&workers[i].thread, NULL, fsck__worker_main, &workers[i]);
+    }
+    for (int i = 0; i < worker_count; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    fsck__scan_snapshots();
+
+    void *bbm = get_blocks_bitmap();
+    uint8_t *refs = get_block_refs();
+    uint32_t *checksums = get_block_checksums();
+    for (int block_i = 0; block_i < INODE_FIRST_DATA_BLOCK; block_i++){
+        if (!bitmap_get(bbm, block_i)){
+            fsck__report("metadata block %d is marked free", block_i);
+        }
+    }
+    for (int block_i = INODE_FIRST_DATA_BLOCK; block_i < BLOCK_COUNT; block_i++){
+        int owners = atomic_load(&block_owners[block_i]);
+        int marked = bitmap_get(bbm, block_i);
+
+        //a block with N owners has to say so, otherwise the first write through one of them changes it for all
+        if (owners > 0 && owners != refs[block_i] + 1){
+            fsck__report("block %d has %d owner(s) but a share count of %d", block_i, owners, refs[block_i]);
+        }
+        if (owners > 0 && !marked){
+            fsck__report("block %d is used by inode %d but marked free", block_i, atomic_load(&block_first_owner[block_i]));
+        }
+        else if (owners == 0 && marked){
+            fsck__report("block %d is marked used but no inode owns it", block_i);
+        }
+        if (marked && checksums[block_i] != 0 && checksum__block(block_i) != checksums[block_i]){
+            fsck__report("block %d doesn't match its checksum", block_i);
+        }
+    }
+
+    //counting again also leaves the summary right, whether or not this is a repair
+    int stale_regions = recount_free_blocks();
+    if (stale_regions > 0){
+        fsck__report("the free block summary is off in %d region(s)", stale_regions);
+    }
+
+    void *inbm = get_inode_bitmap();
+    for (int inode_i = 1; inode_i < inode_count; inode_i++){
+        if (bitmap_get(inbm, inode_i) && atomic_load(&inode_named_refs[inode_i]) == 0){
+            fsck__report("inode %d is orphaned (no directory entry points at it)", inode_i);
+        }
+    }
+
+    for (int inode_i = 0; inode_i < inode_count; inode_i++){
+        if (!bitmap_get(inbm, inode_i)){
+            continue;
+        }
+        int nlink = inode__get_inode(inode_i)->nlink;
+        int expected = atomic_load(&inode_refs[inode_i]);
+        if (expected > 0 && nlink != expected){
+            fsck__report("inode %d has link count %d but %d link(s) point at it", inode_i, nlink, expected);
+        }
+    }
+
+    return atomic_load(&problem_count);
+}
+
+//Drops directory entries that point at free inodes, and the ones that can't be read at all
+static void fsck__repair_dir_entries(){
+    int inode_count = inode__get_inode_count();
+
+    for (int inode_i = 0; inode_i < inode_count; inode_i++){
+        if (!fsck__valid_inode_i(inode_i) || !fsck__is_dir(inode__get_inode(inode_i))){
+            continue;
+        }
+
+        neat_dir_t dd_entry;
+        neat_inode_t *dd = inode__get_inode(inode_i);
+        //walk backwards, removing an entry only moves the ones after it
+        for (int i = dir__entry_count(dd) - 1; i >= 0; i--){
+            if (dir__get_entry(dd, i, &dd_entry) != 0){
+                printf("%sremoving damaged entry %d from inode %d\n", FSCK_FILE_NAME, i, inode_i);
+                dir__rm_entry(dd, i);
+            }
+            else if (!fsck__valid_inode_i(dd_entry.inode_i)){
+                printf("%sremoving dangling entry '%s' from inode %d\n", FSCK_FILE_NAME, dd_entry.name, inode_i);
+                dir__rm_entry(dd, i);
+            }
+        }
+    }
+}
+
+//Adds the blocks every intact snapshot holds to [owners], dropping the snapshots with a damaged block map
+static void fsck__count_snapshot_owners(int *owners){
+    for (int snapshot_id = 1; snapshot_id <= SNAPSHOT_MAX; snapshot_id++){
+        neat_snapshot_t *snapshot = snapshot__get(snapshot_id);
+        if (snapshot == NULL){
+            continue;
+        }
+
+        int held[BLOCK_COUNT] = {0};
+        int intact = fsck__valid_snapshot_run(snapshot) && snapshot__view(snapshot_id) == 0;
+        void *inbm = inode__get_inode_bitmap();
+        for (int inode_i = 0; intact && inode_i < inode__get_inode_count(); inode_i++){
+            if (!bitmap_get(inbm, inode_i)){
+                continue;
+            }
+
+            neat_inode_t *inode = inode__get_inode(inode_i);
+            int expected = inode__blocks_for_size(inode__stored_size(inode));
+            if (expected > inode__max_blocks()
+                || (inode->indirect_i != -1 && !fsck__valid_data_block(inode->indirect_i))){
+                intact = 0;
+                break;
+            }
+            if (expected > NEAT_INODE_DIRECT_BLOCKS && inode->indirect_i != -1){
+                held[inode->indirect_i]++;
+            }
+            int xattr_held[BLOCK_COUNT];
+            int xattr_held_count = xattr__check(inode) == 0 ? xattr__held_blocks(inode, xattr_held, BLOCK_COUNT) : -1;
+            intact = xattr_held_count >= 0;
+            for (int i = 0; i < xattr_held_count; i++){
+                held[xattr_held[i]]++;
+            }
+            for (int i = 0; i < expected && intact; i++){
+                int block_i = inode__get_block_i(inode, i);
+                intact = block_i >= 0 || inode__is_hole(inode, i);
+                held[block_i >= 0 ? block_i : 0]++;
+            }
+        }
+        snapshot__view(0);
+
+        //a snapshot can't be cut short like a file, it is either whole or gone
+        if (!intact){
+            printf("%sdropping snapshot %d, its block maps are damaged\n", FSCK_FILE_NAME, snapshot_id);
+            memset(snapshot, 0, sizeof(neat_snapshot_t));
+            continue;
+        }
+        for (int i = 0; i < SNAPSHOT_BLOCKS; i++){
+            held[snapshot->first_block_i + i]++;
+        }
+        for (int block_i = INODE_FIRST_DATA_BLOCK; block_i < BLOCK_COUNT; block_i++){
+            owners[block_i] += held[block_i];
+        }
+    }
+}
+
+//Rewalks every block map in inode order, cutting it at the first block that is invalid (holes are fine),
+//then rebuilds the block bitmap and share counts from what is left
+static void fsck__repair_maps(){
+    int inode_count = inode__get_inode_count();
+    void *inbm = get_inode_bitmap();
+    int owners[BLOCK_COUNT] = {0};
+
+    //orphans are freed outright, their blocks fall out with the bitmap rebuild
+    for (int inode_i = 1; inode_i < inode_count; inode_i++){
+        if (bitmap_get(inbm, inode_i) && atomic_load(&inode_named_refs[inode_i]) == 0){
+            printf("%sfreeing orphaned inode %d\n", FSCK_FILE_NAME, inode_i);
+            bitmap_put(inbm, inode_i, 0);
+        }
+    }
+
+    for (int inode_i = 0; inode_i < inode_count; inode_i++){
+        if (!bitmap_get(inbm, inode_i)){
+            continue;
+        }
+
+        neat_inode_t *inode = inode__get_inode(inode_i);
+        inode->inode_i = inode_i;
+        int expected = inode__blocks_for_size(inode__stored_size(inode));
+        expected = expected < inode__max_blocks() ? expected : inode__max_blocks();
+        //without its indirect block the file ends with its direct blocks
+        int map_end = expected;
+        if (inode->indirect_i != -1 && !fsck__valid_data_block(inode->indirect_i)){
+            inode->indirect_i = -1;
+            map_end = expected < NEAT_INODE_DIRECT_BLOCKS ? expected : NEAT_INODE_DIRECT_BLOCKS;
+        }
+
+        if (!fsck__valid_inline_link(inode)){
+            printf("%sdropping the symlink target of inode %d, it doesn't fit inline\n", FSCK_FILE_NAME, inode_i);
+            for (int i = 0; i < NEAT_INODE_DIRECT_BLOCKS; i++){
+                inode->blocks[i] = -1;
+            }
+            inode->flags &= ~NEAT_INODE_INLINE_LINK;
+            inode->size = 0;
+        }
+
+        //damaged attributes are let go of as a whole, their blocks fall out with the bitmap rebuild
+        if (xattr__check(inode) != 0){
+            printf("%sdropping the extended attributes of inode %d, they are damaged\n", FSCK_FILE_NAME, inode_i);
+            xattr__clear(inode);
+        }
+        int xattr_held[BLOCK_COUNT];
+        int xattr_held_count = xattr__held_blocks(inode, xattr_held, BLOCK_COUNT);
+        for (int i = 0; i < xattr_held_count; i++){
+            owners[xattr_held[i]]++;
+        }
+
+        int length = 0;
+        while (length < map_end && (inode__get_block_i(inode, length) >= 0 || inode__is_hole(inode, length))){
+            length++;
+        }
+
+        if (length < expected && (length == 0 || (inode->flags & NEAT_INODE_COMPRESSED))){
+            //frames past the cut are gone and the frame table can't be trusted, so nothing is left to keep
+            if (inode->flags & NEAT_INODE_COMPRESSED){
+                printf("%sdropping the compressed data of inode %d, its block map was cut short\n", FSCK_FILE_NAME, inode_i);
+            }
+            else {
+                printf("%sinode %d lost its first block, reset to empty\n", FSCK_FILE_NAME, inode_i);
+            }
+            inode->size = 0;
+            inode->stored_size = 0;
+            inode->flags = 0;
+            length = 0;
+        }
+        else if (length < expected){
+            printf("%struncating inode %d to %d blocks\n", FSCK_FILE_NAME, inode_i, length);
+            inode->size = length * BLOCK_SIZE;
+        }
+
+        //whatever the map still lists past the end is let go of
+        for (int i = length; i < NEAT_INODE_DIRECT_BLOCKS; i++){
+            inode->blocks[i] = -1;
+        }
+        if (length <= NEAT_INODE_DIRECT_BLOCKS){
+            inode->indirect_i = -1;
+        }
+        else if (inode->indirect_i != -1){
+            owners[inode->indirect_i]++;
+        }
+        for (int i = 0; i < length; i++){
+            int block_i = inode__get_block_i(inode, i);
+            owners[block_i >= 0 ? block_i : 0]++;
+        }
+    }
+
+    fsck__count_snapshot_owners(owners);
+
+    uint8_t *refs = get_block_refs();
+    for (int block_i = 0; block_i < BLOCK_COUNT; block_i++){
+        mark_block_used(block_i, block_i < INODE_FIRST_DATA_BLOCK || owners[block_i] > 0);
+        if (block_i >= INODE_FIRST_DATA_BLOCK){
+            int shares = owners[block_i] > 0 ? owners[block_i] - 1 : 0;
+            refs[block_i] = shares < BLOCK_MAX_SHARES ? shares : BLOCK_MAX_SHARES;
+        }
+    }
+}
+
+//Sets every link count to the number of entries actually pointing at the inode
+static void fsck__repair_link_counts(){
+    int inode_count = inode__get_inode_count();
+
+    for (int inode_i = 0; inode_i < inode_count; inode_i++){
+        if (!fsck__valid_inode_i(inode_i)){
+            continue;
+        }
+        neat_inode_t *inode = inode__get_inode(inode_i);
+        int expected = atomic_load(&inode_refs[inode_i]);
+        if (inode->nlink != expected){
+            printf("%ssetting link count of inode %d to %d\n", FSCK_FILE_NAME, inode_i, expected);
+            inode->nlink = expected;
+        }
+    }
+}
+
+//Checksums every block that doesn't match its checksum again, whatever it holds is all there is now
+static void fsck__repair_checksums(){
+    uint32_t *checksums = get_block_checksums();
+
+    for (int block_i = INODE_FIRST_DATA_BLOCK; block_i < BLOCK_COUNT; block_i++){
+        if (!bitmap_get(get_blocks_bitmap(), block_i) || checksums[block_i] == 0){
+            continue;
+        }
+        if (checksum__block(block_i) != checksums[block_i]){
+            printf("%sblock %d doesn't match its checksum, its data may be damaged\n", FSCK_FILE_NAME, block_i);
+            checksum__seal(block_i);
+        }
+    }
+}
+
+static void fsck__usage(const char *prog){
+    fprintf(stderr, "usage: %s [-r] [-j threads] disk_image\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    int repair = 0;
+    int worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1){
+        switch (opt){
+        case 'r':
+            repair = 1;
+            break;
+        case 'j':
+            worker_count = atoi(optarg);
+            break;
+        default:
+            fsck__usage(argv[0]);
+            return FSCK_EXIT_USAGE;
+        }
+    }
+    if (optind != argc - 1 || worker_count < 1){
+        fsck__usage(argv[0]);
+        return FSCK_EXIT_USAGE;
+    }
+
+    //blocks_init would happily create an empty image, which is never what fsck wants
+    const char *image_path = argv[optind];
+    if (blocks_check_image(image_path) != 0){
+        fprintf(stderr, "%sERROR: %s is not a %d byte nufs image\n", FSCK_FILE_NAME, image_path, NUFS_SIZE);
+        return FSCK_EXIT_USAGE;
+    }
+    blocks_init(image_path);
+    //whatever the repair rewrites stays checksummed
+    checksum__set_enabled(1);
+
+    inode_refs = calloc(inode__get_inode_count(), sizeof(atomic_int));
+    inode_named_refs = calloc(inode__get_inode_count(), sizeof(atomic_int));
+
+    int problems = fsck__check(worker_count);
+    printf("%s%s: %d problem(s) found\n", FSCK_FILE_NAME, image_path, problems);
+
+    int rv = FSCK_EXIT_OK;
+    if (problems > 0 && repair){
+        fsck__repair_dir_entries();
+        //entries dropped above may have orphaned more inodes, so recount before fixing block maps
+        quiet = 1;
+        fsck__check(worker_count);
+        quiet = 0;
+        fsck__repair_maps();
+        fsck__repair_link_counts();
+        fsck__repair_checksums();
+
+        problems = fsck__check(worker_count);
+        printf("%s%s: %d problem(s) left after repair\n", FSCK_FILE_NAME, image_path, problems);
+        rv = problems == 0 ? FSCK_EXIT_REPAIRED : FSCK_EXIT_UNCORRECTED;
+    }
+    else if (problems > 0){
+        rv = FSCK_EXIT_UNCORRECTED;
+    }
+
+    int shared = 0, saved = 0;
+    uint8_t *refs = get_block_refs();
+    for (int block_i = INODE_FIRST_DATA_BLOCK; block_i < BLOCK_COUNT; block_i++){
+        if (bitmap_get(get_blocks_bitmap(), block_i) && refs[block_i] > 0){
+            shared++;
+            saved += refs[block_i];
+        }
+    }
+    if (shared > 0){
+        printf("%s%d shared block(s) saving %d block(s)\n", FSCK_FILE_NAME, shared, saved);
+    }
+
+    free(inode_refs);
+    free(inode_named_refs);
+    blocks_free();
+    return rv;
+}
@@ -0,0 +1,397 @@
+// nufs-replay: replays a trace recorded with -o trace=FILE straight into the storage layer, no FUSE involved
+//
+// usage: nufs-replay [-c] [-z] [-d] [-k] [-l] trace disk_image
+//
+// The image should be a copy of the one the trace was recorded on, taken before
+// that mount started, since every op is replayed as it was (and whatever the
+// replay writes ends up in the image). By default the ops run one after the
+// other as fast as they can. -c replays them with the original concurrency
+// instead: one thread per thread that made calls while recording, each one
+// starting its ops no earlier than they started back then. -z, -d, -k and -l turn
+// on compression, dedup, checksums and log mode like the mount options of the
+// same name (log mode with the cleaner running alongside the replay).
+//
+// Prints one JSON object per op on stdout: how many calls were replayed, how
+// many returned something else than when they were recorded, and the replay
+// latencies next to the recorded ones. Ioctls are counted but not replayed.
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "neat_cleaner.h"
+#include "neat_directory.h"
+#include "neat_inode.h"
+#include "neat_stats.h"
+#include "neat_storage.h"
+#include "neat_trace.h"
+
+#define REPLAY_FILE_NAME "nufs_replay.c // "
+
+//what replay__op returns for an op it doesn't replay, no call ever returns it
+#define REPLAY_SKIPPED INT_MIN
+//smallest data buffer the ops of a thread share
+#define REPLAY_MIN_BUFFER 4096
+
+typedef struct replay_op {
+    neat_trace_record_t record;
+    char *path;
+    char *path2;
+    long long latency_ns;
+    int rv;
+} replay_op_t;
+
+typedef struct replay_thread {
+    pthread_t thread;
+    int thread_i;
+    long long replay_start_ns;
+} replay_thread_t;
+
+static FILE *results;
+static replay_op_t *ops = NULL;
+static int op_count = 0;
+static uint32_t max_size = REPLAY_MIN_BUFFER;
+static int thread_count = 0;
+//when the first recorded call started, pacing counts from there instead of from the mount
+static int64_t first_start_ns = INT64_MAX;
+//the handle each recorded handle got in the replay, -1 for none
+static int *handles;
+
+//Loads every record of the trace at [path] into ops
+//Returns 0 on success, -1 on failure
+static int replay__load(const char *path){
+    FILE *file = fopen(path, "r");
+    if (file == NULL){
+        fprintf(stderr, "%sERROR: can't open the trace %s\n", REPLAY_FILE_NAME, path);
+        return -1;
+    }
+    if (trace__read_header(file) != 0){
+        fprintf(stderr, "%sERROR: %s isn't a trace this build can replay\n", REPLAY_FILE_NAME, path);
+        fclose(file);
+        return -1;
+    }
+
+    char record_path[TRACE_PATH_MAX + 1];
+    char record_path2[TRACE_PATH_MAX + 1];
+    neat_trace_record_t record;
+    int capacity = 0;
+    int rv;
+    while ((rv = trace__read_record(file, &record, record_path, record_path2)) == 1){
+        if (op_count == capacity){
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            ops = realloc(ops, capacity * sizeof(replay_op_t));
+        }
+        replay_op_t *op = &ops[op_count++];
+        op->record = record;
+        op->path = strdup(record_path);
+        op->path2 = strdup(record_path2);
+
+        max_size = record.size > max_size ? record.size : max_size;
+        first_start_ns = record.start_ns < first_start_ns ? record.start_ns : first_start_ns;
+        thread_count = record.thread >= thread_count ? record.thread + 1 : thread_count;
+    }
+    fclose(file);
+
+    if (rv < 0){
+        fprintf(stderr, "%sERROR: %s is cut short or damaged after %d records\n", REPLAY_FILE_NAME, path, op_count);
+        return -1;
+    }
+    return 0;
+}
+
+//Does what nufs_readdir does for every entry, minus handing them to FUSE
+static int replay__readdir(const char *path){
+    int inode_i = dir__inode_i_from_path(path);
+    if (inode_i < 0){
+        return -ENOENT;
+    }
+    neat_inode_t *dd = inode__get_inode(inode_i);
+    if (!S_ISDIR(dd->mode)){
+        return -ENOTDIR;
+    }
+
+    struct stat st;
+    neat_dir_t entry;
+    int entry_count = dir__entry_count(dd);
+    for (int i = 0; i < entry_count; i++){
+        if (dir__get_entry(dd, i, &entry) != 0){
+            return -EIO;
+        }
+        int rv = storage_stat_inode(entry.inode_i, &st);
+        if (rv != 0){
+            return rv;
+        }
+    }
+    return 0;
+}
+
+//Maps the handle [recorded] from the trace to an index into handles
+//Returns the index on success, -1 if it can't be a handle
+static int replay__handle_i(int64_t recorded){
+    return recorded >= 0 && recorded < inode__get_inode_count() ? recorded : -1;
+}
+
+//Makes the call [op] was recorded as, with [buf] as the data (caller holds storage_lock)
+//Returns what the call returned, REPLAY_SKIPPED if it isn't replayed
+static int replay__op(replay_op_t *op, char *buf){
+    neat_trace_record_t *record = &op->record;
+    int handle_i;
+
+    switch (record->op){
+    case STATS_OP_GETATTR: {
+        struct stat st;
+        return storage_stat(op->path, &st);
+    }
+    case STATS_OP_ACCESS:
+        return dir__inode_i_from_path(op->path) >= 0 ? 0 : -ENOENT;
+    case STATS_OP_READDIR:
+        return replay__readdir(op->path);
+    case STATS_OP_MKNOD:
+    case STATS_OP_MKDIR:
+        return storage_mknod(op->path, record->arg);
+    case STATS_OP_UNLINK:
+        return storage_unlink(op->path);
+    case STATS_OP_LINK:
+        return storage_link(op->path, op->path2);
+    case STATS_OP_RMDIR:
+        return storage_rmdir(op->path);
+    case STATS_OP_RENAME:
+        return storage_rename(op->path, op->path2);
+    case STATS_OP_CHMOD:
+        return storage_chmod(op->path, record->arg);
+    case STATS_OP_TRUNCATE:
+        return storage_truncate(op->path, record->size);
+    case STATS_OP_OPEN: {
+        int inode_i = storage_open(op->path);
+        handle_i = replay__handle_i(record->offset);
+        if (inode_i >= 0 && handle_i >= 0){
+            handles[handle_i] = inode_i;
+        }
+        //what the kernel would have been told to cache counts towards page_cache_kept like it did live
+        if (inode_i >= 0){
+            storage_open_cache_policy(inode_i);
+        }
+        return inode_i >= 0 ? 0 : inode_i;
+    }
+    case STATS_OP_RELEASE:
+        handle_i = replay__handle_i(record->offset);
+        if (handle_i < 0 || handles[handle_i] < 0){
+            return -EBADF;
+        }
+        storage_release(handles[handle_i]);
+        handles[handle_i] = -1;
+        return 0;
+    case STATS_OP_READ:
+        return storage_read(op->path, buf, record->size, record->offset);
+    case STATS_OP_WRITE:
+        return storage_write(op->path, buf, record->size, record->offset);
+    case STATS_OP_UTIMENS: {
+        struct timespec ts[2];
+        clock_gettime(CLOCK_REALTIME, &ts[0]);
+        ts[1] = ts[0];
+        return storage_set_time(op->path, ts);
+    }
+    case STATS_OP_SYMLINK:
+        return storage_symlink(op->path2, op->path);
+    case STATS_OP_READLINK:
+        return storage_readlink(op->path, buf, record->size);
+    case STATS_OP_SETXATTR:
+        return storage_setxattr(op->path, op->path2, buf, record->size, record->arg);
+    case STATS_OP_GETXATTR:
+        return storage_getxattr(op->path, op->path2, buf, record->size);
+    case STATS_OP_LISTXATTR:
+        return storage_listxattr(op->path, buf, record->size);
+    case STATS_OP_REMOVEXATTR:
+        return storage_removexattr(op->path, op->path2);
+    case STATS_OP_FALLOCATE:
+        return storage_fallocate(op->path, record->arg, record->offset, record->size);
+    case STATS_OP_STATFS: {
+        struct statvfs vfs_st;
+        return storage_statfs(&vfs_st);
+    }
+    case STATS_OP_FSYNC:
+        return storage_fsync();
+    default:
+        //ioctls take snapshots or reset counters, nothing a layout change would make faster or slower
+        return REPLAY_SKIPPED;
+    }
+}
+
+static void replay__sleep_until(long long target_ns){
+    struct timespec ts = {target_ns / 1000000000LL, target_ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+    }
+}
+
+//Replays the ops of the recorded thread [thread_i] (every op for -1), paced to their original start times
+//from [replay_start_ns] unless that is 0
+static void replay__run(int thread_i, long long replay_start_ns){
+    char *buf = malloc(max_size);
+    memset(buf, 'r', max_size);
+
+    for (int i = 0; i < op_count; i++){
+        replay_op_t *op = &ops[i];
+        if (thread_i >= 0 && op->record.thread != thread_i){
+            continue;
+        }
+        if (replay_start_ns != 0){
+            replay__sleep_until(replay_start_ns + op->record.start_ns - first_start_ns);
+        }
+
+        long long start_ns = stats__now_ns();
+        storage_lock();
+        op->rv = replay__op(op, buf);
+        storage_unlock();
+        op->latency_ns = stats__now_ns() - start_ns;
+    }
+    free(buf);
+}
+
+static void *replay__thread_main(void *arg){
+    replay_thread_t *thread = arg;
+    replay__run(thread->thread_i, thread->replay_start_ns);
+    return NULL;
+}
+
+static int replay__cmp_ll(const void *a, const void *b){
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void replay__report(long long wall_ns){
+    long long *replayed = malloc(sizeof(long long) * (op_count + 1));
+    long long *recorded = malloc(sizeof(long long) * (op_count + 1));
+
+    for (int op = 0; op < STATS_OP_COUNT; op++){
+        int count = 0, mismatched = 0, skipped = 0;
+        for (int i = 0; i < op_count; i++){
+            if (ops[i].record.op != op){
+                continue;
+            }
+            if (ops[i].rv == REPLAY_SKIPPED){
+                skipped++;
+                continue;
+            }
+            mismatched += ops[i].rv != ops[i].record.rv;
+            replayed[count] = ops[i].latency_ns;
+            recorded[count] = ops[i].record.duration_ns;
+            count++;
+        }
+        if (count == 0 && skipped == 0){
+            continue;
+        }
+
+        qsort(replayed, count, sizeof(long long), replay__cmp_ll);
+        qsort(recorded, count, sizeof(long long), replay__cmp_ll);
+        //an op that was only ever skipped reports zeros
+        replayed[count] = recorded[count] = 0;
+        int p50 = count / 2, p99 = (count * 99) / 100, last = count > 0 ? count - 1 : 0;
+        fprintf(results, "{\"op\":\"%s\",\"calls\":%d,\"skipped\":%d,\"mismatched\":%d,"
+                "\"p50_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld,"
+                "\"recorded_p50_ns\":%lld,\"recorded_p99_ns\":%lld,\"recorded_max_ns\":%lld}\n",
+                stats__op_name(op), count, skipped, mismatched,
+                replayed[p50], replayed[p99], replayed[last], recorded[p50], recorded[p99], recorded[last]);
+    }
+    fprintf(results, "{\"op\":\"all\",\"calls\":%d,\"threads\":%d,\"secs\":%.6f}\n",
+            op_count, thread_count, wall_ns / 1e9);
+
+    free(replayed);
+    free(recorded);
+}
+
+static void replay__usage(const char *prog){
+    fprintf(stderr, "usage: %s [-c] [-z] [-d] [-k] [-l] trace disk_image\n", prog);
+}
+
+int main(int argc, char *argv[]){
+    int concurrent = 0, compress = 0, dedup = 0, checksums = 0, log = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "czdkl")) != -1){
+        switch (opt){
+        case 'c':
+            concurrent = 1;
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'd':
+            dedup = 1;
+            break;
+        case 'k':
+            checksums = 1;
+            break;
+        case 'l':
+            log = 1;
+            break;
+        default:
+            replay__usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 2){
+        replay__usage(argv[0]);
+        return 1;
+    }
+    if (replay__load(argv[optind]) != 0){
+        return 1;
+    }
+
+    //keep the real stdout for the results, the storage layer logs every call with printf
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL){
+        fprintf(stderr, "%sERROR: can't redirect stdout\n", REPLAY_FILE_NAME);
+        return 1;
+    }
+
+    storage_init(argv[optind + 1]);
+    storage_set_compression(compress);
+    storage_set_dedup(dedup);
+    storage_set_checksums(checksums);
+    storage_set_log(log);
+    if (log && cleaner__start() != 0){
+        return 1;
+    }
+    handles = malloc(sizeof(int) * inode__get_inode_count());
+    for (int i = 0; i < inode__get_inode_count(); i++){
+        handles[i] = -1;
+    }
+
+    long long start_ns = stats__now_ns();
+    if (concurrent){
+        replay_thread_t threads[thread_count];
+        for (int i = 0; i < thread_count; i++){
+            threads[i].thread_i = i;
+            threads[i].replay_start_ns = start_ns;
+            pthread_create(&threads[i].thread, NULL, replay__thread_main, &threads[i]);
+        }
+        for (int i = 0; i < thread_count; i++){
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+    else {
+        replay__run(-1, 0);
+    }
+    long long wall_ns = stats__now_ns() - start_ns;
+
+    //handles the trace never released only go now, so files unlinked while open still get reclaimed
+    for (int i = 0; i < inode__get_inode_count(); i++){
+        if (handles[i] >= 0){
+            storage_release(handles[i]);
+        }
+    }
+    cleaner__stop();
+    blocks_free();
+
+    replay__report(wall_ns);
+    fclose(results);
+    return 0;
+}
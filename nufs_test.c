@@ -0,0 +1,1157 @@
+// nufs-test: in-process behavior tests for the storage layer, no FUSE involved
+//
+// usage: nufs-test [test ...]
+//
+// Each test runs against a fresh image in /tmp and prints one TAP line
+// ("ok N - name" or "not ok N - name", with the failed checks as comments),
+// the way test.pl does for a mounted filesystem. Everything the storage layer
+// prints itself goes to /dev/null. With no test names given, all of them run.
+// Exits with 1 if any test failed.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "neat_checksum.h"
+#include "neat_cleaner.h"
+#include "neat_compress.h"
+#include "neat_dedup.h"
+#include "neat_defrag.h"
+#include "neat_directory.h"
+#include "neat_inode.h"
+#include "neat_snapshot.h"
+#include "neat_storage.h"
+#include "neat_xattr.h"
+
+#define TEST_FILE_NAME "nufs_test.c // "
+//built next to nufs-test by make check
+#define TEST_FSCK "./nufs-fsck"
+
+typedef void (*test_fn)();
+
+typedef struct test_case {
+    const char *name;
+    test_fn fn;
+} test_case_t;
+
+static FILE *results;
+static char image_path[] = "/tmp/nufs-test-XXXXXX";
+//checks that failed in the test running now
+static int check_failures;
+
+//Records [cond] failing as a comment under the test running now, and carries on with the test
+#define TEST_CHECK(cond) do { \
+        if (!(cond)){ \
+            fprintf(results, "#   %s:%d: %s\n", TEST_FILE_NAME, __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+static void test__fresh_image(){
+    int fd = mkstemp(image_path);
+    if (fd < 0){
+        fprintf(stderr, "%sERROR: can't create a scratch image: %s\n", TEST_FILE_NAME, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    storage_init(image_path);
+}
+
+static void test__drop_image(){
+    storage_free();
+    unlink(image_path);
+    strcpy(image_path + strlen(image_path) - 6, "XXXXXX");
+}
+
+//Writes [size] bytes of [c] at [offset] of [path]
+//Returns 0 if all of them were written, -1 if not
+static int test__fill(const char *path, char c, int size, int offset){
+    char *buf = malloc(size);
+    memset(buf, c, size);
+    int rv = storage_write(path, buf, size, offset);
+    free(buf);
+    return rv == size ? 0 : -1;
+}
+
+//Checks that [size] bytes at [offset] of [path] read back as [c]
+//Returns 1 if they all do, 0 if not
+static int test__filled(const char *path, char c, int size, int offset){
+    char *buf = malloc(size);
+    int rv = storage_read(path, buf, size, offset);
+    int filled = rv == size;
+    for (int i = 0; filled && i < size; i++){
+        filled = buf[i] == c;
+    }
+    free(buf);
+    return filled;
+}
+
+//Gets the size of [path]
+//Returns the size on success, -1 if there is no such file
+static long test__size(const char *path){
+    struct stat st;
+    return storage_stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+//Unmounts the image cleanly and mounts it again
+static void test__remount(){
+    storage_free();
+    storage_init(image_path);
+}
+
+//Reads the whole image file as it is on disk into [buf] (NUFS_SIZE bytes)
+//Returns 0 on success, -1 on failure
+static int test__read_image_file(char *buf){
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0){
+        return -1;
+    }
+    ssize_t got = pread(fd, buf, NUFS_SIZE, 0);
+    close(fd);
+    return got == NUFS_SIZE ? 0 : -1;
+}
+
+//Unmounts the image, overwrites the int at byte [offset] of block [block_i] in the image file with [value] (what
+//going bad on disk looks like) and mounts it again
+static void test__damage_block(int block_i, int offset, int value){
+    storage_free();
+    int fd = open(image_path, O_WRONLY);
+    TEST_CHECK(pwrite(fd, &value, sizeof(value), (off_t) block_i * BLOCK_SIZE + offset) == sizeof(value));
+    close(fd);
+    storage_init(image_path);
+}
+
+//A snapshot mount can run next to the live one, so it must not write anything to the image, not even the
+//free block summary or the layout in block 0
+static void test__snapshot_mount_read_only(){
+    char buf[BLOCK_SIZE];
+    memset(buf, 's', sizeof(buf));
+    TEST_CHECK(storage_mknod("/kept", 0100644) == 0);
+    TEST_CHECK(storage_write("/kept", buf, sizeof(buf), 0) == sizeof(buf));
+    int snapshot_id = snapshot__create();
+    TEST_CHECK(snapshot_id > 0);
+    //the live image goes on after the snapshot, so the summary has something to be stale about
+    TEST_CHECK(storage_write("/kept", buf, sizeof(buf), sizeof(buf)) == sizeof(buf));
+    storage_free();
+    //what the image looks like while the live mount has it: the free block summary isn't trusted
+    int fd = open(image_path, O_WRONLY);
+    uint32_t stale_magic = 0;
+    TEST_CHECK(pwrite(fd, &stale_magic, sizeof(stale_magic), BLOCK_SUMMARY_OFFSET) == sizeof(stale_magic));
+    close(fd);
+
+    char *before = malloc(NUFS_SIZE);
+    char *after = malloc(NUFS_SIZE);
+    TEST_CHECK(test__read_image_file(before) == 0);
+
+    storage_init_read_only(image_path);
+    TEST_CHECK(storage_mount_snapshot(snapshot_id) == 0);
+    TEST_CHECK(storage_read_only());
+    struct stat st;
+    TEST_CHECK(storage_stat("/kept", &st) == 0 && st.st_size == BLOCK_SIZE);
+    TEST_CHECK(storage_write("/kept", buf, 1, 0) == -EROFS);
+    storage_free();
+
+    TEST_CHECK(test__read_image_file(after) == 0);
+    TEST_CHECK(memcmp(before, after, NUFS_SIZE) == 0);
+    free(before);
+    free(after);
+
+    storage_init(image_path);
+    TEST_CHECK(!storage_read_only());
+    TEST_CHECK(storage_stat("/kept", &st) == 0 && st.st_size == 2 * BLOCK_SIZE);
+}
+
+//Cloning a range that happens to cover all of a short source must keep the rest of a longer destination,
+//only 0 / 0 / 0 turns the destination into a whole copy
+static void test__clone_range_keeps_destination(){
+    TEST_CHECK(storage_mknod("/src", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/dst", 0100644) == 0);
+    TEST_CHECK(test__fill("/src", 'a', 2 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__fill("/dst", 'b', 4 * BLOCK_SIZE, 0) == 0);
+
+    TEST_CHECK(storage_clone("/dst", "/src", 0, 2 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__size("/dst") == 4 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/dst", 'a', 2 * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/dst", 'b', 2 * BLOCK_SIZE, 2 * BLOCK_SIZE));
+
+    //a length past the end of the source is cut down to it the same way
+    TEST_CHECK(test__fill("/dst", 'b', 4 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_clone("/dst", "/src", 0, 8 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__size("/dst") == 4 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/dst", 'b', 2 * BLOCK_SIZE, 2 * BLOCK_SIZE));
+
+    //offsets past the block map fail before anything of the destination changes, even those an int
+    //would wrap to 0 or to a negative size
+    off_t limit = (off_t) inode__max_blocks() * BLOCK_SIZE;
+    TEST_CHECK(storage_clone("/dst", "/src", 0, BLOCK_SIZE, limit) == -EFBIG);
+    TEST_CHECK(storage_clone("/dst", "/src", 0, 0, limit - BLOCK_SIZE) == -EFBIG);
+    TEST_CHECK(storage_clone("/dst", "/src", 0, BLOCK_SIZE, (off_t) 1 << 32) == -EFBIG);
+    TEST_CHECK(storage_clone("/dst", "/src", 0, BLOCK_SIZE, (off_t) 1 << 31) == -EFBIG);
+    TEST_CHECK(storage_clone("/dst", "/src", (off_t) 1 << 32, BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__size("/dst") == 4 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/dst", 'b', 2 * BLOCK_SIZE, 2 * BLOCK_SIZE));
+
+    TEST_CHECK(storage_clone("/dst", "/src", 0, 0, 0) == 0);
+    TEST_CHECK(test__size("/dst") == 2 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/dst", 'a', 2 * BLOCK_SIZE, 0));
+}
+
+//Defragging moves a file into one run without changing what it reads back or leaking its old blocks, and
+//leaves a file alone while a snapshot still shares its blocks
+static void test__defrag_moves_private_blocks_only(){
+    //past the direct blocks, so the file has an indirect block as well
+    int blocks = NEAT_INODE_DIRECT_BLOCKS + 2;
+    TEST_CHECK(storage_mknod("/x", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/y", 0100644) == 0);
+    for (int i = 0; i < blocks; i++){
+        TEST_CHECK(test__fill("/x", 'x', BLOCK_SIZE, i * BLOCK_SIZE) == 0);
+        TEST_CHECK(test__fill("/y", 'y', BLOCK_SIZE, i * BLOCK_SIZE) == 0);
+    }
+    int inode_i = dir__inode_i_from_path("/x");
+    neat_inode_t *inode = inode__get_inode(inode_i);
+    TEST_CHECK(defrag__inode_fragments(inode, NULL) > 0);
+
+    int snapshot_id = snapshot__create();
+    TEST_CHECK(snapshot_id > 0);
+    TEST_CHECK(defrag__defrag_inode(inode_i) == 0);
+    TEST_CHECK(defrag__inode_fragments(inode, NULL) > 0);
+    TEST_CHECK(snapshot__delete(snapshot_id) == 0);
+
+    int free_before = count_free_blocks();
+    TEST_CHECK(defrag__defrag_inode(inode_i) == blocks);
+    TEST_CHECK(defrag__inode_fragments(inode, NULL) == 0);
+    TEST_CHECK(count_free_blocks() == free_before);
+    TEST_CHECK(test__filled("/x", 'x', blocks * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/y", 'y', blocks * BLOCK_SIZE, 0));
+}
+
+//Opens [path] and gives the handle straight back
+//Returns what storage_open_cache_policy said for it
+static int test__open_policy(const char *path){
+    int inode_i = storage_open(path);
+    int policy = storage_open_cache_policy(inode_i);
+    storage_release(inode_i);
+    return policy;
+}
+
+//Sizes past what the block map holds fail with -EFBIG and leave the file (and its mtime and data
+//generation) as it was, reads out there find the end of the file, sizes within it still work
+static void test__truncate_past_map_limit(){
+    off_t limit = (off_t) inode__max_blocks() * BLOCK_SIZE;
+    TEST_CHECK(storage_mknod("/t", 0100644) == 0);
+    TEST_CHECK(test__fill("/t", 't', BLOCK_SIZE, 0) == 0);
+    test__open_policy("/t");
+
+    TEST_CHECK(storage_truncate("/t", limit + 1) == -EFBIG);
+    TEST_CHECK(storage_truncate("/t", (off_t) 1 << 33) == -EFBIG);
+    TEST_CHECK(storage_truncate("/t", -1) == -EINVAL);
+    TEST_CHECK(storage_fallocate("/t", 0, limit, BLOCK_SIZE) == -EFBIG);
+    char c = 'z';
+    TEST_CHECK(storage_write("/t", &c, 1, limit) == -EFBIG);
+    TEST_CHECK(storage_write("/t", &c, 1, (off_t) 1 << 32) == -EFBIG);
+    TEST_CHECK(test__size("/t") == BLOCK_SIZE);
+    TEST_CHECK(test__open_policy("/t") == STORAGE_OPEN_KEEP_CACHE);
+    //reads that far out are past the end, not wrapped back into the file
+    char buf[BLOCK_SIZE];
+    TEST_CHECK(storage_read("/t", buf, 16, (off_t) 1 << 32) == 0);
+    TEST_CHECK(storage_read("/t", buf, 16, (off_t) 3 << 30) == 0);
+    TEST_CHECK(storage_read("/t", buf, (size_t) 1 << 32, 0) == BLOCK_SIZE);
+    int inode_i = storage_open("/t");
+    TEST_CHECK(storage_read_handle(inode_i, buf, 16, (off_t) 1 << 32) == 0);
+    storage_release(inode_i);
+
+    //the bytes cut off read back as zeros once the file grows over them again
+    TEST_CHECK(storage_truncate("/t", 10) == 0);
+    TEST_CHECK(storage_truncate("/t", limit) == 0);
+    TEST_CHECK(test__size("/t") == limit);
+    TEST_CHECK(test__filled("/t", 't', 10, 0));
+    TEST_CHECK(test__filled("/t", 0, BLOCK_SIZE - 10, 10));
+    TEST_CHECK(test__open_policy("/t") == 0);
+}
+
+//Whole blocks written with the same data end up in one block, which both files keep reading back (across
+//block boundaries and after a remount), and the first file to change it gets a copy of its own
+static void test__dedup_shares_identical_blocks(){
+    storage_set_dedup(1);
+    TEST_CHECK(storage_mknod("/d1", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/d2", 0100644) == 0);
+    TEST_CHECK(test__fill("/d1", 'p', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__fill("/d1", 'q', BLOCK_SIZE, BLOCK_SIZE) == 0);
+    TEST_CHECK(test__fill("/d2", 'q', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__fill("/d2", 'p', BLOCK_SIZE, BLOCK_SIZE) == 0);
+
+    neat_dedup_info_t info;
+    dedup__get_info(&info);
+    TEST_CHECK(info.shared_blocks == 2);
+    TEST_CHECK(info.extra_owners == 2);
+
+    test__remount();
+    TEST_CHECK(test__filled("/d1", 'p', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/d1", 'q', BLOCK_SIZE, BLOCK_SIZE));
+    char buf[20];
+    TEST_CHECK(storage_read("/d2", buf, sizeof(buf), BLOCK_SIZE - 10) == sizeof(buf));
+    TEST_CHECK(memcmp(buf, "qqqqqqqqqqpppppppppp", sizeof(buf)) == 0);
+
+    //still shared after the remount, the fingerprints are kept in the image
+    TEST_CHECK(storage_mknod("/d3", 0100644) == 0);
+    TEST_CHECK(test__fill("/d3", 'p', BLOCK_SIZE, 0) == 0);
+    dedup__get_info(&info);
+    TEST_CHECK(info.shared_blocks == 2);
+    TEST_CHECK(info.extra_owners == 3);
+
+    TEST_CHECK(test__fill("/d1", 'r', 1, 0) == 0);
+    TEST_CHECK(test__filled("/d1", 'r', 1, 0));
+    TEST_CHECK(test__filled("/d2", 'p', BLOCK_SIZE, BLOCK_SIZE));
+    TEST_CHECK(test__filled("/d3", 'p', BLOCK_SIZE, 0));
+    dedup__get_info(&info);
+    TEST_CHECK(info.extra_owners == 2);
+    storage_set_dedup(0);
+}
+
+//Bytes [offset] on of the text test__compression_round_trip writes, compressible but not all the same
+static char test__text_at(int offset){
+    return "the quick brown fox jumps over the lazy dog "[offset % 44] + (offset / 1000) % 3;
+}
+
+//Reads [size] bytes at [offset] of [path] and checks they are the text test__text_at makes
+//Returns 1 if they are, 0 if not
+static int test__text_matches(const char *path, int size, int offset){
+    char *buf = malloc(size);
+    int matches = storage_read(path, buf, size, offset) == size;
+    for (int i = 0; matches && i < size; i++){
+        matches = buf[i] == test__text_at(offset + i);
+    }
+    free(buf);
+    return matches;
+}
+
+static void *test__text_reader(void *arg){
+    *(int *) arg = test__text_matches("/text", 200, COMPRESS_FRAME_SIZE - 100);
+    return NULL;
+}
+
+//A file compressed at its last release reads back the same, across frame boundaries, after a remount and
+//from threads that come and go (each with a frame cache of its own), and goes back to plain blocks once written
+static void test__compression_round_trip(){
+    int size = 3 * COMPRESS_FRAME_SIZE + 1234;
+    char *text = malloc(size);
+    for (int i = 0; i < size; i++){
+        text[i] = test__text_at(i);
+    }
+    storage_set_compression(1);
+    TEST_CHECK(storage_mknod("/text", 0100644) == 0);
+    TEST_CHECK(storage_write("/text", text, size, 0) == size);
+    free(text);
+    storage_release(storage_open("/text"));
+
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path("/text"));
+    TEST_CHECK(inode->flags & NEAT_INODE_COMPRESSED);
+    TEST_CHECK(inode->stored_size < size / 2);
+    TEST_CHECK(test__size("/text") == size);
+    TEST_CHECK(test__text_matches("/text", size, 0));
+
+    test__remount();
+    TEST_CHECK(test__text_matches("/text", 200, COMPRESS_FRAME_SIZE - 100));
+    TEST_CHECK(test__text_matches("/text", 1234, 3 * COMPRESS_FRAME_SIZE));
+    for (int i = 0; i < 4; i++){
+        pthread_t reader;
+        int matches = 0;
+        TEST_CHECK(pthread_create(&reader, NULL, test__text_reader, &matches) == 0);
+        pthread_join(reader, NULL);
+        TEST_CHECK(matches);
+    }
+
+    TEST_CHECK(test__fill("/text", '!', 1, COMPRESS_FRAME_SIZE) == 0);
+    inode = inode__get_inode(dir__inode_i_from_path("/text"));
+    TEST_CHECK(!(inode->flags & NEAT_INODE_COMPRESSED));
+    TEST_CHECK(test__filled("/text", '!', 1, COMPRESS_FRAME_SIZE));
+    TEST_CHECK(test__text_matches("/text", COMPRESS_FRAME_SIZE, 0));
+    TEST_CHECK(test__text_matches("/text", 1000, COMPRESS_FRAME_SIZE + 1));
+    storage_set_compression(0);
+}
+
+//A snapshot keeps seeing the files as they were while the live side changes them (each copying the blocks
+//it changes), a mounted one is read only, and deleting it gives back every block only it still held
+static void test__snapshot_copy_on_write(){
+    TEST_CHECK(storage_mknod("/s", 0100644) == 0);
+    TEST_CHECK(test__fill("/s", 'a', 2 * BLOCK_SIZE, 0) == 0);
+    int snapshot_id = snapshot__create();
+    TEST_CHECK(snapshot_id > 0);
+
+    TEST_CHECK(test__fill("/s", 'b', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_mknod("/new", 0100644) == 0);
+    TEST_CHECK(test__filled("/s", 'b', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/s", 'a', BLOCK_SIZE, BLOCK_SIZE));
+
+    TEST_CHECK(snapshot__view(snapshot_id) == 0);
+    TEST_CHECK(test__filled("/s", 'a', 2 * BLOCK_SIZE, 0));
+    TEST_CHECK(test__size("/new") == -1);
+    TEST_CHECK(snapshot__delete(snapshot_id) == -EBUSY);
+    TEST_CHECK(snapshot__view(0) == 0);
+    TEST_CHECK(test__filled("/s", 'b', BLOCK_SIZE, 0));
+
+    //mounted, nothing about it can change
+    storage_free();
+    storage_init_read_only(image_path);
+    TEST_CHECK(storage_mount_snapshot(snapshot_id) == 0);
+    TEST_CHECK(test__filled("/s", 'a', 2 * BLOCK_SIZE, 0));
+    TEST_CHECK(storage_write("/s", "c", 1, 0) == -EROFS);
+    TEST_CHECK(storage_truncate("/s", 0) == -EROFS);
+    TEST_CHECK(storage_mknod("/other", 0100644) == -EROFS);
+    TEST_CHECK(storage_unlink("/s") == -EROFS);
+    TEST_CHECK(storage_mount_snapshot(snapshot_id + 1) == -ENOENT);
+    test__remount();
+
+    //the old first block of /s, the root directory from before /new and the copy of the table were only
+    //the snapshot's
+    int free_before = count_free_blocks();
+    TEST_CHECK(snapshot__delete(snapshot_id) == 0);
+    TEST_CHECK(count_free_blocks() == free_before + 2 + SNAPSHOT_BLOCKS);
+    TEST_CHECK(snapshot__delete(snapshot_id) == -ENOENT);
+    TEST_CHECK(test__filled("/s", 'b', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/s", 'a', BLOCK_SIZE, BLOCK_SIZE));
+}
+
+//A clone points at the blocks of its source instead of copying them, whole or a range at a time, and
+//writing to either one copies the block first, so the other one keeps its data
+static void test__clone_shares_blocks(){
+    int blocks = NEAT_INODE_DIRECT_BLOCKS + 2;
+    TEST_CHECK(storage_mknod("/orig", 0100644) == 0);
+    TEST_CHECK(test__fill("/orig", 'o', blocks * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_mknod("/copy", 0100644) == 0);
+    neat_inode_t *orig = inode__get_inode(dir__inode_i_from_path("/orig"));
+    neat_inode_t *copy = inode__get_inode(dir__inode_i_from_path("/copy"));
+
+    int free_before = count_free_blocks();
+    TEST_CHECK(storage_clone("/copy", "/orig", 0, 0, 0) == 0);
+    TEST_CHECK(count_free_blocks() == free_before);
+    TEST_CHECK(test__size("/copy") == blocks * BLOCK_SIZE);
+    for (int i = 0; i < blocks; i++){
+        TEST_CHECK(inode__get_block_i(copy, i) == inode__get_block_i(orig, i));
+        TEST_CHECK(block_is_shared(inode__get_block_i(orig, i)));
+    }
+
+    TEST_CHECK(test__fill("/copy", 'c', 10, BLOCK_SIZE + 5) == 0);
+    TEST_CHECK(test__fill("/copy", 'c', 10, (blocks - 1) * BLOCK_SIZE) == 0);
+    TEST_CHECK(inode__get_block_i(copy, 1) != inode__get_block_i(orig, 1));
+    TEST_CHECK(test__filled("/copy", 'c', 10, BLOCK_SIZE + 5));
+    TEST_CHECK(test__filled("/orig", 'o', blocks * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/copy", 'o', BLOCK_SIZE, 0));
+
+    //a block aligned range lands in the middle of a file that had other data there
+    TEST_CHECK(storage_mknod("/mixed", 0100644) == 0);
+    TEST_CHECK(test__fill("/mixed", 'm', 3 * BLOCK_SIZE, 0) == 0);
+    neat_inode_t *mixed = inode__get_inode(dir__inode_i_from_path("/mixed"));
+    TEST_CHECK(storage_clone("/mixed", "/orig", 2 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) == 0);
+    TEST_CHECK(inode__get_block_i(mixed, 1) == inode__get_block_i(orig, 2));
+    TEST_CHECK(test__filled("/mixed", 'm', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/mixed", 'o', BLOCK_SIZE, BLOCK_SIZE));
+    TEST_CHECK(test__filled("/mixed", 'm', BLOCK_SIZE, 2 * BLOCK_SIZE));
+    TEST_CHECK(storage_clone("/mixed", "/orig", 1, BLOCK_SIZE, 0) == -EINVAL);
+
+    //the source changing leaves both clones alone, and unlinking it keeps the blocks they still use
+    TEST_CHECK(test__fill("/orig", 'x', blocks * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__filled("/copy", 'o', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/mixed", 'o', BLOCK_SIZE, BLOCK_SIZE));
+    TEST_CHECK(storage_unlink("/orig") == 0);
+    TEST_CHECK(test__filled("/copy", 'o', BLOCK_SIZE, 2 * BLOCK_SIZE));
+}
+
+//Punching a hole gives back the blocks it covers whole and zeros the rest of the range, fallocate gives a
+//sparse file blocks (growing it unless told to keep its size) that still read back as zeros
+static void test__fallocate_and_punch_hole(){
+    int punch = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    TEST_CHECK(storage_mknod("/f", 0100644) == 0);
+    TEST_CHECK(test__fill("/f", 'f', 4 * BLOCK_SIZE, 0) == 0);
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path("/f"));
+
+    //from the middle of block 0 to the middle of block 3: blocks 1 and 2 go, the ends get zeros
+    int free_before = count_free_blocks();
+    TEST_CHECK(storage_fallocate("/f", punch, BLOCK_SIZE / 2, 3 * BLOCK_SIZE) == 0);
+    TEST_CHECK(count_free_blocks() == free_before + 2);
+    TEST_CHECK(inode__is_hole(inode, 1) && inode__is_hole(inode, 2));
+    TEST_CHECK(test__size("/f") == 4 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/f", 'f', BLOCK_SIZE / 2, 0));
+    TEST_CHECK(test__filled("/f", 0, 3 * BLOCK_SIZE, BLOCK_SIZE / 2));
+    TEST_CHECK(test__filled("/f", 'f', BLOCK_SIZE / 2, 3 * BLOCK_SIZE + BLOCK_SIZE / 2));
+    TEST_CHECK(storage_fallocate("/f", FALLOC_FL_PUNCH_HOLE, 0, BLOCK_SIZE) == -EOPNOTSUPP);
+
+    //the holes get blocks again, and the file doesn't grow with FALLOC_FL_KEEP_SIZE
+    TEST_CHECK(storage_fallocate("/f", FALLOC_FL_KEEP_SIZE, 0, 8 * BLOCK_SIZE) == 0);
+    TEST_CHECK(count_free_blocks() == free_before);
+    TEST_CHECK(inode__allocated_blocks(inode) == 4);
+    TEST_CHECK(test__size("/f") == 4 * BLOCK_SIZE);
+    TEST_CHECK(test__filled("/f", 0, 3 * BLOCK_SIZE, BLOCK_SIZE / 2));
+
+    //a file grown by truncate is all hole, fallocate without flags backs it with blocks and grows it further
+    TEST_CHECK(storage_mknod("/g", 0100644) == 0);
+    TEST_CHECK(storage_truncate("/g", 2 * BLOCK_SIZE) == 0);
+    neat_inode_t *sparse = inode__get_inode(dir__inode_i_from_path("/g"));
+    TEST_CHECK(inode__allocated_blocks(sparse) == 0);
+    free_before = count_free_blocks();
+    TEST_CHECK(storage_fallocate("/g", 0, BLOCK_SIZE, 2 * BLOCK_SIZE) == 0);
+    TEST_CHECK(test__size("/g") == 3 * BLOCK_SIZE);
+    TEST_CHECK(inode__allocated_blocks(sparse) == 2);
+    TEST_CHECK(count_free_blocks() == free_before - 2);
+    TEST_CHECK(test__filled("/g", 0, 3 * BLOCK_SIZE, 0));
+}
+
+//Extended attributes come back as they were set (inline, in the xattr block or in blocks of their own, and
+//after a remount), XATTR_CREATE / XATTR_REPLACE and too small buffers fail like on linux
+static void test__xattr_set_get_list_remove(){
+    char value[NEAT_XATTR_OWN_BLOCKS_MIN * 2];
+    char list[256];
+    TEST_CHECK(storage_mknod("/x", 0100644) == 0);
+
+    TEST_CHECK(storage_setxattr("/x", "user.small", "tiny", 4, 0) == 0);
+    TEST_CHECK(storage_setxattr("/x", "user.small", "other", 5, XATTR_CREATE) == -EEXIST);
+    TEST_CHECK(storage_setxattr("/x", "user.none", "v", 1, XATTR_REPLACE) == -ENODATA);
+    memset(value, 'm', 200);
+    TEST_CHECK(storage_setxattr("/x", "user.medium", value, 200, XATTR_CREATE) == 0);
+    memset(value, 'l', sizeof(value));
+    TEST_CHECK(storage_setxattr("/x", "user.large", value, sizeof(value), 0) == 0);
+
+    TEST_CHECK(storage_getxattr("/x", "user.small", NULL, 0) == 4);
+    TEST_CHECK(storage_getxattr("/x", "user.small", value, 3) == -ERANGE);
+    TEST_CHECK(storage_getxattr("/x", "user.none", value, sizeof(value)) == -ENODATA);
+    int list_len = storage_listxattr("/x", NULL, 0);
+    TEST_CHECK(list_len == (int) sizeof("user.small\0user.medium\0user.large"));
+    TEST_CHECK(storage_listxattr("/x", list, list_len - 1) == -ERANGE);
+
+    test__remount();
+    TEST_CHECK(storage_getxattr("/x", "user.small", value, sizeof(value)) == 4 && memcmp(value, "tiny", 4) == 0);
+    TEST_CHECK(storage_getxattr("/x", "user.medium", value, sizeof(value)) == 200);
+    TEST_CHECK(value[0] == 'm' && value[199] == 'm');
+    TEST_CHECK(storage_getxattr("/x", "user.large", value, sizeof(value)) == sizeof(value));
+    TEST_CHECK(value[0] == 'l' && value[sizeof(value) - 1] == 'l');
+    TEST_CHECK(storage_listxattr("/x", list, sizeof(list)) == list_len);
+    TEST_CHECK(memcmp(list, "user.small\0user.medium\0user.large", list_len) == 0);
+
+    TEST_CHECK(storage_setxattr("/x", "user.small", "replaced", 8, XATTR_REPLACE) == 0);
+    TEST_CHECK(storage_getxattr("/x", "user.small", value, sizeof(value)) == 8 && memcmp(value, "replaced", 8) == 0);
+    TEST_CHECK(storage_removexattr("/x", "user.medium") == 0);
+    TEST_CHECK(storage_removexattr("/x", "user.medium") == -ENODATA);
+    TEST_CHECK(storage_getxattr("/x", "user.medium", value, sizeof(value)) == -ENODATA);
+    TEST_CHECK(storage_getxattr("/x", "user.large", value, sizeof(value)) == sizeof(value));
+
+    //the blocks behind the values go back with the file
+    int free_before = count_free_blocks();
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path("/x"));
+    int held[16];
+    int held_count = xattr__held_blocks(inode, held, 16);
+    TEST_CHECK(held_count > 0);
+    TEST_CHECK(storage_unlink("/x") == 0);
+    TEST_CHECK(count_free_blocks() == free_before + held_count);
+    TEST_CHECK(storage_getxattr("/x", "user.small", value, sizeof(value)) == -ENOENT);
+}
+
+//Hard links share one inode counted in st_nlink, and its blocks only go back once the last link is gone
+//and the last handle on it is released
+static void test__hard_link_reclaim(){
+    struct stat st;
+    int free_before = count_free_blocks();
+    TEST_CHECK(storage_mknod("/a", 0100644) == 0);
+    TEST_CHECK(test__fill("/a", 'h', BLOCK_SIZE * 3, 0) == 0);
+    TEST_CHECK(storage_link("/a", "/b") == 0);
+    TEST_CHECK(storage_link("/a", "/c") == 0);
+    TEST_CHECK(storage_stat("/a", &st) == 0 && st.st_nlink == 3);
+    TEST_CHECK(storage_link("/a", "/b") == -EEXIST);
+
+    TEST_CHECK(storage_unlink("/a") == 0);
+    TEST_CHECK(storage_stat("/b", &st) == 0 && st.st_nlink == 2);
+    TEST_CHECK(test__filled("/c", 'h', BLOCK_SIZE * 3, 0));
+    test__remount();
+    TEST_CHECK(storage_stat("/c", &st) == 0 && st.st_nlink == 2);
+
+    int inode_i = storage_open("/b");
+    TEST_CHECK(inode_i >= 0);
+    TEST_CHECK(storage_unlink("/b") == 0);
+    TEST_CHECK(storage_unlink("/c") == 0);
+    TEST_CHECK(storage_stat("/c", &st) == -ENOENT);
+    //still readable through the handle, and its blocks are still held
+    char buf[BLOCK_SIZE];
+    TEST_CHECK(storage_read_handle(inode_i, buf, BLOCK_SIZE, BLOCK_SIZE * 2) == BLOCK_SIZE);
+    TEST_CHECK(buf[0] == 'h' && buf[BLOCK_SIZE - 1] == 'h');
+    TEST_CHECK(count_free_blocks() < free_before);
+
+    TEST_CHECK(storage_release(inode_i) == 0);
+    TEST_CHECK(count_free_blocks() == free_before);
+    TEST_CHECK(storage_read_handle(inode_i, buf, BLOCK_SIZE, 0) == -EBADF);
+}
+
+//Opens keep the kernel's cached pages only while nothing changed the data since the last open, and
+//files flagged for direct io (or a direct io mount) always go around the page cache
+static void test__open_keep_cache(){
+    TEST_CHECK(storage_mknod("/k", 0100644) == 0);
+    TEST_CHECK(test__fill("/k", 'k', BLOCK_SIZE * 2, 0) == 0);
+    TEST_CHECK(test__open_policy("/k") == 0);
+    TEST_CHECK(test__open_policy("/k") == STORAGE_OPEN_KEEP_CACHE);
+    //metadata changes leave the cached data alone
+    TEST_CHECK(storage_chmod("/k", 0600) == 0);
+    TEST_CHECK(storage_rename("/k", "/kk") == 0);
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_KEEP_CACHE);
+
+    TEST_CHECK(test__fill("/kk", 'j', 1, BLOCK_SIZE) == 0);
+    TEST_CHECK(test__open_policy("/kk") == 0);
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_KEEP_CACHE);
+    TEST_CHECK(storage_truncate("/kk", BLOCK_SIZE) == 0);
+    TEST_CHECK(test__open_policy("/kk") == 0);
+    int inode_i = storage_open("/kk");
+    TEST_CHECK(storage_open_cache_policy(inode_i) == STORAGE_OPEN_KEEP_CACHE);
+    TEST_CHECK(storage_write_handle(inode_i, "x", 1, 0) == 1);
+    storage_release(inode_i);
+    TEST_CHECK(test__open_policy("/kk") == 0);
+
+    TEST_CHECK(storage_set_file_direct_io("/kk", 1) == 0);
+    TEST_CHECK(storage_set_file_direct_io("/", 1) == -EINVAL);
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_DIRECT_IO);
+    test__remount();
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_DIRECT_IO);
+    TEST_CHECK(storage_set_file_direct_io("/kk", 0) == 0);
+    test__open_policy("/kk");
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_KEEP_CACHE);
+
+    storage_set_direct_io(1);
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_DIRECT_IO);
+    storage_set_direct_io(0);
+    TEST_CHECK(test__open_policy("/kk") == STORAGE_OPEN_KEEP_CACHE);
+}
+
+//An image spread over several files keeps its stripe unit across a remount, stripe unit u of the blocks
+//lands in file u % count at (u / count) units in, and a spec with the wrong number of files is turned down
+static void test__stripe_units_across_files(){
+    enum {STRIPE_FILES = 3, STRIPE_BLOCKS = 2, STRIPE_DATA_BLOCKS = 8};
+    char paths[STRIPE_FILES][sizeof(image_path) + 2];
+    char spec[sizeof(paths) + STRIPE_FILES];
+    char short_spec[sizeof(paths)];
+    spec[0] = '\0';
+    for (int i = 0; i < STRIPE_FILES; i++){
+        snprintf(paths[i], sizeof(paths[i]), "%s.%d", image_path, i);
+        strcat(spec, i > 0 ? "," : "");
+        strcat(spec, paths[i]);
+    }
+    snprintf(short_spec, sizeof(short_spec), "%s,%s", paths[0], paths[1]);
+
+    storage_free();
+    TEST_CHECK(blocks_set_stripe_blocks(3) == -1);
+    TEST_CHECK(blocks_set_stripe_blocks(STRIPE_BLOCKS) == 0);
+    storage_init(spec);
+    TEST_CHECK(storage_mknod("/s", 0100644) == 0);
+    for (int i = 0; i < STRIPE_DATA_BLOCKS; i++){
+        TEST_CHECK(test__fill("/s", 'a' + i, BLOCK_SIZE, BLOCK_SIZE * i) == 0);
+    }
+    //the stripe unit of the image is the one it was made with, not whatever is set now
+    blocks_set_stripe_blocks(BLOCKS_DEFAULT_STRIPE_BLOCKS);
+    storage_free();
+    storage_init(spec);
+
+    neat_inode_t *inode = inode__get_inode(dir__inode_i_from_path("/s"));
+    TEST_CHECK(inode != NULL);
+    struct stat st;
+    off_t file_size = -1;
+    for (int i = 0; i < STRIPE_FILES; i++){
+        TEST_CHECK(stat(paths[i], &st) == 0 && st.st_size > 0);
+        TEST_CHECK(file_size < 0 || st.st_size == file_size);
+        file_size = st.st_size;
+    }
+    TEST_CHECK(file_size * STRIPE_FILES >= NUFS_SIZE && file_size * STRIPE_FILES < NUFS_SIZE + STRIPE_FILES * STRIPE_BLOCKS * BLOCK_SIZE);
+    char buf[BLOCK_SIZE];
+    for (int i = 0; inode != NULL && i < STRIPE_DATA_BLOCKS; i++){
+        TEST_CHECK(test__filled("/s", 'a' + i, BLOCK_SIZE, BLOCK_SIZE * i));
+        int block_i = inode__get_block_i(inode, i);
+        int unit = block_i / STRIPE_BLOCKS;
+        off_t offset = ((off_t) (unit / STRIPE_FILES) * STRIPE_BLOCKS + block_i % STRIPE_BLOCKS) * BLOCK_SIZE;
+        int fd = open(paths[unit % STRIPE_FILES], O_RDONLY);
+        TEST_CHECK(pread(fd, buf, BLOCK_SIZE, offset) == BLOCK_SIZE);
+        TEST_CHECK(buf[0] == 'a' + i && buf[BLOCK_SIZE - 1] == 'a' + i);
+        close(fd);
+    }
+    storage_free();
+
+    TEST_CHECK(blocks_check_image(spec) == 0);
+    TEST_CHECK(blocks_check_image(short_spec) == -1);
+    for (int i = 0; i < STRIPE_FILES; i++){
+        unlink(paths[i]);
+    }
+    storage_init(image_path);
+}
+
+//With checksums on, indirect, directory and xattr blocks that went bad fail with -EIO instead of sending reads
+//to another file's blocks, hiding names or dropping attributes, and the rest of the image carries on
+static void test__damaged_metadata_blocks(){
+    storage_set_checksums(1);
+    int blocks = NEAT_INODE_DIRECT_BLOCKS + 2;
+    TEST_CHECK(storage_mknod("/f", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/other", 0100644) == 0);
+    TEST_CHECK(test__fill("/f", 'f', blocks * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__fill("/other", 'o', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_mknod("/d", 040755) == 0);
+    TEST_CHECK(storage_mknod("/d/e", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/x", 0100644) == 0);
+    char value[NEAT_XATTR_OWN_BLOCKS_MIN];
+    memset(value, 'v', sizeof(value));
+    TEST_CHECK(storage_setxattr("/x", "user.a", value, sizeof(value), 0) == 0);
+    TEST_CHECK(storage_setxattr("/x", "user.b", value, sizeof(value), 0) == 0);
+
+    //a flipped indirect entry pointing at a block of /other, which is fine by its own checksum
+    neat_inode_t *f = inode__get_inode(dir__inode_i_from_path("/f"));
+    int other_block_i = inode__get_block_i(inode__get_inode(dir__inode_i_from_path("/other")), 0);
+    test__damage_block(f->indirect_i, 0, other_block_i);
+    char buf[BLOCK_SIZE];
+    TEST_CHECK(storage_read("/f", buf, BLOCK_SIZE, NEAT_INODE_DIRECT_BLOCKS * BLOCK_SIZE) == -EIO);
+    TEST_CHECK(storage_write("/f", "g", 1, (NEAT_INODE_DIRECT_BLOCKS + 1) * BLOCK_SIZE) == -EIO);
+    TEST_CHECK(test__filled("/f", 'f', NEAT_INODE_DIRECT_BLOCKS * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/other", 'o', BLOCK_SIZE, 0));
+
+    neat_inode_t *d = inode__get_inode(dir__inode_i_from_path("/d"));
+    test__damage_block(inode__get_block_i(d, 0), BLOCK_SIZE - sizeof(int), 0x5a5a5a5a);
+    struct stat st;
+    TEST_CHECK(storage_stat("/d/e", &st) == -EIO);
+    TEST_CHECK(storage_mknod("/d/e", 0100644) == -EIO);
+    TEST_CHECK(storage_unlink("/d/e") == -EIO);
+    TEST_CHECK(storage_stat("/d", &st) == 0);
+
+    neat_inode_t *x = inode__get_inode(dir__inode_i_from_path("/x"));
+    TEST_CHECK(x->xattr_i > 0);
+    test__damage_block(x->xattr_i, BLOCK_SIZE - sizeof(int), 0x5a5a5a5a);
+    TEST_CHECK(storage_getxattr("/x", "user.a", value, sizeof(value)) == -EIO);
+    TEST_CHECK(storage_listxattr("/x", buf, sizeof(buf)) == -EIO);
+    TEST_CHECK(storage_setxattr("/x", "user.c", "c", 1, 0) == -EIO);
+    TEST_CHECK(storage_removexattr("/x", "user.b") == -EIO);
+    storage_set_checksums(0);
+}
+
+//Renaming over an existing name swaps the inode behind it and lets go of the old one, moved directories
+//point ".." at their new parent, and a rename that runs out of room leaves both names as they were
+static void test__rename_replaces_target(){
+    struct stat st;
+    TEST_CHECK(storage_mknod("/p1", 040755) == 0);
+    TEST_CHECK(storage_mknod("/p2", 040755) == 0);
+    TEST_CHECK(storage_mknod("/p1/c", 040755) == 0);
+    TEST_CHECK(storage_mknod("/p1/c/f", 0100644) == 0);
+    TEST_CHECK(storage_rename("/p1/c", "/p2/c") == 0);
+    TEST_CHECK(storage_stat("/p2/c/f", &st) == 0);
+    TEST_CHECK(storage_stat("/p1/c", &st) == -ENOENT);
+    TEST_CHECK(dir__inode_i_from_path("/p2/c/..") == dir__inode_i_from_path("/p2"));
+    TEST_CHECK(storage_stat("/p1", &st) == 0 && st.st_nlink == 2);
+    TEST_CHECK(storage_stat("/p2", &st) == 0 && st.st_nlink == 3);
+
+    //an empty directory can be replaced, one with something in it can't
+    TEST_CHECK(storage_mknod("/p1/e", 040755) == 0);
+    TEST_CHECK(storage_rename("/p1/e", "/p2/c") == -ENOTEMPTY);
+    TEST_CHECK(storage_mknod("/p2/e", 040755) == 0);
+    TEST_CHECK(storage_rename("/p2/c", "/p2/e") == 0);
+    TEST_CHECK(storage_stat("/p2/e/f", &st) == 0);
+    TEST_CHECK(storage_stat("/p2", &st) == 0 && st.st_nlink == 3);
+
+    int free_before = count_free_blocks();
+    TEST_CHECK(storage_mknod("/old", 0100644) == 0);
+    TEST_CHECK(storage_mknod("/new", 0100644) == 0);
+    TEST_CHECK(test__fill("/old", 'o', 2 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(test__fill("/new", 'n', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_rename("/new", "/old") == 0);
+    TEST_CHECK(test__filled("/old", 'n', BLOCK_SIZE, 0) && test__size("/old") == BLOCK_SIZE);
+    TEST_CHECK(storage_stat("/new", &st) == -ENOENT);
+    TEST_CHECK(storage_stat("/old", &st) == 0 && st.st_nlink == 1);
+    TEST_CHECK(storage_unlink("/old") == 0);
+    TEST_CHECK(count_free_blocks() == free_before);
+
+    //the source's directory block is shared with a snapshot and there is no block left to copy it into: the
+    //rename fails after the target's entry already changed, which has to be put back
+    TEST_CHECK(storage_mknod("/p1/from", 0100644) == 0);
+    TEST_CHECK(test__fill("/p1/from", 'f', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(snapshot__create() > 0);
+    TEST_CHECK(storage_mknod("/to", 0100644) == 0);
+    TEST_CHECK(test__fill("/to", 't', BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_mknod("/fill", 0100644) == 0);
+    for (int offset = 0; test__fill("/fill", 'x', BLOCK_SIZE, offset) == 0; offset += BLOCK_SIZE){
+    }
+    TEST_CHECK(count_free_blocks() == 0);
+    TEST_CHECK(storage_rename("/p1/from", "/to") == -ENOSPC);
+    TEST_CHECK(test__filled("/to", 't', BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/p1/from", 'f', BLOCK_SIZE, 0));
+    TEST_CHECK(storage_stat("/to", &st) == 0 && st.st_nlink == 1);
+    TEST_CHECK(storage_stat("/p1/from", &st) == 0 && st.st_nlink == 1);
+
+    TEST_CHECK(storage_unlink("/fill") == 0);
+    TEST_CHECK(storage_rename("/p1/from", "/to") == 0);
+    TEST_CHECK(test__filled("/to", 'f', BLOCK_SIZE, 0));
+    TEST_CHECK(storage_stat("/p1/from", &st) == -ENOENT);
+}
+
+//Runs the scrubber until it has gone over the whole image once more, then copies its progress into [progress]
+static void test__scrub_pass(neat_scrub_progress_t *progress){
+    checksum__get_scrub_progress(progress);
+    int passes = progress->passes;
+    while (progress->passes == passes){
+        checksum__scrub_step();
+        checksum__get_scrub_progress(progress);
+    }
+}
+
+//A block that goes bad on disk fails its first read after the mount, one that goes bad while mounted is found by
+//the scrubber (and fails reads from then on), and rewriting it makes it good again
+static void test__checksum_mismatch_and_scrub(){
+    TEST_CHECK(storage_mknod("/unsealed", 0100644) == 0);
+    TEST_CHECK(test__fill("/unsealed", 'u', BLOCK_SIZE, 0) == 0);
+    storage_set_checksums(1);
+    TEST_CHECK(storage_mknod("/a", 0100644) == 0);
+    TEST_CHECK(test__fill("/a", 'a', 2 * BLOCK_SIZE, 0) == 0);
+    int block_i = inode__get_block_i(inode__get_inode(dir__inode_i_from_path("/a")), 1);
+
+    neat_scrub_progress_t progress;
+    test__scrub_pass(&progress);
+    TEST_CHECK(progress.failures == 0 && progress.last_failed_block == -1);
+    TEST_CHECK(progress.blocks_checked >= 2);
+    TEST_CHECK(progress.unsealed >= 1);
+    TEST_CHECK(progress.cursor == 0);
+
+    //behind our back while mounted: reads trust the block until the scrubber looks at it again
+    ((char *) blocks_get_block(block_i))[10] ^= 1;
+    test__scrub_pass(&progress);
+    TEST_CHECK(progress.failures == 1 && progress.last_failed_block == block_i);
+    char buf[BLOCK_SIZE];
+    TEST_CHECK(storage_read("/a", buf, BLOCK_SIZE, BLOCK_SIZE) == -EIO);
+    TEST_CHECK(test__filled("/a", 'a', BLOCK_SIZE, 0));
+
+    //a whole new block of data gets a new checksum
+    TEST_CHECK(test__fill("/a", 'b', BLOCK_SIZE, BLOCK_SIZE) == 0);
+    TEST_CHECK(test__filled("/a", 'b', BLOCK_SIZE, BLOCK_SIZE));
+    test__scrub_pass(&progress);
+    TEST_CHECK(progress.failures == 1);
+
+    //on disk while unmounted: the first read after the mount catches it
+    test__damage_block(block_i, 100, 0x5a5a5a5a);
+    TEST_CHECK(storage_read("/a", buf, BLOCK_SIZE, BLOCK_SIZE) == -EIO);
+    TEST_CHECK(storage_read("/a", buf, 10, 0) == 10);
+    checksum__get_scrub_progress(&progress);
+    TEST_CHECK(progress.passes == 0 && progress.failures == 0);
+    test__scrub_pass(&progress);
+    TEST_CHECK(progress.failures == 1 && progress.last_failed_block == block_i);
+    storage_set_checksums(0);
+    TEST_CHECK(storage_read("/a", buf, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+}
+
+//Writes BLOCK_SIZE bytes of [c] at the end of [path] until [done] says to stop
+//Returns the number of blocks written, -1 if a write failed first
+static int test__append_until(const char *path, char c, int (*done)()){
+    int written = 0;
+    while (!done()){
+        if (test__fill(path, c, BLOCK_SIZE, test__size(path)) != 0){
+            return -1;
+        }
+        written++;
+    }
+    return written;
+}
+
+static int test__log_segment = -1;
+
+static int test__log_left_segment(){
+    return get_log_segment() != test__log_segment;
+}
+
+static int test__one_free_segment(){
+    return cleaner__free_segments() < CLEANER_FREE_SEGMENTS;
+}
+
+//In log mode blocks are handed out one after the other and rewrites go to the log head, and cleaning a segment
+//the log left holes in moves what is still live in it (xattr value runs too) elsewhere until it is entirely free
+static void test__log_cleaner_frees_segment(){
+    storage_set_log(1);
+    TEST_CHECK(storage_mknod("/keep", 0100644) == 0);
+    TEST_CHECK(test__fill("/keep", 'k', 4 * BLOCK_SIZE, 0) == 0);
+    int segment = get_log_segment();
+    char value[2 * BLOCK_SIZE];
+    memset(value, 'v', sizeof(value));
+    TEST_CHECK(storage_setxattr("/keep", "user.big", value, sizeof(value), 0) == 0);
+    TEST_CHECK(storage_mknod("/a", 0100644) == 0);
+    TEST_CHECK(test__fill("/a", 'a', 8 * BLOCK_SIZE, 0) == 0);
+    neat_inode_t *a = inode__get_inode(dir__inode_i_from_path("/a"));
+    int first_block_i = inode__get_block_i(a, 0);
+    for (int i = 1; i < 8; i++){
+        TEST_CHECK(inode__get_block_i(a, i) == first_block_i + i);
+    }
+    TEST_CHECK(first_block_i / BLOCKS_REGION_SIZE == segment);
+
+    //once the log moved on, rewriting /a in place would be cheaper, the log puts the new blocks at its head instead
+    test__log_segment = segment;
+    TEST_CHECK(storage_mknod("/pad", 0100644) == 0);
+    TEST_CHECK(test__append_until("/pad", 'p', test__log_left_segment) > 0);
+    TEST_CHECK(storage_unlink("/pad") == 0);
+    TEST_CHECK(test__fill("/a", 'b', 8 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(inode__get_block_i(a, 0) > first_block_i + 7);
+    TEST_CHECK(count_free_region_blocks(segment) >= 8);
+
+    //nothing to do while enough segments are free
+    TEST_CHECK(cleaner__free_segments() >= CLEANER_FREE_SEGMENTS);
+    TEST_CHECK(cleaner__step() == 0);
+    TEST_CHECK(storage_mknod("/big", 0100644) == 0);
+    TEST_CHECK(test__append_until("/big", 'g', test__one_free_segment) > 0);
+    TEST_CHECK(cleaner__pick_segment() == segment);
+
+    int free_before = count_free_blocks();
+    TEST_CHECK(cleaner__step() > 0);
+    TEST_CHECK(count_free_region_blocks(segment) == BLOCKS_REGION_SIZE);
+    TEST_CHECK(count_free_blocks() == free_before);
+    neat_cleaner_progress_t progress;
+    cleaner__get_progress(&progress);
+    TEST_CHECK(progress.segments_cleaned == 1 && progress.segments_partial == 0);
+
+    TEST_CHECK(test__filled("/keep", 'k', 4 * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/a", 'b', 8 * BLOCK_SIZE, 0));
+    memset(value, 0, sizeof(value));
+    TEST_CHECK(storage_getxattr("/keep", "user.big", value, sizeof(value)) == sizeof(value));
+    TEST_CHECK(value[0] == 'v' && value[sizeof(value) - 1] == 'v');
+    test__remount();
+    TEST_CHECK(test__filled("/keep", 'k', 4 * BLOCK_SIZE, 0));
+    TEST_CHECK(storage_getxattr("/keep", "user.big", value, sizeof(value)) == sizeof(value));
+    storage_set_log(0);
+}
+
+#define TEST_LEGACY_ENTRIES 100
+
+static void test__legacy_name(char *name, int i){
+    snprintf(name, NEAT_DIR_NAME_LENGTH, "entry-with-a-rather-long-name-number-%03d", i);
+}
+
+static void test__legacy_path(char *path, int i){
+    char name[NEAT_DIR_NAME_LENGTH];
+    test__legacy_name(name, i);
+    snprintf(path, NEAT_DIR_NAME_LENGTH + 8, "/old/%s", name);
+}
+
+//A directory in the old fixed size format (written the way it used to be) keeps working, gets packed the
+//first time it changes, and lookups, adds and removals work across the packed blocks it ends up with
+static void test__legacy_directory_packs(){
+    int per_block = BLOCK_SIZE / sizeof(neat_dir_t);
+    int count = TEST_LEGACY_ENTRIES + 2;
+    TEST_CHECK(storage_mknod("/old", 040755) == 0);
+    TEST_CHECK(storage_mknod("/target", 0100644) == 0);
+    TEST_CHECK(test__fill("/target", 't', 10, 0) == 0);
+    int old_i = dir__inode_i_from_path("/old");
+    int target_i = dir__inode_i_from_path("/target");
+
+    //entries never straddle two blocks, the bytes left at the end of each stay unused
+    neat_dir_t *legacy = calloc(BLOCK_SIZE, (count + per_block - 1) / per_block);
+    neat_dir_t *slot = legacy;
+    for (int i = 0; i < count; i++){
+        if (i > 0 && i % per_block == 0){
+            slot = (neat_dir_t *)((char *) legacy + (i / per_block) * BLOCK_SIZE);
+        }
+        if (i < 2){
+            strcpy(slot->name, i == 0 ? "." : "..");
+            slot->inode_i = i == 0 ? old_i : 0;
+        }
+        else {
+            test__legacy_name(slot->name, i - 2);
+            slot->inode_i = target_i;
+            inode__add_link(target_i);
+        }
+        slot++;
+    }
+    int size = (count / per_block) * BLOCK_SIZE + (count % per_block) * sizeof(neat_dir_t);
+    neat_inode_t *old = inode__get_inode(old_i);
+    TEST_CHECK(inode__shrink_inode(old, 0) == 0);
+    old->flags &= ~NEAT_INODE_PACKED_DIR;
+    TEST_CHECK(inode__grow_inode(old, size) == 0);
+    TEST_CHECK(inode__write_data(old, (char *) legacy, size, 0) == size);
+    free(legacy);
+    test__remount();
+
+    char path[NEAT_DIR_NAME_LENGTH + 8];
+    old = inode__get_inode(old_i);
+    TEST_CHECK(dir__entry_count(old) == count);
+    for (int i = 0; i < TEST_LEGACY_ENTRIES; i++){
+        test__legacy_path(path, i);
+        TEST_CHECK(dir__inode_i_from_path(path) == target_i);
+    }
+    TEST_CHECK(dir__inode_i_from_path("/old/..") == 0);
+    TEST_CHECK(!(old->flags & NEAT_INODE_PACKED_DIR));
+
+    //the first change packs it, the long names take more than one packed block
+    TEST_CHECK(storage_mknod("/old/new", 0100644) == 0);
+    TEST_CHECK(old->flags & NEAT_INODE_PACKED_DIR);
+    TEST_CHECK(dir__entry_count(old) == count + 1);
+    TEST_CHECK(old->size / BLOCK_SIZE >= 2);
+    int packed_blocks = old->size / BLOCK_SIZE;
+    neat_dir_t entry;
+    TEST_CHECK(dir__get_entry(old, 0, &entry) == 0 && strcmp(entry.name, ".") == 0);
+    TEST_CHECK(dir__get_entry(old, 1, &entry) == 0 && strcmp(entry.name, "..") == 0 && entry.inode_i == 0);
+    TEST_CHECK(dir__inode_i_from_path("/old/new") >= 0);
+    for (int i = 0; i < TEST_LEGACY_ENTRIES; i++){
+        test__legacy_path(path, i);
+        TEST_CHECK(dir__inode_i_from_path(path) == target_i);
+    }
+
+    //removing from the first block leaves the rest findable, emptying the last block gives it back
+    for (int i = 0; i < TEST_LEGACY_ENTRIES; i += 3){
+        test__legacy_path(path, i);
+        TEST_CHECK(storage_unlink(path) == 0);
+    }
+    for (int i = TEST_LEGACY_ENTRIES - 1; i >= TEST_LEGACY_ENTRIES / 2; i--){
+        test__legacy_path(path, i);
+        storage_unlink(path);
+    }
+    TEST_CHECK(storage_unlink("/old/new") == 0);
+    TEST_CHECK(old->size / BLOCK_SIZE < packed_blocks);
+    test__remount();
+    old = inode__get_inode(old_i);
+    for (int i = 0; i < TEST_LEGACY_ENTRIES; i++){
+        test__legacy_path(path, i);
+        int expected = i % 3 != 0 && i < TEST_LEGACY_ENTRIES / 2 ? target_i : -1;
+        TEST_CHECK(dir__inode_i_from_path(path) == expected);
+    }
+    struct stat st;
+    TEST_CHECK(storage_stat("/target", &st) == 0 && st.st_nlink == 1 + dir__entry_count(old) - 2);
+
+    //adds fill the room the removals left before the directory grows again
+    int size_before = old->size;
+    for (int i = 0; i < TEST_LEGACY_ENTRIES / 2; i += 3){
+        test__legacy_path(path, i);
+        TEST_CHECK(storage_link("/target", path) == 0);
+    }
+    TEST_CHECK(old->size == size_before);
+    TEST_CHECK(storage_rmdir("/old") == -ENOTEMPTY);
+}
+
+//Runs fsck on the unmounted image, repairing it if [repair], and keeps whatever it printed in [report]
+//Returns the exit code of fsck, -1 if it didn't run
+static int test__fsck(int repair, char *report, int report_size){
+    char command[128];
+    snprintf(command, sizeof(command), "%s %s%s 2>&1", TEST_FSCK, repair ? "-r " : "", image_path);
+    FILE *out = popen(command, "r");
+    if (out == NULL){
+        return -1;
+    }
+    int got = fread(report, 1, report_size - 1, out);
+    report[got > 0 ? got : 0] = 0;
+    int status = pclose(out);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+//fsck counts the owners of every block against its share count and every entry against the inode bitmap,
+//reports what doesn't add up, and the repair drops the dangling entry (freeing the inode it orphaned) and
+//rebuilds the share counts, so copy on write works again
+static void test__fsck_repairs_shares_and_entries(){
+    static char report[16384];
+    TEST_CHECK(storage_mknod("/a", 0100644) == 0);
+    TEST_CHECK(test__fill("/a", 'a', 2 * BLOCK_SIZE, 0) == 0);
+    TEST_CHECK(storage_mknod("/b", 0100644) == 0);
+    TEST_CHECK(storage_clone("/b", "/a", 0, 0, 0) == 0);
+    TEST_CHECK(storage_mknod("/c", 0100644) == 0);
+    int shared_i = inode__get_block_i(inode__get_inode(dir__inode_i_from_path("/a")), 0);
+    int orphan_i = dir__inode_i_from_path("/c");
+    TEST_CHECK(block_is_shared(shared_i));
+
+    int free_i = orphan_i + 1;
+    while (free_i < inode__get_inode_count() && bitmap_get(get_inode_bitmap(), free_i)){
+        free_i++;
+    }
+    TEST_CHECK(free_i < inode__get_inode_count());
+    get_block_refs()[shared_i] = 0;
+    TEST_CHECK(dir__relink(inode__get_inode(0), "c", free_i) == 0);
+    storage_free();
+
+    char expected[128];
+    TEST_CHECK(test__fsck(0, report, sizeof(report)) == 4);
+    snprintf(expected, sizeof(expected), "block %d has 2 owner(s) but a share count of 0", shared_i);
+    TEST_CHECK(strstr(report, expected) != NULL);
+    snprintf(expected, sizeof(expected), "entry 'c' points at free inode %d", free_i);
+    TEST_CHECK(strstr(report, expected) != NULL);
+    snprintf(expected, sizeof(expected), "inode %d is orphaned", orphan_i);
+    TEST_CHECK(strstr(report, expected) != NULL);
+
+    TEST_CHECK(test__fsck(1, report, sizeof(report)) == 1);
+    TEST_CHECK(strstr(report, "0 problem(s) left after repair") != NULL);
+    TEST_CHECK(test__fsck(0, report, sizeof(report)) == 0);
+
+    storage_init(image_path);
+    TEST_CHECK(dir__inode_i_from_path("/c") == -1);
+    TEST_CHECK(!bitmap_get(get_inode_bitmap(), orphan_i));
+    TEST_CHECK(block_is_shared(shared_i));
+    TEST_CHECK(test__fill("/b", 'b', 10, 0) == 0);
+    TEST_CHECK(test__filled("/a", 'a', 2 * BLOCK_SIZE, 0));
+    TEST_CHECK(test__filled("/b", 'b', 10, 0));
+    TEST_CHECK(test__filled("/b", 'a', BLOCK_SIZE, BLOCK_SIZE));
+}
+
+static test_case_t tests[] = {
+    {"snapshot_mount_read_only", test__snapshot_mount_read_only},
+    {"clone_range_keeps_destination", test__clone_range_keeps_destination},
+    {"defrag_moves_private_blocks_only", test__defrag_moves_private_blocks_only},
+    {"truncate_past_map_limit", test__truncate_past_map_limit},
+    {"dedup_shares_identical_blocks", test__dedup_shares_identical_blocks},
+    {"compression_round_trip", test__compression_round_trip},
+    {"snapshot_copy_on_write", test__snapshot_copy_on_write},
+    {"clone_shares_blocks", test__clone_shares_blocks},
+    {"fallocate_and_punch_hole", test__fallocate_and_punch_hole},
+    {"xattr_set_get_list_remove", test__xattr_set_get_list_remove},
+    {"hard_link_reclaim", test__hard_link_reclaim},
+    {"open_keep_cache", test__open_keep_cache},
+    {"stripe_units_across_files", test__stripe_units_across_files},
+    {"damaged_metadata_blocks", test__damaged_metadata_blocks},
+    {"rename_replaces_target", test__rename_replaces_target},
+    {"checksum_mismatch_and_scrub", test__checksum_mismatch_and_scrub},
+    {"log_cleaner_frees_segment", test__log_cleaner_frees_segment},
+    {"legacy_directory_packs", test__legacy_directory_packs},
+    {"fsck_repairs_shares_and_entries", test__fsck_repairs_shares_and_entries},
+};
+#define TEST_COUNT ((int) (sizeof(tests) / sizeof(tests[0])))
+
+static int test__selected(const char *name, int argc, char *argv[]){
+    if (argc == 0){
+        return 1;
+    }
+    for (int i = 0; i < argc; i++){
+        if (strcmp(argv[i], name) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    //keep the real stdout for the results, the storage layer logs every call with printf
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL){
+        fprintf(stderr, "%sERROR: can't redirect stdout\n", TEST_FILE_NAME);
+        return 1;
+    }
+    setvbuf(results, NULL, _IOLBF, 0);
+
+    int run = 0;
+    int failed = 0;
+    for (int i = 0; i < TEST_COUNT; i++){
+        if (!test__selected(tests[i].name, argc - 1, argv + 1)){
+            continue;
+        }
+
+        check_failures = 0;
+        test__fresh_image();
+        tests[i].fn();
+        test__drop_image();
+
+        run++;
+        failed += check_failures > 0;
+        fprintf(results, "%s %d - %s\n", check_failures > 0 ? "not ok" : "ok", run, tests[i].name);
+    }
+    fprintf(results, "1..%d\n", run);
+    if (failed > 0){
+        fprintf(results, "# %d of %d tests failed\n", failed, run);
+    }
+
+    fclose(results);
+    return failed > 0 ? 1 : 0;
+}
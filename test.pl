@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 17;
+use Test::Simple tests => 26;
 use IO::Handle;
 
 sub mount {
@@ -101,4 +101,36 @@ system("rm -f mnt/one.txt");
 $files = `ls mnt`;
 ok($files !~ /one\.txt/, "deleted one.txt");
 
+say "#           == Directory Tests ==";
+system("mkdir -p mnt/dir/sub");
+ok(-d "mnt/dir/sub", "Nested directory exists.");
+
+my $msg4 = "hello, nested";
+write_text("dir/sub/three.txt", $msg4);
+my $msg5 = read_text("dir/sub/three.txt");
+say "# '$msg4' eq '$msg5'?";
+ok($msg4 eq $msg5, "Read back nested data correctly.");
+
+system("rmdir mnt/dir 2>/dev/null");
+ok(-d "mnt/dir", "Can't rmdir a non-empty directory.");
+
+system("rm -f mnt/dir/sub/three.txt && rmdir mnt/dir/sub");
+ok(!-e "mnt/dir/sub", "Removed empty nested directory.");
+
+say "#           == Symlink Tests ==";
+write_text("target.txt", "through a link");
+symlink("target.txt", "mnt/short");
+ok(readlink("mnt/short") eq "target.txt", "Read back a short symlink target.");
+ok(read_text("short") eq "through a link", "Read a file through a symlink.");
+my $long = "dir/" x 40 . "target.txt";
+symlink($long, "mnt/long");
+ok(readlink("mnt/long") eq $long, "Read back a long symlink target.");
+system("rm -f mnt/short mnt/long mnt/target.txt");
+
+say "#           == Stats Tests ==";
+my $stats = read_text(".nufs_stats");
+ok($stats =~ /^write [1-9]/m, "Stats file counts writes.");
+$files = `ls -a mnt`;
+ok($files !~ /nufs_stats/, "Stats file is not in the directory");
+
 unmount();